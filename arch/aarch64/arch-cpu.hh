@@ -22,6 +22,8 @@ struct arch_thread;
 
 struct arch_cpu {
     void init_on_cpu();
+    bool preempted() const { return false; }
+    void yield_to() const {}
     int smp_idx;
 };
 
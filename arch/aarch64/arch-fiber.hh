@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef ARCH_FIBER_HH_
+#define ARCH_FIBER_HH_
+
+namespace osv { class fiber; }
+
+extern "C" {
+void fiber_main_c(osv::fiber* f);
+}
+
+// Saved context of a fiber (or of the carrier thread running fibers).
+// The layout mirrors thread_state: fp and arg are loaded as a pair into
+// x29 and x0, so a new fiber starts in fiber_main_c(arg).
+struct fiber_state {
+    void* fp;
+    void* arg;
+
+    void* sp;
+    void* pc;
+};
+
+inline void fiber_init_state(fiber_state& s, void* stacktop, void* arg)
+{
+    s.fp = 0;
+    s.arg = arg;
+    s.sp = stacktop;
+    s.pc = reinterpret_cast<void*>(fiber_main_c);
+}
+
+inline void fiber_switch(fiber_state& from, fiber_state& to)
+{
+    asm volatile("\n"
+                 "str x29,     %0  \n"
+                 "mov x2, sp       \n"
+                 "adr x1, 1f       \n" /* address of label */
+                 "stp x2, x1,  %1  \n"
+
+                 "ldp x29, x0, %2  \n"
+                 "ldp x2, x1,  %3  \n"
+
+                 "mov sp, x2       \n"
+                 "blr x1           \n"
+
+                 "1:               \n" /* label */
+                 :
+                 : "Q"(from.fp), "Ump"(from.sp),
+                   "Ump"(to.fp), "Ump"(to.sp)
+                 : "x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7", "x8",
+                   "x9", "x10", "x11", "x12", "x13", "x14", "x15",
+                   "x16", "x17", "x18", "x19", "x20", "x21", "x22", "x23",
+                   "x24", "x25", "x26", "x27", "x28", "x30",
+                   "d8", "d9", "d10", "d11", "d12", "d13", "d14", "d15",
+                   "memory");
+}
+
+#endif /* ARCH_FIBER_HH_ */
@@ -7,12 +7,35 @@
 
 #include "osv/trace.hh"
 
+constexpr u32 insn_nop = 0xd503201f;
+constexpr u32 insn_b = 0x14000000;  // imm26 is the offset in instructions
+
 /**
- * Empty. No "quick" path on this arch yet.
+ * Replaces the nop or branch instruction of a trace site. Both are among
+ * the instructions the architecture allows to be modified while another
+ * cpu may be executing them, so a single aligned store is enough, followed
+ * by making the instruction cache see it.
  */
+static void patch_trace_site(void* site, u32 insn)
+{
+    auto p = static_cast<u32*>(site);
+    __atomic_store_n(p, insn, __ATOMIC_RELAXED);
+    asm volatile("dc cvau, %0 \n\t"
+                 "dsb ish \n\t"
+                 "ic ivau, %0 \n\t"
+                 "dsb ish \n\t"
+                 "isb \n\t"
+                 : : "r"(p) : "memory");
+}
+
 void tracepoint_base::activate(const tracepoint_id &, void * patch_site, void * slow_path)
-{}
+{
+    auto offset = static_cast<char*>(slow_path) - static_cast<char*>(patch_site);
+    assert(!(offset & 3) && offset >= -(1l << 27) && offset < (1l << 27));
+    patch_trace_site(patch_site, insn_b | ((offset >> 2) & 0x3ffffff));
+}
 
 void tracepoint_base::deactivate(const tracepoint_id &, void * patch_site, void * slow_path)
-{}
-
+{
+    patch_trace_site(patch_site, insn_nop);
+}
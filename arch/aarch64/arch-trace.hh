@@ -14,10 +14,19 @@ template<unsigned _id, typename ... s_args, typename ... r_args, std::tuple<
         s_args...> (*assign)(r_args...)>
 inline void tracepointv<_id, std::tuple<s_args...>(r_args...), assign>::operator()(
         r_args ... as) {
-    // TODO: "fast" path
-    if (active) {
-        trace_slow_path(assign(as...));
-    }
+    // The nop is patched into a branch to slow_path when the tracepoint is
+    // activated, see arch-trace.cc
+    asm goto("1: nop \n\t"
+            ".pushsection .tracepoint_patch_sites, \"aw\", @progbits \n\t"
+            ".quad %c[id] \n\t"
+            ".quad %c[type] \n\t"
+            ".quad 1b \n\t"
+            ".quad %l[slow_path] \n\t"
+            ".popsection"
+            : : [type]"i"(&typeid(*this)), [id]"i"(_id) : : slow_path);
+    return;
+slow_path:
+    trace_slow_path(assign(as...));
 }
 
 #endif /* ARCH_TRACE_HH_ */
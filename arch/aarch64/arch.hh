@@ -93,6 +93,17 @@ inline bool irq_enabled()
     return f.enabled();
 }
 
+// Touch the page below the stack pointer, so a lazily populated stack has it
+// faulted in before we get to code that must not fault.
+__attribute__((no_instrument_function))
+inline void ensure_next_stack_page();
+
+inline void ensure_next_stack_page()
+{
+    unsigned long tmp;
+    asm volatile("sub %0, sp, #4096; ldrb %w0, [%0]" : "=&r"(tmp));
+}
+
 extern bool tls_available() __attribute__((no_instrument_function));
 
 inline bool tls_available()
@@ -11,6 +11,7 @@
 #include "processor.hh"
 #include "exceptions.hh"
 #include "cpuid.hh"
+#include "kvm-pv.hh"
 #include "osv/pagealloc.hh"
 #include <xmmintrin.h>
 
@@ -46,6 +47,8 @@ struct arch_cpu {
     u32 apic_id;
     u32 acpi_id;
     u64 gdt[nr_gdt];
+    // set by kvm_steal_time_init() when running on KVM with steal time
+    processor::kvm_steal_time* steal_time = nullptr;
     void init_on_cpu();
     void set_ist_entry(unsigned ist, char* base, size_t size);
     char* get_ist_entry(unsigned ist);
@@ -55,6 +58,10 @@ struct arch_cpu {
     void set_interrupt_stack(arch_thread* t);
     void enter_exception();
     void exit_exception();
+    // true if the hypervisor has descheduled this (virtual) cpu
+    bool preempted() const;
+    // ask the hypervisor to run this cpu instead of the current one
+    void yield_to() const;
 };
 
 struct arch_thread {
@@ -139,6 +146,18 @@ inline void arch_cpu::set_interrupt_stack(arch_thread* t)
     set_ist_entry(2, s, sizeof(s));
 }
 
+inline bool arch_cpu::preempted() const
+{
+    return processor::kvm_vcpu_preempted(steal_time);
+}
+
+inline void arch_cpu::yield_to() const
+{
+    if (processor::features().kvm_pv_sched_yield) {
+        processor::kvm_sched_yield(apic_id);
+    }
+}
+
 inline void arch_cpu::init_on_cpu()
 {
     using namespace processor;
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef ARCH_FIBER_HH_
+#define ARCH_FIBER_HH_
+
+#include <stddef.h>
+#include <osv/types.h>
+
+extern "C" {
+void fiber_main(void);
+}
+
+// Saved context of a fiber (or of the carrier thread running fibers).
+// Like thread_state, only the stack and frame pointers and the resume
+// address are saved; the other callee-saved registers are clobbered by
+// fiber_switch(), so the compiler saves them on the stack being left.
+// The MXCSR and x87 control words are callee-saved too, and each fiber
+// keeps its own.
+struct fiber_state {
+    void* rsp;
+    void* rbp;
+    void* rip;
+    u32 mxcsr;
+    u16 fpucw;
+};
+
+// Prepare a new fiber's state so that switching to it calls
+// fiber_main_c(arg) on the given stack.
+inline void fiber_init_state(fiber_state& s, void* stacktop, void* arg)
+{
+    s.rsp = stacktop;
+    s.rbp = arg;
+    s.rip = reinterpret_cast<void*>(fiber_main);
+    // The power-on defaults, as a new thread starts with
+    s.mxcsr = 0x1f80;
+    s.fpucw = 0x37f;
+}
+
+inline void fiber_switch(fiber_state& from, fiber_state& to)
+{
+    asm volatile
+        ("mov %%rbp, %c[rbp](%0) \n\t"
+         "movq $1f, %c[rip](%0) \n\t"
+         "mov %%rsp, %c[rsp](%0) \n\t"
+         "stmxcsr %c[mxcsr](%0) \n\t"
+         "fnstcw %c[fpucw](%0) \n\t"
+         "ldmxcsr %c[mxcsr](%1) \n\t"
+         "fldcw %c[fpucw](%1) \n\t"
+         "mov %c[rsp](%1), %%rsp \n\t"
+         "mov %c[rbp](%1), %%rbp \n\t"
+         "jmpq *%c[rip](%1) \n\t"
+         "1: \n\t"
+         :
+         : "a"(&from), "c"(&to),
+           [rsp]"i"(offsetof(fiber_state, rsp)),
+           [rbp]"i"(offsetof(fiber_state, rbp)),
+           [rip]"i"(offsetof(fiber_state, rip)),
+           [mxcsr]"i"(offsetof(fiber_state, mxcsr)),
+           [fpucw]"i"(offsetof(fiber_state, fpucw))
+         : "rbx", "rdx", "rsi", "rdi", "r8", "r9",
+           "r10", "r11", "r12", "r13", "r14", "r15", "memory");
+}
+
+#endif /* ARCH_FIBER_HH_ */
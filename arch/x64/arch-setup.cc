@@ -222,6 +222,7 @@ void arch_init_premain()
 #include "drivers/virtio-scsi.hh"
 #include "drivers/virtio-net.hh"
 #include "drivers/virtio-rng.hh"
+#include "drivers/virtio-fs.hh"
 #include "drivers/xenfront-xenbus.hh"
 #include "drivers/ahci.hh"
 #include "drivers/vmw-pvscsi.hh"
@@ -230,10 +231,6 @@ void arch_init_premain()
 
 void arch_init_drivers()
 {
-    // initialize panic drivers
-    panic::pvpanic::probe_and_setup();
-    boot_time.event("pvpanic done");
-
     // Enumerate PCI devices
     pci::pci_device_enumeration();
     boot_time.event("pci enumerated");
@@ -244,6 +241,7 @@ void arch_init_drivers()
     drvman->register_driver(virtio::scsi::probe);
     drvman->register_driver(virtio::net::probe);
     drvman->register_driver(virtio::rng::probe);
+    drvman->register_driver(virtio::fs::probe);
     drvman->register_driver(xenfront::xenbus::probe);
     drvman->register_driver(ahci::hba::probe);
     drvman->register_driver(vmw::pvscsi::probe);
@@ -98,6 +98,17 @@ inline bool irq_enabled()
     return f.enabled();
 }
 
+// Touch the page below the stack pointer, so a lazily populated stack has it
+// faulted in before we get to code that must not fault.
+__attribute__((no_instrument_function))
+inline void ensure_next_stack_page();
+
+inline void ensure_next_stack_page()
+{
+    char c;
+    asm volatile("movb -4096(%%rsp), %0" : "=r"(c));
+}
+
 extern bool tls_available() __attribute__((no_instrument_function));
 
 inline bool tls_available()
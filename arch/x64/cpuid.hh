@@ -33,6 +33,10 @@ struct features_type {
     bool kvm_clocksource2;
     bool kvm_clocksource_stable;
     bool kvm_pv_eoi;
+    bool kvm_steal_time;
+    bool kvm_pv_tlb_flush;
+    bool kvm_pv_send_ipi;
+    bool kvm_pv_sched_yield;
     bool xen_clocksource;
     bool xen_vector_callback;
     bool xen_pci;
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include "kvm-pv.hh"
+#include "msr.hh"
+#include "cpuid.hh"
+#include "apic.hh"
+#include <osv/sched.hh>
+#include <osv/percpu.hh>
+#include <osv/mmu.hh>
+#include <osv/trace.hh>
+#include <string.h>
+
+TRACEPOINT(trace_kvm_send_ipi, "min=%d bitmap=%x:%x ret=%d", u32, u64, u64, long);
+TRACEPOINT(trace_kvm_sched_yield, "apic_id=%d", u32);
+
+namespace processor {
+
+enum {
+    KVM_HC_SEND_IPI = 10,
+    KVM_HC_SCHED_YIELD = 11,
+};
+
+// KVM accepts vmcall on both Intel and AMD hosts: on AMD, the instruction
+// traps and the host patches it to vmmcall.
+inline long kvm_hypercall(unsigned nr, ulong a0, ulong a1 = 0, ulong a2 = 0,
+        ulong a3 = 0)
+{
+    long ret;
+    asm volatile ("vmcall"
+                  : "=a"(ret)
+                  : "a"(nr), "b"(a0), "c"(a1), "d"(a2), "S"(a3)
+                  : "memory");
+    return ret;
+}
+
+static PERCPU(kvm_steal_time, kvm_steal_time_area);
+
+void kvm_steal_time_init()
+{
+    if (!features().kvm_steal_time) {
+        return;
+    }
+    auto st = &*kvm_steal_time_area;
+    memset(st, 0, sizeof(*st));
+    wrmsr(msr::KVM_STEAL_TIME, mmu::virt_to_phys(st) | 1);
+    sched::cpu::current()->arch.steal_time = st;
+}
+
+bool kvm_defer_tlb_flush(kvm_steal_time* st)
+{
+    if (!st) {
+        return false;
+    }
+    u8 state = __atomic_load_n(&st->preempted, __ATOMIC_RELAXED);
+    if (!(state & KVM_VCPU_PREEMPTED)) {
+        return false;
+    }
+    // If the host schedules the vCPU in between the load and the cmpxchg,
+    // it clears "preempted" and the cmpxchg fails, so we never lose a flush.
+    return __atomic_compare_exchange_n(&st->preempted, &state,
+            u8(state | KVM_VCPU_FLUSH_TLB), false,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+// Each KVM_HC_SEND_IPI covers a 128-bit window of APIC ids starting at "min"
+static constexpr unsigned ipi_window = 128;
+
+static void send_ipi_window(u64 (&bitmap)[2], u32 min, unsigned vector)
+{
+    auto ret = kvm_hypercall(KVM_HC_SEND_IPI, bitmap[0], bitmap[1], min, vector);
+    trace_kvm_send_ipi(min, bitmap[0], bitmap[1], ret);
+    if (ret >= 0) {
+        return;
+    }
+    // The host rejected the hypercall: deliver this window through the APIC.
+    for (unsigned bit = 0; bit < ipi_window; ++bit) {
+        if (bitmap[bit / 64] & (u64(1) << (bit % 64))) {
+            apic->ipi(min + bit, vector);
+        }
+    }
+}
+
+void kvm_send_ipi_mask(sched::cpu_set& cpus, unsigned vector)
+{
+    u64 bitmap[2] = {};
+    u32 min = 0;
+    bool empty = true;
+    // APIC ids normally grow with the cpu id, so walking the set in order
+    // usually fills a single window. If an id falls outside the current
+    // window, flush it and open a new one.
+    for (auto c : cpus) {
+        u32 apic_id = sched::cpus[c]->arch.apic_id;
+        if (!empty && (apic_id < min || apic_id - min >= ipi_window)) {
+            send_ipi_window(bitmap, min, vector);
+            bitmap[0] = bitmap[1] = 0;
+            empty = true;
+        }
+        if (empty) {
+            min = apic_id;
+            empty = false;
+        }
+        auto bit = apic_id - min;
+        bitmap[bit / 64] |= u64(1) << (bit % 64);
+    }
+    if (!empty) {
+        send_ipi_window(bitmap, min, vector);
+    }
+}
+
+void kvm_sched_yield(u32 apic_id)
+{
+    trace_kvm_sched_yield(apic_id);
+    kvm_hypercall(KVM_HC_SCHED_YIELD, apic_id);
+}
+
+}
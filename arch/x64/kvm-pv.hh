@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef KVM_PV_HH_
+#define KVM_PV_HH_
+
+#include <osv/types.h>
+
+namespace sched {
+class cpu_set;
+}
+
+namespace processor {
+
+// The steal time area a vCPU shares with the host (MSR_KVM_STEAL_TIME).
+// Besides steal time accounting, the host uses it to tell us whether the
+// vCPU is currently descheduled, and lets us ask it to flush the vCPU's TLB
+// before it runs again.
+struct kvm_steal_time {
+    u64 steal;
+    u32 version;
+    u32 flags;
+    u8 preempted;
+    u8 pad0[3];
+    u32 pad1[11];
+} __attribute__((aligned(64)));
+
+static_assert(sizeof(kvm_steal_time) == 64, "bad kvm_steal_time layout");
+
+enum : u8 {
+    KVM_VCPU_PREEMPTED = 1 << 0,
+    KVM_VCPU_FLUSH_TLB = 1 << 1,
+};
+
+void kvm_steal_time_init();
+
+inline bool kvm_vcpu_preempted(const kvm_steal_time* st)
+{
+    return st && (__atomic_load_n(&st->preempted, __ATOMIC_RELAXED) & KVM_VCPU_PREEMPTED);
+}
+
+// If the vCPU owning @st is descheduled, ask the host to flush its TLB when
+// it is scheduled back in, and return true. Otherwise, the caller must flush
+// the vCPU's TLB itself (with an IPI).
+bool kvm_defer_tlb_flush(kvm_steal_time* st);
+
+// Send @vector to all cpus in @cpus with as few KVM_HC_SEND_IPI hypercalls
+// as possible (one per 128 consecutive APIC ids).
+void kvm_send_ipi_mask(sched::cpu_set& cpus, unsigned vector);
+
+// Donate the rest of our timeslice to the vCPU with the given APIC id
+void kvm_sched_yield(u32 apic_id);
+
+}
+
+#endif /* KVM_PV_HH_ */
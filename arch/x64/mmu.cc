@@ -13,6 +13,7 @@
 #include <osv/interrupt.hh>
 #include <osv/migration-lock.hh>
 #include <osv/prio.hh>
+#include <osv/trace.hh>
 #include "exceptions.hh"
 
 void page_fault(exception_frame *ef)
@@ -53,10 +54,17 @@ void flush_tlb_local() {
 // processors confirm flushing their TLB. This is slow, but necessary for
 // correctness so that, for example, after mprotect() returns, no thread on
 // no cpu can write to the protected page.
+//
+// On KVM with PV TLB flush, we don't interrupt vCPUs which the host has
+// descheduled: instead we ask the host to flush their TLB before they run
+// again, which is both cheaper and doesn't make us wait for the host to
+// schedule them in.
 mutex tlb_flush_mutex;
 sched::thread_handle tlb_flush_waiter;
 std::atomic<int> tlb_flush_pendingconfirms;
 
+TRACEPOINT(trace_tlb_flush_deferred, "cpu=%d", unsigned);
+
 inter_processor_interrupt tlb_flush_ipi{[] {
         mmu::flush_tlb_local();
         if (tlb_flush_pendingconfirms.fetch_add(-1) == 1) {
@@ -74,9 +82,36 @@ void flush_tlb_all()
     SCOPE_LOCK(migration_lock);
     mmu::flush_tlb_local();
     std::lock_guard<mutex> guard(tlb_flush_mutex);
+    if (!processor::features().kvm_pv_tlb_flush) {
+        tlb_flush_waiter.reset(*sched::thread::current());
+        tlb_flush_pendingconfirms.store((int)sched::cpus.size() - 1);
+        tlb_flush_ipi.send_allbutself();
+        sched::thread::wait_until([] {
+                return tlb_flush_pendingconfirms.load() == 0;
+        });
+        tlb_flush_waiter.clear();
+        return;
+    }
+    sched::cpu_set ipi_cpus;
+    int count = 0;
+    auto me = sched::cpu::current();
+    for (auto c : sched::cpus) {
+        if (c == me) {
+            continue;
+        }
+        if (processor::kvm_defer_tlb_flush(c->arch.steal_time)) {
+            trace_tlb_flush_deferred(c->id);
+            continue;
+        }
+        ipi_cpus.set(c->id);
+        ++count;
+    }
+    if (!count) {
+        return;
+    }
     tlb_flush_waiter.reset(*sched::thread::current());
-    tlb_flush_pendingconfirms.store((int)sched::cpus.size() - 1);
-    tlb_flush_ipi.send_allbutself();
+    tlb_flush_pendingconfirms.store(count);
+    tlb_flush_ipi.send(ipi_cpus);
     sched::thread::wait_until([] {
             return tlb_flush_pendingconfirms.load() == 0;
     });
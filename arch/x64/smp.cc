@@ -9,6 +9,7 @@
 #include "processor.hh"
 #include "msr.hh"
 #include "apic.hh"
+#include "kvm-pv.hh"
 #include "ioapic.hh"
 #include <osv/mmu.hh>
 #include <string.h>
@@ -89,6 +90,7 @@ void ap_bringup(sched::cpu* c)
 {
     __sync_fetch_and_add(&smp_processors, 1);
     processor::kvm_pv_eoi_init();
+    processor::kvm_steal_time_init();
     c->idle_thread->start();
     c->load_balance();
 }
@@ -107,6 +109,7 @@ void smp_launch()
 {
     ioapic::init();
     processor::kvm_pv_eoi_init();
+    processor::kvm_steal_time_init();
     auto boot_cpu = smp_initial_find_current_cpu();
     for (auto c : sched::cpus) {
         auto name = osv::sprintf("balancer%d", c->id);
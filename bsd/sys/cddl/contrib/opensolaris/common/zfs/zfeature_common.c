@@ -159,4 +159,7 @@ zpool_feature_init(void)
 	zfeature_register(SPA_FEATURE_LZ4_COMPRESS,
 	    "org.illumos:lz4_compress", "lz4_compress",
 	    "LZ4 compression algorithm support.", B_FALSE, B_FALSE, NULL);
+	zfeature_register(SPA_FEATURE_ZSTD_COMPRESS,
+	    "com.cloudius:zstd_compress", "zstd_compress",
+	    "Zstandard compression algorithm support.", B_FALSE, B_FALSE, NULL);
 }
@@ -667,6 +667,28 @@ dsl_pool_memory_pressure(dsl_pool_t *dp)
 	    MIN(dp->dp_write_limit, space_inuse / 4));
 }
 
+/*
+ * Returns the space dirtied in the unsynced transaction groups, as a
+ * percentage of the per-txg write limit.  We can do this without locks
+ * since a little slop here is ok.
+ */
+uint64_t
+dsl_pool_dirty_percent(dsl_pool_t *dp)
+{
+	uint64_t dirty = 0;
+	uint64_t write_limit = (zfs_write_limit_override ?
+	    zfs_write_limit_override : dp->dp_write_limit);
+	int i;
+
+	if (write_limit == 0)
+		return (0);
+
+	for (i = 0; i < TXG_SIZE; i++)
+		dirty += dp->dp_space_towrite[i];
+
+	return (dirty * 100 / write_limit);
+}
+
 void
 dsl_pool_willuse_space(dsl_pool_t *dp, int64_t space, dmu_tx_t *tx)
 {
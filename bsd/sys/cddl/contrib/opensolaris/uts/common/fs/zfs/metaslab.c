@@ -24,6 +24,7 @@
  */
 
 #include <sys/zfs_context.h>
+#include <sys/kstat.h>
 #include <sys/dmu.h>
 #include <sys/dmu_tx.h>
 #include <sys/space_map.h>
@@ -73,12 +74,21 @@ static int metaslab_debug = 0;
 uint64_t metaslab_df_alloc_threshold = SPA_MAXBLOCKSIZE;
 
 /*
- * The minimum free space, in percent, which must be available
- * in a space map to continue allocations in a first-fit fashion.
- * Once the space_map's free space drops below this level we dynamically
- * switch to using best-fit allocations.
+ * First-fit walks the space map by offset, past every free segment too
+ * small for the request.  Once fewer than one in metaslab_df_max_search
+ * of the segments is large enough (as the segment size histogram tells),
+ * we switch to best-fit through the size sorted tree, which finds one
+ * without the walk.
  */
-int metaslab_df_free_pct = 4;
+int metaslab_df_max_search = 16;
+
+/*
+ * Best-fit allocations of at least this size carry on from where the
+ * previous one left off, in the same free segment, while it lasts; so that
+ * a sequence of large blocks stays contiguous rather than being scattered
+ * over the best fitting holes.  Smaller ones always take the best fit.
+ */
+uint64_t metaslab_bf_cursor_min = SPA_MAXBLOCKSIZE / 4;
 
 /*
  * A metaslab is considered "free" if it contains a contiguous
@@ -96,6 +106,56 @@ int metaslab_prefetch_limit = SPA_DVAS_PER_BP;
  */
 int metaslab_smo_bonus_pct = 150;
 
+kstat_t	*ms_ksp = NULL;
+
+typedef struct metaslab_stats {
+	kstat_named_t ms_stat_allocs;
+	kstat_named_t ms_stat_alloc_time;
+	kstat_named_t ms_stat_alloc_failures;
+	kstat_named_t ms_stat_loads;
+	kstat_named_t ms_stat_load_time;
+	kstat_named_t ms_stat_first_fit;
+	kstat_named_t ms_stat_best_fit;
+	kstat_named_t ms_stat_cursor_fit;
+	kstat_named_t ms_stat_weight_capped;
+} metaslab_stats_t;
+
+static metaslab_stats_t ms_stats = {
+	{ "allocs",		KSTAT_DATA_UINT64 },
+	{ "alloc_time_ns",	KSTAT_DATA_UINT64 },
+	{ "alloc_failures",	KSTAT_DATA_UINT64 },
+	{ "loads",		KSTAT_DATA_UINT64 },
+	{ "load_time_ns",	KSTAT_DATA_UINT64 },
+	{ "first_fit",		KSTAT_DATA_UINT64 },
+	{ "best_fit",		KSTAT_DATA_UINT64 },
+	{ "cursor_fit",		KSTAT_DATA_UINT64 },
+	{ "weight_capped",	KSTAT_DATA_UINT64 }
+};
+
+#define	MSSTAT_ADD(stat, val)	atomic_add_64(&ms_stats.stat.value.ui64, (val))
+#define	MSSTAT_BUMP(stat)	MSSTAT_ADD(stat, 1)
+
+void
+metaslab_stat_init(void)
+{
+	ms_ksp = kstat_create("zfs", 0, "metaslab_stats", "misc",
+	    KSTAT_TYPE_NAMED, sizeof (ms_stats) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+	if (ms_ksp != NULL) {
+		ms_ksp->ks_data = &ms_stats;
+		kstat_install(ms_ksp);
+	}
+}
+
+void
+metaslab_stat_fini(void)
+{
+	if (ms_ksp != NULL) {
+		kstat_delete(ms_ksp);
+		ms_ksp = NULL;
+	}
+}
+
 /*
  * ==========================================================================
  * Metaslab classes
@@ -416,20 +476,35 @@ metaslab_block_picker(avl_tree_t *t, uint64_t *cursor, uint64_t size,
 	return (metaslab_block_picker(t, cursor, size, align));
 }
 
+/*
+ * Picker-private data: a cursor per alignment (see metaslab_ff_alloc()),
+ * then the best-fit cursor and the end of the segment it's in (see
+ * metaslab_bf_cursor_alloc()).
+ */
+#define	METASLAB_PP_BF_CURSOR	64
+#define	METASLAB_PP_SIZE	(66 * sizeof (uint64_t))
+
 static void
 metaslab_pp_load(space_map_t *sm)
 {
 	space_seg_t *ss;
 
 	ASSERT(sm->sm_ppd == NULL);
-	sm->sm_ppd = kmem_zalloc(64 * sizeof (uint64_t), KM_SLEEP);
+	sm->sm_ppd = kmem_zalloc(METASLAB_PP_SIZE, KM_SLEEP);
 
 	sm->sm_pp_root = kmem_alloc(sizeof (avl_tree_t), KM_SLEEP);
 	avl_create(sm->sm_pp_root, metaslab_segsize_compare,
 	    sizeof (space_seg_t), offsetof(struct space_seg, ss_pp_node));
 
-	for (ss = avl_first(&sm->sm_root); ss; ss = AVL_NEXT(&sm->sm_root, ss))
+	if (sm->sm_histogram != NULL)
+		bzero(sm->sm_histogram,
+		    SPACE_MAP_HISTOGRAM_SIZE * sizeof (uint64_t));
+
+	for (ss = avl_first(&sm->sm_root); ss; ss = AVL_NEXT(&sm->sm_root, ss)) {
 		avl_add(sm->sm_pp_root, ss);
+		if (sm->sm_histogram != NULL)
+			sm->sm_histogram[SPACE_MAP_HISTOGRAM_BUCKET(ss)]++;
+	}
 }
 
 static void
@@ -437,9 +512,13 @@ metaslab_pp_unload(space_map_t *sm)
 {
 	void *cookie = NULL;
 
-	kmem_free(sm->sm_ppd, 64 * sizeof (uint64_t));
+	kmem_free(sm->sm_ppd, METASLAB_PP_SIZE);
 	sm->sm_ppd = NULL;
 
+	/*
+	 * The segment histogram is left as it is, for the owner to remember
+	 * what the map looked like when it was last loaded.
+	 */
 	while (avl_destroy_nodes(sm->sm_pp_root, &cookie) != NULL) {
 		/* tear down the tree */
 	}
@@ -478,6 +557,26 @@ metaslab_pp_maxsize(space_map_t *sm)
 	return (ss->ss_end - ss->ss_start);
 }
 
+/*
+ * Return the number of free segments in the map which are certainly large
+ * enough for an allocation of the given size, from the segment histogram:
+ * those in buckets starting at or above the size.  Without a histogram,
+ * all of them.
+ */
+static uint64_t
+metaslab_pp_nfit(space_map_t *sm, uint64_t size)
+{
+	uint64_t n = 0;
+
+	if (sm->sm_histogram == NULL)
+		return (avl_numnodes(&sm->sm_root));
+
+	for (int b = highbit(size - 1); b < SPACE_MAP_HISTOGRAM_SIZE; b++)
+		n += sm->sm_histogram[b];
+
+	return (n);
+}
+
 /*
  * ==========================================================================
  * The first-fit block allocator
@@ -513,11 +612,50 @@ static space_map_ops_t metaslab_ff_ops = {
 /*
  * ==========================================================================
  * Dynamic block allocator -
- * Uses the first fit allocation scheme until space get low and then
+ * Uses the first fit allocation scheme until space gets fragmented and then
  * adjusts to a best fit allocation method. Uses metaslab_df_alloc_threshold
- * and metaslab_df_free_pct to determine when to switch the allocation scheme.
+ * and the segment histogram (metaslab_df_max_search) to determine when to
+ * switch the allocation scheme.
  * ==========================================================================
  */
+
+/*
+ * Best-fit for large blocks: continue in the segment the previous one was
+ * taken from, if what's left of it still holds the block; otherwise take
+ * the smallest segment that does, and continue from there next time.
+ */
+static uint64_t
+metaslab_bf_cursor_alloc(space_map_t *sm, uint64_t size)
+{
+	uint64_t *cursor = (uint64_t *)sm->sm_ppd + METASLAB_PP_BF_CURSOR;
+	uint64_t *cursor_end = cursor + 1;
+	uint64_t offset;
+
+	if (*cursor + size <= *cursor_end &&
+	    space_map_contains(sm, *cursor, size)) {
+		MSSTAT_BUMP(ms_stat_cursor_fit);
+	} else {
+		space_seg_t *ss, ssearch;
+		avl_index_t where;
+
+		ssearch.ss_start = 0;
+		ssearch.ss_end = size;
+		ss = avl_find(sm->sm_pp_root, &ssearch, &where);
+		if (ss == NULL)
+			ss = avl_nearest(sm->sm_pp_root, where, AVL_AFTER);
+		if (ss == NULL)
+			return (-1ULL);
+
+		*cursor = ss->ss_start;
+		*cursor_end = ss->ss_end;
+		MSSTAT_BUMP(ms_stat_best_fit);
+	}
+
+	offset = *cursor;
+	*cursor += size;
+	return (offset);
+}
+
 static uint64_t
 metaslab_df_alloc(space_map_t *sm, uint64_t size)
 {
@@ -525,22 +663,27 @@ metaslab_df_alloc(space_map_t *sm, uint64_t size)
 	uint64_t align = size & -size;
 	uint64_t *cursor = (uint64_t *)sm->sm_ppd + highbit(align) - 1;
 	uint64_t max_size = metaslab_pp_maxsize(sm);
-	int free_pct = sm->sm_space * 100 / sm->sm_size;
+	uint64_t nsegs = avl_numnodes(&sm->sm_root);
 
 	ASSERT(MUTEX_HELD(sm->sm_lock));
-	ASSERT3U(avl_numnodes(&sm->sm_root), ==, avl_numnodes(sm->sm_pp_root));
+	ASSERT3U(nsegs, ==, avl_numnodes(sm->sm_pp_root));
 
 	if (max_size < size)
 		return (-1ULL);
 
 	/*
-	 * If we're running low on space switch to using the size
+	 * If the space is fragmented, switch to using the size
 	 * sorted AVL tree (best-fit).
 	 */
 	if (max_size < metaslab_df_alloc_threshold ||
-	    free_pct < metaslab_df_free_pct) {
+	    metaslab_pp_nfit(sm, size) * metaslab_df_max_search < nsegs) {
+		if (size >= metaslab_bf_cursor_min)
+			return (metaslab_bf_cursor_alloc(sm, size));
 		t = sm->sm_pp_root;
 		*cursor = 0;
+		MSSTAT_BUMP(ms_stat_best_fit);
+	} else {
+		MSSTAT_BUMP(ms_stat_first_fit);
 	}
 
 	return (metaslab_block_picker(t, cursor, size, 1ULL));
@@ -550,10 +693,11 @@ static boolean_t
 metaslab_df_fragmented(space_map_t *sm)
 {
 	uint64_t max_size = metaslab_pp_maxsize(sm);
-	int free_pct = sm->sm_space * 100 / sm->sm_size;
+	uint64_t nsegs = avl_numnodes(&sm->sm_root);
 
 	if (max_size >= metaslab_df_alloc_threshold &&
-	    free_pct >= metaslab_df_free_pct)
+	    metaslab_pp_nfit(sm, metaslab_df_alloc_threshold) *
+	    metaslab_df_max_search >= nsegs)
 		return (B_FALSE);
 
 	return (B_TRUE);
@@ -725,6 +869,7 @@ metaslab_init(metaslab_group_t *mg, space_map_obj_t *smo,
 	 */
 	space_map_create(&msp->ms_map, start, size,
 	    vd->vdev_ashift, &msp->ms_lock);
+	msp->ms_map.sm_histogram = msp->ms_histogram;
 
 	metaslab_group_add(mg, msp);
 
@@ -795,7 +940,8 @@ metaslab_weight(metaslab_t *msp)
 	space_map_t *sm = &msp->ms_map;
 	space_map_obj_t *smo = &msp->ms_smo;
 	vdev_t *vd = mg->mg_vd;
-	uint64_t weight, space;
+	uint64_t weight, space, max_size;
+	boolean_t capped = B_FALSE;
 
 	ASSERT(MUTEX_HELD(&msp->ms_lock));
 
@@ -827,6 +973,24 @@ metaslab_weight(metaslab_t *msp)
 	ASSERT(weight >= space &&
 	    weight <= 2 * (metaslab_smo_bonus_pct / 100) * space);
 
+	/*
+	 * If we know the metaslab's largest free segment, and it couldn't
+	 * hold a block of metaslab_df_alloc_threshold, weigh the metaslab by
+	 * that instead: allocations it can't satisfy then pass it by, rather
+	 * than loading its space map to find out.  An unloaded metaslab's
+	 * is only known until something is freed into it.
+	 */
+	if (sm->sm_loaded || msp->ms_max_size_known) {
+		max_size = sm->sm_loaded ?
+		    space_map_maxsize(sm) : msp->ms_max_size;
+		if (max_size < metaslab_df_alloc_threshold &&
+		    max_size < weight) {
+			weight = max_size;
+			capped = !sm->sm_loaded;
+		}
+	}
+	msp->ms_weight_capped = capped;
+
 	if (sm->sm_loaded && !sm->sm_ops->smop_fragmented(sm)) {
 		/*
 		 * If this metaslab is one we're actively using, adjust its
@@ -882,9 +1046,12 @@ metaslab_activate(metaslab_t *msp, uint64_t activation_weight)
 		space_map_load_wait(sm);
 		if (!sm->sm_loaded) {
 			space_map_obj_t *smo = &msp->ms_smo;
+			hrtime_t start = gethrtime();
 
 			int error = space_map_load(sm, sm_ops, SM_FREE, smo,
 			    spa_meta_objset(msp->ms_group->mg_vd->vdev_spa));
+			MSSTAT_BUMP(ms_stat_loads);
+			MSSTAT_ADD(ms_stat_load_time, gethrtime() - start);
 			if (error)  {
 				metaslab_group_sort(msp->ms_group, msp, 0);
 				return (error);
@@ -926,6 +1093,21 @@ metaslab_passivate(metaslab_t *msp, uint64_t size)
 	ASSERT((msp->ms_weight & METASLAB_ACTIVE_MASK) == 0);
 }
 
+/*
+ * Account for frees into an unloaded metaslab.  A freed segment may merge
+ * with free space around it into a range of any size, which we can't tell
+ * without loading the space map, so the largest free segment it had when
+ * last loaded is no longer known.
+ */
+static void
+metaslab_unloaded_free(metaslab_t *msp, space_map_t *freed)
+{
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+
+	if (freed->sm_space != 0)
+		msp->ms_max_size_known = B_FALSE;
+}
+
 /*
  * Write a metaslab to disk in the context of the specified transaction group.
  */
@@ -1078,6 +1260,8 @@ metaslab_sync_done(metaslab_t *msp, uint64_t txg)
 	 * transfer freed_map (this txg's frees) to defer_map.
 	 */
 	space_map_load_wait(sm);
+	if (!sm->sm_loaded)
+		metaslab_unloaded_free(msp, defer_map);
 	space_map_vacate(defer_map, sm->sm_loaded ? space_map_free : NULL, sm);
 	space_map_vacate(freed_map, space_map_add, defer_map);
 
@@ -1106,8 +1290,11 @@ metaslab_sync_done(metaslab_t *msp, uint64_t txg)
 			if (msp->ms_allocmap[(txg + t) & TXG_MASK].sm_space)
 				evictable = 0;
 
-		if (evictable && !metaslab_debug)
+		if (evictable && !metaslab_debug) {
+			msp->ms_max_size = space_map_maxsize(sm);
+			msp->ms_max_size_known = B_TRUE;
 			space_map_unload(sm);
+		}
 	}
 
 	metaslab_group_sort(mg, msp, metaslab_weight(msp));
@@ -1187,6 +1374,9 @@ metaslab_group_alloc(metaslab_group_t *mg, uint64_t psize, uint64_t asize,
 		mutex_enter(&mg->mg_lock);
 		for (msp = avl_first(t); msp; msp = AVL_NEXT(t, msp)) {
 			if (msp->ms_weight < asize) {
+				/* Passed by without loading its space map */
+				if (msp->ms_weight_capped)
+					MSSTAT_BUMP(ms_stat_weight_capped);
 				spa_dbgmsg(spa, "%s: failed to meet weight "
 				    "requirement: vdev %llu, txg %llu, mg %p, "
 				    "msp %p, psize %llu, asize %llu, "
@@ -1266,6 +1456,7 @@ metaslab_group_alloc(metaslab_group_t *mg, uint64_t psize, uint64_t asize,
 			break;
 
 		atomic_inc_64(&mg->mg_alloc_failures);
+		MSSTAT_BUMP(ms_stat_alloc_failures);
 
 		metaslab_passivate(msp, space_map_maxsize(&msp->ms_map));
 
@@ -1575,6 +1766,7 @@ metaslab_alloc(spa_t *spa, metaslab_class_t *mc, uint64_t psize, blkptr_t *bp,
 {
 	dva_t *dva = bp->blk_dva;
 	dva_t *hintdva = hintbp->blk_dva;
+	hrtime_t start = gethrtime();
 	int error = 0;
 
 	ASSERT(bp->blk_birth == 0);
@@ -1608,6 +1800,9 @@ metaslab_alloc(spa_t *spa, metaslab_class_t *mc, uint64_t psize, blkptr_t *bp,
 
 	spa_config_exit(spa, SCL_ALLOC, FTAG);
 
+	MSSTAT_BUMP(ms_stat_allocs);
+	MSSTAT_ADD(ms_stat_alloc_time, gethrtime() - start);
+
 	BP_SET_BIRTH(bp, txg, txg);
 
 	return (0);
@@ -1624,6 +1624,8 @@ spa_init(int mode)
 	dmu_init();
 	zil_init();
 	vdev_cache_stat_init();
+	vdev_queue_stat_init();
+	metaslab_stat_init();
 	zfs_prop_init();
 	zpool_prop_init();
 	zpool_feature_init();
@@ -1638,6 +1640,8 @@ spa_fini(void)
 
 	spa_evict_all();
 
+	metaslab_stat_fini();
+	vdev_queue_stat_fini();
 	vdev_cache_stat_fini();
 	zil_fini();
 	dmu_fini();
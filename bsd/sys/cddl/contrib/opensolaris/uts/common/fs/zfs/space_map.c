@@ -98,6 +98,34 @@ space_map_destroy(space_map_t *sm)
 	cv_destroy(&sm->sm_load_cv);
 }
 
+/*
+ * While the map is loaded for allocation, its segments are also kept in the
+ * picker-private tree and, if the owner supplied one, counted by size in the
+ * segment histogram.  A segment must be taken out before it's resized, and
+ * put back after.
+ */
+static void
+space_map_pp_add(space_map_t *sm, space_seg_t *ss)
+{
+	if (sm->sm_pp_root == NULL)
+		return;
+	avl_add(sm->sm_pp_root, ss);
+	if (sm->sm_histogram != NULL)
+		sm->sm_histogram[SPACE_MAP_HISTOGRAM_BUCKET(ss)]++;
+}
+
+static void
+space_map_pp_remove(space_map_t *sm, space_seg_t *ss)
+{
+	if (sm->sm_pp_root == NULL)
+		return;
+	avl_remove(sm->sm_pp_root, ss);
+	if (sm->sm_histogram != NULL) {
+		ASSERT(sm->sm_histogram[SPACE_MAP_HISTOGRAM_BUCKET(ss)] != 0);
+		sm->sm_histogram[SPACE_MAP_HISTOGRAM_BUCKET(ss)]--;
+	}
+}
+
 void
 space_map_add(space_map_t *sm, uint64_t start, uint64_t size)
 {
@@ -136,22 +164,18 @@ space_map_add(space_map_t *sm, uint64_t start, uint64_t size)
 
 	if (merge_before && merge_after) {
 		avl_remove(&sm->sm_root, ss_before);
-		if (sm->sm_pp_root) {
-			avl_remove(sm->sm_pp_root, ss_before);
-			avl_remove(sm->sm_pp_root, ss_after);
-		}
+		space_map_pp_remove(sm, ss_before);
+		space_map_pp_remove(sm, ss_after);
 		ss_after->ss_start = ss_before->ss_start;
 		kmem_cache_free(space_seg_cache, ss_before);
 		ss = ss_after;
 	} else if (merge_before) {
+		space_map_pp_remove(sm, ss_before);
 		ss_before->ss_end = end;
-		if (sm->sm_pp_root)
-			avl_remove(sm->sm_pp_root, ss_before);
 		ss = ss_before;
 	} else if (merge_after) {
+		space_map_pp_remove(sm, ss_after);
 		ss_after->ss_start = start;
-		if (sm->sm_pp_root)
-			avl_remove(sm->sm_pp_root, ss_after);
 		ss = ss_after;
 	} else {
 		ss = kmem_cache_alloc(space_seg_cache, KM_SLEEP);
@@ -160,8 +184,7 @@ space_map_add(space_map_t *sm, uint64_t start, uint64_t size)
 		avl_insert(&sm->sm_root, ss, where);
 	}
 
-	if (sm->sm_pp_root)
-		avl_add(sm->sm_pp_root, ss);
+	space_map_pp_add(sm, ss);
 
 	sm->sm_space += size;
 }
@@ -196,8 +219,7 @@ space_map_remove(space_map_t *sm, uint64_t start, uint64_t size)
 	left_over = (ss->ss_start != start);
 	right_over = (ss->ss_end != end);
 
-	if (sm->sm_pp_root)
-		avl_remove(sm->sm_pp_root, ss);
+	space_map_pp_remove(sm, ss);
 
 	if (left_over && right_over) {
 		newseg = kmem_cache_alloc(space_seg_cache, KM_SLEEP);
@@ -205,8 +227,7 @@ space_map_remove(space_map_t *sm, uint64_t start, uint64_t size)
 		newseg->ss_end = ss->ss_end;
 		ss->ss_end = start;
 		avl_insert_here(&sm->sm_root, newseg, ss, AVL_AFTER);
-		if (sm->sm_pp_root)
-			avl_add(sm->sm_pp_root, newseg);
+		space_map_pp_add(sm, newseg);
 	} else if (left_over) {
 		ss->ss_end = start;
 	} else if (right_over) {
@@ -217,8 +238,8 @@ space_map_remove(space_map_t *sm, uint64_t start, uint64_t size)
 		ss = NULL;
 	}
 
-	if (sm->sm_pp_root && ss != NULL)
-		avl_add(sm->sm_pp_root, ss);
+	if (ss != NULL)
+		space_map_pp_add(sm, ss);
 
 	sm->sm_space -= size;
 }
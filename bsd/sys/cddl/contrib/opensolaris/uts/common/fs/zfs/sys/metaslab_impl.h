@@ -85,6 +85,16 @@ struct metaslab {
 	metaslab_group_t *ms_group;	/* metaslab group		*/
 	avl_node_t	ms_group_node;	/* node in metaslab group tree	*/
 	txg_node_t	ms_txg_node;	/* per-txg dirty metaslab links	*/
+
+	/*
+	 * ms_map's free segments by size, kept by the space map while it's
+	 * loaded, and its largest free segment as of its unloading.  While
+	 * unloaded, frees may raise the latter (see metaslab_unloaded_free()).
+	 */
+	uint64_t	ms_histogram[SPACE_MAP_HISTOGRAM_SIZE];
+	uint64_t	ms_max_size;	/* largest free segment, if known */
+	boolean_t	ms_max_size_known; /* unloaded, nothing freed since */
+	boolean_t	ms_weight_capped; /* ms_weight is ms_max_size	*/
 };
 
 #ifdef	__cplusplus
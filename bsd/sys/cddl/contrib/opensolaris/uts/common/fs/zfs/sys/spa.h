@@ -674,6 +674,14 @@ extern void spa_get_errlists(spa_t *spa, avl_tree_t *last, avl_tree_t *scrub);
 extern void vdev_cache_stat_init(void);
 extern void vdev_cache_stat_fini(void);
 
+/* vdev queue */
+extern void vdev_queue_stat_init(void);
+extern void vdev_queue_stat_fini(void);
+
+/* metaslab */
+extern void metaslab_stat_init(void);
+extern void metaslab_stat_fini(void);
+
 /* Initialization and termination */
 extern void spa_init(int flags);
 extern void spa_fini(void);
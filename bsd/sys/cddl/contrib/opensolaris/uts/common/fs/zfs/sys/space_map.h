@@ -52,6 +52,7 @@ typedef struct space_map {
 	space_map_ops_t	*sm_ops;	/* space map block picker ops vector */
 	avl_tree_t	*sm_pp_root;	/* picker-private AVL tree */
 	void		*sm_ppd;	/* picker-private data */
+	uint64_t	*sm_histogram;	/* segment counts by size, if owned */
 	kmutex_t	*sm_lock;	/* pointer to lock that protects map */
 } space_map_t;
 
@@ -62,6 +63,14 @@ typedef struct space_seg {
 	uint64_t	ss_end;		/* ending offset (non-inclusive) */
 } space_seg_t;
 
+/*
+ * Segment size histogram, maintained while the map is loaded for allocation
+ * (see sm_histogram): bucket i counts segments of [2^i, 2^(i+1)) bytes.
+ */
+#define	SPACE_MAP_HISTOGRAM_SIZE	64
+#define	SPACE_MAP_HISTOGRAM_BUCKET(ss)	\
+	(highbit((ss)->ss_end - (ss)->ss_start) - 1)
+
 typedef struct space_ref {
 	avl_node_t	sr_node;	/* AVL node */
 	uint64_t	sr_offset;	/* offset (start or end) */
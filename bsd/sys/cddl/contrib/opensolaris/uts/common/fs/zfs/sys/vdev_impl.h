@@ -99,11 +99,22 @@ struct vdev_cache {
 	kmutex_t	vc_lock;
 };
 
+typedef struct vdev_queue_class {
+	uint32_t	vqc_active;
+
+	/*
+	 * Sorted by offset, so that we can easily identify sequential
+	 * i/os.
+	 */
+	avl_tree_t	vqc_queued_tree;
+} vdev_queue_class_t;
+
 struct vdev_queue {
-	avl_tree_t	vq_deadline_tree;
-	avl_tree_t	vq_read_tree;
-	avl_tree_t	vq_write_tree;
-	avl_tree_t	vq_pending_tree;
+	vdev_t		*vq_vdev;
+	vdev_queue_class_t vq_class[ZIO_PRIORITY_NUM_QUEUEABLE];
+	avl_tree_t	vq_active_tree;
+	uint64_t	vq_last_offset;
+	hrtime_t	vq_io_complete_ts; /* time last i/o completed */
 	kmutex_t	vq_lock;
 };
 
@@ -192,7 +203,7 @@ struct vdev {
 	uint8_t		vdev_cant_write; /* vdev is failing all writes	*/
 	uint64_t	vdev_isspare;	/* was a hot spare		*/
 	uint64_t	vdev_isl2cache;	/* was a l2cache device		*/
-	vdev_queue_t	vdev_queue;	/* I/O deadline schedule queue	*/
+	vdev_queue_t	vdev_queue;	/* I/O scheduler queues		*/
 	vdev_cache_t	vdev_cache;	/* physical block cache		*/
 	spa_aux_vdev_t	*vdev_aux;	/* for l2cache vdevs		*/
 	zio_t		*vdev_probe_zio; /* root of current probe	*/
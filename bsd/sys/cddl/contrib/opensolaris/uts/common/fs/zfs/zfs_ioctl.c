@@ -2269,9 +2269,10 @@ zfs_prop_set_special(const char *dsname, zprop_source_t source,
 	}
 	case ZFS_PROP_COMPRESSION:
 	{
-		if (intval == ZIO_COMPRESS_LZ4) {
+		if (intval == ZIO_COMPRESS_LZ4 || ZIO_COMPRESS_IS_ZSTD(intval)) {
 			zfeature_info_t *feature =
-			    &spa_feature_table[SPA_FEATURE_LZ4_COMPRESS];
+			    &spa_feature_table[intval == ZIO_COMPRESS_LZ4 ?
+			    SPA_FEATURE_LZ4_COMPRESS : SPA_FEATURE_ZSTD_COMPRESS];
 			spa_t *spa;
 			dsl_pool_t *dp;
 
@@ -2281,8 +2282,8 @@ zfs_prop_set_special(const char *dsname, zprop_source_t source,
 			dp = spa->spa_dsl_pool;
 
 			/*
-			 * Setting the LZ4 compression algorithm activates
-			 * the feature.
+			 * Setting the LZ4 or zstd compression algorithm
+			 * activates its feature.
 			 */
 			if (!spa_feature_is_active(spa, feature)) {
 				if ((err = zfs_prop_activate_feature(dp,
@@ -3540,10 +3541,13 @@ zfs_check_settable(const char *dsname, nvpair_t *pair, cred_t *cr)
 			    SPA_VERSION_ZLE_COMPRESSION))
 				return (ENOTSUP);
 
-			if (intval == ZIO_COMPRESS_LZ4) {
+			if (intval == ZIO_COMPRESS_LZ4 ||
+			    ZIO_COMPRESS_IS_ZSTD(intval)) {
 				zfeature_info_t *feature =
 				    &spa_feature_table[
-				    SPA_FEATURE_LZ4_COMPRESS];
+				    intval == ZIO_COMPRESS_LZ4 ?
+				    SPA_FEATURE_LZ4_COMPRESS :
+				    SPA_FEATURE_ZSTD_COMPRESS];
 				spa_t *spa;
 
 				if ((err = spa_open(dsname, &spa, FTAG)) != 0)
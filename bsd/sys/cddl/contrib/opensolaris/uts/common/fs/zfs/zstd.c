@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+/*
+ * Zstandard compression, from the library in sys/contrib/zstd.
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/zio_compress.h>
+
+#define	ZSTD_STATIC_LINKING_ONLY
+#include <contrib/zstd/lib/zstd.h>
+
+/*
+ * Compression and decompression contexts, a set of each per cpu.  They are
+ * created on first use and kept, with their workspace, so that compressing
+ * a block doesn't allocate, unless it's at a higher level than the context
+ * has seen before.  A thread takes its cpu's context, or, if a thread which
+ * was preempted or migrated holds that one, any other that's free.
+ */
+typedef struct zstd_pcpu {
+	kmutex_t	zp_lock;
+	void		*zp_ctx;
+} zstd_pcpu_t;
+
+static zstd_pcpu_t *zstd_cctx;
+static zstd_pcpu_t *zstd_dctx;
+
+static zstd_pcpu_t *
+zstd_pcpu_enter(zstd_pcpu_t *pcpu)
+{
+	int cpu = CPU_SEQID;
+
+	for (int i = 0; i < max_ncpus; i++) {
+		zstd_pcpu_t *zp = &pcpu[(cpu + i) % max_ncpus];
+
+		if (mutex_tryenter(&zp->zp_lock))
+			return (zp);
+	}
+
+	mutex_enter(&pcpu[cpu].zp_lock);
+	return (&pcpu[cpu]);
+}
+
+/*
+ * Like lz4, we precede the compressed data with its size, as the block
+ * read back may be padded past it.
+ */
+size_t
+zstd_compress(void *s_start, void *d_start, size_t s_len, size_t d_len,
+    int level)
+{
+	char *dest = d_start;
+	zstd_pcpu_t *zp;
+	size_t c_len;
+
+	ASSERT(d_len >= sizeof (uint32_t));
+
+	zp = zstd_pcpu_enter(zstd_cctx);
+	if (zp->zp_ctx == NULL)
+		zp->zp_ctx = ZSTD_createCCtx();
+	if (zp->zp_ctx == NULL) {
+		mutex_exit(&zp->zp_lock);
+		return (s_len);
+	}
+	c_len = ZSTD_compressCCtx(zp->zp_ctx, &dest[sizeof (uint32_t)],
+	    d_len - sizeof (uint32_t), s_start, s_len, level);
+	mutex_exit(&zp->zp_lock);
+
+	/* Including when the result wouldn't fit in d_len */
+	if (ZSTD_isError(c_len))
+		return (s_len);
+
+	*(uint32_t *)dest = BE_32(c_len);
+
+	return (c_len + sizeof (uint32_t));
+}
+
+/*ARGSUSED*/
+int
+zstd_decompress(void *s_start, void *d_start, size_t s_len, size_t d_len,
+    int level)
+{
+	const char *src = s_start;
+	uint32_t bufsiz = BE_IN32(src);
+	zstd_pcpu_t *zp;
+	size_t len;
+
+	/* invalid compressed buffer size encoded at start */
+	if (bufsiz + sizeof (bufsiz) > s_len)
+		return (1);
+
+	zp = zstd_pcpu_enter(zstd_dctx);
+	if (zp->zp_ctx == NULL)
+		zp->zp_ctx = ZSTD_createDCtx();
+	if (zp->zp_ctx == NULL) {
+		mutex_exit(&zp->zp_lock);
+		return (1);
+	}
+	len = ZSTD_decompressDCtx(zp->zp_ctx, d_start, d_len,
+	    &src[sizeof (bufsiz)], bufsiz);
+	mutex_exit(&zp->zp_lock);
+
+	return (ZSTD_isError(len) || len != d_len);
+}
+
+void
+zstd_init(void)
+{
+	zstd_cctx = kmem_zalloc(max_ncpus * sizeof (zstd_pcpu_t), KM_SLEEP);
+	zstd_dctx = kmem_zalloc(max_ncpus * sizeof (zstd_pcpu_t), KM_SLEEP);
+
+	for (int c = 0; c < max_ncpus; c++) {
+		mutex_init(&zstd_cctx[c].zp_lock, NULL, MUTEX_DEFAULT, NULL);
+		mutex_init(&zstd_dctx[c].zp_lock, NULL, MUTEX_DEFAULT, NULL);
+	}
+}
+
+void
+zstd_fini(void)
+{
+	for (int c = 0; c < max_ncpus; c++) {
+		ZSTD_freeCCtx(zstd_cctx[c].zp_ctx);
+		ZSTD_freeDCtx(zstd_dctx[c].zp_ctx);
+		mutex_destroy(&zstd_cctx[c].zp_lock);
+		mutex_destroy(&zstd_dctx[c].zp_lock);
+	}
+
+	kmem_free(zstd_cctx, max_ncpus * sizeof (zstd_pcpu_t));
+	kmem_free(zstd_dctx, max_ncpus * sizeof (zstd_pcpu_t));
+}
@@ -96,6 +96,7 @@ typedef struct {
 #define	LINUX_SO_SNDTIMEO	21
 #define	LINUX_SO_TIMESTAMP	29
 #define	LINUX_SO_ACCEPTCONN	30
+#define	LINUX_SO_BUSY_POLL	46
 
 #define	LINUX_IP_MULTICAST_IF		32
 #define	LINUX_IP_MULTICAST_TTL		33
@@ -351,6 +351,8 @@ linux_to_bsd_so_sockopt(int opt)
 		return (SO_TIMESTAMP);
 	case LINUX_SO_ACCEPTCONN:
 		return (SO_ACCEPTCONN);
+	case LINUX_SO_BUSY_POLL:
+		return (SO_BUSY_POLL);
 	}
 	return (-1);
 }
@@ -324,6 +324,13 @@ socket_file::poll_uninstall(pollreq& pr)
     SOCK_UNLOCK(so);
 }
 
+void
+socket_file::busy_poll(int budget)
+{
+    // Packets pushed onto the channel wake the pollers and epollers
+    sobusypoll(so, budget);
+}
+
 int
 socket_file::stat(struct stat *ub)
 {
@@ -138,11 +138,72 @@ void sockbuf_iolock::unlock(mutex& mtx)
 	_wq.wake_all(mtx);
 }
 
+/*
+ * Drive the receive queue of the interface feeding the socket's net channel
+ * once, if it can be.  Returns true if packets are waiting on the channel.
+ * Called without the socket lock, so the channel may be going away.
+ */
+bool
+sobusypoll(struct socket *so, int budget)
+{
+	net_channel::busy_poller bp;
+
+	WITH_LOCK(osv::rcu_read_lock) {
+		auto nc = so->so_nc;
+		if (!nc) {
+			return false;
+		}
+		if (!nc->empty()) {
+			return true;
+		}
+		bp = nc->get_busy_poller();
+	}
+	if (bp.poll) {
+		bp.poll(bp.arg, budget);
+	}
+	return false;
+}
+
+/*
+ * Poll the net channel for up to so_busy_poll usecs, but not past the
+ * receive timeout, before sleeping on it, as its consumer.  Returns true if
+ * packets arrived.
+ */
+template<typename Clock>
+static bool
+sbbusypoll(socket* so, boost::optional<std::chrono::time_point<Clock>> timeout)
+{
+	auto until = Clock::now() + std::chrono::microseconds(so->so_busy_poll);
+	bool ready;
+
+	if (timeout && *timeout < until) {
+		until = *timeout;
+	}
+	so->so_nc_busy = true;
+	DROP_LOCK(SOCK_MTX_REF(so)) {
+		while (!(ready = sobusypoll(so, SO_BUSY_POLL_BUDGET)) &&
+		    Clock::now() < until) {
+			barrier();
+		}
+	}
+	so->so_nc_busy = false;
+	so->so_nc_wq.wake_all(SOCK_MTX_REF(so));
+	return ready;
+}
+
 template<typename Clock>
 int sbwait_tmo(socket* so, struct sockbuf *sb, boost::optional<std::chrono::time_point<Clock>> timeout)
 {
 	SOCK_LOCK_ASSERT(so);
 
+	if (sb == &so->so_rcv && so->so_busy_poll && so->so_nc &&
+	    !so->so_nc_busy && sbbusypoll(so, timeout)) {
+		if (so->so_nc) {
+			so->so_nc->process_queue();
+		}
+		return 0;
+	}
+
 	sb->sb_flags |= SB_WAIT;
 	sched::timer tmr(*sched::thread::current());
 	if (timeout) {
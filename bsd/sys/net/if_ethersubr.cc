@@ -395,6 +395,15 @@ ether_output_frame(struct ifnet *ifp, struct mbuf *m)
 	 * successful, and start output if interface not yet active.
 	 */
 	log_packet_out(m, NETISR_ETHER);
+	/*
+	 * The packet leaves the stack here, as far as TCP autocorking is
+	 * concerned, unless the driver says when it reaches the device.
+	 */
+	if (!(ifp->if_capenable & IFCAP_TXQTAG)) {
+		struct m_tag *t = m_tag_find(m, PACKET_TAG_TCP_TXQ, NULL);
+		if (t != NULL)
+			m_tag_delete(m, t);
+	}
 	return ((ifp->if_transmit)(ifp, m));
 }
 
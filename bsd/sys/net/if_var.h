@@ -177,6 +177,11 @@ struct ifnet {
 	 * get the interface info and statistics including the one gathered by HW
 	 */
 	void (*if_getinfo)(struct ifnet *, struct if_data *);
+	/*
+	 * receive up to budget packets, from a thread busy polling a net
+	 * channel the interface feeds, if it isn't being done already
+	 */
+	void (*if_busy_poll)(struct ifnet *, int budget);
 	classifier if_classifier;
 
 	struct	vnet *if_home_vnet;	/* where this ifnet originates from */
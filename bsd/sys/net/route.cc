@@ -45,6 +45,7 @@
 #include <bsd/sys/net/if.h>
 #include <bsd/sys/net/if_dl.h>
 #include <bsd/sys/net/route.h>
+#include <bsd/sys/net/routecache.hh>
 #include <bsd/sys/net/vnet.h>
 
 #include <bsd/sys/netinet/in.h>
@@ -577,6 +578,7 @@ rtredirect_fib(struct bsd_sockaddr *dst,
 			RADIX_NODE_HEAD_LOCK(rnh);
 			RT_LOCK(rt);
 			rt_setgate(rt, rt_key(rt), gateway);
+			route_cache::invalidate(rt_key(rt), rt_mask(rt));
 			gwrt = rtalloc1(gateway, 1, RTF_RNH_LOCKED);
 			RADIX_NODE_HEAD_UNLOCK(rnh);
 			EVENTHANDLER_INVOKE(route_redirect_event, rt, gwrt, dst);
@@ -873,6 +875,7 @@ rtexpunge(struct rtentry *rt)
 #endif /* RADIX_MPATH */
 
 	rt->rt_flags &= ~RTF_UP;
+	route_cache::invalidate(rt_key(rt), rt_mask(rt));
 
 	/*
 	 * Give the protocol a chance to keep things in sync.
@@ -1079,6 +1082,7 @@ rtrequest1_fib(int req, struct rt_addrinfo *info, struct rtentry **ret_nrt,
 		RT_LOCK(rt);
 		RT_ADDREF(rt);
 		rt->rt_flags &= ~RTF_UP;
+		route_cache::invalidate(rt_key(rt), rt_mask(rt));
 
 		/*
 		 * give the protocol a chance to keep things in sync.
@@ -1181,6 +1185,7 @@ rtrequest1_fib(int req, struct rt_addrinfo *info, struct rtentry **ret_nrt,
 			uma_zfree(V_rtzone, rt);
 			senderr(EEXIST);
 		} 
+		route_cache::invalidate(ndst, netmask);
 
 		/*
 		 * If this protocol has something to add to this then
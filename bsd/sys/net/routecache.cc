@@ -7,5 +7,108 @@
 
 #include "routecache.hh"
 
-osv::rcu_ptr<route_cache::routemap, osv::rcu_deleter<route_cache::routemap>> route_cache::cache (new route_cache::routemap);
+#include <stddef.h>
+#include <vector>
+
+osv::rcu_hashtable<route_cache::entry, route_cache::entry_hash> route_cache::cache;
 mutex route_cache::cache_mutex;
+std::atomic<unsigned long> route_cache::generation;
+
+// The address of an AF_INET route key or mask. Masks in the radix tree
+// are trimmed to their last nonzero byte, so may be shorter than a
+// bsd_sockaddr_in (the default route's mask has sa_len 0).
+static u32 sockaddr_in_addr(const struct bsd_sockaddr *sa)
+{
+    constexpr int off = offsetof(struct bsd_sockaddr_in, sin_addr);
+    u32 addr = 0;
+    int len = std::min<int>(sa->sa_len, off + sizeof(addr));
+    if (len > off) {
+        memcpy(&addr, (const char *)sa + off, len - off);
+    }
+    return addr;
+}
+
+static u32 route_netmask(const struct bsd_sockaddr *netmask)
+{
+    return netmask ? sockaddr_in_addr(netmask) : 0xffffffff;
+}
+
+void route_cache::lookup_slow(struct bsd_sockaddr_in *dst, u_int fibnum,
+        struct rtentry *ret, struct bsd_sockaddr_storage *gateway)
+{
+    auto gen = generation.load();
+    struct route ro {};
+    ro.ro_dst = *(struct bsd_sockaddr *)dst;
+    in_rtalloc_ign(&ro, 0, fibnum);
+    if (!ro.ro_rt) {
+        // No route, and no prefix to cache it under
+        memset(ret, 0, sizeof(*ret));
+        ret->rt_refcnt = -1;
+        return;
+    }
+    memcpy(ret, ro.ro_rt, sizeof(*ret));
+    // Before RO_RTFREE() may free the route, and its gateway with it
+    copy_gateway(ret, gateway);
+    auto netmask = route_netmask(rt_mask(ro.ro_rt));
+    auto prefix = sockaddr_in_addr(rt_key(ro.ro_rt)) & netmask;
+    RO_RTFREE(&ro);
+    ret->rt_refcnt = -1; // try to catch some monkey-business
+    mutex_init(&ret->rt_mtx._mutex); // try to catch some monkey-business?
+    // Add the result to the cache
+    auto addr = dst->sin_addr.s_addr;
+    WITH_LOCK(cache_mutex) {
+        if (generation.load() != gen) {
+            // The routing table changed since we looked it up
+            return;
+        }
+        if (cache.owner_find(addr, std::hash<u32>(), entry_compare())) {
+            // Someone beat us to it
+            return;
+        }
+        if (cache.size() >= max_entries) {
+            flush_locked();
+        }
+        cache.emplace(addr, prefix, netmask, *(nonlockable_rtentry *)ret);
+    }
+}
+
+void route_cache::invalidate(const struct bsd_sockaddr *dst, const struct bsd_sockaddr *netmask)
+{
+    if (dst->sa_family != AF_INET) {
+        return;
+    }
+    auto mask = route_netmask(netmask);
+    auto prefix = sockaddr_in_addr(dst) & mask;
+    auto len = __builtin_popcount(mask);
+    WITH_LOCK(cache_mutex) {
+        generation++;
+        std::vector<u32> stale;
+        cache.owner_for_each([&] (const entry& e) {
+            if ((e.dst & mask) == prefix && __builtin_popcount(e.netmask) <= len) {
+                stale.push_back(e.dst);
+            }
+        });
+        for (auto addr : stale) {
+            cache.erase(cache.owner_find(addr, std::hash<u32>(), entry_compare()));
+        }
+    }
+}
+
+void route_cache::invalidate()
+{
+    WITH_LOCK(cache_mutex) {
+        generation++;
+        flush_locked();
+    }
+}
+
+void route_cache::flush_locked()
+{
+    std::vector<u32> all;
+    cache.owner_for_each([&] (const entry& e) {
+        all.push_back(e.dst);
+    });
+    for (auto addr : all) {
+        cache.erase(cache.owner_find(addr, std::hash<u32>(), entry_compare()));
+    }
+}
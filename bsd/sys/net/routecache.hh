@@ -34,12 +34,17 @@
 //    We should use this function whenever it makes sense and performance
 //    is important. We don't have to change all the existing code to use it.
 //
-// 3. A new function invalidates the routing cache. It should be called
-//    whenever routes are modified. Missing a few places is not a disaster
-//    but can lead to the wrong route being used in esoteric places. It
-//    would be better to find a good place to call this function every
-//    time (e.g., perhaps write-unlock of the radix tree is a good place?
-//    or not good enough if just a route itself is modified?).
+// 3. route.cc tells the cache about every route it adds, deletes or
+//    changes, and the cache drops the destinations that route may now
+//    apply to (see invalidate() below).
+//
+// The cache holds the route found for each individual destination, in an
+// RCU hash table, so a miss adds a single entry rather than copying the
+// cache. Each entry remembers the prefix of the route it was found with,
+// which is what makes invalidation both precise and longest-prefix aware:
+// a route for prefix P/len can only change the route of destinations in P
+// whose current route is no more specific than len, and all other cached
+// destinations, including the ones in P using a more specific route, stay.
 
 #ifndef INCLUDED_ROUTECACHE_HH
 #define INCLUDED_ROUTECACHE_HH
@@ -58,7 +63,10 @@
 #include <bsd/sys/net/route.h>
 
 #include <osv/rcu.hh>
-#include <unordered_map>
+#include <osv/rcu-hashtable.hh>
+#include <osv/mutex.h>
+#include <algorithm>
+#include <atomic>
 #include <functional>
 
 
@@ -86,86 +94,85 @@ public:
     }
 };
 
-// Silly routing table implementation, allowing search given address in list
-// list address ranges (address+netmask). This silly implementation is IPv4
-// only (assumes addresses are u32) and performs a linear search, which only
-// makes sense when there are only a few entries (on a typical non-router
-// system, there will be only one).
-// TODO: Use the radix tree implementation that BSD already has (radix.cc,
-// route.cc), but it is incredibly complex.
-class silly_rtable {
-    // Limit the number of routing entries cached to some reasonable small
-    // limit. This is an O(N) data structure, after all...
-    static constexpr unsigned max_entries = 10;
-    struct silly_rtable_entry {
-        u32 address;
+class route_cache {
+    struct entry {
+        u32 dst;
+        // The prefix of the route used for dst
+        u32 prefix;
         u32 netmask;
         nonlockable_rtentry rte;
-        silly_rtable_entry(u32 a, u32 n, const nonlockable_rtentry &r) :
-            address(a), netmask(n), rte(r) { }
-    };
-    std::list<silly_rtable_entry> entries;
-public:
-    void add(u32 a, u32 n, const nonlockable_rtentry &r) {
-        while (entries.size() >= max_entries) {
-            entries.erase(entries.end());
+        // The route's gateway is freed with the route, so rte points to
+        // this copy, which lives until readers are done with the entry
+        struct bsd_sockaddr_storage gateway;
+        entry(u32 dst, u32 prefix, u32 netmask, const nonlockable_rtentry& rte)
+            : dst(dst), prefix(prefix), netmask(netmask), rte(rte) {
+            copy_gateway(&this->rte, &gateway);
         }
-        entries.emplace_front(a, n, r);
-    }
-    nonlockable_rtentry *search(u32 address) {
-        for (silly_rtable_entry &e : entries) {
-            if ((e.address & e.netmask) == (address & e.netmask)) {
-                return &e.rte;
+        // rcu_hashtable copies entries when it resizes
+        entry(const entry& e)
+            : dst(e.dst), prefix(e.prefix), netmask(e.netmask), rte(e.rte)
+            , gateway(e.gateway) {
+            if (rte.rt_gateway) {
+                rte.rt_gateway = (struct bsd_sockaddr *)&gateway;
             }
         }
-        return nullptr;
-    }
-};
-
-
-class route_cache {
-    using routemap = silly_rtable;
-    static osv::rcu_ptr<routemap, osv::rcu_deleter<routemap>> cache;
+    };
+    struct entry_hash {
+        size_t operator()(const entry& e) const { return std::hash<u32>()(e.dst); }
+    };
+    struct entry_compare {
+        bool operator()(u32 dst, const entry& e) const { return dst == e.dst; }
+    };
+    // When a host talks to this many destinations, start over rather than
+    // keep track of which entries are in use.
+    static constexpr size_t max_entries = 4096;
+    static osv::rcu_hashtable<entry, entry_hash> cache;
     static mutex cache_mutex;
+    // Bumped by every invalidation, so a miss which looked up the routing
+    // table before a route changed doesn't cache the old route after it
+    static std::atomic<unsigned long> generation;
+
+    static void lookup_slow(struct bsd_sockaddr_in *dst, u_int fibnum,
+            struct rtentry *ret, struct bsd_sockaddr_storage *gateway);
+    static void flush_locked();
+    // Points rte's gateway to a copy of it in the given storage
+    static void copy_gateway(struct rtentry *rte, struct bsd_sockaddr_storage *gateway) {
+        if (rte->rt_gateway) {
+            memcpy(gateway, rte->rt_gateway,
+                   std::min<size_t>(rte->rt_gateway->sa_len, sizeof(*gateway)));
+            rte->rt_gateway = (struct bsd_sockaddr *)gateway;
+        }
+    }
 public:
     // Note that this returns a copy of a routing entry, *not* a pointer.
     // So the return value shouldn't be written to, nor, of course, be RTFREE'd.
-    static void lookup(struct bsd_sockaddr_in *dst, u_int fibnum, struct rtentry *ret) {
+    // If there is no route, the copy's rt_ifp is null.
+    // The copy's rt_gateway points to "gateway", which the caller provides
+    // and must keep for as long as it uses the copy: neither the cache
+    // entry nor the route outlive the lookup.
+    static void lookup(struct bsd_sockaddr_in *dst, u_int fibnum,
+            struct rtentry *ret, struct bsd_sockaddr_storage *gateway) {
         // Only support fib 0, which is what we use anyway (see rt_numfibs in
         // route.cc).
         assert(fibnum == 0);
 
         WITH_LOCK(osv::rcu_read_lock) {
-            auto *c = cache.read();
-            auto entry = c->search(dst->sin_addr.s_addr);
-            if (entry) {
-                memcpy(ret, entry, sizeof(*ret));
+            auto e = cache.reader_find(dst->sin_addr.s_addr, std::hash<u32>(), entry_compare());
+            if (e) {
+                memcpy(ret, &e->rte, sizeof(*ret));
+                copy_gateway(ret, gateway);
                 return;
             }
         }
-        // Not found in cache. Do the slow lookup
-        struct route ro {};
-        ro.ro_dst = *(struct bsd_sockaddr *)dst;
-        in_rtalloc_ign(&ro, 0, fibnum);
-        memcpy(ret, ro.ro_rt, sizeof(*ret));
-        RO_RTFREE(&ro);
-        ret->rt_refcnt = -1; // try to catch some monkey-business
-        mutex_init(&ret->rt_mtx._mutex); // try to catch some monkey-business?
-        // Add the result to the cache
-        WITH_LOCK(cache_mutex) {
-            auto *old_cache = cache.read_by_owner();
-            auto new_cache = new routemap(*old_cache);
-            auto netmask = ((bsd_sockaddr_in *)(ret->rt_ifa->ifa_netmask))->sin_addr.s_addr;
-            auto addr = dst->sin_addr.s_addr;
-            new_cache->add(addr, netmask, *(nonlockable_rtentry *)ret);
-            cache.assign(new_cache);
-            osv::rcu_dispose(old_cache);
-        }
+        lookup_slow(dst, fibnum, ret, gateway);
     }
 
-    static void invalidate() {
-
-    }
+    // Drops the cached destinations whose route may change because a route
+    // to dst/netmask (a null netmask for a host route) was added, deleted
+    // or changed. Called by route.cc with the route's key and mask.
+    static void invalidate(const struct bsd_sockaddr *dst, const struct bsd_sockaddr *netmask);
+    // Drops everything
+    static void invalidate();
 };
 
 #endif
@@ -49,6 +49,7 @@
 #include <bsd/sys/net/netisr.h>
 #include <bsd/sys/net/raw_cb.h>
 #include <bsd/sys/net/route.h>
+#include <bsd/sys/net/routecache.hh>
 #include <bsd/sys/net/vnet.h>
 
 #include <bsd/sys/netinet/in.h>
@@ -702,6 +703,7 @@ route_output(struct mbuf *m, struct socket *so)
 			rtm->rtm_index = rt->rt_ifp->if_index;
 			if (rt->rt_ifa && rt->rt_ifa->ifa_rtrequest)
 			       rt->rt_ifa->ifa_rtrequest(RTM_ADD, rt, &info);
+			route_cache::invalidate(rt_key(rt), rt_mask(rt));
 			/* FALLTHROUGH */
 		case RTM_LOCK:
 			/* We don't support locks anymore */
@@ -7,17 +7,43 @@
 
 #include <bsd/sys/netinet/arpcache.hh>
 #include <bsd/sys/net/if_llatbl.h>
+#include <bsd/sys/net/if_dl.h>
+#include <bsd/sys/net/if_var.h>
+
+#include <osv/async.hh>
+
+extern void arprequest(struct ifnet *, struct in_addr *, struct in_addr *,
+	u_char *);
 
 struct arp_cache global_arp_cache{};
 
-void arp_cache_add(const struct llentry *lle)
+void arp_cache::probe(const in_addr ip, struct ifnet* ifp)
+{
+    _probes.increment();
+    // arprequest() allocates and transmits, which the sender (it may hold
+    // the inpcb lock) shouldn't wait for. ifp is good here, as interfaces
+    // outlive the ARP entries pointing at them, and the reference keeps it
+    // so until the request is out.
+    if_ref(ifp);
+    async::run_later([ip, ifp] {
+        auto tip = ip;
+        arprequest(ifp, NULL, &tip, (u_char *)IF_LLADDR(ifp));
+        if_rele(ifp);
+    });
+}
+
+void arp_cache_add(const struct llentry *lle, int keep)
 {
     if (!(lle->la_flags & LLE_VALID)) {
         return;
     }
     auto* mac = reinterpret_cast<const arp_cache::mac_address*>(lle->ll_addr.mac16);
     auto* sin = satosin(L3_ADDR(lle));
-    global_arp_cache.add(sin->sin_addr, *mac, lle->la_flags);
+    auto* ifp = lle->lle_tbl ? lle->lle_tbl->llt_ifp : nullptr;
+    if (lle->la_flags & LLE_STATIC) {
+        keep = 0;
+    }
+    global_arp_cache.add(sin->sin_addr, *mac, lle->la_flags, ifp, keep);
 }
 
 void arp_cache_remove(const struct llentry *lle)
@@ -28,11 +54,10 @@ void arp_cache_remove(const struct llentry *lle)
 
 bool arp_cache_lookup(const in_addr ip, arp_cache::mac_address& mac, u16& flags)
 {
-    auto e = global_arp_cache.lookup(ip);
-    if (e) {
-        mac = e->mac;
-        flags = e->flags;
-        return true;
-    }
-    return false;
+    return global_arp_cache.lookup(ip, mac, flags);
+}
+
+struct arp_cache::stats arp_cache_stats()
+{
+    return global_arp_cache.get_stats();
 }
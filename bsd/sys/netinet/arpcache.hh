@@ -16,13 +16,18 @@
 #include <osv/rcu.hh>
 #include <osv/types.h>
 #include <osv/mutex.h>
+#include <osv/clock.hh>
+#include <osv/per-cpu-counter.hh>
 
 #include <boost/optional.hpp>
+#include <algorithm>
+#include <atomic>
 #include <functional>
 #include <iostream>
 #include <iomanip>
 
 struct llentry;
+struct ifnet;
 
 namespace std {
 template <>
@@ -56,11 +61,33 @@ struct arp_cache {
         }
     };
 
+    // An entry is reachable until its refresh time, which comes a little
+    // before the kernel's own entry expires. The first sender to find it
+    // past that marks it stale and has it probed in the background; while
+    // the probe is out, one sender every probe_interval sends another,
+    // until a reply refreshes the entry or the kernel expires it. Senders
+    // keep using the entry throughout.
+    enum class state : u8 { reachable, stale, probe };
+
     struct entry {
         in_addr ip;
         mac_address mac;
         u16 flags;
-        entry(in_addr i, mac_address m, u16 f) : ip(i), mac(m), flags(f) {}
+        struct ifnet* ifp;
+        // In osv::clock::uptime nanoseconds; 0 for entries that never expire
+        std::atomic<s64> refresh;
+        std::atomic<s64> next_probe;
+        std::atomic<state> st;
+        entry(in_addr i, mac_address m, u16 f, struct ifnet* ifp, s64 refresh)
+            : ip(i), mac(m), flags(f), ifp(ifp), refresh(refresh)
+            , next_probe(0), st(state::reachable) {}
+        // rcu_hashtable copies entries when it resizes; a probe state
+        // change racing with that may be lost, which only costs a probe.
+        entry(const entry& e)
+            : ip(e.ip), mac(e.mac), flags(e.flags), ifp(e.ifp)
+            , refresh(e.refresh.load(std::memory_order_relaxed))
+            , next_probe(e.next_probe.load(std::memory_order_relaxed))
+            , st(e.st.load(std::memory_order_relaxed)) {}
     };
 
     struct entry_hash : private std::hash<in_addr> {
@@ -73,17 +100,42 @@ struct arp_cache {
         }
     };
 
-    void add(const in_addr ip, const mac_address mac, const u16 flags)
+    struct stats {
+        ulong hits;
+        ulong misses;
+        ulong probes;
+    };
+
+    static constexpr s64 probe_interval = 1000000000LL;
+    // How long before the kernel's entry expires we start probing
+    static constexpr s64 refresh_margin = 30 * 1000000000LL;
+
+    static s64 now()
     {
+        return osv::clock::uptime::now().time_since_epoch().count();
+    }
+
+    // keep is how many seconds the entry stays valid for, 0 for ever
+    void add(const in_addr ip, const mac_address mac, const u16 flags,
+             struct ifnet* ifp = nullptr, int keep = 0)
+    {
+        s64 refresh = 0;
+        if (keep) {
+            s64 ns = keep * 1000000000LL;
+            refresh = now() + std::max(ns - refresh_margin, ns / 2);
+        }
         WITH_LOCK(_mtx) {
             auto i = _entries.owner_find(ip, std::hash<in_addr>(), entry_compare());
             if (i) {
-                if (i->mac == mac && i->flags == flags) {
+                if (i->mac == mac && i->flags == flags && i->ifp == ifp) {
+                    // Refreshed in place, so readers never see a gap
+                    i->refresh.store(refresh, std::memory_order_relaxed);
+                    i->st.store(state::reachable, std::memory_order_relaxed);
                     return;
                 }
                 _entries.erase(i);
             }
-            _entries.emplace(ip, mac, flags);
+            _entries.emplace(ip, mac, flags, ifp, refresh);
         }
     }
 
@@ -96,6 +148,28 @@ struct arp_cache {
         }
     }
 
+    bool lookup(const in_addr ip, mac_address& mac, u16& flags)
+    {
+        struct ifnet* probe_ifp = nullptr;
+        WITH_LOCK(osv::rcu_read_lock) {
+            auto i = _entries.reader_find(ip, std::hash<in_addr>(), entry_compare());
+            if (!i) {
+                _misses.increment();
+                return false;
+            }
+            _hits.increment();
+            mac = i->mac;
+            flags = i->flags;
+            if (i->ifp && needs_probe(*i)) {
+                probe_ifp = i->ifp;
+            }
+        }
+        if (probe_ifp) {
+            probe(ip, probe_ifp);
+        }
+        return true;
+    }
+
     boost::optional<entry> lookup(const in_addr ip)
     {
         WITH_LOCK(osv::rcu_read_lock) {
@@ -104,13 +178,52 @@ struct arp_cache {
         }
     }
 
+    struct stats get_stats()
+    {
+        return { _hits.read(), _misses.read(), _probes.read() };
+    }
+
 private:
+    // Whether the sender that found e should send a probe for it
+    static bool needs_probe(entry& e)
+    {
+        auto refresh = e.refresh.load(std::memory_order_relaxed);
+        if (!refresh) {
+            return false;
+        }
+        auto t = now();
+        auto s = e.st.load(std::memory_order_relaxed);
+        switch (s) {
+        case state::reachable:
+            if (t < refresh || !e.st.compare_exchange_strong(s, state::stale)) {
+                return false;
+            }
+            e.next_probe.store(t + probe_interval, std::memory_order_relaxed);
+            e.st.store(state::probe, std::memory_order_relaxed);
+            return true;
+        case state::probe: {
+            auto next = e.next_probe.load(std::memory_order_relaxed);
+            return t >= next && e.next_probe.compare_exchange_strong(next, t + probe_interval);
+        }
+        default:
+            // Another sender is sending the first probe
+            return false;
+        }
+    }
+
+    // Has an ARP request for ip sent on ifp from a worker thread
+    void probe(const in_addr ip, struct ifnet* ifp);
+
     mutex _mtx;
     osv::rcu_hashtable<entry, entry_hash> _entries;
+    per_cpu_counter _hits;
+    per_cpu_counter _misses;
+    per_cpu_counter _probes;
 };
 
-void arp_cache_add(const struct llentry *lle);
+void arp_cache_add(const struct llentry *lle, int keep = 0);
 void arp_cache_remove(const struct llentry *lle);
 bool arp_cache_lookup(const in_addr ip, arp_cache::mac_address& mac, u16& flags);
+struct arp_cache::stats arp_cache_stats();
 
 #endif
@@ -712,7 +712,7 @@ match:
 		(void)memcpy(&la->ll_addr, ar_sha(ah), ifp->if_addrlen);
 		la->la_flags |= LLE_VALID;
 
-		arp_cache_add(la);
+		arp_cache_add(la, V_arpt_keep);
 
 		EVENTHANDLER_INVOKE(arp_update_event, la);
 
@@ -657,6 +657,7 @@ in_pcbladdr(struct inpcb *inp, struct in_addr *faddr, struct in_addr *laddr,
 	struct bsd_sockaddr_in *sin;
 	struct route sro;
 	struct rtentry rte_one;
+	struct bsd_sockaddr_storage gw_one;
 	int error;
 
 	KASSERT(laddr != NULL, ("%s: laddr NULL", __func__));
@@ -677,7 +678,7 @@ in_pcbladdr(struct inpcb *inp, struct in_addr *faddr, struct in_addr *laddr,
 	 */
 	if ((inp->inp_socket->so_options & SO_DONTROUTE) == 0)
 	{
-	    route_cache::lookup(sin, inp->inp_inc.inc_fibnum, &rte_one);
+	    route_cache::lookup(sin, inp->inp_inc.inc_fibnum, &rte_one, &gw_one);
 	    sro.ro_rt = &rte_one;
 	}
 
@@ -57,6 +57,8 @@
 #include <bsd/sys/netinet/in_var.h>
 #include <bsd/sys/netinet/ip_var.h>
 #include <bsd/sys/netinet/ip_options.h>
+#include <bsd/sys/netinet/udp.h>
+#include <bsd/sys/netinet/udp_var.h>
 
 #include <bsd/sys/net/routecache.hh>
 
@@ -109,11 +111,13 @@ ip_output(struct mbuf *m, struct mbuf *opt, struct route *ro, int flags,
 	struct bsd_sockaddr_in *dst;
 	struct in_ifaddr *ia;
 	int isbroadcast, sw_csum;
+	int segmented = 0;
 	struct route iproute;
 	struct rtentry *rte;	/* cache for ro->ro_rt */
 	struct in_addr odst;
 	struct m_tag *fwd_tag = NULL;
 	struct rtentry rte_one;
+	struct bsd_sockaddr_storage gw_one;	/* rte_one's gateway */
 	int have_ia_ref;
 #ifdef IPSEC
 	int no_route_but_check_spd = 0;
@@ -257,7 +261,8 @@ again:
 			    ntohl(ip->ip_src.s_addr ^ ip->ip_dst.s_addr),
 			    inp ? inp->inp_inc.inc_fibnum : M_GETFIB(m));
 #else
-			route_cache::lookup(dst, inp ? inp->inp_inc.inc_fibnum : M_GETFIB(m), &rte_one);
+			route_cache::lookup(dst, inp ? inp->inp_inc.inc_fibnum : M_GETFIB(m),
+			    &rte_one, &gw_one);
 			ro->ro_rt = &rte_one;
 #endif
 			rte = ro->ro_rt;
@@ -567,6 +572,28 @@ passout:
 
 	m->M_dat.MH.MH_pkthdr.csum_flags |= CSUM_IP;
 	sw_csum = m->M_dat.MH.MH_pkthdr.csum_flags & ~ifp->if_hwassist;
+	if (m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_UDP_SEG) {
+		/* Each of the UDP_SEGMENT datagrams has to fit. */
+		if (hlen + sizeof(struct udphdr) +
+		    m->M_dat.MH.MH_pkthdr.tso_segsz > (u_int)mtu) {
+			error = EMSGSIZE;
+			IPSTAT_INC(ips_cantfrag);
+			goto bad;
+		}
+		/*
+		 * If the interface can't split them, do it here and send
+		 * them like fragments.
+		 */
+		if (sw_csum & CSUM_UDP_SEG) {
+			ip->ip_len = htons(ip->ip_len);
+			ip->ip_off = htons(ip->ip_off);
+			error = udp_segment(&m, 0, sw_csum);
+			if (error)
+				goto bad;
+			segmented = 1;
+			goto sendlist;
+		}
+	}
 	if (sw_csum & CSUM_DELAY_DATA) {
 		in_delayed_cksum(m);
 		sw_csum &= ~CSUM_DELAY_DATA;
@@ -584,7 +611,8 @@ passout:
 	 * care of the fragmentation for us, we can just send directly.
 	 */
 	if (ip->ip_len <= mtu ||
-	    (m->M_dat.MH.MH_pkthdr.csum_flags & ifp->if_hwassist & CSUM_TSO) != 0 ||
+	    (m->M_dat.MH.MH_pkthdr.csum_flags & ifp->if_hwassist &
+	     (CSUM_TSO | CSUM_UDP_SEG)) != 0 ||
 	    ((ip->ip_off & IP_DF) == 0 && (ifp->if_hwassist & CSUM_FRAGMENT))) {
 		ip->ip_len = htons(ip->ip_len);
 		ip->ip_off = htons(ip->ip_off);
@@ -599,7 +627,8 @@ passout:
 		 * once instead of for every generated packet.
 		 */
 		if (!(flags & IP_FORWARDING) && ia) {
-			if (m->M_dat.MH.MH_pkthdr.csum_flags & CSUM_TSO)
+			if (m->M_dat.MH.MH_pkthdr.csum_flags &
+			    (CSUM_TSO | CSUM_UDP_SEG))
 				ia->ia_ifa.if_opackets +=
 				    m->M_dat.MH.MH_pkthdr.len / m->M_dat.MH.MH_pkthdr.tso_segsz;
 			else
@@ -634,6 +663,7 @@ passout:
 	error = ip_fragment(ip, &m, mtu, ifp->if_hwassist, sw_csum);
 	if (error)
 		goto bad;
+sendlist:
 	for (; m; m = m0) {
 		m0 = m->m_hdr.mh_nextpkt;
 		m->m_hdr.mh_nextpkt = 0;
@@ -655,7 +685,7 @@ passout:
 			m_freem(m);
 	}
 
-	if (error == 0)
+	if (error == 0 && !segmented)
 		IPSTAT_INC(ips_fragmented);
 
 done:
@@ -3223,10 +3223,20 @@ static ipv4_tcp_conn_id tcp_connection_id(tcpcb* tp)
 	};
 }
 
+static void
+tcp_net_channel_busy_poll(void* intf, int budget)
+{
+	auto ifp = static_cast<struct ifnet*>(intf);
+	ifp->if_busy_poll(ifp, budget);
+}
+
 void
 tcp_setup_net_channel(tcpcb* tp, struct ifnet* intf)
 {
 	auto nc = new net_channel([=] (mbuf *m) { tcp_net_channel_packet(tp, m); });
+	if (intf->if_busy_poll) {
+		nc->set_busy_poller({tcp_net_channel_busy_poll, intf});
+	}
 	tp->nc = nc;
 	tp->nc_intf = intf;
 	intf->add_net_channel(nc, tcp_connection_id(tp));
@@ -75,6 +75,9 @@
 
 #include <machine/in_cksum.h>
 
+#include <atomic>
+#include <new>
+
 TRACEPOINT(trace_tso_flush_sched, "");
 TRACEPOINT(trace_tso_flush_cancel, "");
 TRACEPOINT(trace_tso_flush_fire, "Going to send %d bytes", int);
@@ -88,6 +91,8 @@ TRACEPOINT(trace_tcp_output_ret, "tcp_output() returning: %d", int);
 TRACEPOINT(trace_tcp_output_just_ret, "tcp_output() just returning: len %d off %d sendwin(snd_wnd: %d snd_cwnd %d) %d sb_cc %d", int, int, int, int, int, int);
 
 TRACEPOINT(trace_tcp_output_cant_take_inp_lock, "Can't take inp lock");
+TRACEPOINT(trace_tcp_autocork, "tp=%p, unsent %d", void*, int);
+TRACEPOINT(trace_tcp_autocork_drain, "inp=%p", void*);
 
 VNET_DEFINE(int, path_mtu_discovery) = 1;
 SYSCTL_VNET_INT(_net_inet_tcp, OID_AUTO, path_mtu_discovery, CTLFLAG_RW,
@@ -110,6 +115,12 @@ SYSCTL_VNET_INT(_net_inet_tcp, OID_AUTO, tso, CTLFLAG_RW,
 	&VNET_NAME(tcp_do_tso), 0,
 	"Enable TCP Segmentation Offload");
 
+VNET_DEFINE(int, tcp_do_autocork) = 1;
+#define	V_tcp_do_autocork	VNET(tcp_do_autocork)
+SYSCTL_VNET_INT(_net_inet_tcp, OID_AUTO, autocork, CTLFLAG_RW,
+	&VNET_NAME(tcp_do_autocork), 0,
+	"Coalesce small writes while earlier segments are queued to the driver");
+
 VNET_DEFINE(int, tcp_do_autosndbuf) = 1;
 #define	V_tcp_do_autosndbuf	VNET(tcp_do_autosndbuf)
 SYSCTL_VNET_INT(_net_inet_tcp, OID_AUTO, sendbuf_auto, CTLFLAG_RW,
@@ -216,6 +227,148 @@ static inline bool tcp_tso_send_now(struct tcpcb *tp, long len,
 	return false;
 }
 
+/*
+ * Autocorking: a write smaller than a segment isn't sent while segments
+ * sent before it are still queued on their way to the device, but waits
+ * in the send buffer to go out together with whatever is written until
+ * they drain.
+ *
+ * A sent segment carries the connection's PACKET_TAG_TCP_TXQ tag, which is
+ * deleted when the packet is handed to the driver (or later, by drivers
+ * setting IFCAP_TXQTAG, when they hand it to the device). There is one tag
+ * per connection, embedded in its tcp_txq, so it's only put on a segment
+ * when the last one it was on has gone; tagging doesn't allocate. When it
+ * goes, the corked data is flushed from the async worker, as the tag may
+ * be deleted under anybody's locks; the TT_AUTOCORK timer flushes it a
+ * tick later if that takes longer.
+ */
+struct tcp_txq {
+	struct m_tag tag;			/* first, see tcp_txq_tag_free() */
+	std::atomic<u_int> refs {1};		/* the tcpcb's, and the tag's */
+	std::atomic<bool> queued {false};	/* the tag is on a segment */
+	std::atomic<struct inpcb *> corked {nullptr}; /* holds a reference */
+};
+
+static void
+tcp_txq_rele(struct tcp_txq *q)
+{
+	if (q->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		delete q;
+	}
+}
+
+static void
+tcp_autocork_drain(struct inpcb *inp)
+{
+	trace_tcp_autocork_drain(inp);
+	async::run_later([inp] {
+		INP_LOCK(inp);
+		if (in_pcbrele_locked(inp)) {
+			return;
+		}
+		struct tcpcb *tp = intotcpcb(inp);
+		if (tp != NULL && !(inp->inp_flags & (INP_TIMEWAIT | INP_DROPPED)) &&
+		    (tp->t_flags & TF_AUTOCORK)) {
+			CURVNET_SET(tp->t_vnet);
+			TCPSTAT_INC(tcps_autocork_drain);
+			(void) tcp_output(tp);
+			CURVNET_RESTORE();
+		}
+		INP_UNLOCK(inp);
+	});
+}
+
+static void
+tcp_txq_tag_free(struct m_tag *t)
+{
+	struct tcp_txq *q = reinterpret_cast<struct tcp_txq *>(t);
+
+	// Already unlinked from the mbuf, so tcp_output() may reuse it now
+	q->queued.store(false);
+	struct inpcb *inp = q->corked.exchange(nullptr);
+	if (inp != NULL) {
+		tcp_autocork_drain(inp);
+	}
+	tcp_txq_rele(q);
+}
+
+static void
+tcp_txq_tag(struct tcpcb *tp, struct mbuf *m)
+{
+	struct tcp_txq *q = tp->t_txq;
+
+	if (q == NULL) {
+		q = tp->t_txq = new (std::nothrow) tcp_txq;
+		if (q == NULL)
+			return;
+		// Copies of the tag carry no data and get the default
+		// destructor, so don't count
+		m_tag_setup(&q->tag, MTAG_ABI_COMPAT, PACKET_TAG_TCP_TXQ, 0);
+		q->tag.m_tag_free = tcp_txq_tag_free;
+	}
+	if (q->queued.load(std::memory_order_acquire))
+		return;
+	q->queued.store(true, std::memory_order_relaxed);
+	q->refs.fetch_add(1, std::memory_order_relaxed);
+	m_tag_prepend(m, &q->tag);
+}
+
+/**
+ * Check if data just appended to the send buffer should wait for the
+ * connection's queued segments to drain, and arm the flush if so
+ *
+ * @param tp TCP context handle
+ *
+ * @return 1 if tcp_output() should not be called now, 0 otherwise
+ */
+int
+tcp_autocork(struct tcpcb *tp)
+{
+	struct inpcb *inp = tp->t_inpcb;
+	struct socket *so = inp->inp_socket;
+	struct tcp_txq *q = tp->t_txq;
+	struct inpcb *expected = NULL;
+	long unsent;
+
+	INP_LOCK_ASSERT(inp);
+
+	if (!V_tcp_do_autocork || q == NULL ||
+	    !q->queued.load(std::memory_order_acquire) ||
+	    tp->get_state() != TCPS_ESTABLISHED ||
+	    (tp->t_flags & (TF_FORCEDATA | TF_SENTFIN)))
+		return (0);
+	unsent = so->so_snd.sb_cc - (tp->snd_nxt - tp->snd_una);
+	if (unsent <= 0 || unsent >= (long)tp->t_maxseg)
+		return (0);
+
+	in_pcbref(inp);
+	if (!q->corked.compare_exchange_strong(expected, inp))
+		(void) in_pcbrele_locked(inp);
+	// The tag may have gone before its deletion could see us corked
+	if (!q->queued.load()) {
+		if (q->corked.exchange(nullptr) != NULL)
+			(void) in_pcbrele_locked(inp);
+		return (0);
+	}
+
+	trace_tcp_autocork(tp, unsent);
+	TCPSTAT_INC(tcps_autocork);
+	tp->t_flags |= TF_AUTOCORK;
+	if (!tcp_timer_active(tp, TT_AUTOCORK))
+		tcp_timer_activate(tp, TT_AUTOCORK, 1);
+	return (1);
+}
+
+void
+tcp_autocork_discard(struct tcpcb *tp)
+{
+	// A reference held for the drain stays with the tcp_txq until then
+	if (tp->t_txq != NULL) {
+		tcp_txq_rele(tp->t_txq);
+		tp->t_txq = NULL;
+	}
+}
+
 /*
  * Tcp output routine: figure out what should be sent and send it.
  */
@@ -253,6 +406,8 @@ tcp_output(struct tcpcb *tp)
 
 	INP_LOCK_ASSERT(tp->t_inpcb);
 
+	tp->t_flags &= ~TF_AUTOCORK;
+
 	/*
 	 * Determine length of data that should be transmitted,
 	 * and flags that will be used.
@@ -1343,6 +1498,9 @@ timer:
 			tcp_cancel_tso_flush_timer(tp);
 		}
 
+		if (V_tcp_do_autocork)
+			tcp_txq_tag(tp, m);
+
 		/* TODO: IPv6 IP6TOS_ECT bit on */
 		error = ip6_output(m, tp->t_inpcb->in6p_outputopts, &ro,
 		    ((so->so_options & SO_DONTROUTE) ?  IP_ROUTETOIF : 0),
@@ -1382,6 +1540,9 @@ timer:
 		tcp_cancel_tso_flush_timer(tp);
 	}
 
+	if (V_tcp_do_autocork)
+		tcp_txq_tag(tp, m);
+
 	error = ip_output(m, tp->t_inpcb->inp_options, &ro,
 	    ((so->so_options & SO_DONTROUTE) ? IP_ROUTETOIF : 0), 0,
 	    tp->t_inpcb);
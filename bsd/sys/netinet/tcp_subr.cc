@@ -877,6 +877,8 @@ tcp_discardcb(struct tcpcb *tp)
 
 	tcp_free_net_channel(tp);
 
+	tcp_autocork_discard(tp);
+
 	/* Allow the CC algorithm to clean up after itself. */
 	if (CC_ALGO(tp)->cb_destroy != NULL)
 		CC_ALGO(tp)->cb_destroy(tp->ccv);
@@ -1675,6 +1677,7 @@ tcp_maxmtu(struct in_conninfo *inc, int *flags)
 {
 	struct route sro;
 	struct rtentry rte_one;
+	struct bsd_sockaddr_storage gw_one;
 	struct bsd_sockaddr_in *dst;
 	struct ifnet *ifp;
 	u_long maxmtu = 0;
@@ -1687,10 +1690,10 @@ tcp_maxmtu(struct in_conninfo *inc, int *flags)
 		dst->sin_family = AF_INET;
 		dst->sin_len = sizeof(*dst);
 		dst->sin_addr = inc->inc_faddr;
-		route_cache::lookup(dst, inc->inc_fibnum, &rte_one);
+		route_cache::lookup(dst, inc->inc_fibnum, &rte_one, &gw_one);
 		sro.ro_rt = &rte_one;
 	}
-	if (sro.ro_rt != NULL) {
+	if (sro.ro_rt != NULL && sro.ro_rt->rt_ifp != NULL) {
 		ifp = sro.ro_rt->rt_ifp;
 		if (sro.ro_rt->rt_rmx.rmx_mtu == 0)
 			maxmtu = ifp->if_mtu;
@@ -65,6 +65,7 @@
 TRACEPOINT(trace_tcp_timer_tso_flush, "");
 TRACEPOINT(trace_tcp_timer_tso_flush_ret, "");
 TRACEPOINT(trace_tcp_timer_tso_flush_err, "");
+TRACEPOINT(trace_tcp_timer_autocork, "tp=%p", struct tcpcb *);
 
 int	tcp_keepinit;
 SYSCTL_PROC(_net_inet_tcp, TCPCTL_KEEPINIT, keepinit, CTLTYPE_INT|CTLFLAG_RW,
@@ -455,6 +456,26 @@ tcp_timer_tso_flush(serial_timer_task& timer, struct tcpcb *tp)
 	trace_tcp_timer_tso_flush_ret();
 }
 
+static void
+tcp_timer_autocork(serial_timer_task& timer, struct tcpcb *tp)
+{
+	CURVNET_SET(tp->t_vnet);
+	struct inpcb *inp = tp->t_inpcb;
+
+	KASSERT(inp != NULL, ("tcp_timer_autocork: inp == NULL"));
+	INP_LOCK(inp);
+
+	// The segments ahead of the corked data may have drained already
+	if (timer.try_fire() && (tp->t_flags & TF_AUTOCORK)) {
+		trace_tcp_timer_autocork(tp);
+		TCPSTAT_INC(tcps_autocork_timer);
+		(void) tcp_output(tp);
+	}
+
+	INP_UNLOCK(inp);
+	CURVNET_RESTORE();
+}
+
 static void
 tcp_timer_rexmt(serial_timer_task& timer, struct tcpcb *tp)
 {
@@ -648,6 +669,9 @@ init_timers(struct tcp_timer* timers, struct tcpcb *tp, struct inpcb *inp)
 
 	timers->timers[tcp_timer_type::TT_TSO_FLUSH] =
 		new serial_timer_task(inp->inp_lock, std::bind(tcp_timer_tso_flush, _1, tp));
+
+	timers->timers[tcp_timer_type::TT_AUTOCORK] =
+		new serial_timer_task(inp->inp_lock, std::bind(tcp_timer_autocork, _1, tp));
 }
 
 serial_timer_task&
@@ -103,6 +103,7 @@ do {								\
 #endif
 
 struct net_channel;
+struct tcp_txq;
 
 static TRACEPOINT(trace_tcp_state, "tp=%p, %d -> %d", struct tcpcb*, int, int);
 
@@ -224,8 +225,10 @@ public:
 	net_channel* nc;
 	struct ifnet* nc_intf;
 
+	struct tcp_txq *t_txq;		/* segments queued for the driver */
+
 	uint32_t t_ispare[8];		/* 5 UTO, 3 TBD */
-	void	*t_pspare2[4];		/* 4 TBD */
+	void	*t_pspare2[3];		/* 3 TBD */
 	uint64_t _pad[6];		/* 6 TBD (1-2 CC/RTT?) */
 public:
 	inline void set_state(int state) {
@@ -272,6 +275,7 @@ public:
 #define	TF_ECN_SND_ECE	0x10000000	/* ECN ECE in queue */
 #define	TF_CONGRECOVERY	0x20000000	/* congestion recovery mode */
 #define	TF_WASCRECOVERY	0x40000000	/* was in congestion recovery */
+#define	TF_AUTOCORK	0x80000000	/* unsent data waits for the driver */
 
 #define	IN_FASTRECOVERY(t_flags)	(t_flags & TF_FASTRECOVERY)
 #define	ENTER_FASTRECOVERY(t_flags)	t_flags |= TF_FASTRECOVERY
@@ -525,7 +529,12 @@ struct	tcpstat {
 	u_long	tcps_sig_err_sigopt;	/* No signature expected by socket */
 	u_long	tcps_sig_err_nosigopt;	/* No signature provided by segment */
 
-	u_long	_pad[12];		/* 6 UTO, 6 TBD */
+	/* Autocorking */
+	u_long	tcps_autocork;		/* writes deferred behind queued segments */
+	u_long	tcps_autocork_drain;	/* corked data flushed when they drained */
+	u_long	tcps_autocork_timer;	/* corked data flushed by the timer */
+
+	u_long	_pad[9];		/* 6 UTO, 3 TBD */
 };
 
 #ifdef _KERNEL
@@ -714,6 +723,8 @@ struct inpcb *
 struct tcpcb *
 	 tcp_newtcpcb(struct inpcb *);
 int	 tcp_output(struct tcpcb *);
+int	 tcp_autocork(struct tcpcb *);
+void	 tcp_autocork_discard(struct tcpcb *);
 void	 tcp_respond(struct tcpcb *, void *,
 	    struct tcphdr *, struct mbuf *, tcp_seq, tcp_seq, int);
 void	 tcp_tw_init(void);
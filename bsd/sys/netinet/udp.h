@@ -49,6 +49,11 @@ struct udphdr {
  * User-settable options (used with setsockopt).
  */
 #define	UDP_ENCAP			0x01
+#define	UDP_SEGMENT			103 /* send buffers as datagrams of this size */
+#define	UDP_GRO				104 /* receive datagrams of a flow together */
+
+/* Most datagrams one UDP_SEGMENT send may be split into */
+#define	UDP_MAX_SEGMENTS		64
 
 
 /*
@@ -43,6 +43,7 @@
 
 #include <bsd/sys/sys/param.h>
 #include <bsd/sys/sys/domain.h>
+#include <bsd/sys/sys/libkern.h>
 #include <bsd/sys/sys/eventhandler.h>
 #include <bsd/sys/sys/mbuf.h>
 #include <bsd/sys/sys/protosw.h>
@@ -194,6 +195,40 @@ udp_discardcb(struct udpcb *up)
 }
 
 #ifdef INET
+/*
+ * UDP_GRO: adds the datagram n, whose data is off bytes in, to the receive
+ * buffer record of the ones before it, if they are of its flow and it is
+ * not longer than them.  A shorter one ends the record.  Returns 0 if the
+ * datagram is to get a record of its own.
+ */
+static int
+udp_gro_merge(struct inpcb *inp, struct udpcb *up, struct mbuf *n, int off,
+    struct bsd_sockaddr_in *udp_in)
+{
+	struct socket *so = inp->inp_socket;
+	struct sockbuf *sb = &so->so_rcv;
+	int len = n->M_dat.MH.MH_pkthdr.len - off;
+
+	if (up->u_gro_rec == NULL || up->u_gro_rec != sb->sb_lastrecord ||
+	    up->u_gro_faddr.s_addr != udp_in->sin_addr.s_addr ||
+	    up->u_gro_fport != udp_in->sin_port ||
+	    len == 0 || len > up->u_gro_segsize ||
+	    up->u_gro_nsegs >= UDP_MAX_SEGMENTS ||
+	    up->u_gro_len + len > IP_MAXPACKET ||
+	    len > sbspace(sb))
+		return (0);
+
+	m_adj(n, off);
+	m_demote(n, 1);
+	sbcompress(so, sb, n, sb->sb_mbtail);
+	up->u_gro_nsegs++;
+	up->u_gro_len += len;
+	if (len < up->u_gro_segsize)
+		up->u_gro_rec = NULL;
+	sorwakeup_locked(so);
+	return (1);
+}
+
 /*
  * Subroutine of udp_input(), which appends the provided mbuf chain to the
  * passed pcb/socket.  The caller must provide a bsd_sockaddr_in via udp_in that
@@ -212,6 +247,7 @@ udp_append(struct inpcb *inp, struct ip *ip, struct mbuf *n, int off,
 	struct bsd_sockaddr_in6 udp_in6;
 #endif
 	struct udpcb *up;
+	int len;
 
 	INP_LOCK_ASSERT(inp);
 
@@ -252,6 +288,12 @@ udp_append(struct inpcb *inp, struct ip *ip, struct mbuf *n, int off,
 		return;
 	}
 #endif /* MAC */
+	so = inp->inp_socket;
+	SOCK_LOCK_ASSERT(so);
+	len = n->M_dat.MH.MH_pkthdr.len - off;
+	if ((up->u_flags & UF_GRO) && udp_gro_merge(inp, up, n, off, udp_in))
+		return;
+
 	if (inp->inp_flags & INP_CONTROLOPTS ||
 	    inp->inp_socket->so_options & (SO_TIMESTAMP | SO_BINTIME)) {
 #ifdef INET6
@@ -261,6 +303,15 @@ udp_append(struct inpcb *inp, struct ip *ip, struct mbuf *n, int off,
 #endif /* INET6 */
 			ip_savecontrol(inp, &opts, ip, n);
 	}
+	if (up->u_flags & UF_GRO) {
+		/* The size of the datagrams the record will have */
+		struct mbuf **mp;
+
+		for (mp = &opts; *mp; mp = &(*mp)->m_hdr.mh_next)
+			;
+		*mp = sbcreatecontrol((caddr_t)&len, sizeof(len), UDP_GRO,
+		    IPPROTO_UDP);
+	}
 #ifdef INET6
 	if (inp->inp_vflag & INP_IPV6) {
 		bzero(&udp_in6, sizeof(udp_in6));
@@ -273,15 +324,24 @@ udp_append(struct inpcb *inp, struct ip *ip, struct mbuf *n, int off,
 		append_sa = (struct bsd_sockaddr *)udp_in;
 	m_adj(n, off);
 
-	so = inp->inp_socket;
-	SOCK_LOCK_ASSERT(so);
 	if (sbappendaddr_locked(so, &so->so_rcv, append_sa, n, opts) == 0) {
 		m_freem(n);
 		if (opts)
 			m_freem(opts);
 		UDPSTAT_INC(udps_fullsock);
-	} else
+		up->u_gro_rec = NULL;
+	} else {
+		if ((up->u_flags & UF_GRO) && len) {
+			up->u_gro_rec = so->so_rcv.sb_lastrecord;
+			up->u_gro_faddr = udp_in->sin_addr;
+			up->u_gro_fport = udp_in->sin_port;
+			up->u_gro_segsize = len;
+			up->u_gro_nsegs = 1;
+			up->u_gro_len = len;
+		} else
+			up->u_gro_rec = NULL;
 		sorwakeup_locked(so);
+	}
 }
 
 void
@@ -866,6 +926,40 @@ udp_ctloutput(struct socket *so, struct sockopt *sopt)
 			}
 			INP_UNLOCK(inp);
 			break;
+		case UDP_SEGMENT:
+			INP_UNLOCK(inp);
+			error = sooptcopyin(sopt, &optval, sizeof optval,
+					    sizeof optval);
+			if (error)
+				break;
+			if (optval < 0 ||
+			    optval > IP_MAXPACKET - (int)sizeof(struct udpiphdr)) {
+				error = EINVAL;
+				break;
+			}
+			inp = sotoinpcb(so);
+			KASSERT(inp != NULL, ("%s: inp == NULL", __func__));
+			INP_LOCK(inp);
+			intoudpcb(inp)->u_segsize = optval;
+			INP_UNLOCK(inp);
+			break;
+		case UDP_GRO:
+			INP_UNLOCK(inp);
+			error = sooptcopyin(sopt, &optval, sizeof optval,
+					    sizeof optval);
+			if (error)
+				break;
+			inp = sotoinpcb(so);
+			KASSERT(inp != NULL, ("%s: inp == NULL", __func__));
+			INP_LOCK(inp);
+			if (optval)
+				intoudpcb(inp)->u_flags |= UF_GRO;
+			else {
+				intoudpcb(inp)->u_flags &= ~UF_GRO;
+				intoudpcb(inp)->u_gro_rec = NULL;
+			}
+			INP_UNLOCK(inp);
+			break;
 		default:
 			INP_UNLOCK(inp);
 			error = ENOPROTOOPT;
@@ -883,6 +977,16 @@ udp_ctloutput(struct socket *so, struct sockopt *sopt)
 			error = sooptcopyout(sopt, &optval, sizeof optval);
 			break;
 #endif
+		case UDP_SEGMENT:
+			optval = intoudpcb(inp)->u_segsize;
+			INP_UNLOCK(inp);
+			error = sooptcopyout(sopt, &optval, sizeof optval);
+			break;
+		case UDP_GRO:
+			optval = (intoudpcb(inp)->u_flags & UF_GRO) != 0;
+			INP_UNLOCK(inp);
+			error = sooptcopyout(sopt, &optval, sizeof optval);
+			break;
 		default:
 			INP_UNLOCK(inp);
 			error = ENOPROTOOPT;
@@ -911,6 +1015,7 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct bsd_sockaddr *addr,
 	u_short fport, lport;
 	int unlock_udbinfo;
 	u_char tos;
+	int segsize;
 
 	/*
 	 * udp_output() may need to temporarily bind or connect the current
@@ -928,6 +1033,7 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct bsd_sockaddr *addr,
 	src.sin_family = 0;
 	INP_LOCK(inp);
 	tos = inp->inp_ip_tos;
+	segsize = intoudpcb(inp)->u_segsize;
 	if (control != NULL) {
 		/*
 		 * XXX: Currently, we assume all the optional information is
@@ -948,6 +1054,16 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct bsd_sockaddr *addr,
 				error = EINVAL;
 				break;
 			}
+			if (cm->cmsg_level == IPPROTO_UDP &&
+			    cm->cmsg_type == UDP_SEGMENT) {
+				if (cm->cmsg_len !=
+				    CMSG_LEN(sizeof(u_int16_t))) {
+					error = EINVAL;
+					break;
+				}
+				segsize = *(u_int16_t *)CMSG_DATA(cm);
+				continue;
+			}
 			if (cm->cmsg_level != IPPROTO_IP)
 				continue;
 
@@ -983,6 +1099,16 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct bsd_sockaddr *addr,
 		}
 		m_freem(control);
 	}
+	/*
+	 * A UDP_SEGMENT send of more than one datagram goes down the stack
+	 * as a single packet, which the interface, or ip_output() when it
+	 * can't, splits in datagrams of segsize bytes (the last may be
+	 * shorter), each checksummed.
+	 */
+	if (segsize >= len)
+		segsize = 0;
+	if (segsize && (!V_udp_cksum || len > segsize * UDP_MAX_SEGMENTS))
+		error = EINVAL;
 	if (error) {
 		INP_UNLOCK(inp);
 		m_freem(m);
@@ -1171,10 +1297,17 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct bsd_sockaddr *addr,
 		m->M_dat.MH.MH_pkthdr.csum_data = offsetof(struct udphdr, uh_sum);
 	} else
 		ui->ui_sum = 0;
+	if (segsize) {
+		m->M_dat.MH.MH_pkthdr.csum_flags |= CSUM_UDP_SEG;
+		m->M_dat.MH.MH_pkthdr.tso_segsz = segsize;
+	}
 	((struct ip *)ui)->ip_len = sizeof (struct udpiphdr) + len;
 	((struct ip *)ui)->ip_ttl = inp->inp_ip_ttl;	/* XXX */
 	((struct ip *)ui)->ip_tos = tos;		/* XXX */
-	UDPSTAT_INC(udps_opackets);
+	if (segsize)
+		UDPSTAT_ADD(udps_opackets, howmany(len, segsize));
+	else
+		UDPSTAT_INC(udps_opackets);
 
 	if (unlock_udbinfo == UH_WLOCKED)
 		INP_HASH_WUNLOCK(&V_udbinfo);
@@ -1198,6 +1331,106 @@ release:
 	return (error);
 }
 
+/*
+ * Splits a UDP_SEGMENT packet (see udp_output()), whose IP header is off
+ * bytes into *mp and in network byte order, in datagrams of tso_segsz
+ * bytes, each with a copy of the headers before its data.  On success *mp
+ * is the list of datagrams, linked through m_nextpkt.  The headers are
+ * checksummed here as sw_csum says (CSUM_DELAY_IP, CSUM_UDP), and left
+ * to the interface otherwise.
+ */
+int
+udp_segment(struct mbuf **mp, int off, int sw_csum)
+{
+	struct mbuf *m0 = *mp, *m, *n, **mnext;
+	struct ip *ip, *mip;
+	struct udphdr *muh;
+	int hlen, hdrlen, len, pos, seglen, segsize, nsegs;
+	u_short id;
+	int error = 0;
+
+	*mp = NULL;
+	if (m0->m_hdr.mh_len < off + (int)sizeof(struct ip) &&
+	    (m0 = m_pullup(m0, off + sizeof(struct ip))) == NULL)
+		return (ENOBUFS);
+	ip = (struct ip *)(mtod(m0, caddr_t) + off);
+	hlen = ip->ip_hl << 2;
+	hdrlen = off + hlen + sizeof(struct udphdr);
+	if (m0->m_hdr.mh_len < hdrlen &&
+	    (m0 = m_pullup(m0, hdrlen)) == NULL)
+		return (ENOBUFS);
+	ip = (struct ip *)(mtod(m0, caddr_t) + off);
+	len = ntohs(ip->ip_len) - hlen - sizeof(struct udphdr);
+	segsize = m0->M_dat.MH.MH_pkthdr.tso_segsz;
+	id = ntohs(ip->ip_id);
+
+	mnext = mp;
+	for (pos = 0, nsegs = 0; pos < len; pos += segsize, nsegs++) {
+		seglen = imin(segsize, len - pos);
+		MGETHDR(m, M_DONTWAIT, MT_DATA);
+		if (m == NULL) {
+			error = ENOBUFS;
+			break;
+		}
+		m->m_hdr.mh_flags |= m0->m_hdr.mh_flags &
+		    (M_BCAST | M_MCAST | M_FLOWID);
+		m->M_dat.MH.MH_pkthdr.flowid = m0->M_dat.MH.MH_pkthdr.flowid;
+		/*
+		 * Leave room for the link header if it's yet to be added, as
+		 * ip_fragment() does.
+		 */
+		if (off == 0)
+			m->m_hdr.mh_data += max_linkhdr;
+		bcopy(mtod(m0, caddr_t), mtod(m, caddr_t), hdrlen);
+		m->m_hdr.mh_len = hdrlen;
+		m->m_hdr.mh_next = m_copym(m0, hdrlen + pos, seglen, M_DONTWAIT);
+		if (m->m_hdr.mh_next == NULL) {
+			m_free(m);
+			error = ENOBUFS;
+			break;
+		}
+		m->M_dat.MH.MH_pkthdr.len = hdrlen + seglen;
+
+		mip = (struct ip *)(mtod(m, caddr_t) + off);
+		mip->ip_len = htons(hlen + sizeof(struct udphdr) + seglen);
+		mip->ip_id = htons(id + nsegs);
+		mip->ip_sum = 0;
+		if (sw_csum & CSUM_DELAY_IP)
+			mip->ip_sum = in_cksum_skip(m, off + hlen, off);
+		else
+			m->M_dat.MH.MH_pkthdr.csum_flags |= CSUM_IP;
+
+		muh = (struct udphdr *)((caddr_t)mip + hlen);
+		muh->uh_ulen = htons(sizeof(struct udphdr) + seglen);
+		if (m0->M_dat.MH.MH_pkthdr.csum_flags & CSUM_UDP) {
+			muh->uh_sum = in_pseudo(mip->ip_src.s_addr,
+			    mip->ip_dst.s_addr,
+			    htons(sizeof(struct udphdr) + seglen + IPPROTO_UDP));
+			if (sw_csum & CSUM_UDP) {
+				muh->uh_sum = in_cksum_skip(m,
+				    m->M_dat.MH.MH_pkthdr.len, off + hlen);
+				if (muh->uh_sum == 0)
+					muh->uh_sum = 0xffff;
+			} else {
+				m->M_dat.MH.MH_pkthdr.csum_flags |= CSUM_UDP;
+				m->M_dat.MH.MH_pkthdr.csum_data =
+				    offsetof(struct udphdr, uh_sum);
+			}
+		}
+		*mnext = m;
+		mnext = &m->m_hdr.mh_nextpkt;
+	}
+	m_freem(m0);
+	if (error) {
+		for (m = *mp; m; m = n) {
+			n = m->m_hdr.mh_nextpkt;
+			m_freem(m);
+		}
+		*mp = NULL;
+	}
+	return (error);
+}
+
 
 #if defined(IPSEC) && defined(IPSEC_NAT_T)
 /*
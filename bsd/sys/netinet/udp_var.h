@@ -59,6 +59,17 @@ typedef void(*udp_tun_func_t)(struct mbuf *, int off, struct inpcb *);
 struct udpcb {
 	udp_tun_func_t	u_tun_func;	/* UDP kernel tunneling callback. */
 	u_int		u_flags;	/* Generic UDP flags. */
+	u_int16_t	u_segsize;	/* UDP_SEGMENT size, or 0 */
+	/*
+	 * UDP_GRO: the receive buffer record datagrams of one flow are
+	 * being added to, while they come at the size of the first.
+	 */
+	struct mbuf	*u_gro_rec;
+	struct in_addr	u_gro_faddr;
+	u_short		u_gro_fport;
+	u_int16_t	u_gro_segsize;
+	u_int16_t	u_gro_nsegs;
+	int		u_gro_len;
 };
 
 #define	intoudpcb(ip)	((struct udpcb *)(ip)->inp_ppcb)
@@ -69,6 +80,7 @@ struct udpcb {
 	/* .. per draft-ietf-ipsec-nat-t-ike-0[01],
 	 * and draft-ietf-ipsec-udp-encaps-(00/)01.txt */
 #define	UF_ESPINUDP		0x00000002	/* w/ non-ESP marker. */
+#define	UF_GRO			0x00000004	/* UDP_GRO is set */
 
 struct udpstat {
 				/* input statistics: */
@@ -158,6 +170,7 @@ struct inpcb	*udp_notify(struct inpcb *inp, int errval);
 int		 udp_shutdown(struct socket *so);
 
 int udp_set_kernel_tunneling(struct socket *so, udp_tun_func_t f);
+int		 udp_segment(struct mbuf **mp, int off, int sw_csum);
 #endif
 
 #endif
@@ -287,6 +287,7 @@ struct mbuf {
 /*	CSUM_TSO_IPV6		0x8000		will do IPv6/TSO */
 
 /*	CSUM_FRAGMENT_IPV6	0x10000		will do IPv6 fragementation */
+#define	CSUM_UDP_SEG		0x20000		/* will split UDP in tso_segsz datagrams */
 
 #define	CSUM_DELAY_DATA_IPV6	(CSUM_TCP_IPV6 | CSUM_UDP_IPV6)
 #define	CSUM_DATA_VALID_IPV6	CSUM_DATA_VALID
@@ -959,6 +960,7 @@ struct mbuf	*m_unshare(struct mbuf *, int how);
 #define	PACKET_TAG_CARP				28 /* CARP info */
 #define	PACKET_TAG_IPSEC_NAT_T_PORTS		29 /* two uint16_t */
 #define	PACKET_TAG_ND_OUTGOING			30 /* ND outgoing */
+#define	PACKET_TAG_TCP_TXQ			31 /* TCP segment not yet sent */
 
 /* Specific cookies and tags. */
 
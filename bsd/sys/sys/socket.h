@@ -114,6 +114,7 @@
 #define	SO_USER_COOKIE	0x1015		/* user cookie (dummynet etc.) */
 #define	SO_PROTOCOL	0x1016		/* get socket protocol (Linux name) */
 #define	SO_PROTOTYPE	SO_PROTOCOL	/* alias for SO_PROTOCOL (SunOS name) */
+#define	SO_BUSY_POLL	0x1017		/* usecs to poll before sleeping */
 #endif
 
 #if __BSD_VISIBLE
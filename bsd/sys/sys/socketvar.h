@@ -125,6 +125,9 @@ struct socket {
 	// a net channel only supports one consumer, so let others wait on a waitqueue instead
 	bool so_nc_busy = false;
 	waitqueue so_nc_wq;
+	// usecs to busy poll so_nc for before sleeping on it (SO_BUSY_POLL)
+	int so_busy_poll = 0;
+#define	SO_BUSY_POLL_BUDGET	8	/* packets per poll of the interface */
 	/* FIXME: this is done for poll,
 	 * make sure there's only 1 ref to a fp */
 	struct file* fp;
@@ -345,6 +348,7 @@ int	sopoll(struct socket *so, int events, struct ucred *active_cred,
 int	sopoll_generic(struct socket *so, int events,
 	    struct ucred *active_cred, struct thread *td);
 int sopoll_generic_locked(struct socket *so, int events);
+bool	sobusypoll(struct socket *so, int budget);
 int	soreceive(struct socket *so, struct bsd_sockaddr **paddr, struct uio *uio,
 	    struct mbuf **mp0, struct mbuf **controlp, int *flagsp);
 int	soreceive_stream(struct socket *so, struct bsd_sockaddr **paddr,
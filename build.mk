@@ -51,6 +51,7 @@ endif
 modules ?= !$(image)
 img_format ?= qcow2
 fs_size_mb ?= 10240
+fs_compression ?= lz4
 local-includes =
 INCLUDES = $(local-includes) -I$(src)/arch/$(arch) -I$(src) -I$(src)/include  -I$(src)/arch/common
 INCLUDES += -isystem $(src)/include/glibc-compat
@@ -159,7 +160,8 @@ bsd/%.o: INCLUDES += -isystem $(src)/bsd/
 # for machine/
 bsd/%.o: INCLUDES += -isystem $(src)/bsd/$(arch)
 
-configuration-defines = conf-preempt conf-debug_memory conf-logger_debug
+configuration-defines = conf-preempt conf-debug_memory conf-logger_debug \
+                        conf-lazy_stack
 
 configuration = $(foreach cf,$(configuration-defines), \
                       -D$(cf:conf-%=CONF_%)=$($(cf)))
@@ -266,6 +268,22 @@ tests += tests/misc-console.so
 tests += tests/misc-leak.so
 tests += tests/misc-readbench.so
 tests += tests/misc-mmap-anon-perf.so
+tests += tests/misc-compaction.so
+tests += tests/misc-ksm.so
+tests += tests/misc-virtiofs.so
+tests += tests/misc-udp-gso.so
+tests += tests/misc-bdev-direct.so
+tests += tests/misc-tcp-autocork.so
+tests += tests/misc-busy-poll.so
+tests += tests/misc-thread-stacks.so
+tests += tests/misc-arp-cache.so
+tests += tests/misc-shm-ring.so
+tests += tests/misc-eventfd-doorbell.so
+tests += tests/misc-route-churn.so
+tests += tests/misc-bdev-iops.so
+tests += tests/misc-zfs-read-latency.so
+tests += tests/misc-zfs-fragment.so
+tests += tests/misc-zfs-image-read.so
 tests += tests/tst-mmap-file.so
 tests += tests/misc-mmap-big-file.so
 tests += tests/tst-mmap.so
@@ -280,7 +298,12 @@ tests += tests/tst-queue-mpsc.so
 tests += tests/tst-af-local.so
 tests += tests/tst-pipe.so
 tests += tests/tst-yield.so
+tests += tests/tst-mutex-pi.so
+tests += tests/tst-fiber.so
 tests += tests/misc-ctxsw.so
+tests += tests/misc-tlb-shootdown.so
+tests += tests/misc-tx-pps.so
+tests += tests/misc-fiber-echo.so
 tests += tests/tst-readdir.so
 tests += tests/tst-read.so
 tests += tests/tst-symlink.so
@@ -300,6 +323,7 @@ tests += tests/misc-tcp-hash-srv.so
 tests += tests/misc-loadbalance.so
 tests += tests/misc-scheduler.so
 tests += tests/misc-setpriority.so
+tests += tests/misc-rt-latency.so
 tests += tests/tst-dns-resolver.so
 tests += tests/tst-fs-link.so
 tests += tests/tst-kill.so
@@ -347,6 +371,7 @@ tests += tests/tst-pthread-affinity.so
 tests += tests/tst-pthread-tsd.so
 tests += tests/tst-thread-local.so
 tests += tests/tst-app.so
+tests += tests/tst-memfd.so
 endif
 
 ifeq ($(arch),aarch64)
@@ -723,6 +748,38 @@ zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/zle.o
 zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/zrlock.o
 zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/zvol.o
 zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/lz4.o
+zfs += bsd/sys/cddl/contrib/opensolaris/uts/common/fs/zfs/zstd.o
+
+zstd :=
+zstd += bsd/sys/contrib/zstd/lib/common/debug.o
+zstd += bsd/sys/contrib/zstd/lib/common/entropy_common.o
+zstd += bsd/sys/contrib/zstd/lib/common/error_private.o
+zstd += bsd/sys/contrib/zstd/lib/common/fse_decompress.o
+zstd += bsd/sys/contrib/zstd/lib/common/xxhash.o
+zstd += bsd/sys/contrib/zstd/lib/common/zstd_common.o
+zstd += bsd/sys/contrib/zstd/lib/compress/fse_compress.o
+zstd += bsd/sys/contrib/zstd/lib/compress/hist.o
+zstd += bsd/sys/contrib/zstd/lib/compress/huf_compress.o
+zstd += bsd/sys/contrib/zstd/lib/compress/zstd_compress.o
+zstd += bsd/sys/contrib/zstd/lib/compress/zstd_compress_literals.o
+zstd += bsd/sys/contrib/zstd/lib/compress/zstd_compress_sequences.o
+zstd += bsd/sys/contrib/zstd/lib/compress/zstd_compress_superblock.o
+zstd += bsd/sys/contrib/zstd/lib/compress/zstd_double_fast.o
+zstd += bsd/sys/contrib/zstd/lib/compress/zstd_fast.o
+zstd += bsd/sys/contrib/zstd/lib/compress/zstd_lazy.o
+zstd += bsd/sys/contrib/zstd/lib/compress/zstd_ldm.o
+zstd += bsd/sys/contrib/zstd/lib/compress/zstd_opt.o
+zstd += bsd/sys/contrib/zstd/lib/compress/zstd_preSplit.o
+zstd += bsd/sys/contrib/zstd/lib/decompress/huf_decompress.o
+zstd += bsd/sys/contrib/zstd/lib/decompress/zstd_ddict.o
+zstd += bsd/sys/contrib/zstd/lib/decompress/zstd_decompress.o
+zstd += bsd/sys/contrib/zstd/lib/decompress/zstd_decompress_block.o
+
+# Single threaded, without the x86-64 assembly Huffman decoder
+$(zstd): CFLAGS += -DZSTD_DISABLE_ASM -DZSTD_LEGACY_SUPPORT=0 -DZSTD_TRACE=0 \
+	-DDEBUGLEVEL=0
+
+bsd += $(zstd)
 
 zfs-tests += tests/misc-zfs-disk.so
 zfs-tests += tests/misc-zfs-io.so
@@ -794,6 +851,7 @@ drivers += drivers/vmxnet3-queues.o
 drivers += drivers/virtio-blk.o
 drivers += drivers/virtio-scsi.o
 drivers += drivers/virtio-rng.o
+drivers += drivers/virtio-fs.o
 drivers += drivers/kvmclock.o drivers/xenclock.o
 drivers += drivers/acpi.o
 drivers += drivers/hpet.o
@@ -836,6 +894,7 @@ objects += arch/x64/arch-trace.o
 objects += arch/x64/ioapic.o
 objects += arch/x64/apic.o
 objects += arch/x64/apic-clock.o
+objects += arch/x64/kvm-pv.o
 objects += arch/x64/entry-xen.o
 objects += arch/x64/xen.o
 objects += arch/x64/xen_intr.o
@@ -853,12 +912,14 @@ objects += core/debug.o
 objects += core/rcu.o
 objects += core/pagecache.o
 objects += core/mempool.o
+objects += core/ksm.o
 objects += core/alloctracker.o
 objects += core/printf.o
 
 objects += linux.o
 objects += core/commands.o
 objects += core/sched.o
+objects += core/fiber.o
 objects += core/mmio.o
 objects += core/kprintf.o
 objects += core/trace.o
@@ -969,7 +1030,7 @@ bare.img: scripts/mkzfs.py $(jni) bare.raw bootfs.manifest
 	$(call quiet, echo Creating $@ as $(img_format))
 	$(call quiet, qemu-img convert -f raw -O $(img_format) bare.raw $@)
 	$(call quiet, qemu-img resize $@ +$(fs_size_mb)M > /dev/null 2>&1)
-	$(src)/scripts/mkzfs.py -o $@ -d $@.d -m bootfs.manifest
+	$(src)/scripts/mkzfs.py -o $@ -d $@.d -m bootfs.manifest -c $(fs_compression)
 
 usr.img: bare.img usr.manifest cmdline
 	$(call quiet, cp bare.img $@)
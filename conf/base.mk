@@ -2,6 +2,11 @@ conf-preempt=1
 conf-tracing=0
 conf-debug_memory=0
 
+# Populate application thread stacks on demand. Before disabling preemption
+# or interrupts, the kernel faults in as much stack as it may then use (see
+# osv/lazy-stack.hh).
+conf-lazy_stack=1
+
 # debug level logging (enabled automatically in mode=debug)
 conf-logger_debug=0
 
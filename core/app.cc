@@ -10,7 +10,12 @@
 #include <osv/run.hh>
 #include <osv/power.hh>
 #include <osv/trace.hh>
+#include <osv/file.h>
+#include <osv/mmu.hh>
+#include <osv/debug.hh>
 #include <functional>
+#include <atomic>
+#include <list>
 #include <thread>
 #include <libgen.h>
 #include <errno.h>
@@ -37,6 +42,11 @@ namespace osv {
 
 static thread_local shared_app_t current_app;
 
+// The applications started with run(), for get_all()
+static mutex apps_mutex;
+static std::list<std::weak_ptr<application>> apps;
+static std::atomic<unsigned long> next_id(1);
+
 shared_app_t application::get_current()
 {
     return current_app;
@@ -52,6 +62,9 @@ void application::adopt_current()
 
     trace_app_adopt_current(this);
     current_app = shared_from_this();
+    WITH_LOCK(_state_mutex) {
+        _threads++;
+    }
 }
 
 TRACEPOINT(trace_app_abandon_current, "app=%p", application*);
@@ -59,9 +72,29 @@ TRACEPOINT(trace_app_abandon_current, "app=%p", application*);
 void application::abandon_current()
 {
     trace_app_abandon_current(this);
+    if (current_app.get() == this) {
+        WITH_LOCK(_state_mutex) {
+            _threads--;
+            _state_cond.wake_all();
+        }
+    }
     current_app.reset();
 }
 
+std::shared_ptr<void> application::count_new_thread()
+{
+    WITH_LOCK(_state_mutex) {
+        _threads++;
+    }
+    auto app = shared_from_this();
+    return std::shared_ptr<void>(nullptr, [app] (void*) {
+        WITH_LOCK(app->_state_mutex) {
+            app->_threads--;
+            app->_state_cond.wake_all();
+        }
+    });
+}
+
 shared_app_t application::run(const std::vector<std::string>& args)
 {
     return run(args[0], args);
@@ -71,13 +104,40 @@ shared_app_t application::run(const std::string& command, const std::vector<std:
 {
     auto app = std::make_shared<application>(command, args);
     app->start();
+    WITH_LOCK(apps_mutex) {
+        apps.remove_if([](const std::weak_ptr<application>& a) { return a.expired(); });
+        apps.push_back(app);
+    }
     return app;
 }
 
+std::vector<shared_app_t> application::get_all()
+{
+    std::vector<shared_app_t> ret;
+    WITH_LOCK(apps_mutex) {
+        for (auto& a : apps) {
+            if (auto app = a.lock()) {
+                ret.push_back(app);
+            }
+        }
+    }
+    return ret;
+}
+
 application::application(const std::string& command, const std::vector<std::string>& args)
     : _args(args)
     , _command(command)
     , _termination_requested(false)
+    , _id(next_id++)
+    , _threads(0)
+    , _main_done(false)
+    , _restarting(false)
+    , _restarts(0)
+{
+    load();
+}
+
+void application::load()
 {
     try {
         _lib = elf::get_program()->get_library(_command);
@@ -86,7 +146,7 @@ application::application(const std::string& command, const std::vector<std::stri
     }
 
     if (!_lib) {
-        throw launch_error("Failed to load object: " + command);
+        throw launch_error("Failed to load object: " + _command);
     }
 
     _main = _lib->lookup<int (int, char**)>("main");
@@ -100,10 +160,15 @@ void application::start()
     // FIXME: we cannot create the thread inside the constructor because
     // the thread would attempt to call shared_from_this() before object
     // is constructed which is illegal.
-    auto err = pthread_create(&_thread, NULL, [](void *app) -> void* {
+    // Detached: join() and restart() wait for main() to return instead.
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    auto err = pthread_create(&_thread, &attr, [](void *app) -> void* {
         ((application*)app)->main();
         return nullptr;
     }, this);
+    pthread_attr_destroy(&attr);
     if (err) {
         throw launch_error("Failed to create the main thread, err=" + std::to_string(err));
     }
@@ -122,8 +187,9 @@ TRACEPOINT(trace_app_join_ret, "return_code=%d", int);
 int application::join()
 {
     trace_app_join(this);
-    auto err = pthread_join(_thread, NULL);
-    assert(!err);
+    WITH_LOCK(_state_mutex) {
+        _state_cond.wait_until(_state_mutex, [&] { return _main_done && !_restarting; });
+    }
     trace_app_join_ret(_return_code);
     return _return_code;
 }
@@ -148,6 +214,11 @@ void application::main()
     }
 
     trace_app_main_ret(_return_code);
+
+    WITH_LOCK(_state_mutex) {
+        _main_done = true;
+        _state_cond.wake_all();
+    }
 }
 
 void application::run_main(std::string path, int argc, char** argv)
@@ -240,6 +311,86 @@ void application::request_termination()
     trace_app_request_termination_ret();
 }
 
+TRACEPOINT(trace_app_restart, "app=%p, cmd=%s", application*, const char*);
+TRACEPOINT(trace_app_restart_ret, "");
+TRACEPOINT(trace_app_release, "app=%p, files=%d, mappings=%d, unloaded=%d", application*, int, int, bool);
+
+void application::restart(std::chrono::nanoseconds timeout)
+{
+    trace_app_restart(this, _command.c_str());
+    if (current_app.get() == this) {
+        throw launch_error("An application can't restart itself: " + _command);
+    }
+    WITH_LOCK(_state_mutex) {
+        if (_restarting) {
+            throw launch_error("Already restarting: " + _command);
+        }
+        _restarting = true;
+    }
+
+    request_termination();
+
+    auto deadline = osv::clock::uptime::now() + timeout;
+    bool exited;
+    WITH_LOCK(_state_mutex) {
+        while (!(_main_done && !_threads) &&
+                _state_cond.wait(&_state_mutex, deadline) == 0) {
+        }
+        exited = _main_done && !_threads;
+        if (!exited) {
+            _restarting = false;
+            _state_cond.wake_all();
+        }
+    }
+    if (!exited) {
+        throw launch_error("Timed out waiting for the threads of " + _command + " to exit");
+    }
+
+    release();
+    try {
+        load();
+        WITH_LOCK(_termination_mutex) {
+            _termination_requested = false;
+        }
+        WITH_LOCK(_state_mutex) {
+            _main_done = false;
+            _restarts++;
+        }
+        start();
+    } catch (...) {
+        WITH_LOCK(_state_mutex) {
+            _main_done = true;
+            _restarting = false;
+            _state_cond.wake_all();
+        }
+        throw;
+    }
+
+    WITH_LOCK(_state_mutex) {
+        _restarting = false;
+        _state_cond.wake_all();
+    }
+    trace_app_restart_ret();
+}
+
+// Frees what the application's threads, all gone, left behind
+void application::release()
+{
+    // The callbacks are the program's code, which is about to go
+    _termination_signal.disconnect_all_slots();
+
+    auto files = fdclose_owned(_id);
+    auto mappings = mmu::unmap_owned(_id);
+
+    std::weak_ptr<elf::object> lib = _lib;
+    _lib.reset();
+    _main = nullptr;
+    trace_app_release(this, files, mappings, lib.expired());
+    if (!lib.expired()) {
+        debug("%s is still referenced and was not unloaded\n", _command.c_str());
+    }
+}
+
 int application::get_return_code()
 {
     return _return_code;
@@ -250,6 +401,38 @@ std::string application::get_command()
     return _command;
 }
 
+unsigned long application::get_id()
+{
+    return _id;
+}
+
+unsigned application::get_restarts()
+{
+    WITH_LOCK(_state_mutex) {
+        return _restarts;
+    }
+}
+
+std::vector<application_info> get_applications()
+{
+    std::vector<application_info> ret;
+    for (auto& app : application::get_all()) {
+        ret.push_back({app->get_id(), app->get_command(), app->get_restarts()});
+    }
+    return ret;
+}
+
+bool restart_application(unsigned long id, std::chrono::nanoseconds timeout)
+{
+    for (auto& app : application::get_all()) {
+        if (app->get_id() == id) {
+            app->restart(timeout);
+            return true;
+        }
+    }
+    return false;
+}
+
 namespace this_application {
 
 void on_termination_request(std::function<void()> callback)
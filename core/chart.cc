@@ -20,6 +20,9 @@ void boot_time_chart::print_one_time(int index)
 
 void boot_time_chart::event(const char *str)
 {
+    if (_event == sizeof(arrays) / sizeof(arrays[0])) {
+        return;
+    }
     arrays[_event].str  = str;
     arrays[_event++].stamp = processor::ticks();
 }
@@ -25,6 +25,7 @@
 #include <lockfree/ring.hh>
 
 #include <osv/debug.hh>
+#include <osv/defer.hh>
 #include <unordered_map>
 #include <boost/range/algorithm/find.hpp>
 #include <algorithm>
@@ -45,6 +46,10 @@ static_assert(POLLRDHUP == EPOLLRDHUP, "POLLRDHUP!=EPOLLRDHUP");
 static_assert(POLLPRI == EPOLLPRI, "POLLPRI!=EPOLLPRI");
 static_assert(POLLERR == EPOLLERR, "POLLERR!=EPOLLERR");
 static_assert(POLLHUP == EPOLLHUP, "POLLHUP!=EPOLLHUP");
+// NAPI_POLL_WEIGHT in Linux, though an interface only polls this many
+// packets at a time anyway
+constexpr unsigned busy_poll_budget_default = 8;
+
 constexpr int SUPPORTED_EVENTS =
         EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLPRI | EPOLLERR | EPOLLHUP |
         EPOLLET | EPOLLONESHOT;
@@ -72,11 +77,46 @@ class epoll_file final : public special_file {
     ring_spsc<epoll_key, 256> _activity_ring;
     std::atomic<bool> _activity_ring_overflow = { false };
     sched::thread_handle _activity_ring_owner;
+    std::atomic<unsigned> _wakes = { 0 };
+    // EPIOCSPARAMS
+    unsigned _busy_poll_usecs = 0;
+    unsigned _busy_poll_budget = 0;
+    bool _prefer_busy_poll = false;
+    // What busy_poll() drives, kept for the storage; one thread at a time
+    // busy polls, the others just wait
+    std::vector<fileref> _busy_poll_files;
+    std::atomic<bool> _busy_polling = { false };
 public:
     epoll_file()
         : special_file(0, DTYPE_UNSPEC)
     {
     }
+    virtual int ioctl(u_long com, void *data) override {
+        auto params = static_cast<epoll_params*>(data);
+        switch (com) {
+        case EPIOCSPARAMS:
+            if (params->busy_poll_usecs > INT_MAX ||
+                    params->prefer_busy_poll > 1 || params->__pad) {
+                return EINVAL;
+            }
+            WITH_LOCK(f_lock) {
+                _busy_poll_usecs = params->busy_poll_usecs;
+                _busy_poll_budget = params->busy_poll_budget ?: busy_poll_budget_default;
+                _prefer_busy_poll = params->prefer_busy_poll;
+            }
+            return 0;
+        case EPIOCGPARAMS:
+            WITH_LOCK(f_lock) {
+                *params = {};
+                params->busy_poll_usecs = _busy_poll_usecs;
+                params->busy_poll_budget = _busy_poll_budget;
+                params->prefer_busy_poll = _prefer_busy_poll;
+            }
+            return 0;
+        default:
+            return special_file::ioctl(com, data);
+        }
+    }
     virtual int close() override {
         for (auto& e : map) {
             remove_me(e.first);
@@ -142,6 +182,7 @@ public:
         sched::timer tmr(*sched::thread::current());
         if (tmo) {
             tmr.set(*tmo);
+            busy_poll(*tmo);
         }
         int nr = 0;
         WITH_LOCK(f_lock) {
@@ -219,6 +260,40 @@ public:
         }
         return nr;
     }
+    // Spins for up to the EPIOCSPARAMS busy_poll_usecs, but not past the
+    // timeout, before wait() goes to sleep, driving the receive queues
+    // behind the registered sockets until one of them has an event
+    void busy_poll(clock::time_point tmo)
+    {
+        if (!_busy_poll_usecs ||
+                _busy_polling.exchange(true, std::memory_order_acquire)) {
+            return;
+        }
+        auto done = defer([&] {
+            _busy_poll_files.clear();
+            _busy_polling.store(false, std::memory_order_release);
+        });
+        unsigned wakes = _wakes.load(std::memory_order_acquire);
+        unsigned budget;
+        clock::time_point until;
+        WITH_LOCK(f_lock) {
+            if (!_busy_poll_usecs || !_activity.empty()) {
+                return;
+            }
+            budget = _busy_poll_budget;
+            until = std::min(tmo, clock::now() +
+                    std::chrono::microseconds(_busy_poll_usecs));
+            for (auto& e : map) {
+                _busy_poll_files.emplace_back(e.first._file);
+            }
+        }
+        while (_wakes.load(std::memory_order_acquire) == wakes &&
+                clock::now() < until) {
+            for (auto& fp : _busy_poll_files) {
+                fp->busy_poll(budget);
+            }
+        }
+    }
     void flush_activity_ring() {
         epoll_key ep;
         while (_activity_ring.pop(ep)) {
@@ -239,6 +314,7 @@ public:
         WITH_LOCK(f_lock) {
             auto ins = _activity.insert(key);
             if (ins.second) {
+                _wakes.fetch_add(1, std::memory_order_release);
                 _waiters.wake_all(f_lock);
             }
         }
@@ -247,6 +323,7 @@ public:
         if (!_activity_ring.push(key)) {
             _activity_ring_overflow.store(true, std::memory_order_relaxed);
         }
+        _wakes.fetch_add(1, std::memory_order_release);
         _activity_ring_owner.wake();
     }
 private:
@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include <osv/fiber.hh>
+#include <osv/trace.hh>
+#include <osv/mmu.hh>
+#include <lockfree/queue-mpsc.hh>
+
+#include <stdlib.h>
+#include <string>
+
+TRACEPOINT(trace_fiber_create, "fiber=%p", osv::fiber*);
+TRACEPOINT(trace_fiber_switch, "fiber=%p", osv::fiber*);
+TRACEPOINT(trace_fiber_wait, "fiber=%p", osv::fiber*);
+TRACEPOINT(trace_fiber_wake, "fiber=%p", osv::fiber*);
+TRACEPOINT(trace_fiber_carrier_idle, "");
+
+namespace bi = boost::intrusive;
+
+namespace osv {
+
+fiber __thread * s_current_fiber;
+
+// A thread running fibers, pinned to one cpu. Fibers become runnable by
+// being pushed to the carrier's incoming queue, by anyone, and are run by
+// the carrier in FIFO order.
+class fiber_carrier {
+public:
+    explicit fiber_carrier(sched::cpu* c);
+    static fiber_carrier* get(sched::cpu* c);
+    // Make a fiber runnable; its status must already be queued.
+    void enqueue(fiber* f);
+private:
+    void run();
+    void resume(fiber* f);
+    bool poll_parked();
+private:
+    std::unique_ptr<sched::thread> _thread;
+    lockfree::queue_mpsc<fiber> _incoming;
+    fiber_state _state;
+    // Fibers parked in fiber::wait_for(), polled when the carrier wakes
+    bi::list<fiber,
+             bi::member_hook<fiber,
+                             bi::list_member_hook<>,
+                             &fiber::_polled_hook>> _polled;
+    friend class fiber;
+};
+
+static std::atomic<fiber_carrier*> carriers[sched::max_cpus];
+static mutex carriers_mutex;
+
+fiber_carrier::fiber_carrier(sched::cpu* c)
+    : _thread(new sched::thread([this] { run(); },
+            sched::thread::attr().pin(c).name("fiber" + std::to_string(c->id))))
+{
+    _thread->start();
+}
+
+fiber_carrier* fiber_carrier::get(sched::cpu* c)
+{
+    auto carrier = carriers[c->id].load(std::memory_order_acquire);
+    if (carrier) {
+        return carrier;
+    }
+    WITH_LOCK(carriers_mutex) {
+        carrier = carriers[c->id].load(std::memory_order_relaxed);
+        if (!carrier) {
+            carrier = new fiber_carrier(c);
+            carriers[c->id].store(carrier, std::memory_order_release);
+        }
+    }
+    return carrier;
+}
+
+void fiber_carrier::enqueue(fiber* f)
+{
+    _incoming.push(f);
+    _thread->wake();
+}
+
+void fiber_carrier::run()
+{
+    while (true) {
+        // Poll the parked fibers on every pass, so fibers that keep
+        // yielding can't starve them
+        while (true) {
+            poll_parked();
+            auto f = _incoming.pop();
+            if (!f) {
+                break;
+            }
+            resume(f);
+        }
+        trace_fiber_carrier_idle();
+        sched::thread::wait_until([&] {
+            return !_incoming.empty() || poll_parked();
+        });
+    }
+}
+
+void fiber_carrier::resume(fiber* f)
+{
+    auto& st = f->_detached_state->st;
+    assert(st.load(std::memory_order_relaxed) == fiber::status::queued);
+    st.store(fiber::status::running, std::memory_order_relaxed);
+    trace_fiber_switch(f);
+    s_current_fiber = f;
+    // The fiber's stack is the one to fault in (see lazy_stack_ensure())
+    std::swap(sched::lazy_stack, f->_lazy_stack);
+    fiber_switch(_state, f->_state);
+    std::swap(sched::lazy_stack, f->_lazy_stack);
+    s_current_fiber = nullptr;
+    if (f->_finished) {
+        // Can only be done here, after we left the fiber's stack
+        f->complete();
+    }
+}
+
+// Called by the carrier before running each fiber, before sleeping, and
+// whenever it is woken; wakes the parked fibers whose wait objects are ready.
+bool fiber_carrier::poll_parked()
+{
+    bool woke = false;
+    for (auto i = _polled.begin(); i != _polled.end();) {
+        auto& f = *i;
+        if (!f._poll(f._poll_arg)) {
+            ++i;
+            continue;
+        }
+        i = _polled.erase(i);
+        auto old = fiber::status::waiting;
+        if (f._detached_state->st.compare_exchange_strong(old,
+                fiber::status::queued)) {
+            _incoming.push(&f);
+        }
+        woke = true;
+    }
+    return woke;
+}
+
+// The stack asked for, and the guard page below it
+static size_t stack_mapping_size(size_t stack_size)
+{
+    return stack_size + mmu::page_size;
+}
+
+extern "C" void fiber_main_c(fiber* f)
+{
+    f->main();
+}
+
+fiber::fiber(std::function<void ()> func, attr a)
+    : _func(std::move(func))
+    , _attr(a)
+    , _detached_state(new detached_state(this))
+{
+    trace_fiber_create(this);
+    // Like a pthread's stack, with a guard page below it (on top of the
+    // size asked for) to catch overflows
+    _stack = mmu::map_anon(nullptr, stack_mapping_size(_attr._stack_size),
+#if CONF_lazy_stack
+            mmu::mmap_stack,
+#else
+            mmu::mmap_populate,
+#endif
+            mmu::perm_rw);
+    mmu::mprotect(_stack, mmu::page_size, 0);
+    auto stacktop = static_cast<char*>(_stack) + stack_mapping_size(_attr._stack_size);
+#if CONF_lazy_stack
+    auto bottom = reinterpret_cast<uintptr_t>(_stack) + mmu::page_size;
+    auto top = reinterpret_cast<uintptr_t>(stacktop);
+    _lazy_stack = { std::max(top - mmu::stack_prefault_size, bottom), bottom, top };
+#endif
+    fiber_init_state(_state, stacktop, this);
+}
+
+fiber::~fiber()
+{
+    if (!_attr._detached) {
+        join();
+    }
+    mmu::munmap(_stack, stack_mapping_size(_attr._stack_size));
+    osv::rcu_dispose(_detached_state.release());
+}
+
+void fiber::start(sched::cpu* c)
+{
+    auto carrier = c ? fiber_carrier::get(c) :
+            current() ? current()->_detached_state->carrier :
+            fiber_carrier::get(sched::cpu::current());
+    _detached_state->carrier = carrier;
+    _detached_state->st.store(status::queued);
+    carrier->enqueue(this);
+}
+
+void fiber::main()
+{
+    _func();
+    _finished = true;
+    switch_out();
+    abort("fiber resumed after completion");
+}
+
+// Runs on the carrier after the fiber's last switch_out()
+void fiber::complete()
+{
+    if (_attr._detached) {
+        _detached_state->st.store(status::done);
+        delete this;
+        return;
+    }
+    // Like thread::destroy(): solve a race between join() and completion.
+    // If join() sets _joiner first, it will sleep and we need to wake it.
+    // But if we set _joiner first, join() will never wait.
+    static joiner completed;
+    joiner* j = nullptr;
+    WITH_LOCK(rcu_read_lock) {
+        auto ds = _detached_state.get();
+        if (_joiner.compare_exchange_strong(j, &completed)) {
+            ds->st.store(status::done);
+        } else {
+            j->wake_with([&] { ds->st.store(status::done); });
+        }
+    }
+}
+
+void fiber::join()
+{
+    auto& st = _detached_state->st;
+    if (st.load() == status::unstarted) {
+        return;
+    }
+    joiner me{sched::thread::current(), current()};
+    joiner* old_joiner = nullptr;
+    if (!_joiner.compare_exchange_strong(old_joiner, &me)) {
+        // The fiber is concurrently completing and won't use 'this' anymore
+        return;
+    }
+    auto done = [&] { return st.load() == status::done; };
+    if (me.f) {
+        wait_until(done);
+    } else {
+        sched::thread::wait_until(done);
+    }
+}
+
+void fiber::switch_out()
+{
+    fiber_switch(_state, _detached_state->carrier->_state);
+}
+
+void fiber::prepare_wait()
+{
+    _detached_state->st.store(status::waiting);
+}
+
+void fiber::wait()
+{
+    trace_fiber_wait(this);
+    switch_out();
+}
+
+void fiber::stop_wait()
+{
+    auto old = status::waiting;
+    if (_detached_state->st.compare_exchange_strong(old, status::running)) {
+        return;
+    }
+    // A concurrent wake() has already queued us on the carrier; let the
+    // carrier consume that and resume us.
+    assert(old == status::queued);
+    switch_out();
+}
+
+void fiber::wait_polled(bool (*poll)(void*), void* arg)
+{
+    auto carrier = _detached_state->carrier;
+    _poll = poll;
+    _poll_arg = arg;
+    while (true) {
+        prepare_wait();
+        if (poll(arg)) {
+            stop_wait();
+            return;
+        }
+        carrier->_polled.push_back(*this);
+        wait();
+        if (_polled_hook.is_linked()) {
+            // woken by wake() rather than by the carrier's polling
+            carrier->_polled.erase(carrier->_polled.iterator_to(*this));
+        }
+    }
+}
+
+void fiber::wake_impl(detached_state* st)
+{
+    auto old = status::waiting;
+    if (st->st.compare_exchange_strong(old, status::queued)) {
+        trace_fiber_wake(st->f);
+        st->carrier->enqueue(st->f);
+    }
+}
+
+void fiber::wake()
+{
+    WITH_LOCK(rcu_read_lock) {
+        wake_impl(_detached_state.get());
+    }
+}
+
+void fiber::yield()
+{
+    auto me = current();
+    if (!me) {
+        // Not on a fiber: yield the thread instead
+        sched::thread::yield();
+        return;
+    }
+    me->_detached_state->st.store(status::queued);
+    me->_detached_state->carrier->_incoming.push(me);
+    me->switch_out();
+}
+
+void fiber::timer_fired()
+{
+    wake();
+}
+
+void fiber_handle::wake()
+{
+    WITH_LOCK(rcu_read_lock) {
+        auto ds = _f.read();
+        if (ds) {
+            fiber::wake_impl(ds);
+        }
+    }
+}
+
+}
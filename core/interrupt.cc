@@ -14,6 +14,7 @@
 #include "exceptions.hh"
 #include <osv/interrupt.hh>
 #include "apic.hh"
+#include "kvm-pv.hh"
 #include <osv/trace.hh>
 
 TRACEPOINT(trace_msix_interrupt, "vector=0x%02x", unsigned);
@@ -136,6 +137,11 @@ static inline void set_affinity_and_wake(
 }
 
 bool interrupt_manager::easy_register(std::initializer_list<msix_binding> bindings)
+{
+    return easy_register(std::vector<msix_binding>(bindings));
+}
+
+bool interrupt_manager::easy_register(const std::vector<msix_binding>& bindings)
 {
     unsigned n = bindings.size();
 
@@ -282,6 +288,17 @@ void inter_processor_interrupt::send(sched::cpu* cpu)
     apic->ipi(cpu->arch.apic_id, _vector);
 }
 
+void inter_processor_interrupt::send(sched::cpu_set& cpus)
+{
+    if (processor::features().kvm_pv_send_ipi) {
+        processor::kvm_send_ipi_mask(cpus, _vector);
+        return;
+    }
+    for (auto c : cpus) {
+        apic->ipi(sched::cpus[c]->arch.apic_id, _vector);
+    }
+}
+
 void inter_processor_interrupt::send_allbutself(){
     apic->ipi_allbutself(_vector);
 }
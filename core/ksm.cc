@@ -0,0 +1,332 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include <osv/ksm.hh>
+#include <osv/mempool.hh>
+#include <osv/sched.hh>
+#include <osv/trace.hh>
+
+#include <string.h>
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+
+TRACEPOINT(trace_ksm_scan, "scanned=%d, merged=%d", unsigned, unsigned);
+TRACEPOINT(trace_ksm_merge, "addr=%p, page=%p", uintptr_t, void*);
+TRACEPOINT(trace_ksm_unshare, "page=%p, refs=%d", void*, unsigned);
+
+namespace ksm {
+
+// Everything here is protected by mmu::vma_list_mutex, which also keeps
+// the page tables from changing under us.
+
+// A page mapped, read-only and marked cow, in place of identical ones
+struct merged_page {
+    uint64_t hash;
+    unsigned refs;
+};
+
+static std::unordered_map<void*, merged_page> merged_pages;
+// The "stable tree": merged pages by contents; their contents don't change
+static std::unordered_multimap<uint64_t, void*> stable;
+static size_t total_refs;
+static stats counters;
+
+static uint64_t page_hash(const void* page)
+{
+    auto p = static_cast<const uint64_t*>(page);
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < mmu::page_size / sizeof(*p); i++) {
+        h = (h ^ p[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static void forget(void* page, uint64_t hash)
+{
+    auto r = stable.equal_range(hash);
+    for (auto i = r.first; i != r.second; ++i) {
+        if (i->second == page) {
+            stable.erase(i);
+            break;
+        }
+    }
+    merged_pages.erase(page);
+}
+
+bool unshare(mmu::hw_ptep<0> ptep, mmu::pt_element<0> pte)
+{
+    void* page = mmu::phys_to_virt(ptep.read().addr());
+    auto i = merged_pages.find(page);
+    assert(i != merged_pages.end());
+    auto& mp = i->second;
+    trace_ksm_unshare(page, mp.refs);
+    if (mp.refs == 1) {
+        // The last user can have the page for itself
+        if (!mmu::write_pte(page, ptep, pte)) {
+            return false;
+        }
+        forget(page, mp.hash);
+    } else {
+        void* copy = memory::alloc_page();
+        memcpy(copy, page, mmu::page_size);
+        if (!mmu::write_pte(copy, ptep, pte)) {
+            memory::free_page(copy);
+            return false;
+        }
+        mp.refs--;
+        // Other cpus may still have the shared page mapped at this address
+        mmu::flush_tlb_all();
+    }
+    total_refs--;
+    counters.pages_unmerged++;
+    return true;
+}
+
+bool put(void* addr, mmu::hw_ptep<0> ptep)
+{
+    mmu::clear_pte(ptep);
+    auto i = merged_pages.find(addr);
+    assert(i != merged_pages.end());
+    total_refs--;
+    if (--i->second.refs) {
+        return false;
+    }
+    forget(addr, i->second.hash);
+    return true;
+}
+
+// Makes a pte read-only, returning what it was
+static mmu::pt_element<0> write_protect(mmu::hw_ptep<0> ptep)
+{
+    while (true) {
+        auto pte = ptep.read();
+        auto ro = pte;
+        ro.set_writable(false);
+        if (ptep.compare_exchange(pte, ro)) {
+            return pte;
+        }
+    }
+}
+
+class scanner {
+public:
+    scanner();
+    void set_rate(unsigned pages, std::chrono::milliseconds interval);
+    std::chrono::nanoseconds cpu_time() { return _thread.thread_clock(); }
+private:
+    // A page write-protected, to be compared to target, once the tlb was
+    // flushed, and replaced by it if they are the same
+    struct candidate {
+        uintptr_t addr;
+        mmu::pt_element<0>* ptep;
+        mmu::pt_element<0> old;
+        void* target;
+        uint64_t hash;
+        // If target is another page found in the unstable tree, which
+        // becomes a merged page: its write-protected pte, and what it was
+        mmu::pt_element<0>* other_ptep;
+        mmu::pt_element<0> other_old;
+    };
+    void run();
+    void scan();
+    void collect(uintptr_t addr, mmu::hw_ptep<0> ptep);
+    bool merge(candidate& c);
+    mmu::pt_element<0>* find(uintptr_t addr);
+private:
+    sched::thread _thread;
+    std::atomic<unsigned> _pages_per_scan {100};
+    std::atomic<long> _interval_ms {20};
+    uintptr_t _cursor = 0;
+    // A page's checksum in this full scan and in the previous one; pages
+    // which changed in between are not worth merging
+    std::unordered_map<uintptr_t, uint64_t> _checksums;
+    std::unordered_map<uintptr_t, uint64_t> _old_checksums;
+    // The "unstable tree": pages seen in this full scan and not merged, by
+    // checksum. They may have changed since.
+    std::unordered_map<uint64_t, uintptr_t> _unstable;
+    // This pass's candidates, all compared after a single tlb flush
+    std::vector<candidate> _candidates;
+    // Pages replaced by merged ones, freed after the next tlb flush
+    std::vector<void*> _to_free;
+};
+
+scanner::scanner()
+    : _thread([this] { run(); }, sched::thread::attr().name("ksm"))
+{
+    _thread.start();
+}
+
+void scanner::set_rate(unsigned pages, std::chrono::milliseconds interval)
+{
+    _pages_per_scan.store(pages);
+    _interval_ms.store(interval.count());
+}
+
+void scanner::run()
+{
+    while (true) {
+        scan();
+        sched::thread::sleep(std::chrono::milliseconds(_interval_ms.load()));
+    }
+}
+
+void scanner::scan()
+{
+    unsigned limit = _pages_per_scan.load();
+    unsigned scanned = 0, merged = 0;
+    SCOPE_LOCK(mmu::vma_list_mutex);
+    _cursor = mmu::for_each_small_page(mmu::mmap_mergeable, _cursor,
+            [&] (uintptr_t addr, mmu::hw_ptep<0> ptep) {
+        collect(addr, ptep);
+        return ++scanned < limit;
+    });
+    if (!_candidates.empty() || !_to_free.empty()) {
+        // Other cpus can no longer write the candidates, nor read the
+        // pages replaced in the previous pass
+        mmu::flush_tlb_all();
+        for (auto page : _to_free) {
+            memory::free_page(page);
+        }
+        _to_free.clear();
+    }
+    for (auto& c : _candidates) {
+        merged += merge(c);
+    }
+    _candidates.clear();
+    counters.pages_scanned += scanned;
+    counters.pages_merged += merged;
+    if (!_cursor && scanned) {
+        _old_checksums.swap(_checksums);
+        _checksums.clear();
+        _unstable.clear();
+        counters.full_scans++;
+    }
+    trace_ksm_scan(scanned, merged);
+}
+
+// Looks up the pte mapping addr, if it is still in a mergeable vma
+mmu::pt_element<0>* scanner::find(uintptr_t addr)
+{
+    mmu::pt_element<0>* ret = nullptr;
+    mmu::for_each_small_page(mmu::mmap_mergeable, addr,
+            [&] (uintptr_t a, mmu::hw_ptep<0> ptep) {
+        if (a == addr) {
+            ret = ptep.release();
+        }
+        return false;
+    });
+    return ret;
+}
+
+// Finds a page the one ptep maps may be merged with, and if there is one,
+// write-protects both and queues them up for merge()
+void scanner::collect(uintptr_t addr, mmu::hw_ptep<0> ptep)
+{
+    auto pte = ptep.read();
+    if (!pte.valid() || mmu::pte_is_cow(pte)) {
+        return;
+    }
+    auto hash = page_hash(mmu::phys_to_virt(pte.addr()));
+    _checksums[addr] = hash;
+
+    auto s = stable.find(hash);
+    if (s != stable.end()) {
+        _candidates.push_back({addr, ptep.release(), write_protect(ptep),
+                               s->second, hash, nullptr, {}});
+        return;
+    }
+
+    auto old = _old_checksums.find(addr);
+    if (old == _old_checksums.end() || old->second != hash) {
+        return;
+    }
+    auto u = _unstable.find(hash);
+    if (u == _unstable.end()) {
+        _unstable.emplace(hash, addr);
+        return;
+    }
+    // A page seen earlier in this scan had the same checksum; if it is
+    // still mapped and still the same, it becomes the merged page.
+    auto other = find(u->second);
+    if (!other) {
+        u->second = addr;
+        return;
+    }
+    auto other_ptep = mmu::hw_ptep<0>::force(other);
+    auto other_old = write_protect(other_ptep);
+    if (!other_old.valid() || mmu::pte_is_cow(other_old)) {
+        other_ptep.write(other_old);
+        u->second = addr;
+        return;
+    }
+    _unstable.erase(u);
+    _candidates.push_back({addr, ptep.release(), write_protect(ptep),
+                           mmu::phys_to_virt(other_old.addr()), hash,
+                           other, other_old});
+}
+
+// Maps c.target, whose contents won't change anymore, instead of the page
+// c.ptep maps, if the two are identical. Called after the tlb flush which
+// made both read-only everywhere.
+bool scanner::merge(candidate& c)
+{
+    auto ptep = mmu::hw_ptep<0>::force(c.ptep);
+    void* page = mmu::phys_to_virt(c.old.addr());
+    if (memcmp(page, c.target, mmu::page_size)) {
+        ptep.write(c.old);
+        if (c.other_ptep) {
+            mmu::hw_ptep<0>::force(c.other_ptep).write(c.other_old);
+        }
+        return false;
+    }
+    auto pte = mmu::pte_mark_cow(c.old, true);
+    pte.mod_addr(mmu::virt_to_phys(c.target));
+    ptep.write(pte);
+    _to_free.push_back(page);
+    trace_ksm_merge(c.addr, c.target);
+    if (c.other_ptep) {
+        mmu::hw_ptep<0>::force(c.other_ptep).write(
+                mmu::pte_mark_cow(c.other_old, true));
+        merged_pages[c.target] = merged_page{c.hash, 2};
+        stable.emplace(c.hash, c.target);
+        total_refs += 2;
+    } else {
+        merged_pages[c.target].refs++;
+        total_refs++;
+    }
+    return true;
+}
+
+static scanner* s_scanner;
+
+void start()
+{
+    assert(mutex_owned(&mmu::vma_list_mutex));
+    if (!s_scanner) {
+        s_scanner = new scanner;
+    }
+}
+
+void set_rate(unsigned pages, std::chrono::milliseconds interval)
+{
+    SCOPE_LOCK(mmu::vma_list_mutex);
+    start();
+    s_scanner->set_rate(pages, interval);
+}
+
+stats get_stats()
+{
+    SCOPE_LOCK(mmu::vma_list_mutex);
+    auto ret = counters;
+    ret.pages_shared = merged_pages.size();
+    ret.pages_sharing = total_refs - merged_pages.size();
+    ret.scan_time = s_scanner ? s_scanner->cpu_time() : std::chrono::nanoseconds(0);
+    return ret;
+}
+
+}
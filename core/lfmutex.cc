@@ -9,6 +9,7 @@
 #include <osv/trace.hh>
 #include <osv/sched.hh>
 #include <osv/wait_record.hh>
+#include <osv/rcu.hh>
 
 namespace lockfree {
 
@@ -20,6 +21,7 @@ TRACEPOINT(trace_mutex_unlock, "%p", mutex *);
 TRACEPOINT(trace_mutex_unlock_wake, "%p, t=%p", mutex *, const sched::thread*);
 TRACEPOINT(trace_mutex_send_lock, "%p, wr=%p", mutex *, wait_record *);
 TRACEPOINT(trace_mutex_receive_lock, "%p", mutex *);
+TRACEPOINT(trace_mutex_lend_priority, "%p", mutex *);
 
 void mutex::lock()
 {
@@ -34,6 +36,9 @@ void mutex::lock()
         // just for implementing a recursive mutex.
         owner.store(current, std::memory_order_relaxed);
         depth = 1;
+        if (prio_inherit) {
+            current->pi_acquired();
+        }
         return;
     }
 
@@ -76,20 +81,61 @@ void mutex::lock()
                 } else {
                     // got the lock ourselves
                     assert(other == &waiter);
-                    owner.store(current, std::memory_order_relaxed);
-                    depth = 1;
+                    acquired(current);
                     return;
                 }
             }
         }
     }
 
+    if (prio_inherit) {
+        lend_priority(current);
+    }
+
     // Wait until another thread pops us from the wait queue and wakes us up.
     trace_mutex_lock_wait(this);
     waiter.wait();
     trace_mutex_lock_wake(this);
+    acquired(current);
+}
+
+// Take ownership after getting the lock from the wait queue.
+void mutex::acquired(sched::thread *current)
+{
     owner.store(current, std::memory_order_relaxed);
     depth = 1;
+    if (prio_inherit) {
+        current->pi_acquired();
+        // Threads which queued up while nobody was marked as the owner
+        // couldn't lend us their priority, so take it from them now. As
+        // the lock holder, we are the queue's consumer, so we may iterate it.
+        auto seen = current->pi_state();
+        for (auto& x : waitqueue) {
+            current->inherit_priority(*x.thread(), seen);
+            seen = current->pi_state();
+        }
+    }
+}
+
+// Called by a thread about to wait for a priority-inheritance mutex: let
+// the owner run at least at our priority until it releases the mutex.
+void mutex::lend_priority(sched::thread *current)
+{
+    trace_mutex_lend_priority(this);
+    // The owner can't be destroyed under rcu_read_lock, see ~thread().
+    WITH_LOCK(osv::rcu_read_lock) {
+        auto o = owner.load(std::memory_order_relaxed);
+        if (!o || o == current) {
+            return;
+        }
+        // If o still owns the mutex after we read its state, the boost
+        // goes to that state's epoch, which o's pi_released() ends.
+        // Otherwise o may have released it, and gets nothing from us.
+        auto seen = o->pi_state();
+        if (owner.load(std::memory_order_relaxed) == o) {
+            o->inherit_priority(*current, seen);
+        }
+    }
 }
 
 // send_lock() is used for implementing a "wait morphing" technique, where
@@ -171,8 +217,7 @@ bool mutex::send_lock_unless_already_waiting(wait_record *wr)
 void mutex::receive_lock()
 {
     trace_mutex_receive_lock(this);
-    owner.store(sched::thread::current(), std::memory_order_relaxed);
-    depth = 1;
+    acquired(sched::thread::current());
 }
 
 bool mutex::try_lock()
@@ -183,6 +228,9 @@ bool mutex::try_lock()
         // Uncontended case. We got the lock.
         owner.store(current, std::memory_order_relaxed);
         depth = 1;
+        if (prio_inherit) {
+            current->pi_acquired();
+        }
         trace_mutex_try_lock(this, true);
         return true;
     }
@@ -201,8 +249,7 @@ bool mutex::try_lock()
     auto old_handoff = handoff.load();
     if(old_handoff && handoff.compare_exchange_strong(old_handoff, 0U)) {
         count.fetch_add(1, std::memory_order_relaxed);
-        owner.store(current, std::memory_order_relaxed);
-        depth = 1;
+        acquired(current);
         trace_mutex_try_lock(this, true);
         return true;
     }
@@ -229,6 +276,18 @@ void mutex::unlock()
     // is in the middle of acquiring the lock and has set count>0.
     owner.store(nullptr, std::memory_order_relaxed);
 
+    // Once we hand off the lock, the mutex may be freed by its next owner,
+    // so read the flag before.
+    bool pi = prio_inherit;
+    hand_off();
+    if (pi) {
+        // Drop the priority lent to us by waiters, after they got the lock.
+        sched::thread::current()->pi_released();
+    }
+}
+
+void mutex::hand_off()
+{
     // If there is no waiting lock(), we're done. This is the easy case :-)
     if (count.fetch_add(-1, std::memory_order_release) == 1) {
         return;
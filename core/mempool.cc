@@ -24,6 +24,7 @@
 #include <osv/trace.hh>
 #include <lockfree/ring.hh>
 #include <osv/percpu-worker.hh>
+#include <osv/semaphore.hh>
 #include <osv/preempt-lock.hh>
 #include <osv/sched.hh>
 #include <algorithm>
@@ -426,6 +427,21 @@ void wake_reclaimer()
     reclaimer_thread.wake();
 }
 
+// Runs compact() when huge page allocations fail
+class compactor {
+public:
+    compactor();
+    void wake();
+private:
+    void run();
+private:
+    std::atomic<bool> _pending = { false };
+    sched::thread _thread;
+};
+
+static compactor compactor_thread
+    __attribute__((init_priority((int)init_prio::reclaimer)));
+
 static void on_free(size_t mem)
 {
     free_memory.fetch_add(mem);
@@ -555,6 +571,13 @@ public:
         }
         return size;
     }
+    // Number of pages, free or not, from the start of physical memory to
+    // the end of the last range we manage
+    size_t span() const {
+        return _bitmap.size();
+    }
+
+    page_range* isolate(page_range& pr, void* start, void* end);
 
 private:
     template<bool UseBitmap = true>
@@ -761,6 +784,31 @@ void page_range_allocator::free(page_range* pr)
     insert(*pr);
 }
 
+// Takes the pages of pr which are in [start, end) out of the free ranges,
+// for compaction: they stay free, but won't be allocated until given back
+// with free(). Returns what is left of pr after end, if anything.
+page_range* page_range_allocator::isolate(page_range& pr, void* start, void* end)
+{
+    remove(pr);
+    auto pr_start = reinterpret_cast<char*>(&pr);
+    auto pr_end = pr_start + pr.size;
+    auto s = static_cast<char*>(start), e = static_cast<char*>(end);
+    page_range* rest = nullptr;
+    if (pr_end > e) {
+        rest = new (e) page_range(pr_end - e);
+        insert(*rest);
+    }
+    if (pr_start < s) {
+        pr.size = s - pr_start;
+        insert(pr);
+    }
+    // Ranges freed next to the isolated pages must not take them for free
+    // ones when looking for neighbors to merge with
+    _bitmap[(std::max(pr_start, s) - mmu::phys_mem) / page_size] = false;
+    _bitmap[(std::min(pr_end, e) - mmu::phys_mem) / page_size - 1] = false;
+    return rest;
+}
+
 void page_range_allocator::initial_add(page_range* pr)
 {
     auto idx = get_bitmap_idx(*pr) + pr->size / page_size;
@@ -1203,6 +1251,7 @@ void* alloc_huge_page(size_t N)
         // just to be sure, and if this is not real pressure, it will just go back to
         // sleep
         reclaimer_thread.wake();
+        compactor_thread.wake();
         trace_memory_huge_failure(free_page_ranges.size());
         return nullptr;
     }
@@ -1213,6 +1262,230 @@ void free_huge_page(void* v, size_t N)
     free_page_range(v, N);
 }
 
+// Memory compaction
+//
+// Over time, the free memory gets scattered in small ranges all over, and
+// alloc_huge_page() fails even though there is plenty of memory free. We
+// pick the huge page regions which are mostly free, and move the pages still
+// in use there to other places, when we know how to (see mmu::migrate_pages());
+// the regions become free huge pages again.
+
+static constexpr unsigned region_pages = mmu::huge_page_size / page_size;
+// Below that, compacting a region is too much copying for one huge page
+static constexpr unsigned compact_min_free = region_pages / 4;
+// Bounds the time a pass holds vma_list_mutex, and so page faults off
+static constexpr unsigned compact_max_regions = 64;
+
+// Calls f(i, pages) for each region of the sorted list which the free page
+// range overlaps, with the number of pages in the overlap
+template <typename Func>
+static void for_each_region(const std::vector<mmu::phys>& regions, page_range& pr, Func f)
+{
+    mmu::phys start = static_cast<char*>(static_cast<void*>(&pr)) - mmu::phys_mem;
+    mmu::phys end = start + pr.size;
+    size_t i = std::upper_bound(regions.begin(), regions.end(), start) - regions.begin();
+    for (i = i ? i - 1 : 0; i < regions.size() && regions[i] < end; i++) {
+        auto s = std::max(start, regions[i]);
+        auto e = std::min(end, regions[i] + mmu::huge_page_size);
+        if (s < e) {
+            f(i, (e - s) / page_size);
+        }
+    }
+}
+
+// The pages in the per-cpu buffers are free, but not in free_page_ranges.
+// Each cpu's buffer is drained by its percpu worker, which posts
+// page_buffers_drained when done.
+static semaphore page_buffers_drained(0);
+
+static void drain_local_page_buffer()
+{
+    WITH_LOCK(free_page_ranges_lock) {
+        WITH_LOCK(preempt_lock) {
+            auto& pbuf = *percpu_page_buffer;
+            while (pbuf.nr) {
+                auto pr = new (pbuf.free[--pbuf.nr]) page_range(page_size);
+                free_page_range_locked(pr);
+            }
+        }
+    }
+    page_buffers_drained.post();
+}
+
+PCPU_WORKERITEM(page_buffer_drainer, [] { drain_local_page_buffer(); });
+
+static void drain_page_buffers()
+{
+    for (auto c : sched::cpus) {
+        page_buffer_drainer.signal(c);
+    }
+    page_buffers_drained.wait(sched::cpus.size());
+}
+
+// The regions worth compacting, most free first, as many as we have room
+// to move their pages in use to
+static std::vector<mmu::phys> compaction_candidates()
+{
+    size_t nr_regions;
+    WITH_LOCK(free_page_ranges_lock) {
+        nr_regions = align_up(free_page_ranges.span(), size_t(region_pages)) / region_pages;
+    }
+    // Can't allocate memory while walking the free ranges
+    std::vector<unsigned> nr_free(nr_regions);
+    std::vector<mmu::phys> all(nr_regions);
+    for (size_t i = 0; i < nr_regions; i++) {
+        all[i] = i * mmu::huge_page_size;
+    }
+    size_t total_free = 0;
+    WITH_LOCK(free_page_ranges_lock) {
+        free_page_ranges.for_each([&] (page_range& pr) {
+            total_free += pr.size / page_size;
+            for_each_region(all, pr, [&] (size_t i, size_t pages) {
+                nr_free[i] += pages;
+            });
+            return true;
+        });
+    }
+
+    std::vector<size_t> candidates;
+    for (size_t i = 0; i < nr_regions; i++) {
+        if (nr_free[i] >= compact_min_free && nr_free[i] < region_pages) {
+            candidates.push_back(i);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(), [&] (size_t a, size_t b) {
+        return nr_free[a] > nr_free[b];
+    });
+    std::vector<mmu::phys> regions;
+    size_t to_move = 0, in_regions = 0;
+    for (auto i : candidates) {
+        if (regions.size() == compact_max_regions) {
+            break;
+        }
+        // Leave the moved pages plenty of room outside the regions
+        if ((to_move + region_pages - nr_free[i]) * 2 > total_free - in_regions - nr_free[i]) {
+            break;
+        }
+        to_move += region_pages - nr_free[i];
+        in_regions += nr_free[i];
+        regions.push_back(all[i]);
+    }
+    std::sort(regions.begin(), regions.end());
+    return regions;
+}
+
+// Takes the free pages of the regions whose pages in use are all movable out
+// of free_page_ranges, so they are still free when the pages are moved out.
+static std::vector<bool> isolate_regions(const std::vector<mmu::phys>& regions,
+                                         const std::vector<unsigned>& movable)
+{
+    std::vector<unsigned> nr_free(regions.size());
+    std::vector<bool> isolated(regions.size());
+    // A region has at most region_pages / 2 + 1 free ranges in it
+    std::vector<page_range*> ranges;
+    ranges.reserve(regions.size() * (region_pages / 2 + 1));
+    WITH_LOCK(free_page_ranges_lock) {
+        free_page_ranges.for_each([&] (page_range& pr) {
+            for_each_region(regions, pr, [&] (size_t i, size_t pages) {
+                nr_free[i] += pages;
+            });
+            return true;
+        });
+        for (size_t i = 0; i < regions.size(); i++) {
+            isolated[i] = nr_free[i] + movable[i] == region_pages;
+        }
+        free_page_ranges.for_each([&] (page_range& pr) {
+            bool overlaps = false;
+            for_each_region(regions, pr, [&] (size_t i, size_t pages) {
+                overlaps |= isolated[i];
+            });
+            if (overlaps) {
+                ranges.push_back(&pr);
+            }
+            return true;
+        });
+        for (auto pr : ranges) {
+            // A range may overlap two regions, one at each end
+            auto rest = pr;
+            for_each_region(regions, *pr, [&] (size_t i, size_t pages) {
+                if (isolated[i] && rest) {
+                    auto r = mmu::phys_mem + regions[i];
+                    rest = free_page_ranges.isolate(*rest, r, r + mmu::huge_page_size);
+                }
+            });
+        }
+    }
+    return isolated;
+}
+
+TRACEPOINT(trace_memory_compact, "candidates=%d", size_t);
+TRACEPOINT(trace_memory_compact_ret, "huge pages=%d, pages moved=%d", size_t, size_t);
+
+static mutex compaction_mutex;
+
+size_t compact()
+{
+    if (!smp_allocator) {
+        return 0;
+    }
+    SCOPE_LOCK(compaction_mutex);
+    drain_page_buffers();
+    auto regions = compaction_candidates();
+    trace_memory_compact(regions.size());
+    if (regions.empty()) {
+        trace_memory_compact_ret(0, 0);
+        return 0;
+    }
+    std::vector<unsigned> movable;
+    std::vector<bool> isolated;
+    auto moved = mmu::migrate_pages(regions, [&] (const std::vector<unsigned>& m) {
+        movable = m;
+        isolated = isolate_regions(regions, movable);
+        return isolated;
+    });
+    size_t freed = 0;
+    WITH_LOCK(free_page_ranges_lock) {
+        for (size_t i = 0; i < regions.size(); i++) {
+            if (isolated[i]) {
+                // The isolated free pages were never accounted as allocated
+                on_free(movable[i] * page_size);
+                free_page_ranges.free(new (mmu::phys_mem + regions[i])
+                                      page_range(mmu::huge_page_size));
+                freed++;
+            }
+        }
+    }
+    trace_memory_compact_ret(freed, moved);
+    return freed;
+}
+
+compactor::compactor()
+    : _thread([&] { run(); },
+              sched::thread::attr().detached().name("compactor"))
+{
+    _thread.start();
+}
+
+void compactor::wake()
+{
+    _pending.store(true, std::memory_order_relaxed);
+    _thread.wake();
+}
+
+void compactor::run()
+{
+    while (true) {
+        sched::thread::wait_until([&] {
+            return _pending.load(std::memory_order_relaxed);
+        });
+        _pending.store(false, std::memory_order_relaxed);
+        compact();
+        // Failing huge page allocations will keep asking for more; if we
+        // couldn't help, asking again right away won't either.
+        sched::thread::sleep(std::chrono::seconds(1));
+    }
+}
+
 void free_initial_memory_range(void* addr, size_t size)
 {
     if (!size) {
@@ -27,6 +27,11 @@
 #include <osv/file.h>
 #include "dump.hh"
 #include <osv/rcu.hh>
+#include <osv/rwlock.h>
+#include <osv/pagecache.hh>
+#include <osv/bio.h>
+#include <osv/ksm.hh>
+#include <osv/defer.hh>
 
 extern void* elf_start;
 extern size_t elf_size;
@@ -728,6 +733,96 @@ public:
     }
 };
 
+/*
+ * Collects the small pages mapped in a range which lie in one of the given
+ * (sorted) physical regions. Huge pages are left alone: they are what page
+ * migration is trying to make more of.
+ */
+class find_pages_in_regions :
+        public page_table_operation<allocate_intermediate_opt::no, skip_empty_opt::yes,
+        descend_opt::yes, once_opt::no, split_opt::no> {
+public:
+    struct found_page {
+        phys addr;
+        pt_element<0>* ptep;
+    };
+    find_pages_in_regions(const std::vector<phys>& regions, std::vector<found_page>& pages)
+        : _regions(regions), _pages(pages) {}
+    // Index of the region containing addr, or -1
+    static ssize_t region_of(const std::vector<phys>& regions, phys addr) {
+        auto r = std::upper_bound(regions.begin(), regions.end(), addr);
+        if (r == regions.begin() || addr >= *--r + huge_page_size) {
+            return -1;
+        }
+        return r - regions.begin();
+    }
+    template<int N>
+    bool page(hw_ptep<N> ptep, uintptr_t offset) {
+        return true;
+    }
+    bool page(hw_ptep<0> ptep, uintptr_t offset) {
+        auto pte = ptep.read();
+        auto addr = pte.addr();
+        // Merged pages (see ksm.cc) are known by their address; they stay
+        // put, and so do the regions they are in.
+        if (!pte_is_cow(pte) && region_of(_regions, addr) >= 0) {
+            _pages.push_back({addr, ptep.release()});
+        }
+        return true;
+    }
+private:
+    const std::vector<phys>& _regions;
+    std::vector<found_page>& _pages;
+};
+
+/*
+ * Calls a function on each small page of a range until it returns false;
+ * offset is the page's virtual address (see for_each_small_page()).
+ */
+class small_page_visitor :
+        public page_table_operation<allocate_intermediate_opt::no, skip_empty_opt::yes,
+        descend_opt::yes, once_opt::no, split_opt::no> {
+public:
+    explicit small_page_visitor(std::function<bool (uintptr_t, hw_ptep<0>)>& f) : _f(f) {}
+    template<int N>
+    bool page(hw_ptep<N> ptep, uintptr_t offset) {
+        return true;
+    }
+    bool page(hw_ptep<0> ptep, uintptr_t offset) {
+        if (!_next && !_f(offset, ptep)) {
+            _next = offset + page_size;
+        }
+        return true;
+    }
+    uintptr_t next() const { return _next; }
+private:
+    std::function<bool (uintptr_t, hw_ptep<0>)>& _f;
+    uintptr_t _next = 0;
+};
+
+/*
+ * Replaces the merged pages of a range (see ksm.cc) with private copies.
+ */
+class unmerge : public vma_operation<allocate_intermediate_opt::no, skip_empty_opt::yes> {
+private:
+    unsigned _perm;
+public:
+    explicit unmerge(unsigned perm) : _perm(perm) {}
+    template<int N>
+    bool page(hw_ptep<N> ptep, uintptr_t offset) {
+        return true;
+    }
+    bool page(hw_ptep<0> ptep, uintptr_t offset) {
+        auto pte = ptep.read();
+        if (pte_is_cow(pte)) {
+            pte = pte_mark_cow(pte, false);
+            pte.set_writable(_perm & perm_write);
+            ksm::unshare(ptep, pte);
+        }
+        return true;
+    }
+};
+
 template<typename T> ulong operate_range(T mapper, void *vma_start, void *start, size_t size)
 {
     start = align_down(start, page_size);
@@ -904,6 +999,10 @@ private:
     }
 public:
     virtual bool map(uintptr_t offset, hw_ptep<0> ptep, pt_element<0> pte, bool write) override {
+        if (pte_is_cow(ptep.read())) {
+            // A write to a page merged with identical ones
+            return ksm::unshare(ptep, pte);
+        }
         return set_pte(fill(memory::alloc_page(), offset, page_size), ptep, pte);
     }
     virtual bool map(uintptr_t offset, hw_ptep<1> ptep, pt_element<1> pte, bool write) override {
@@ -911,6 +1010,9 @@ public:
         return set_pte(fill(memory::alloc_huge_page(size), offset, size), ptep, pte);
     }
     virtual bool unmap(void *addr, uintptr_t offset, hw_ptep<0> ptep) override {
+        if (pte_is_cow(ptep.read())) {
+            return ksm::put(addr, ptep);
+        }
         clear_pte(ptep);
         return true;
     }
@@ -1030,31 +1132,61 @@ void vcleanup(void* addr, size_t size)
     }
 }
 
-static void depopulate(void* addr, size_t length)
+// Calls f(vma, start, size) for the part of each vma within [addr, addr+length)
+template <typename F>
+static void for_each_vma_part(void* addr, size_t length, F f)
 {
-    length = align_up(length, mmu::page_size);
     auto start = reinterpret_cast<uintptr_t>(addr);
-    auto range = vma_list.equal_range(addr_range(start, start + length), vma::addr_compare());
+    auto end = start + align_up(length, mmu::page_size);
+    auto range = vma_list.equal_range(addr_range(start, end), vma::addr_compare());
     for (auto i = range.first; i != range.second; ++i) {
-        i->operate_range(unpopulate<>(i->page_ops()), reinterpret_cast<void*>(start), std::min(length, i->size()));
-        start += i->size();
-        length -= i->size();
+        auto s = std::max(start, i->start());
+        auto e = std::min(end, i->end());
+        f(*i, reinterpret_cast<void*>(s), e - s);
     }
 }
 
+static void depopulate(void* addr, size_t length)
+{
+    for_each_vma_part(addr, length, [] (vma& v, void* start, size_t size) {
+        v.operate_range(unpopulate<>(v.page_ops()), start, size);
+    });
+}
+
 static void nohugepage(void* addr, size_t length)
 {
+    for_each_vma_part(addr, length, [] (vma& v, void* start, size_t size) {
+        if (!v.has_flags(mmap_small)) {
+            v.update_flags(mmap_small);
+            v.operate_range(splithugepages(), start, size);
+        }
+    });
+}
+
+// Merging only looks at small pages, and at anonymous memory which page
+// faults can be taken on (not thread stacks, nor the JVM heap).
+static void mergeable(void* addr, size_t length)
+{
+    nohugepage(addr, length);
     length = align_up(length, mmu::page_size);
     auto start = reinterpret_cast<uintptr_t>(addr);
     auto range = vma_list.equal_range(addr_range(start, start + length), vma::addr_compare());
     for (auto i = range.first; i != range.second; ++i) {
-        if (!i->has_flags(mmap_small)) {
-            i->update_flags(mmap_small);
-            i->operate_range(splithugepages(), reinterpret_cast<void*>(start), std::min(length, i->size()));
+        if (dynamic_cast<anon_vma*>(&*i) && !i->has_flags(mmap_populate | mmap_jvm_heap)) {
+            i->update_flags(mmap_mergeable);
         }
-        start += i->size();
-        length -= i->size();
     }
+    ksm::start();
+}
+
+static void unmergeable(void* addr, size_t length)
+{
+    for_each_vma_part(addr, length, [] (vma& v, void* start, size_t size) {
+        if (v.has_flags(mmap_mergeable)) {
+            v.clear_flags(mmap_mergeable);
+            v.operate_range(unmerge(v.perm()), start, size);
+        }
+    });
 }
 
 error advise(void* addr, size_t size, int advice)
@@ -1069,11 +1201,149 @@ error advise(void* addr, size_t size, int advice)
         } else if (advice == advise_nohugepage) {
             nohugepage(addr, size);
             return no_error();
+        } else if (advice == advise_mergeable) {
+            mergeable(addr, size);
+            return no_error();
+        } else if (advice == advise_unmergeable) {
+            unmergeable(addr, size);
+            return no_error();
         }
         return make_error(EINVAL);
     }
 }
 
+// Device I/O straight to or from mapped memory (see physio()) would lose
+// data if its pages moved while it is in flight, so it holds this for read.
+static rwlock page_migration_lock;
+
+extern "C" void bio_user_io_begin()
+{
+    page_migration_lock.rlock();
+}
+
+extern "C" void bio_user_io_end()
+{
+    page_migration_lock.runlock();
+}
+
+// Only the linear mapping is physically contiguous and can be handed to a
+// device as is; mmap()ed memory is bounced.
+extern "C" int bio_user_io_direct(const void* addr, size_t len)
+{
+    return is_linear_mapped(addr, len);
+}
+
+TRACEPOINT(trace_mmu_migrate_pages, "regions=%d, found=%d", size_t, size_t);
+TRACEPOINT(trace_mmu_migrate_pages_ret, "regions=%d, moved=%d", size_t, size_t);
+
+size_t migrate_pages(const std::vector<phys>& regions,
+        std::function<std::vector<bool> (const std::vector<unsigned>& movable)> isolate)
+{
+    typedef find_pages_in_regions::found_page found_page;
+    auto region_of = find_pages_in_regions::region_of;
+    std::vector<found_page> pages;
+    SCOPE_LOCK(vma_list_mutex);
+
+    // We know all the ptes mapping a page of an anonymous vma: there is
+    // just one. But while its pte is clear, touching the page faults, so we
+    // only move the pages of vmas the kernel touches where it may fault:
+    // the application's own anonymous mmap()s, which it only reaches
+    // through system calls (see mmap_movable). Thread stacks, memory the
+    // kernel mapped for itself and the JVM heap, whose balloon moves pages
+    // on its own, stay.
+    find_pages_in_regions finder(regions, pages);
+    for (auto& v : vma_list) {
+        if (!dynamic_cast<anon_vma*>(&v) || !v.has_flags(mmap_movable) ||
+                v.has_flags(mmap_populate | mmap_stack | mmap_jvm_heap)) {
+            continue;
+        }
+        map_range(v.start(), v.start(), v.size(), finder);
+    }
+    // The page cache knows the ptes mapping its write cache pages
+    pagecache::for_each_write_page([&] (void* page) {
+        auto addr = virt_to_phys(page);
+        if (region_of(regions, addr) >= 0) {
+            pages.push_back({addr, nullptr});
+        }
+    });
+    trace_mmu_migrate_pages(regions.size(), pages.size());
+
+    std::sort(pages.begin(), pages.end(), [] (const found_page& a, const found_page& b) {
+        return a.addr < b.addr;
+    });
+    std::vector<unsigned> movable(regions.size());
+    for (auto i = pages.begin(); i != pages.end(); ++i) {
+        auto& n = movable[region_of(regions, i->addr)];
+        if (i != pages.begin() && i->addr == (i - 1)->addr) {
+            // Mapped twice, so we don't know who uses it: keep the region
+            n = pte_per_page + 1;
+        } else if (n <= pte_per_page) {
+            n++;
+        }
+    }
+    auto isolated = isolate(movable);
+
+    WITH_LOCK(page_migration_lock.for_write()) {
+        std::vector<pt_element<0>> old(pages.size());
+        bool flush = false;
+        for (size_t i = 0; i < pages.size(); i++) {
+            if (pages[i].ptep && isolated[region_of(regions, pages[i].addr)]) {
+                old[i] = clear_pte(hw_ptep<0>::force(pages[i].ptep));
+                flush = true;
+            }
+        }
+        if (flush) {
+            mmu::flush_tlb_all();
+        }
+        // The old pages stay where they are, as the regions they are in are
+        // about to be handed back to the page allocator in one piece
+        size_t moved = 0;
+        for (size_t i = 0; i < pages.size(); i++) {
+            if (pages[i].ptep && isolated[region_of(regions, pages[i].addr)]) {
+                void* page = memory::alloc_page();
+                memcpy(page, phys_to_virt(pages[i].addr), page_size);
+                write_pte(page, hw_ptep<0>::force(pages[i].ptep), old[i]);
+                moved++;
+            }
+        }
+        pagecache::move_write_pages([&] (void* page) {
+            auto r = region_of(regions, virt_to_phys(page));
+            if (r >= 0 && isolated[r]) {
+                moved++;
+                return true;
+            }
+            return false;
+        });
+        trace_mmu_migrate_pages_ret(regions.size(), moved);
+        return moved;
+    }
+}
+
+uintptr_t for_each_small_page(unsigned flags, uintptr_t start,
+        std::function<bool (uintptr_t addr, hw_ptep<0> ptep)> f)
+{
+    assert(mutex_owned(&vma_list_mutex));
+    small_page_visitor visitor(f);
+    auto i = vma_list.lower_bound(addr_range(start, start + 1), vma::addr_compare());
+    for (; i != vma_list.end(); ++i) {
+        if (!i->has_flags(flags)) {
+            continue;
+        }
+        // A huge page's worth at a time, so we don't walk much past where
+        // f() asked to stop
+        auto addr = std::max(start, i->start());
+        while (addr < i->end()) {
+            auto end = std::min(align_down(addr, huge_page_size) + huge_page_size, i->end());
+            map_range(0, addr, end - addr, visitor);
+            if (visitor.next()) {
+                return visitor.next();
+            }
+            addr = end;
+        }
+    }
+    return 0;
+}
+
 template<account_opt Account = account_opt::no>
 ulong populate_vma(vma *vma, void *v, size_t size, bool write = false)
 {
@@ -1090,11 +1360,20 @@ void* map_anon(const void* addr, size_t size, unsigned flags, unsigned perm)
     bool search = !(flags & mmap_fixed);
     size = align_up(size, mmu::page_size);
     auto start = reinterpret_cast<uintptr_t>(addr);
+    if (flags & mmap_stack) {
+        // Grows a page at a time, not a huge page
+        flags |= mmap_small;
+    }
     auto* vma = new mmu::anon_vma(addr_range(start, start + size), perm, flags);
     std::lock_guard<mutex> guard(vma_list_mutex);
     auto v = (void*) allocate(vma, start, size, search);
     if (flags & mmap_populate) {
         populate_vma(vma, v, size);
+    } else if (flags & mmap_stack) {
+        // A new thread starts out at the top of its stack with interrupts
+        // disabled, so it can't fault that in
+        auto top = std::min(size, stack_prefault_size);
+        populate_vma(vma, v + size - top, top);
     }
     return v;
 }
@@ -1283,6 +1562,12 @@ bool vma::has_flags(unsigned flag)
     return _flags & flag;
 }
 
+void vma::clear_flags(unsigned flag)
+{
+    assert(mutex_owned(&vma_list_mutex));
+    _flags &= ~flag;
+}
+
 template<typename T> ulong vma::operate_range(T mapper, void *addr, size_t size)
 {
     return mmu::operate_range(mapper, reinterpret_cast<void*>(start()), addr, size);
@@ -1342,6 +1627,7 @@ void anon_vma::split(uintptr_t edge)
         return;
     }
     vma* n = new anon_vma(addr_range(edge, _range.end()), _perm, _flags);
+    n->set_owner(_owner);
     set(_range.start(), edge);
     vma_list.insert(*n);
 }
@@ -1572,8 +1858,11 @@ void file_vma::fault(uintptr_t addr, exception_frame *ef)
         return;
     }
     size_t size;
-    if (!has_flags(mmap_small) && (hp_start <= addr && addr < hp_end) && offset(hp_end) < fsize) {
-        addr = align_down(addr, huge_page_size);
+    auto hp = align_down(addr, huge_page_size);
+    if (!has_flags(mmap_small) && (hp_start <= addr && addr < hp_end)
+            && offset(hp) + huge_page_size <= fsize
+            && !(offset(hp) & (huge_page_size - 1))) {
+        addr = hp;
         size = huge_page_size;
     } else {
         size = page_size;
@@ -1595,6 +1884,7 @@ void file_vma::split(uintptr_t edge)
     }
     auto off = offset(edge);
     vma *n = _file->mmap(addr_range(edge, _range.end()), _flags, _perm, off).release();
+    n->set_owner(_owner);
     set(_range.start(), edge);
     vma_list.insert(*n);
 }
@@ -1623,6 +1913,10 @@ int file_vma::validate_perm(unsigned perm)
         if (has_flags(mmap_shared) && !(_file->f_flags & FWRITE)) {
             return EACCES;
         }
+        auto shm = dynamic_cast<shm_file*>(_file.get());
+        if (has_flags(mmap_shared) && shm && (shm->seals() & F_SEAL_WRITE)) {
+            return EPERM;
+        }
     }
     // fail if prot asks for PROT_EXEC and the underlying FS was
     // mounted no-exec.
@@ -1639,30 +1933,144 @@ f_offset file_vma::offset(uintptr_t addr)
 
 std::unique_ptr<file_vma> shm_file::mmap(addr_range range, unsigned flags, unsigned perm, off_t offset)
 {
-    return map_file_mmap(this, range, flags, perm, offset);
+    if ((flags & mmap_shared) && (perm & perm_write) && (seals() & F_SEAL_WRITE)) {
+        throw make_error(EPERM);
+    }
+    auto vma = map_file_mmap(this, range, flags, perm, offset);
+    // Faulting in a huge page at a time takes one page table entry, and one
+    // TLB entry, for every 2MB instead of 512. Private mappings copy on
+    // write, which only small pages can.
+    if (flags & mmap_shared) {
+        vma->allow_huge_pages();
+    }
+    return vma;
+}
+
+// Holes in shm files read as zeros from these, shared by all files
+static void* shm_zero_page()
+{
+    static void* zero = [] {
+        auto p = memory::alloc_page();
+        memset(p, 0, page_size);
+        return p;
+    }();
+    return zero;
+}
+
+static void* shm_zero_huge_page()
+{
+    static void* zero = [] {
+        auto p = memory::alloc_huge_page(huge_page_size);
+        memset(p, 0, huge_page_size);
+        return p;
+    }();
+    return zero;
+}
+
+// Clears the ptes which map the zero pages, leaving the page tables
+// themselves alone: this can run from inside a fault on the same range.
+class clear_shm_zero_ptes :
+        public page_table_operation<allocate_intermediate_opt::no, skip_empty_opt::yes,
+        descend_opt::yes, once_opt::no, split_opt::no> {
+public:
+    bool page(hw_ptep<0> ptep, uintptr_t offset) {
+        return clear(ptep, shm_zero_page());
+    }
+    bool page(hw_ptep<1> ptep, uintptr_t offset) {
+        return clear(ptep, shm_zero_huge_page());
+    }
+    bool cleared() const { return _cleared; }
+private:
+    template<int N>
+    bool clear(hw_ptep<N> ptep, void* zero) {
+        if (ptep.read().addr() == virt_to_phys(zero)) {
+            clear_pte(ptep);
+            _cleared = true;
+        }
+        return true;
+    }
+    bool _cleared = false;
+};
+
+void* shm_file::find_page(uintptr_t hp_off)
+{
+    SCOPE_LOCK(_mutex);
+    auto p = _pages.find(hp_off);
+    return p == _pages.end() ? nullptr : p->second;
 }
 
+// Called with vma_list_mutex held, so that a new page can't race with a
+// read fault mapping the zero page in its place
 void* shm_file::page(uintptr_t hp_off)
 {
     void *addr;
+    bool zero_mapped;
 
-    auto p = _pages.find(hp_off);
-    if (p == _pages.end()) {
+    WITH_LOCK(_mutex) {
+        auto p = _pages.find(hp_off);
+        if (p != _pages.end()) {
+            return p->second;
+        }
         addr = memory::alloc_huge_page(huge_page_size);
         memset(addr, 0, huge_page_size);
         _pages.emplace(hp_off, addr);
-    } else {
-        addr = p->second;
+        zero_mapped = _zero_mapped.erase(hp_off);
+    }
+    if (zero_mapped) {
+        unmap_zero(hp_off);
     }
 
     return addr;
 }
 
+// Drops the zero page mappings of the hole at hp_off, now that it has a
+// page of its own; they fault in again to map that.
+void shm_file::unmap_zero(uintptr_t hp_off)
+{
+    clear_shm_zero_ptes op;
+    for (auto& v : vma_list) {
+        auto fv = dynamic_cast<file_vma*>(&v);
+        if (!fv || fv->file().get() != this) {
+            continue;
+        }
+        auto from = std::max(hp_off, uintptr_t(fv->offset()));
+        auto to = std::min(hp_off + huge_page_size, uintptr_t(fv->offset()) + v.size());
+        if (from < to) {
+            auto start = v.start() + (from - fv->offset());
+            map_range(v.start(), start, to - from, op);
+        }
+    }
+    if (op.cleared()) {
+        flush_tlb_all();
+    }
+}
+
 bool shm_file::map_page(uintptr_t offset, hw_ptep<0> ptep, pt_element<0> pte, bool write, bool shared)
 {
     uintptr_t hp_off = align_down(offset, huge_page_size);
 
-    return write_pte(static_cast<char*>(page(hp_off)) + offset - hp_off, ptep, pte);
+    if (write && !shared) {
+        // Copy on write: the file, which may be sealed, stays as it is
+        void* copy = memory::alloc_page();
+        auto addr = static_cast<char*>(find_page(hp_off));
+        if (addr) {
+            memcpy(copy, addr + offset - hp_off, page_size);
+        } else {
+            memset(copy, 0, page_size);
+        }
+        return write_pte(copy, ptep, pte);
+    }
+
+    void* addr = write ? page(hp_off) : find_page(hp_off);
+
+    if (!addr) {
+        WITH_LOCK(_mutex) {
+            _zero_mapped.insert(hp_off);
+        }
+        pte.set_writable(false);
+        return write_pte(shm_zero_page(), ptep, pte_mark_cow(pte, !shared));
+    }
+    return write_pte(static_cast<char*>(addr) + offset - hp_off, ptep, pte_mark_cow(pte, !shared));
 }
 
 bool shm_file::map_page(uintptr_t offset, hw_ptep<1> ptep, pt_element<1> pte, bool write, bool shared)
@@ -1670,18 +2078,220 @@ bool shm_file::map_page(uintptr_t offset, hw_ptep<1> ptep, pt_element<1> pte, bo
     uintptr_t hp_off = align_down(offset, huge_page_size);
 
     assert(hp_off == offset);
+    // See shm_file::mmap()
+    assert(shared);
+
+    void* addr = write ? page(hp_off) : find_page(hp_off);
+
+    if (!addr) {
+        WITH_LOCK(_mutex) {
+            _zero_mapped.insert(hp_off);
+        }
+        pte.set_writable(false);
+        return write_pte(shm_zero_huge_page(), ptep, pte);
+    }
+    return write_pte(addr, ptep, pte);
+}
+
+// The pages stay with the file until it's closed; only the mapping goes.
+// Private copies are freed by the caller.
+bool shm_file::put_page(void *addr, uintptr_t offset, hw_ptep<0> ptep)
+{
+    uintptr_t hp_off = align_down(offset, huge_page_size);
+    auto hp = static_cast<char*>(find_page(hp_off));
+
+    clear_pte(ptep);
+    return addr != shm_zero_page() && (!hp || addr != hp + offset - hp_off);
+}
+
+bool shm_file::put_page(void *addr, uintptr_t offset, hw_ptep<1> ptep)
+{
+    clear_pte(ptep);
+    return false;
+}
+
+shm_file::shm_file(size_t size, int flags, bool sealable)
+    : special_file(flags, DTYPE_UNSPEC), _size(size)
+    , _seals(sealable ? 0 : F_SEAL_SEAL) {}
+
+int shm_file::read(struct uio *uio, int flags)
+{
+    if ((flags & FOF_OFFSET) == 0) {
+        uio->uio_offset = f_offset;
+    }
+    auto start = uio->uio_offset;
+    while (uio->uio_resid) {
+        size_t size;
+        WITH_LOCK(_mutex) {
+            size = _size;
+        }
+        if (uio->uio_offset < 0 || size_t(uio->uio_offset) >= size) {
+            break;
+        }
+        uintptr_t off = uio->uio_offset;
+        auto hp_off = align_down(off, huge_page_size);
+        auto len = std::min({uio->uio_resid, ssize_t(size - off),
+                ssize_t(hp_off + huge_page_size - off)});
+        auto addr = static_cast<char*>(find_page(hp_off));
+        int error;
+        if (addr) {
+            error = uiomove(addr + off - hp_off, len, uio);
+        } else {
+            // A hole: no need to allocate a page to read zeros from
+            error = uiomove(shm_zero_page(), std::min(len, ssize_t(page_size)), uio);
+        }
+        if (error) {
+            return error;
+        }
+    }
+    if ((flags & FOF_OFFSET) == 0) {
+        f_offset += uio->uio_offset - start;
+    }
+    return 0;
+}
+
+int shm_file::write(struct uio *uio, int flags)
+{
+    if ((flags & FOF_OFFSET) == 0) {
+        uio->uio_offset = f_offset;
+    }
+    if (uio->uio_offset < 0) {
+        return EINVAL;
+    }
+    auto start = uio->uio_offset;
+    size_t end = uio->uio_offset + uio->uio_resid;
+    size_t old_size;
+    WITH_LOCK(_mutex) {
+        // A pending F_SEAL_WRITE goes first
+        _writers_cond.wait_until(_mutex, [&] { return !_write_sealers; });
+        if (_seals & F_SEAL_WRITE) {
+            return EPERM;
+        }
+        old_size = _size;
+        if (end > _size) {
+            if (_seals & F_SEAL_GROW) {
+                return EPERM;
+            }
+            _size = end;
+        }
+        // Keeps F_SEAL_WRITE out until the data is in
+        _writers++;
+    }
+    int error = 0;
+    while (uio->uio_resid) {
+        uintptr_t off = uio->uio_offset;
+        auto hp_off = align_down(off, huge_page_size);
+        auto len = std::min(uio->uio_resid, ssize_t(hp_off + huge_page_size - off));
+        auto addr = find_page(hp_off);
+        if (!addr) {
+            WITH_LOCK(vma_list_mutex) {
+                addr = page(hp_off);
+            }
+        }
+        error = uiomove(static_cast<char*>(addr) + off - hp_off, len, uio);
+        if (error) {
+            break;
+        }
+    }
+    WITH_LOCK(_mutex) {
+        // Grow the file only by what was written, unless it has been
+        // resized since
+        if (error && _size == end) {
+            _size = std::max(old_size, size_t(uio->uio_offset));
+        }
+        if (!--_writers) {
+            _writers_cond.wake_all();
+        }
+    }
+    if (error) {
+        return error;
+    }
+    if ((flags & FOF_OFFSET) == 0) {
+        f_offset += uio->uio_offset - start;
+    }
+    return 0;
+}
 
-    return write_pte(static_cast<char*>(page(hp_off)) + offset - hp_off, ptep, pte);
+int shm_file::truncate(off_t len)
+{
+    if (len < 0) {
+        return EINVAL;
+    }
+    SCOPE_LOCK(_mutex);
+    if (size_t(len) > _size && (_seals & F_SEAL_GROW)) {
+        return EPERM;
+    }
+    if (size_t(len) < _size) {
+        if (_seals & F_SEAL_SHRINK) {
+            return EPERM;
+        }
+        // The pages may still be mapped, so they are only cleared here, to
+        // read back as zeros if the file grows again, and freed on close
+        for (auto& i : _pages) {
+            auto hp_end = i.first + huge_page_size;
+            if (hp_end > size_t(len) && i.first < _size) {
+                auto from = std::max(i.first, size_t(len));
+                auto to = std::min(hp_end, _size);
+                memset(static_cast<char*>(i.second) + from - i.first, 0, to - from);
+            }
+        }
+    }
+    _size = len;
+    return 0;
 }
 
-bool shm_file::put_page(void *addr, uintptr_t offset, hw_ptep<0> ptep) {return false;}
-bool shm_file::put_page(void *addr, uintptr_t offset, hw_ptep<1> ptep) {return false;}
+int shm_file::add_seals(unsigned seals)
+{
+    if (seals & ~(F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)) {
+        return EINVAL;
+    }
+    if (seals & F_SEAL_WRITE) {
+        // Wait out the write()s copying in, holding off new ones. Not under
+        // vma_list_mutex, which their copying may fault and need.
+        WITH_LOCK(_mutex) {
+            _write_sealers++;
+            _writers_cond.wait_until(_mutex, [&] { return !_writers; });
+        }
+    }
+    auto sealed = defer([&] {
+        if (seals & F_SEAL_WRITE) {
+            WITH_LOCK(_mutex) {
+                if (!--_write_sealers) {
+                    _writers_cond.wake_all();
+                }
+            }
+        }
+    });
+    // vma_list_mutex first, as faults take the two
+    SCOPE_LOCK(vma_list_mutex);
+    SCOPE_LOCK(_mutex);
+    if (_seals & F_SEAL_SEAL) {
+        return EPERM;
+    }
+    if ((seals & F_SEAL_WRITE) && !(_seals & F_SEAL_WRITE)) {
+        for (auto& v : vma_list) {
+            auto fv = dynamic_cast<file_vma*>(&v);
+            if (fv && fv->file().get() == this && fv->has_flags(mmap_shared)
+                    && (fv->perm() & perm_write)) {
+                return EBUSY;
+            }
+        }
+    }
+    _seals |= seals;
+    return 0;
+}
 
-shm_file::shm_file(size_t size, int flags) : special_file(flags, DTYPE_UNSPEC), _size(size) {}
+unsigned shm_file::seals()
+{
+    SCOPE_LOCK(_mutex);
+    return _seals;
+}
 
 int shm_file::stat(struct stat* buf)
 {
+    SCOPE_LOCK(_mutex);
     buf->st_size = _size;
+    buf->st_blksize = huge_page_size;
     return 0;
 }
 
@@ -1691,6 +2301,7 @@ int shm_file::close()
         memory::free_huge_page(i.second, huge_page_size);
     }
     _pages.clear();
+    _zero_mapped.clear();
     return 0;
 }
 
@@ -1732,6 +2343,47 @@ error munmap(const void *addr, size_t length)
     return no_error();
 }
 
+void set_unmovable(const void* addr, size_t size)
+{
+    std::lock_guard<mutex> guard(vma_list_mutex);
+
+    auto start = align_down(reinterpret_cast<uintptr_t>(addr), page_size);
+    auto end = align_up(reinterpret_cast<uintptr_t>(addr) + size, page_size);
+    auto range = vma_list.equal_range(addr_range(start, end), vma::addr_compare());
+    for (auto i = range.first; i != range.second; ++i) {
+        i->clear_flags(mmap_movable);
+    }
+}
+
+void set_owner(const void* addr, size_t size, unsigned long owner)
+{
+    std::lock_guard<mutex> guard(vma_list_mutex);
+
+    auto start = reinterpret_cast<uintptr_t>(addr);
+    auto range = vma_list.equal_range(addr_range(start, start + size), vma::addr_compare());
+    for (auto i = range.first; i != range.second; ++i) {
+        i->set_owner(owner);
+    }
+}
+
+int unmap_owned(unsigned long owner)
+{
+    std::lock_guard<mutex> guard(vma_list_mutex);
+
+    std::vector<addr_range> owned;
+    for (auto& v : vma_list) {
+        if (v.owner() == owner) {
+            owned.push_back(addr_range(v.start(), v.end()));
+        }
+    }
+    for (auto& r : owned) {
+        auto addr = reinterpret_cast<void*>(r.start());
+        sync(addr, r.end() - r.start(), 0);
+        unmap(addr, r.end() - r.start());
+    }
+    return owned.size();
+}
+
 error msync(const void* addr, size_t length, int flags)
 {
     std::lock_guard<mutex> guard(vma_list_mutex);
@@ -46,7 +46,7 @@ void net_channel::wake_pollers()
             for (pollreq* pr : *pl) {
                 // net_channel is self synchronizing
                 pr->_awake.store(true, std::memory_order_relaxed);
-                pr->_poll_thread.wake();
+                pr->wake();
             }
         }
         // can't call epoll_wake from rcu, so copy the data
@@ -10,6 +10,7 @@
 #include <unordered_set>
 #include <deque>
 #include <stack>
+#include <vector>
 #include <boost/variant.hpp>
 #include <osv/pagecache.hh>
 #include <osv/mempool.hh>
@@ -173,6 +174,13 @@ public:
     int flush() {
         return for_each_pte([] (mmu::hw_ptep<0> pte) { mmu::clear_pte(pte); return 1;});
     }
+    // Clears and forgets all the ptes mapping the page; returns whether the
+    // page was dirtied through them.
+    bool unmap_all() {
+        bool dirty = for_each_pte([] (mmu::hw_ptep<0> pte) { return mmu::clear_pte(pte).dirty(); }, std::logical_or<bool>(), false);
+        _ptes = nullptr;
+        return dirty;
+    }
     int clear_accessed() {
         return for_each_pte([] (mmu::hw_ptep<0> pte) -> int { return mmu::clear_accessed(pte); });
     }
@@ -226,6 +234,12 @@ public:
     void mark_dirty() {
         _dirty |= true;
     }
+    // Moves the contents to another page, for memory compaction; the old
+    // page is left to the caller.
+    void move(void* page) {
+        memcpy(page, _page, mmu::page_size);
+        _page = page;
+    }
     bool flush_check_dirty() {
         return for_each_pte([] (mmu::hw_ptep<0> pte) { return mmu::clear_pte(pte).dirty(); }, std::logical_or<bool>(), false);
     }
@@ -529,6 +543,38 @@ void sync(vfs_file* fp, off_t start, off_t end)
     }
 }
 
+void for_each_write_page(std::function<void (void* page)> f)
+{
+    for (auto&& p : write_cache) {
+        f(p.second->addr());
+    }
+}
+
+TRACEPOINT(trace_move_write_page, "addr=%p", void*);
+void move_write_pages(std::function<bool (void* page)> move)
+{
+    std::vector<cached_page_write*> moving;
+    for (auto&& p : write_cache) {
+        auto cp = p.second;
+        if (move(cp->addr())) {
+            // No need to remap: the next fault on the page will find its
+            // new location in the write cache
+            if (cp->unmap_all()) {
+                cp->mark_dirty();
+            }
+            moving.push_back(cp);
+        }
+    }
+    if (moving.empty()) {
+        return;
+    }
+    mmu::flush_tlb_all();
+    for (auto cp : moving) {
+        trace_move_write_page(cp->addr());
+        cp->move(memory::alloc_page());
+    }
+}
+
 TRACEPOINT(trace_access_scanner, "scanned=%u, cleared=%u, %%cpu=%g", unsigned, unsigned, double);
 static class access_scanner {
     static constexpr double _max_cpu = 20;
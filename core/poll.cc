@@ -175,7 +175,7 @@ int poll_wake(struct file* fp, int events)
     for (auto&& pl : fp->f_poll_list) {
         if (pl._events & events) {
             pl._req->_awake.store(true, memory_order_relaxed);
-            pl._req->_poll_thread.wake();
+            pl._req->wake();
         }
     }
 
@@ -271,11 +271,14 @@ void poll_uninstall(struct pollreq* p)
     } /* End of clearing pollreq references from the other fds */
 }
 
-int do_poll(std::vector<poll_file>& pfd, file::timeout_t _timeout)
+// Waiter is sched::thread, or osv::fiber when polling from a fiber: the
+// fiber parks and its carrier thread goes on running other fibers.
+template <class Waiter, class Timer>
+static int do_poll(std::vector<poll_file>& pfd, file::timeout_t _timeout)
 {
     int nr_events;
     unique_ptr<pollreq> p{new pollreq};
-    sched::timer tmr(*sched::thread::current());
+    Timer tmr(*Waiter::current());
 
     p->_nfds = pfd.size();
     p->_pfd = std::move(pfd);
@@ -303,7 +306,7 @@ int do_poll(std::vector<poll_file>& pfd, file::timeout_t _timeout)
 
     /* Block  */
     do {
-        sched::thread::wait_until([&] {
+        Waiter::wait_until([&] {
             return p->_awake.load(memory_order_relaxed) || tmr.expired();
         });
 
@@ -320,10 +323,19 @@ int do_poll(std::vector<poll_file>& pfd, file::timeout_t _timeout)
     pfd = std::move(p->_pfd);
 out:
     p->_poll_thread.clear();
+    p->_poll_fiber.clear();
     osv::rcu_dispose(p.release());
     return nr_events;
 }
 
+int do_poll(std::vector<poll_file>& pfd, file::timeout_t _timeout)
+{
+    if (osv::fiber::current()) {
+        return do_poll<osv::fiber, osv::fiber::timer>(pfd, _timeout);
+    }
+    return do_poll<sched::thread, sched::timer>(pfd, _timeout);
+}
+
 int file::poll_many(struct pollfd _pfd[], nfds_t _nfds, timeout_t timeout)
 {
     std::vector<poll_file> pfd;
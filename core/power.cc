@@ -15,6 +15,7 @@
 extern "C" {
 #include "acpi.h"
 }
+#include "drivers/acpi.hh"
 #endif /* !AARCH64_PORT_STUB */
 
 namespace osv {
@@ -38,6 +39,10 @@ void halt(void)
 void poweroff(void)
 {
 #ifndef AARCH64_PORT_STUB
+    // \_S5 is looked up in the namespace
+    if (!acpi::load_namespace()) {
+        halt();
+    }
     ACPI_STATUS status = AcpiEnterSleepStatePrep(ACPI_STATE_S5);
     if (ACPI_FAILURE(status)) {
         debug("AcpiEnterSleepStatePrep failed: %s\n", AcpiFormatException(status));
@@ -13,6 +13,7 @@
 #include <osv/debug.hh>
 #include <osv/irqlock.hh>
 #include <osv/align.hh>
+#include <osv/mmu-defs.hh>
 
 #ifndef AARCH64_PORT_STUB
 #include <osv/interrupt.hh>
@@ -60,6 +61,8 @@ TRACEPOINT(trace_sched_wake, "wake %p", thread*);
 TRACEPOINT(trace_sched_migrate, "thread=%p cpu=%d", thread*, unsigned);
 TRACEPOINT(trace_sched_queue, "thread=%p", thread*);
 TRACEPOINT(trace_sched_preempt, "");
+TRACEPOINT(trace_sched_rt_throttle, "cpu=%d", unsigned);
+TRACEPOINT(trace_sched_set_realtime, "thread=%p policy=%d priority=%d", thread*, unsigned, unsigned);
 TRACEPOINT(trace_timer_set, "timer=%p time=%d", timer_base*, s64);
 TRACEPOINT(trace_timer_reset, "timer=%p time=%d", timer_base*, s64);
 TRACEPOINT(trace_timer_cancel, "timer=%p", timer_base*);
@@ -74,6 +77,27 @@ cpu __thread * current_cpu;
 unsigned __thread preempt_counter = 1;
 bool __thread need_reschedule = false;
 
+__thread lazy_stack_state lazy_stack;
+
+// Runs with preemption and interrupts still enabled, so the reads below
+// can fault the pages in
+void lazy_stack_fault_in(uintptr_t sp)
+{
+    if (sp < lazy_stack.bottom || sp >= lazy_stack.top) {
+        // Not on the thread's own stack (e.g. on a makecontext() one),
+        // whose extent we don't know
+        arch::ensure_next_stack_page();
+        return;
+    }
+    auto want = std::max(align_down(sp - lazy_stack_depth, mmu::page_size),
+            lazy_stack.bottom);
+    for (auto p = lazy_stack.low; p > want; ) {
+        p -= mmu::page_size;
+        *reinterpret_cast<volatile char*>(p);
+    }
+    lazy_stack.low = want;
+}
+
 elf::tls_data tls;
 
 #ifndef AARCH64_PORT_STUB
@@ -255,6 +279,10 @@ void cpu::reschedule_from_interrupt()
     assert(sched::exception_depth <= 1);
     need_reschedule = false;
     handle_incoming_wakeups();
+    if (realtime_update_pending.load(std::memory_order_relaxed) &&
+            realtime_update_pending.exchange(false)) {
+        update_queued_realtime();
+    }
 
     auto now = osv::clock::uptime::now();
     auto interval = now - running_since;
@@ -272,39 +300,39 @@ void cpu::reschedule_from_interrupt()
 
     p->_total_cpu_time += interval;
     p->_runtime.ran_for(interval);
+    account_realtime(p, interval, now);
+    // p isn't on the runqueue now, so we may change its real-time priority
+    p->update_realtime();
 
     if (p_status == thread::status::running) {
-        // The current thread is still runnable. Check if it still has the
-        // lowest runtime, and update the timer until the next thread's turn.
-        if (runqueue.empty()) {
+        // The current thread is still runnable. Check if it should still
+        // run, and update the timer until the next thread's turn.
+        auto t = next_queued();
+        if (!t) {
             preemption_timer.cancel();
             return;
         } else {
-            auto &t = *runqueue.begin();
-            if (p->_runtime.get_local() < t._runtime.get_local()) {
-                preemption_timer.cancel();
-                auto delta = p->_runtime.time_until(t._runtime.get_local());
-                if (delta > 0) {
-                    preemption_timer.set(now + delta);
-                }
+            if (keeps_running(*p, *t)) {
+                p->_realtime.yielded = false;
+                set_preemption_timer(*p, *t, now);
                 return;
             }
         }
-        // If we're here, p no longer has the lowest runtime. Before queuing
-        // p, return the runtime it borrowed for hysteresis.
+        // If we're here, p should no longer run. Before queuing p, return
+        // the runtime it borrowed for hysteresis.
         p->_runtime.hysteresis_run_stop();
         p->_detached_state->st.store(thread::status::queued);
-        enqueue(*p);
+        requeue_preempted(*p);
         trace_sched_preempt();
     } else {
         // p is no longer running, so we'll switch to a different thread.
         // Return the runtime p borrowed for hysteresis.
         p->_runtime.hysteresis_run_stop();
+        p->_realtime.yielded = false;
     }
 
-    auto ni = runqueue.begin();
-    auto n = &*ni;
-    runqueue.erase(ni);
+    auto n = next_queued();
+    runqueue.erase(runqueue.iterator_to(*n));
     n->cputime_estimator_set(now, n->_total_cpu_time);
     assert(n->_detached_state->st.load() == thread::status::queued);
     trace_sched_switch(n, p->_runtime.get_local(), n->_runtime.get_local());
@@ -318,12 +346,8 @@ void cpu::reschedule_from_interrupt()
         n->_runtime.add_context_switch_penalty();
     }
     preemption_timer.cancel();
-    if (!runqueue.empty()) {
-        auto& t = *runqueue.begin();
-        auto delta = n->_runtime.time_until(t._runtime.get_local());
-        if (delta > 0) {
-            preemption_timer.set(now + delta);
-        }
+    if (auto t = next_queued()) {
+        set_preemption_timer(*n, *t, now);
     }
     n->switch_to();
     if (p->_detached_state->_cpu->terminating_thread) {
@@ -332,6 +356,143 @@ void cpu::reschedule_from_interrupt()
     }
 }
 
+// Returns the queued thread which should run next, or nullptr if the
+// runqueue is empty.
+thread* cpu::next_queued()
+{
+    if (runqueue.empty()) {
+        return nullptr;
+    }
+    auto& top = *runqueue.begin();
+    if (!rt_throttled || !top._realtime.priority) {
+        return &top;
+    }
+    // While throttled, real-time threads compete with the fair-share ones by
+    // runtime. They are all at the head of the runqueue, so we only need to
+    // look at them and at the first fair-share thread.
+    thread* best = &top;
+    for (auto& t : runqueue) {
+        if (t._runtime.get_local() < best->_runtime.get_local()) {
+            best = &t;
+        }
+        if (!t._realtime.priority) {
+            break;
+        }
+    }
+    return best;
+}
+
+// Move queued threads whose real-time priority was changed by another cpu
+// (see thread::request_realtime_update()) to their new place.
+void cpu::update_queued_realtime()
+{
+    for (auto i = runqueue.begin(); i != runqueue.end(); ) {
+        auto& t = *i;
+        if (!t.realtime_changed()) {
+            ++i;
+            continue;
+        }
+        i = runqueue.erase(i);
+        t.update_realtime();
+        // If t moved further back, we'll meet it again, unchanged.
+        enqueue(t);
+    }
+}
+
+// Whether the running thread p should keep running, rather than switch to
+// the queued thread t returned by next_queued().
+bool cpu::keeps_running(thread& p, thread& t)
+{
+    if (!rt_throttled) {
+        auto pp = p._realtime.priority;
+        auto tp = t._realtime.priority;
+        if (pp != tp) {
+            return pp > tp;
+        }
+        if (pp) {
+            if (p._realtime.yielded) {
+                return false;
+            }
+            return p._realtime.policy != thread::realtime_policy::rr ||
+                   p._realtime.slice_used < thread::realtime_rr_slice;
+        }
+    }
+    return p._runtime.get_local() < t._runtime.get_local();
+}
+
+// Queue the running thread p after deciding to switch away from it.
+void cpu::requeue_preempted(thread& p)
+{
+    auto& rt = p._realtime;
+    if (rt.priority && !rt.yielded && !rt_throttled &&
+            (rt.policy != thread::realtime_policy::rr ||
+             rt.slice_used < thread::realtime_rr_slice)) {
+        // Preempted by a higher priority thread: like POSIX says, it goes
+        // back to the head of the list of threads of its priority.
+        trace_sched_queue(&p);
+        runqueue.insert_before(runqueue.lower_bound(p), p);
+        return;
+    }
+    rt.slice_used = thread_runtime::duration(0);
+    rt.yielded = false;
+    enqueue(p);
+}
+
+void cpu::account_realtime(thread* p, thread_runtime::duration interval,
+        osv::clock::uptime::time_point now)
+{
+    if (p->_realtime.priority) {
+        p->_realtime.slice_used += interval;
+        if (!rt_throttled) {
+            rt_used += interval;
+            if (rt_used >= thread::realtime_runtime) {
+                rt_throttled = true;
+                trace_sched_rt_throttle(id);
+            }
+        }
+    }
+    if (now >= rt_period_end) {
+        rt_period_end = now + thread::realtime_period;
+        rt_used = thread_runtime::duration(0);
+        rt_throttled = false;
+    }
+}
+
+// Arm the preemption timer for when the running thread n should give way
+// to the queued thread t returned by next_queued().
+void cpu::set_preemption_timer(thread& n, thread& t,
+        osv::clock::uptime::time_point now)
+{
+    preemption_timer.cancel();
+    auto when = osv::clock::uptime::time_point::max();
+    if (n._realtime.priority && !rt_throttled) {
+        // A real-time thread isn't preempted by runtime, only when its
+        // round-robin slice runs out, or when the cpu's real-time budget
+        // does while fair-share threads are waiting.
+        if (n._realtime.policy == thread::realtime_policy::rr &&
+                t._realtime.priority == n._realtime.priority) {
+            when = now + (thread::realtime_rr_slice - n._realtime.slice_used);
+        }
+        if (!runqueue.rbegin()->_realtime.priority) {
+            when = std::min(when,
+                    now + (thread::realtime_runtime - rt_used));
+        }
+    } else {
+        auto delta = n._runtime.time_until(t._runtime.get_local());
+        if (delta > 0) {
+            when = now + delta;
+        }
+        if (rt_throttled) {
+            // Let the real-time threads take over again when the next
+            // period starts.
+            when = std::min(when, rt_period_end);
+        }
+    }
+    if (when != osv::clock::uptime::time_point::max()) {
+        preemption_timer.set(when);
+    }
+}
+
 void cpu::timer_fired()
 {
     // nothing to do, preemption will happen if needed
@@ -429,6 +590,7 @@ void cpu::handle_incoming_wakeups()
                     // local value when waking up after a CPU migration, or to
                     // perform renormalizations which we missed while sleeping.
                     t._runtime.update_after_sleep();
+                    t.update_realtime();
                     enqueue(t);
                     t.resume_timers();
                 }
@@ -464,8 +626,19 @@ void cpu::load_balance()
         if (runqueue.empty()) {
             continue;
         }
+        // Don't migrate threads to a vCPU the hypervisor has descheduled,
+        // they would not run until the host schedules it back.
         auto min = *std::min_element(cpus.begin(), cpus.end(),
-                [](cpu* c1, cpu* c2) { return c1->load() < c2->load(); });
+                [](cpu* c1, cpu* c2) {
+                    bool p1 = c1->arch.preempted(), p2 = c2->arch.preempted();
+                    if (p1 != p2) {
+                        return p2;
+                    }
+                    return c1->load() < c2->load();
+                });
+        if (min->arch.preempted()) {
+            continue;
+        }
         if (min == this) {
             continue;
         }
@@ -542,7 +715,13 @@ void thread::yield()
     if (tnext.priority() == thread::priority_idle) {
         return;
     }
-    t->_runtime.set_local(tnext._runtime);
+    if (t->_realtime.priority) {
+        // A real-time thread only yields to queued threads of its own
+        // priority, by going to the back of their list.
+        t->_realtime.yielded = true;
+    } else {
+        t->_runtime.set_local(tnext._runtime);
+    }
     // Note that reschedule_from_interrupt will further increase t->_runtime
     // by thyst, giving the other thread 2*thyst to run before going back to t
     t->_detached_state->_cpu->reschedule_from_interrupt();
@@ -550,12 +729,170 @@ void thread::yield()
 
 void thread::set_priority(float priority)
 {
-    _runtime.set_priority(priority);
+    _base_priority = priority;
+    _runtime.set_priority(std::min(priority,
+            _pi_boost.load(std::memory_order_relaxed).priority));
 }
 
 float thread::priority() const
 {
-    return _runtime.priority();
+    return _base_priority;
+}
+
+constexpr thread_runtime::duration thread::realtime_rr_slice;
+constexpr thread_runtime::duration thread::realtime_period;
+constexpr thread_runtime::duration thread::realtime_runtime;
+
+void thread::set_realtime(realtime_policy policy, unsigned priority)
+{
+    if (policy == realtime_policy::none) {
+        priority = 0;
+    } else {
+        assert(priority >= 1 && priority <= realtime_priority_max);
+    }
+    trace_sched_set_realtime(this, unsigned(policy), priority);
+    _realtime_request.store(unsigned(policy) << 16 | priority,
+            std::memory_order_relaxed);
+    request_realtime_update();
+}
+
+// Have the scheduler of the thread's cpu apply a change to its real-time
+// policy or priority. Threads which aren't queued or running pick up the
+// change when they are woken.
+void thread::request_realtime_update()
+{
+    if (this == current()) {
+        // We may have lowered our priority below a queued thread's
+        WITH_LOCK(preempt_lock) {
+            need_reschedule = true;
+        }
+        return;
+    }
+    WITH_LOCK(rcu_read_lock) {
+        auto c = _detached_state->_cpu;
+        if (!c) {
+            return; // not started yet
+        }
+        c->realtime_update_pending.store(true);
+        if (c == cpu::current()) {
+            need_reschedule = true;
+        } else {
+            c->send_wakeup_ipi();
+        }
+    }
+}
+
+thread::realtime_policy thread::get_realtime_policy() const
+{
+    return realtime_policy(_realtime_request.load(std::memory_order_relaxed) >> 16);
+}
+
+unsigned thread::realtime_priority() const
+{
+    return _realtime_request.load(std::memory_order_relaxed) & 0xffff;
+}
+
+// Must be called by the scheduler of the thread's cpu, while the thread is
+// not on the runqueue.
+// The real-time policy and priority the thread should have: the requested
+// ones, possibly raised by priority inheritance.
+void thread::effective_realtime(realtime_policy& policy, unsigned& priority) const
+{
+    auto req = _realtime_request.load(std::memory_order_relaxed);
+    policy = realtime_policy(req >> 16);
+    priority = req & 0xffff;
+    auto inherited = _pi_boost.load(std::memory_order_relaxed).realtime;
+    if (inherited > priority) {
+        priority = inherited;
+        if (policy == realtime_policy::none) {
+            policy = realtime_policy::fifo;
+        }
+    }
+}
+
+// The fair-share priority the thread should run at: its own, possibly
+// raised (lowered, in value) by priority inheritance.
+float thread::effective_priority() const
+{
+    return std::min(_base_priority,
+            _pi_boost.load(std::memory_order_relaxed).priority);
+}
+
+void thread::update_realtime()
+{
+    realtime_policy policy;
+    unsigned priority;
+    effective_realtime(policy, priority);
+    if (policy != _realtime.policy || priority != _realtime.priority) {
+        _realtime.policy = policy;
+        _realtime.priority = priority;
+        _realtime.slice_used = thread_runtime::duration(0);
+    }
+    _runtime.set_priority(effective_priority());
+}
+
+bool thread::realtime_changed() const
+{
+    realtime_policy policy;
+    unsigned priority;
+    effective_realtime(policy, priority);
+    return policy != _realtime.policy || priority != _realtime.priority ||
+           _runtime.priority() != effective_priority();
+}
+
+thread::pi_boost thread::pi_state() const
+{
+    return _pi_boost.load(std::memory_order_acquire);
+}
+
+// Called by a thread about to wait for a priority-inheritance mutex which
+// "this" thread held after "seen" was read. The caller must hold
+// rcu_read_lock, which keeps us from being destroyed (see ~thread()).
+// We only post the boost; our cpu's scheduler applies it, as we may be
+// running there.
+void thread::inherit_priority(const thread& from, pi_boost seen)
+{
+    auto want = seen;
+    want.priority = std::min(seen.priority, from._runtime.priority());
+    want.realtime = std::max<unsigned>(seen.realtime, from._realtime.priority);
+    while (want.priority != seen.priority || want.realtime != seen.realtime) {
+        // Fails for good if pi_released() moved us to a new epoch: the
+        // mutex was released, and the boost is no longer due.
+        if (_pi_boost.compare_exchange_weak(seen, want)) {
+            request_realtime_update();
+            return;
+        }
+        if (seen.epoch != want.epoch) {
+            return;
+        }
+        want.priority = std::min(seen.priority, want.priority);
+        want.realtime = std::max(seen.realtime, want.realtime);
+    }
+}
+
+void thread::pi_acquired()
+{
+    _pi_used = true;
+    ++_pi_held;
+}
+
+void thread::pi_released()
+{
+    assert(_pi_held);
+    if (--_pi_held) {
+        return;
+    }
+    auto old = _pi_boost.load(std::memory_order_relaxed);
+    pi_boost none { priority_idle, u16(old.epoch + 1), 0 };
+    // Release, so that a waiter which sees the new epoch also sees that
+    // we no longer own the mutex.
+    while (!_pi_boost.compare_exchange_weak(old, none,
+            std::memory_order_release, std::memory_order_relaxed)) {
+        none.epoch = old.epoch + 1;
+    }
+    if (old.priority != priority_idle || old.realtime) {
+        request_realtime_update();
+    }
 }
 
 thread::stack_info::stack_info()
@@ -728,9 +1065,13 @@ thread::thread(std::function<void ()> func, attr attr, bool main)
         remote_thread_local_var(s_current) = this;
 
         const auto& app = application::get_current();
-        if (app) {
-            _func = [app, func] {
+        if (app && _attr._app) {
+            // Counted in now, so the application can't be restarted (and
+            // unloaded) before we get to run and adopt it.
+            auto counted = app->count_new_thread();
+            _func = [app, counted, func] () mutable {
                 app->adopt_current();
+                counted.reset();
                 func();
             };
         }
@@ -790,6 +1131,11 @@ thread::~thread()
     if (!_attr._detached) {
         join();
     }
+    if (_pi_used) {
+        // A thread waiting for a mutex we held may still be inheriting its
+        // priority to us, see inherit_priority().
+        osv::rcu_synchronize();
+    }
     WITH_LOCK(thread_map_mutex) {
         thread_map.erase(_id);
         total_app_time_exited += _total_cpu_time;
@@ -963,6 +1309,12 @@ void thread::stop_wait()
 void thread::complete()
 {
     run_exit_notifiers();
+    // Only now, as the notifiers may run application code (e.g., TSD
+    // destructors), which application::restart() unloads once we leave.
+    // Scoped, so the reference is dropped before this thread stops running.
+    if (auto app = application::get_current()) {
+        app->abandon_current();
+    }
 
     auto value = detach_state::attached;
     _detach_state.compare_exchange_strong(value, detach_state::attached_complete);
@@ -8,14 +8,40 @@
 #include <osv/spinlock.h>
 #include <osv/sched.hh>
 
+static inline void set_owner(spinlock_t *sl)
+{
+    // Preemption is disabled while the lock is held, so we can't migrate
+    // away from this cpu until spin_unlock().
+    auto c = sched::cpu::current();
+    sl->_owner = c ? c->id + 1 : 0;
+}
+
+// Spinning on a lock whose holder's vCPU was descheduled by the hypervisor
+// is useless until the holder runs again, so ask the hypervisor to run it.
+static void spin_wait_owner(spinlock_t *sl)
+{
+    unsigned owner = *static_cast<volatile unsigned char*>(&sl->_owner);
+    if (owner && owner <= sched::cpus.size()) {
+        auto c = sched::cpus[owner - 1];
+        if (c->arch.preempted()) {
+            c->arch.yield_to();
+        }
+    }
+}
+
 void spin_lock(spinlock_t *sl)
 {
     sched::preempt_disable();
     while (__sync_lock_test_and_set(&sl->_lock, 1)) {
+        unsigned spins = 0;
         while (sl->_lock) {
             barrier();
+            if (++spins % 1024 == 0) {
+                spin_wait_owner(sl);
+            }
         }
     }
+    set_owner(sl);
 }
 
 bool spin_trylock(spinlock_t *sl)
@@ -25,11 +51,13 @@ bool spin_trylock(spinlock_t *sl)
         sched::preempt_enable();
         return false;
     }
+    set_owner(sl);
     return true;
 }
 
 void spin_unlock(spinlock_t *sl)
 {
+    sl->_owner = 0;
     __sync_lock_release(&sl->_lock, 0);
     sched::preempt_enable();
 }
@@ -374,6 +374,7 @@ extern "C" void __cyg_profile_func_enter(void *this_fn, void *call_site)
     }
     arch::irq_flag_notrace irq;
     irq.save();
+    trace_ensure_stack(irq);
     arch::irq_disable_notrace();
     if (func_trace_nesting++ == 0) {
         trace_function_entry(this_fn, call_site);
@@ -389,6 +390,7 @@ extern "C" void __cyg_profile_func_exit(void *this_fn, void *call_site)
     }
     arch::irq_flag_notrace irq;
     irq.save();
+    trace_ensure_stack(irq);
     arch::irq_disable_notrace();
     if (func_trace_nesting++ == 0) {
         trace_function_exit(this_fn, call_site);
@@ -666,6 +668,7 @@ trace::create_trace_dump()
         sched::thread t([&, i]() {
             arch::irq_flag_notrace irq;
             irq.save();
+            trace_ensure_stack(irq);
             arch::irq_disable_notrace();
             auto * tbp = percpu_trace_buffer.for_cpu(cpu);
             copies.emplace_back(*tbp);
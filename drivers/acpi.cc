@@ -30,6 +30,10 @@ extern "C" {
 #include <osv/interrupt.hh>
 
 #include <osv/prio.hh>
+#include <osv/boot.hh>
+#include "drivers/pvpanic.hh"
+
+extern boot_time_chart boot_time;
 
 #define acpi_tag "acpi"
 #define acpi_d(...)   tprintf_d(acpi_tag, __VA_ARGS__)
@@ -539,6 +543,9 @@ namespace acpi {
 
 static ACPI_TABLE_DESC TableArray[ACPI_MAX_INIT_TABLES];
 
+// Boot only needs the static tables: the MADT for the cpus, and the HPET and
+// MCFG tables. Building the namespace means interpreting all of the DSDT's
+// AML, which few guests ever use, so it is left to load_namespace().
 void early_init()
 {
     ACPI_STATUS status;
@@ -548,41 +555,44 @@ void early_init()
         acpi_e("AcpiInitializeTables failed: %s\n", AcpiFormatException(status));
         return;
     }
+    boot_time.event("ACPI tables");
+}
+
+UINT32 acpi_poweroff(void *unused)
+{
+    osv::shutdown();
+    return 1;
+}
+
+enum class namespace_state { unloaded, loaded, failed };
+static mutex namespace_mutex;
+static namespace_state ns_state = namespace_state::unloaded;
+
+// The following function comes from the documentation example page 262
+static bool do_load_namespace()
+{
+    ACPI_STATUS status;
 
     // Initialize ACPICA subsystem
     status = AcpiInitializeSubsystem();
     if (ACPI_FAILURE(status)) {
         acpi_e("AcpiInitializeSubsystem failed: %s\n", AcpiFormatException(status));
-        return;
+        return false;
     }
 
     // Copy the root table list to dynamic memory
     status = AcpiReallocateRootTable();
     if (ACPI_FAILURE(status)) {
         acpi_e("AcpiReallocateRootTable failed: %s\n", AcpiFormatException(status));
-        return;
+        return false;
     }
 
     // Create the ACPI namespace from ACPI tables
     status = AcpiLoadTables();
     if (ACPI_FAILURE(status)) {
         acpi_e("AcpiLoadTables failed: %s\n", AcpiFormatException(status));
-        return;
+        return false;
     }
-}
-
-UINT32 acpi_poweroff(void *unused)
-{
-    osv::shutdown();
-    return 1;
-}
-
-// must be called after the scheduler, apic and smp where started to run
-// The following function comes from the documentation example page 262
-void init()
-{
-    ACPI_STATUS status;
-
 
     // TODO: Installation of Local handlers
 
@@ -590,7 +600,7 @@ void init()
     status = AcpiEnableSubsystem(ACPI_FULL_INITIALIZATION);
     if (ACPI_FAILURE(status)) {
         acpi_e("AcpiEnableSubsystem failed: %s\n", AcpiFormatException(status));
-        return;
+        return false;
     }
 
     // Complete the ACPI namespace object initialization
@@ -601,6 +611,32 @@ void init()
 
     AcpiInstallFixedEventHandler(ACPI_EVENT_POWER_BUTTON, acpi_poweroff, nullptr);
     AcpiEnableEvent(ACPI_EVENT_POWER_BUTTON, 0);
+    return true;
+}
+
+bool load_namespace()
+{
+    SCOPE_LOCK(namespace_mutex);
+    if (ns_state == namespace_state::unloaded) {
+        auto t0 = clock::get()->uptime();
+        ns_state = do_load_namespace() ? namespace_state::loaded : namespace_state::failed;
+        acpi_i("namespace loaded in %d ms\n",
+                int((clock::get()->uptime() - t0) / 1000000));
+    }
+    return ns_state == namespace_state::loaded;
+}
+
+// must be called after the scheduler, apic and smp where started to run
+void init()
+{
+    // Boot goes on while the namespace loads, for the power button and
+    // pvpanic; anything else needing it waits in load_namespace()
+    auto t = new sched::thread([] {
+        if (load_namespace()) {
+            panic::pvpanic::probe_and_setup();
+        }
+    }, sched::thread::attr().detached().name("acpi"));
+    t->start();
 }
 
 }
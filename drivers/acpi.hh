@@ -12,6 +12,9 @@
 namespace acpi {
 
 void init();
+// Loads the ACPI namespace, unless it already is, and returns whether it is
+// usable
+bool load_namespace();
 
 }
 
@@ -138,9 +138,10 @@ void port::setup()
 
 void port::enable_irq()
 {
-    // Enable Device to Host Register FIS interrupt
+    // Enable Device to Host Register FIS interrupt, and Set Device Bits
+    // FIS interrupt, with which queued commands complete
     auto val = port_readl(PORT_IE);
-    val |= PORT_IE_DHRE;
+    val |= PORT_IE_DHRE | PORT_IE_SDBE;
     port_writel(PORT_IE, val);
 }
 
@@ -164,7 +165,7 @@ void port::wait_ci_ready(u8 slot)
     }
 }
 
-int port::send_cmd(u8 slot, int iswrite, void *buffer, u32 bsize)
+int port::send_cmd(u8 slot, int iswrite, void *buffer, u32 bsize, bool queued)
 {
     u32 flags;
 
@@ -192,15 +193,20 @@ int port::send_cmd(u8 slot, int iswrite, void *buffer, u32 bsize)
         _cmd_table[slot].prdt[0].flags = bsize - 1;
     }
 
-    // Use _cmd_lock to close the following race:
-    // Cmd send             Cmd completion
-    // 1) set _cmd_active
-    //                      2) read PORT_CI for cmd completion
-    //                         done_mask would think this cmd was completed
-    // 3) set PORT_CI
-    WITH_LOCK(_cmd_lock) {
-        _cmd_active |= 1U << slot;
-        port_writel(PORT_CI, 1U << slot);
+    // Writing zeroes to PORT_SACT and PORT_CI has no effect, so commands
+    // in different slots are issued concurrently, without a lock. The slot
+    // is marked in _cmd_active only after it's issued, so that done_mask()
+    // never takes a slot not issued yet for a completed one. If the
+    // command completed in between, its interrupt has bumped _irq_seq, and
+    // the completion thread may have missed it: wake it again.
+    auto seq = _irq_seq.load();
+    if (queued) {
+        port_writel(PORT_SACT, 1U << slot);
+    }
+    port_writel(PORT_CI, 1U << slot);
+    _cmd_active.fetch_or(1U << slot);
+    if (_irq_seq.load() != seq) {
+        _irq_thread->wake();
     }
 
     return 0;
@@ -237,15 +243,18 @@ void port::wait_cmd_poll(u8 slot)
 
 u32 port::done_mask()
 {
-    if (_cmd_active == 0x0)
-        return 0x0;
-
-    if (!used_slot())
+    auto active = _cmd_active.load();
+    if (active == 0x0)
         return 0x0;
 
-    auto ci = port_readl(PORT_CI);
+    // A queued command is done when the device clears its PORT_SACT bit,
+    // which it sets before PORT_CI; other commands when PORT_CI clears.
+    auto busy = port_readl(PORT_CI);
+    if (_ncq) {
+        busy |= port_readl(PORT_SACT);
+    }
 
-    return _cmd_active & (~ci);
+    return active & (~busy);
 }
 
 void port::req_done()
@@ -253,9 +262,7 @@ void port::req_done()
     while (1) {
         u32 mask;
 
-        WITH_LOCK(_cmd_lock) {
-            sched::thread::wait_until(_cmd_lock, [&] { mask = this->done_mask(); return mask != 0x0; });
-        }
+        sched::thread::wait_until([&] { mask = this->done_mask(); return mask != 0x0; });
 
         while (mask) {
             u8 slot = ffs(mask) - 1;
@@ -265,49 +272,44 @@ void port::req_done()
             _bios[slot] = nullptr;
             assert(bio != nullptr);
 
-            biodone(bio, true);
-
             mask &= ~(1U << slot);
 
             // Mark the slot available
-            _cmd_active &= ~(1U << slot);
+            _cmd_active.fetch_and(~(1U << slot));
+            put_slot(slot);
 
-            // Increase slot free number
-            _slot_free++;
-
-            // Wakeup the thread waiting for a free slot
-            _cmd_send_waiter.wake();
+            biodone(bio, true);
         }
     }
 }
 
 int port::make_request(struct bio* bio)
 {
-    WITH_LOCK(_lock) {
-        if (!bio)
-            return EIO;
-
-        switch (bio->bio_cmd) {
-        case BIO_READ:
-            disk_rw(bio, false);
-            break;
-        case BIO_WRITE:
-            disk_rw(bio, true);
-            break;
-        case BIO_FLUSH:
-            disk_flush(bio);
-            break;
-        default:
-            return ENOTBLK;
-        }
-        return 0;
+    if (!bio)
+        return EIO;
+
+    switch (bio->bio_cmd) {
+    case BIO_READ:
+        disk_rw(bio, false);
+        break;
+    case BIO_WRITE:
+        disk_rw(bio, true);
+        break;
+    case BIO_FLUSH:
+        disk_flush(bio);
+        break;
+    default:
+        return ENOTBLK;
     }
+    return 0;
 }
 
 void port::poll_mode_done(struct bio *bio, u8 slot)
 {
     if (_hba->poll_mode()) {
         wait_cmd_poll(slot);
+        _bios[slot] = nullptr;
+        put_slot(slot);
         biodone(bio, true);
     }
 }
@@ -325,13 +327,22 @@ void port::disk_rw(struct bio *bio, bool iswrite)
     struct cmd_table &cmd = _cmd_table[slot];
 
     memset(&cmd.fis, 0, sizeof(cmd.fis));
-    command = (iswrite ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
     cmd.fis.fis_type = 0x27;
     cmd.fis.flags = 1 << 7;
-    cmd.fis.feature_low = 1;
+    if (_ncq) {
+        // FPDMA QUEUED: the sector count goes in the features, the tag
+        // (our slot) in the sector count
+        command = (iswrite ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED);
+        cmd.fis.feature_low = nr_sec & 0xFF;
+        cmd.fis.feature_high = (nr_sec >> 8) & 0xFF;
+        cmd.fis.sector_count = slot << 3;
+    } else {
+        command = (iswrite ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+        cmd.fis.feature_low = 1;
+        cmd.fis.sector_count = nr_sec & 0xFF;
+        cmd.fis.sector_count_ext = (nr_sec >> 8) & 0xFF;
+    }
     cmd.fis.command = command;
-    cmd.fis.sector_count = nr_sec & 0xFF;
-    cmd.fis.sector_count_ext = (nr_sec >> 8) & 0xFF;
     cmd.fis.lba_low = lba & 0xFF;
     cmd.fis.lba_mid = (lba >> 8) & 0xFF;
     cmd.fis.lba_high = (lba >> 16) & 0xFF;
@@ -341,26 +352,54 @@ void port::disk_rw(struct bio *bio, bool iswrite)
     cmd.fis.device = (1 << 6) | (1 << 4); // must have bit 6 set
 
     _bios[slot] = bio;
-    send_cmd(slot, iswrite, buf, len);
+    send_cmd(slot, iswrite, buf, len, _ncq);
 
     poll_mode_done(bio, slot);
 }
 
 void port::disk_flush(struct bio *bio)
 {
-    auto slot = get_slot_wait();
-
-    struct cmd_table &cmd = _cmd_table[slot];
-
-    memset(&cmd.fis, 0, sizeof(cmd.fis));
-    cmd.fis.fis_type = 0x27;
-    cmd.fis.flags = 1 << 7;
-    cmd.fis.command = ATA_CMD_FLUSH_CACHE_EXT;
-
-    _bios[slot] = bio;
-    send_cmd(slot, 0, nullptr, 0);
+    if (!_ncq) {
+        // Non-queued commands are run in order by the HBA
+        auto slot = get_slot_wait();
+        struct cmd_table &cmd = _cmd_table[slot];
+        memset(&cmd.fis, 0, sizeof(cmd.fis));
+        cmd.fis.fis_type = 0x27;
+        cmd.fis.flags = 1 << 7;
+        cmd.fis.command = ATA_CMD_FLUSH_CACHE_EXT;
+        _bios[slot] = bio;
+        send_cmd(slot, 0, nullptr, 0);
+        poll_mode_done(bio, slot);
+        return;
+    }
 
-    poll_mode_done(bio, slot);
+    // A non-queued command can't be issued while queued ones are
+    // outstanding, nor queued ones while it is. So stop handing out slots,
+    // wait for the queued commands to complete, and run the flush alone.
+    // Flushes are rare enough for their submitter to wait for it.
+    WITH_LOCK(_flush_lock) {
+        _slots.fetch_or(_slots_exclusive);
+        wait_slots([this] { return (_slots.load() & _slot_mask) == 0; });
+        u8 slot = 0;
+        _slots.fetch_or(1U << slot);
+
+        struct cmd_table &cmd = _cmd_table[slot];
+        memset(&cmd.fis, 0, sizeof(cmd.fis));
+        cmd.fis.fis_type = 0x27;
+        cmd.fis.flags = 1 << 7;
+        cmd.fis.command = ATA_CMD_FLUSH_CACHE_EXT;
+
+        _bios[slot] = bio;
+        send_cmd(slot, 0, nullptr, 0);
+        wait_slots([this] { return (_slots.load() & _slot_mask) == 0; });
+
+        _slots.fetch_and(~_slots_exclusive);
+        if (_slot_waiters.load()) {
+            WITH_LOCK(_slot_mutex) {
+                _slot_cond.wake_all();
+            }
+        }
+    }
 }
 
 void port::disk_identify()
@@ -381,6 +420,17 @@ void port::disk_identify()
     // Word 75 queue depth
     _queue_depth = buffer[75] & 0x1F;
 
+    // Use all the HBA's command slots, and as many as the device queues
+    // when both support NCQ (word 76 bit 8). Queued commands complete with
+    // a Set Device Bits FIS, which poll mode doesn't wait for.
+    auto caps = _hba->hba_readl(HOST_CAP);
+    u32 nr_slots = ((caps >> HOST_CAP_NCS_SHIFT) & HOST_CAP_NCS_MASK) + 1;
+    _ncq = !_hba->poll_mode() && (caps & HOST_CAP_SNCQ) && (buffer[76] & (1 << 8));
+    if (_ncq) {
+        nr_slots = std::min<u32>(nr_slots, _queue_depth + 1);
+    }
+    _slot_mask = nr_slots == 32 ? 0xFFFFFFFF : (1U << nr_slots) - 1;
+
     // Word 83 LBA48 support
     if (buffer[83] & (1 << 10))  {
         // Word 100 to 103
@@ -395,40 +445,56 @@ void port::disk_identify()
     delete [] buffer;
 }
 
-bool port::used_slot()
-{
-    return _slot_free.load(std::memory_order_relaxed) != _slot_nr;
-}
-
-bool port::avail_slot()
+bool port::try_get_slot(u8 &slot)
 {
-    return _slot_free.load(std::memory_order_relaxed) >= 1;
+    u64 old = _slots.load(std::memory_order_relaxed);
+    do {
+        if (old & _slots_exclusive) {
+            return false;
+        }
+        u32 free = ~u32(old) & _slot_mask;
+        if (!free) {
+            return false;
+        }
+        slot = ffs(free) - 1;
+    } while (!_slots.compare_exchange_weak(old, old | (1ULL << slot)));
+    return true;
 }
 
-bool port::get_slot(u8 &slot)
+// Waits, with the other slow-path waiters, until pred() is true. Waiters
+// count themselves before checking pred() under _slot_mutex, and put_slot()
+// checks for waiters after freeing a slot, so no wakeup is missed.
+template <class Pred>
+void port::wait_slots(Pred pred)
 {
-    if (!avail_slot()) {
-        return false;
+    WITH_LOCK(_slot_mutex) {
+        _slot_waiters.fetch_add(1);
+        while (!pred()) {
+            _slot_cond.wait(_slot_mutex);
+        }
+        _slot_waiters.fetch_sub(1);
     }
-
-    _slot_free--;
-
-    slot = ffs(~_cmd_active) - 1;
-
-    return true;
 }
 
 u8 port::get_slot_wait()
 {
     u8 slot;
-    while (!get_slot(slot)) {
-        _cmd_send_waiter.reset(*sched::thread::current());
-        sched::thread::wait_until([this] {return this->avail_slot();});
-        _cmd_send_waiter.clear();
+    if (!try_get_slot(slot)) {
+        wait_slots([&] { return this->try_get_slot(slot); });
     }
     return slot;
 }
 
+void port::put_slot(u8 slot)
+{
+    _slots.fetch_and(~(1ULL << slot));
+    if (_slot_waiters.load()) {
+        WITH_LOCK(_slot_mutex) {
+            _slot_cond.wake_all();
+        }
+    }
+}
+
 void hba::enable_irq()
 {
     if (poll_mode()) {
@@ -587,7 +653,7 @@ bool hba::ack_irq()
 
         u8 error = port->recv_fis_error();
         assert (error == 0);
-        if ((is & 1)) {
+        if (is & (PORT_IS_DHRS | PORT_IS_SDBS)) {
             port->wakeup();
             handled = true;
         }
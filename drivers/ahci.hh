@@ -18,6 +18,8 @@
 #include <osv/mempool.hh>
 #include <osv/bio.h>
 #include <osv/types.h>
+#include <osv/mutex.h>
+#include <osv/condvar.h>
 
 namespace ahci {
 
@@ -27,6 +29,8 @@ enum ata_cmd {
     ATA_CMD_READ_DMA_EXT = 0x25,
     ATA_CMD_WRITE_DMA = 0xCA,
     ATA_CMD_WRITE_DMA_EXT = 0x35,
+    ATA_CMD_READ_FPDMA_QUEUED = 0x60,
+    ATA_CMD_WRITE_FPDMA_QUEUED = 0x61,
     ATA_CMD_FLUSH_CACHE_EXT = 0xEA,
     ATA_CMD_IDENTIFY_DEVICE = 0xEC,
     ATA_CMD_IDENTIFY_PACKET_DEVICE = 0xA1,
@@ -45,6 +49,13 @@ enum hba_reg {
     HOST_EM_CTL     = 0x20,
 };
 
+// HOST_CAP bits
+enum hba_reg_cap_bits {
+    HOST_CAP_NCS_SHIFT  = 8,
+    HOST_CAP_NCS_MASK   = 0x1F,
+    HOST_CAP_SNCQ       = 1U << 30,
+};
+
 // HOST_GHC bits
 enum hba_reg_ghc_bits {
     HOST_GHC_HR     = 1U << 0,
@@ -231,7 +242,7 @@ public:
 
     void reset();
     void setup();
-    int send_cmd(u8 slot, int iswrite, void *buffer, u32 bsize);
+    int send_cmd(u8 slot, int iswrite, void *buffer, u32 bsize, bool queued = false);
     void wait_cmd_poll(u8 slot);
     void wait_cmd_irq(u8 slot);
     void disk_identify();
@@ -241,7 +252,11 @@ public:
     void enable_irq();
     void wait_device_ready();
     void wait_ci_ready(u8 slot);
-    void wakeup() { _irq_thread->wake(); }
+    void wakeup()
+    {
+        _irq_seq.fetch_add(1);
+        _irq_thread->wake();
+    }
     bool linkup() { return _linkup; }
 
     u32 port2hba(u32 port_reg)
@@ -274,19 +289,20 @@ public:
 
     void poll_mode_done(struct bio *bio, u8 slot);
     u32 done_mask();
-    bool avail_slot();
-    bool used_slot();
-    bool get_slot(u8 &slot);
+    bool try_get_slot(u8 &slot);
     u8 get_slot_wait();
+    void put_slot(u8 slot);
+    template <class Pred>
+    void wait_slots(Pred pred);
     void req_done();
 
 private:
-    sched::thread_handle _cmd_send_waiter;
     bool _linkup = false;
     u8 _queue_depth;
+    // Native command queuing: reads and writes are issued as FPDMA QUEUED
+    // commands, tagged with their slot, up to _slot_mask's worth at once
+    bool _ncq = false;
     size_t _devsize;
-    mutex _lock;
-    mutex _cmd_lock;
     u32 _pnr;
     hba *_hba;
 
@@ -296,8 +312,23 @@ private:
 
     static constexpr u32 _slot_nr = 32;
     std::atomic<struct bio *> _bios[_slot_nr];
-    std::atomic<u32> _slot_free{_slot_nr};
+    // Slots are taken without a lock, from the low 32 bits of _slots. While
+    // a non-queued command (a flush) waits for the queued ones to drain, or
+    // runs, _slots_exclusive is set too and no slot is handed out.
+    static constexpr u64 _slots_exclusive = 1ULL << 32;
+    std::atomic<u64> _slots{0};
+    u32 _slot_mask = 0xFFFFFFFF;
+    // Submitters and flushes waiting for slots; only they take _slot_mutex
+    std::atomic<unsigned> _slot_waiters{0};
+    mutex _slot_mutex;
+    condvar _slot_cond;
+    // Serializes flushes, which wait for completion of the queued commands
+    mutex _flush_lock;
+    // Slots issued to the port, which req_done() watches for completion
     std::atomic<u32> _cmd_active{0};
+    // Counts interrupts, so that a command completing before it is marked
+    // in _cmd_active still gets its completion thread woken
+    std::atomic<unsigned> _irq_seq{0};
     sched::thread *_irq_thread;
 };
 
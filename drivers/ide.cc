@@ -91,6 +91,7 @@ ide_drive::ide_drive(pci::device& pci_dev)
     prv = reinterpret_cast<struct ide_priv*>(dev->private_data);
     prv->drv = this;
     dev->size = prv->drv->size();
+    dev->max_io_size = 131072; // see make_request()
     read_partition_table(dev);
 
     debugf("ide: Add ide device instances %d as %s, devsize=%lld\n", _id, dev_name.c_str(), dev->size);
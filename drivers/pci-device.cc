@@ -45,9 +45,12 @@ namespace pci {
             }
 
             bar * pbar = new bar(this, pos);
-            add_bar(idx++, pbar);
+            add_bar(idx, pbar);
 
+            // A 64-bit bar takes the next bar register too, so that bar
+            // numbers (in capabilities, for example) still match
             pos += pbar->is_64() ? 8 : 4;
+            idx += pbar->is_64() ? 2 : 1;
         }
 
         return true;
@@ -9,6 +9,18 @@
 #include <iomanip>
 
 #include <osv/debug.hh>
+#include <osv/mmio.hh>
+#include <osv/spinlock.h>
+#include <osv/sched.hh>
+#include <osv/boot.hh>
+
+extern "C" {
+#include "acpi.h"
+}
+#include <boost/intrusive/parent_from_member.hpp>
+#include <atomic>
+#include <memory>
+#include <vector>
 
 #include "drivers/pci.hh"
 #include "drivers/driver.hh"
@@ -17,8 +29,28 @@
 #include "drivers/pci-bridge.hh"
 #include "drivers/pci-device.hh"
 
+extern boot_time_chart boot_time;
+
+using boost::intrusive::get_parent_from_member;
+
 namespace pci {
 
+// Config space is reached through MMCONFIG (ECAM) when the MCFG table has
+// it: one memory access per read or write, instead of an address and a data
+// port access, which also need a lock as the ACPI interpreter may use them
+// concurrently with drivers.
+static volatile u8* ecam_base;
+static u8 ecam_start_bus, ecam_end_bus;
+static spinlock_t port_lock;
+
+static inline mmioaddr_t ecam_addr(u8 bus, u8 slot, u8 func, u8 offset)
+{
+    if (!ecam_base || bus < ecam_start_bus || bus > ecam_end_bus) {
+        return mmio_nullptr;
+    }
+    return ecam_base + ((bus - ecam_start_bus) << 20 | slot << 15 | func << 12 | offset);
+}
+
 static inline void prepare_pci_config_access(u8 bus, u8 slot, u8 func, u8 offset)
 {
     outl(PCI_CONFIG_ADDRESS_ENABLE | (bus<<PCI_BUS_OFFSET) | (slot<<PCI_SLOT_OFFSET) | (func<<PCI_FUNC_OFFSET) | (offset & ~0x03), PCI_CONFIG_ADDRESS);
@@ -26,30 +58,52 @@ static inline void prepare_pci_config_access(u8 bus, u8 slot, u8 func, u8 offset
 
 u32 read_pci_config(u8 bus, u8 slot, u8 func, u8 offset)
 {
+    if (auto addr = ecam_addr(bus, slot, func, offset & ~0x03)) {
+        return mmio_getl(addr);
+    }
+    SCOPE_LOCK(port_lock);
     prepare_pci_config_access(bus, slot, func, offset);
     return inl(PCI_CONFIG_DATA);
 }
 
 u16 read_pci_config_word(u8 bus, u8 slot, u8 func, u8 offset)
 {
+    if (auto addr = ecam_addr(bus, slot, func, offset & ~0x01)) {
+        return mmio_getw(addr);
+    }
+    SCOPE_LOCK(port_lock);
     prepare_pci_config_access(bus, slot, func, offset);
     return inw(PCI_CONFIG_DATA + (offset & 0x02));
 }
 
 u8 read_pci_config_byte(u8 bus, u8 slot, u8 func, u8 offset)
 {
+    if (auto addr = ecam_addr(bus, slot, func, offset)) {
+        return mmio_getb(addr);
+    }
+    SCOPE_LOCK(port_lock);
     prepare_pci_config_access(bus, slot, func, offset);
     return inb(PCI_CONFIG_DATA + (offset & 0x03));
 }
 
 void write_pci_config(u8 bus, u8 slot, u8 func, u8 offset, u32 val)
 {
+    if (auto addr = ecam_addr(bus, slot, func, offset & ~0x03)) {
+        mmio_setl(addr, val);
+        return;
+    }
+    SCOPE_LOCK(port_lock);
     prepare_pci_config_access(bus, slot, func, offset);
     outl(val, PCI_CONFIG_DATA);
 }
 
 void write_pci_config_word(u8 bus, u8 slot, u8 func, u8 offset, u16 val)
 {
+    if (auto addr = ecam_addr(bus, slot, func, offset & ~0x01)) {
+        mmio_setw(addr, val);
+        return;
+    }
+    SCOPE_LOCK(port_lock);
     prepare_pci_config_access(bus, slot, func, offset);
     outw(val, PCI_CONFIG_DATA + (offset & 0x02));
 }
@@ -57,10 +111,52 @@ void write_pci_config_word(u8 bus, u8 slot, u8 func, u8 offset, u16 val)
 
 void write_pci_config_byte(u8 bus, u8 slot, u8 func, u8 offset, u8 val)
 {
+    if (auto addr = ecam_addr(bus, slot, func, offset)) {
+        mmio_setb(addr, val);
+        return;
+    }
+    SCOPE_LOCK(port_lock);
     prepare_pci_config_access(bus, slot, func, offset);
     outb(val, PCI_CONFIG_DATA + (offset & 0x03));
 }
 
+// Switches config access to ECAM, for the segment 0 buses the MCFG table
+// gives it for
+static void init_ecam()
+{
+    char mcfg_sig[] = ACPI_SIG_MCFG;
+    ACPI_TABLE_HEADER* mcfg_header;
+    if (AcpiGetTable(mcfg_sig, 0, &mcfg_header) != AE_OK) {
+        return;
+    }
+    auto mcfg = get_parent_from_member(mcfg_header, &ACPI_TABLE_MCFG::Header);
+    auto alloc = reinterpret_cast<ACPI_MCFG_ALLOCATION*>(mcfg + 1);
+    auto end = reinterpret_cast<ACPI_MCFG_ALLOCATION*>(
+            reinterpret_cast<char*>(mcfg) + mcfg->Header.Length);
+    for (; alloc < end; alloc++) {
+        if (alloc->PciSegment != 0 || alloc->StartBusNumber > alloc->EndBusNumber) {
+            continue;
+        }
+        size_t buses = alloc->EndBusNumber - alloc->StartBusNumber + 1;
+        auto base = static_cast<volatile u8*>(mmio_map(alloc->Address, buses << 20));
+        // Some firmware describes windows which aren't decoded; trust one
+        // only if it sees the host bridge as the ports do
+        u8 bus = alloc->StartBusNumber;
+        u32 id = mmio_getl(base);
+        if (id == 0xffffffff || id != read_pci_config(bus, 0, 0, PCI_VENDOR_ID)) {
+            pci_w("ignoring MCFG window at %lx for buses %d-%d", (u64)alloc->Address,
+                    alloc->StartBusNumber, alloc->EndBusNumber);
+            continue;
+        }
+        ecam_start_bus = alloc->StartBusNumber;
+        ecam_end_bus = alloc->EndBusNumber;
+        ecam_base = base;
+        pci_i("using ECAM at %lx for buses %d-%d", (u64)alloc->Address,
+                ecam_start_bus, ecam_end_bus);
+        return;
+    }
+}
+
 void pci_device_print(u8 bus, u8 slot, u8 func)
 {
     pci_d("Config space of: %02x:%02x:%02x",
@@ -101,9 +197,10 @@ void pci_devices_print()
     }
 }
 
-bool check_bus(u16 bus)
+// Finds the functions on bus, and on the buses behind its bridges, in the
+// order they were always registered in (so devices keep their names)
+static void check_bus(u16 bus, std::vector<function*>& found)
 {
-    bool found = false;
     u16 slot, func;
     for (slot = 0; slot < 32; slot++) {
         if (read_pci_config_word(bus, slot, 0, PCI_VENDOR_ID) == 0xffff)
@@ -115,30 +212,15 @@ bool check_bus(u16 bus)
                 continue;
             }
 
-            found = true;
-
             function * dev = nullptr;
             if (function::is_bridge(bus, slot, func)) {
                 dev = new bridge(bus, slot, func);
                 u8 sec_bus = read_pci_config_byte(bus, slot, func, PCI_CONFIG_SECONDARY_BUS);
-                check_bus(sec_bus);
+                check_bus(sec_bus, found);
             } else {
                 dev = new device(bus, slot, func);
             }
-
-            bool parse_ok = dev->parse_pci_config();
-            if (!parse_ok) {
-                pci_e("Error: couldn't parse device config space %x:%x.%x",
-                        bus, slot, func);
-                break;
-            }
-
-            if (!device_manager::instance()->register_device(dev)) {
-                pci_e("Error: couldn't register device %x:%x.%x",
-                        bus, slot, func);
-                //TODO: Need to beautify it as multiple instances of the device may exist
-                delete dev;
-            }
+            found.push_back(dev);
 
             // test for multiple functions
             if (func == 0 &&
@@ -146,15 +228,69 @@ bool check_bus(u16 bus)
                 break;
         }
     }
+}
 
-    return found;
+// Parsing a function's config space (capabilities, and sizing its BARs) is
+// where enumeration spends its config accesses. With ECAM the functions are
+// independent, so they are parsed on all cpus at once.
+static void parse_all(std::vector<function*>& funcs, std::vector<char>& ok)
+{
+    std::atomic<size_t> next(0);
+    auto parse = [&] {
+        for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < funcs.size(); ) {
+            ok[i] = funcs[i]->parse_pci_config();
+        }
+    };
+    auto nthreads = std::min(sched::cpus.size(), funcs.size());
+    if (!ecam_base || nthreads <= 1) {
+        parse();
+        return;
+    }
+    std::vector<std::unique_ptr<sched::thread>> threads;
+    for (size_t i = 1; i < nthreads; i++) {
+        threads.emplace_back(new sched::thread(parse,
+                sched::thread::attr().pin(sched::cpus[i]).name("pci-scan")));
+        threads.back()->start();
+    }
+    parse();
+    for (auto& t : threads) {
+        t->join();
+    }
 }
 
 void pci_device_enumeration()
 {
-    for (u16 bus = 0; bus < 256; bus++) {
-        if (check_bus(bus))
-            break;
+    init_ecam();
+
+    std::vector<function*> funcs;
+    for (u16 bus = 0; bus < 256 && funcs.empty(); bus++) {
+        check_bus(bus, funcs);
+    }
+    boot_time.event("pci buses scanned");
+
+    // Not vector<bool>, whose elements share words, as several threads
+    // write them
+    std::vector<char> ok(funcs.size());
+    parse_all(funcs, ok);
+    boot_time.event("pci config parsed");
+
+    for (size_t i = 0; i < funcs.size(); i++) {
+        auto dev = funcs[i];
+        u8 bus, slot, func;
+        dev->get_bdf(bus, slot, func);
+        if (!ok[i]) {
+            pci_e("Error: couldn't parse device config space %x:%x.%x",
+                    bus, slot, func);
+            delete dev;
+            continue;
+        }
+
+        if (!device_manager::instance()->register_device(dev)) {
+            pci_e("Error: couldn't register device %x:%x.%x",
+                    bus, slot, func);
+            //TODO: Need to beautify it as multiple instances of the device may exist
+            delete dev;
+        }
     }
 }
 }
@@ -148,6 +148,11 @@ blk::blk(pci::device& pci_dev)
     prv = reinterpret_cast<struct blk_priv*>(dev->private_data);
     prv->drv = this;
     dev->size = prv->drv->size();
+    // The most a request can carry (see make_request()), if the device
+    // limits its segments
+    if (_seg_max) {
+        dev->max_io_size = std::max<u32>(_seg_max - 1, 1) * seg_size();
+    }
     read_partition_table(dev);
 
     debugf("virtio-blk: Add blk device instances %d as %s, devsize=%lld\n", _id, dev_name.c_str(), dev->size);
@@ -166,10 +171,14 @@ void blk::read_config()
 
     trace_virtio_blk_read_config_capacity(_config.capacity);
 
-    if (get_guest_feature_bit(VIRTIO_BLK_F_SIZE_MAX))
+    if (get_guest_feature_bit(VIRTIO_BLK_F_SIZE_MAX)) {
         trace_virtio_blk_read_config_size_max(_config.size_max);
-    if (get_guest_feature_bit(VIRTIO_BLK_F_SEG_MAX))
+        _size_max = _config.size_max;
+    }
+    if (get_guest_feature_bit(VIRTIO_BLK_F_SEG_MAX)) {
         trace_virtio_blk_read_config_seg_max(_config.seg_max);
+        _seg_max = _config.seg_max;
+    }
     if (get_guest_feature_bit(VIRTIO_BLK_F_GEOMETRY)) {
         trace_virtio_blk_read_config_geometry((u32)_config.geometry.cylinders, (u32)_config.geometry.heads, (u32)_config.geometry.sectors);
     }
@@ -238,8 +247,8 @@ int blk::make_request(struct bio* bio)
 
         if (!bio) return EIO;
 
-        if (bio->bio_bcount/mmu::page_size + 1 > _config.seg_max) {
-            trace_virtio_blk_make_request_seg_max(bio->bio_bcount, _config.seg_max);
+        if (_seg_max && bio->bio_bcount/seg_size() + 1 > _seg_max) {
+            trace_virtio_blk_make_request_seg_max(bio->bio_bcount, _seg_max);
             return EIO;
         }
 
@@ -275,10 +284,13 @@ int blk::make_request(struct bio* bio)
         queue->add_out_sg(hdr, sizeof(struct blk_outhdr));
 
         if (bio->bio_data && bio->bio_bcount > 0) {
-            if (type == VIRTIO_BLK_T_OUT)
-                queue->add_out_sg(bio->bio_data, bio->bio_bcount);
-            else
-                queue->add_in_sg(bio->bio_data, bio->bio_bcount);
+            auto flags = type == VIRTIO_BLK_T_OUT ?
+                    vring_desc::VRING_DESC_F_READ : vring_desc::VRING_DESC_F_WRITE;
+            auto data = static_cast<char*>(bio->bio_data);
+            size_t max = _size_max ? _size_max : bio->bio_bcount;
+            for (size_t off = 0; off < bio->bio_bcount; off += max) {
+                queue->add_sg(data + off, std::min(max, bio->bio_bcount - off), flags);
+            }
         }
 
         req->res.status = 0;
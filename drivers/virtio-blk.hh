@@ -155,6 +155,14 @@ private:
     static int _instance;
     int _id;
     bool _ro;
+    // Longest a segment of a request may be, or 0
+    u32 _size_max = 0;
+    // Most segments a request may have, or 0 if the device doesn't say
+    u32 _seg_max = 0;
+    // Length of data each segment of a request is counted for
+    size_t seg_size() const {
+        return _size_max ? std::min<size_t>(_size_max, mmu::page_size) : mmu::page_size;
+    }
     // This mutex protects parallel make_request invocations
     mutex _lock;
     gsi_level_interrupt _gsi;
@@ -0,0 +1,401 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include "drivers/virtio.hh"
+#include "drivers/virtio-fs.hh"
+#include "drivers/pci-device.hh"
+#include <osv/interrupt.hh>
+
+#include <osv/mmio.hh>
+#include <osv/mmu.hh>
+
+#include <string>
+#include <string.h>
+#include <errno.h>
+#include <osv/debug.h>
+
+#include <osv/sched.hh>
+#include "osv/trace.hh"
+
+#include <osv/device.h>
+
+TRACEPOINT(trace_virtio_fs_request, "unique=%lu, opcode=%u, nodeid=%lu", u64, u32, u64);
+TRACEPOINT(trace_virtio_fs_reply, "unique=%lu, error=%d", u64, int);
+TRACEPOINT(trace_virtio_fs_wake, "queue=%u", unsigned);
+
+namespace virtio {
+
+// virtio 1.0 pci capabilities (struct virtio_pci_cap), and the layout of
+// the registers they point to
+enum {
+    VIRTIO_PCI_CAP_COMMON_CFG = 1,
+    VIRTIO_PCI_CAP_NOTIFY_CFG = 2,
+    VIRTIO_PCI_CAP_ISR_CFG = 3,
+    VIRTIO_PCI_CAP_DEVICE_CFG = 4,
+    VIRTIO_PCI_CAP_SHARED_MEMORY_CFG = 8,
+
+    VIRTIO_PCI_CAP_CFG_TYPE = 3,
+    VIRTIO_PCI_CAP_BAR = 4,
+    VIRTIO_PCI_CAP_ID = 5,
+    VIRTIO_PCI_CAP_OFFSET = 8,
+    VIRTIO_PCI_CAP_LENGTH = 12,
+    VIRTIO_PCI_NOTIFY_CAP_MULT = 16,
+    VIRTIO_PCI_CAP_OFFSET_HI = 16,
+    VIRTIO_PCI_CAP_LENGTH_HI = 20,
+
+    VIRTIO_PCI_COMMON_DFSELECT = 0,
+    VIRTIO_PCI_COMMON_DF = 4,
+    VIRTIO_PCI_COMMON_GFSELECT = 8,
+    VIRTIO_PCI_COMMON_GF = 12,
+    VIRTIO_PCI_COMMON_MSIX = 16,
+    VIRTIO_PCI_COMMON_NUMQ = 18,
+    VIRTIO_PCI_COMMON_STATUS = 20,
+    VIRTIO_PCI_COMMON_Q_SELECT = 22,
+    VIRTIO_PCI_COMMON_Q_SIZE = 24,
+    VIRTIO_PCI_COMMON_Q_MSIX = 26,
+    VIRTIO_PCI_COMMON_Q_ENABLE = 28,
+    VIRTIO_PCI_COMMON_Q_NOFF = 30,
+    VIRTIO_PCI_COMMON_Q_DESC = 32,
+    VIRTIO_PCI_COMMON_Q_AVAIL = 40,
+    VIRTIO_PCI_COMMON_Q_USED = 48,
+
+    // The shared memory region of a virtio-fs device for the DAX window
+    VIRTIO_FS_SHMCAP_ID_CACHE = 0,
+};
+
+int fs::_instance = 0;
+
+static struct devops fs_devops {
+    no_open,
+    no_close,
+    no_read,
+    no_write,
+    no_ioctl,
+    no_devctl,
+};
+
+struct driver fs_driver = {
+    "virtio_fs",
+    &fs_devops,
+    sizeof(struct fs_priv),
+};
+
+// FORGET requests belong to the driver, which frees them when done
+struct forget_request : fuse_request {
+    fuse_forget_in arg;
+};
+
+fs::fs(pci::device& pci_dev)
+    : virtio_driver(pci_dev, modern_transport())
+{
+    _driver_name = "virtio-fs";
+    _id = _instance++;
+    virtio_i("VIRTIO FS INSTANCE %d", _id);
+
+    if (!parse_caps()) {
+        virtio_e("virtio-fs: device lacks the virtio 1.0 capabilities");
+        return;
+    }
+
+    // make sure the queues are reset
+    set_dev_status(0);
+    while (get_dev_status()) {
+        sched::thread::yield();
+    }
+    add_dev_status(VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER);
+
+    if (!negotiate_features()) {
+        virtio_e("virtio-fs: feature negotiation failed");
+        add_dev_status(VIRTIO_CONFIG_S_FAILED);
+        return;
+    }
+    read_config();
+    setup_queues();
+    if (_num_queues <= VIRTIO_FS_REQUEST_QUEUE) {
+        virtio_e("virtio-fs: device has no request queue");
+        add_dev_status(VIRTIO_CONFIG_S_FAILED);
+        return;
+    }
+
+    sched::thread* hiprio = new sched::thread([this] { this->req_done(VIRTIO_FS_HIPRIO_QUEUE); },
+            sched::thread::attr().name("virtio-fs-hiprio"));
+    sched::thread* t = new sched::thread([this] { this->req_done(VIRTIO_FS_REQUEST_QUEUE); },
+            sched::thread::attr().name("virtio-fs"));
+    hiprio->start();
+    t->start();
+    auto hiprio_queue = get_virt_queue(VIRTIO_FS_HIPRIO_QUEUE);
+    auto queue = get_virt_queue(VIRTIO_FS_REQUEST_QUEUE);
+    if (pci_dev.is_msix()) {
+        _msi.easy_register({
+            { VIRTIO_FS_HIPRIO_QUEUE, [=] { hiprio_queue->disable_interrupts(); }, hiprio },
+            { VIRTIO_FS_REQUEST_QUEUE, [=] { queue->disable_interrupts(); }, t },
+        });
+    } else {
+        _gsi.set_ack_and_handler(pci_dev.get_interrupt_line(),
+                [=] { return this->ack_irq(); },
+                [=] { hiprio->wake(); t->wake(); });
+    }
+
+    queue->set_use_indirect(true);
+
+    add_dev_status(VIRTIO_CONFIG_S_DRIVER_OK);
+
+    struct fs_priv* prv;
+    struct device *dev;
+    std::string dev_name("virtiofs");
+    dev_name += std::to_string(_id);
+
+    dev = device_create(&fs_driver, dev_name.c_str(), D_CHR);
+    prv = reinterpret_cast<struct fs_priv*>(dev->private_data);
+    prv->drv = this;
+
+    debugf("virtio-fs: Add device instance %d as %s, tag=%s, dax window=%luMB\n",
+            _id, dev_name.c_str(), _tag.c_str(), _dax.len >> 20);
+}
+
+fs::~fs()
+{
+    //TODO: In theory maintain the list of free instances and gc it
+    // including the thread objects and their stack
+    if (_common_cfg.bar) {
+        set_dev_status(0);
+    }
+}
+
+// Finds the virtio 1.0 structures among the vendor specific capabilities
+bool fs::parse_caps()
+{
+    u8 off = _dev.pci_readb(pci::PCI_CAPABILITIES_PTR);
+    for (int ctr = 0; off != 0 && ctr < 0xF0; ctr++) {
+        if (_dev.pci_readb(off + pci::function::PCI_CAP_OFF_ID) == pci::function::PCI_CAP_VENDOR) {
+            u8 type = _dev.pci_readb(off + VIRTIO_PCI_CAP_CFG_TYPE);
+            // bars are numbered from 1 here
+            auto bar = _dev.get_bar(_dev.pci_readb(off + VIRTIO_PCI_CAP_BAR) + 1);
+            cap_region region;
+            region.bar = bar;
+            region.offset = _dev.pci_readl(off + VIRTIO_PCI_CAP_OFFSET);
+            region.length = _dev.pci_readl(off + VIRTIO_PCI_CAP_LENGTH);
+            // The DAX window is mapped on its own below, it can be large
+            if (type != VIRTIO_PCI_CAP_SHARED_MEMORY_CFG && bar &&
+                    bar->is_mmio() && bar->get_mmio() == mmio_nullptr) {
+                bar->map();
+            }
+            switch (type) {
+            case VIRTIO_PCI_CAP_COMMON_CFG:
+                _common_cfg = region;
+                break;
+            case VIRTIO_PCI_CAP_NOTIFY_CFG:
+                _notify_cfg = region;
+                _notify_multiplier = _dev.pci_readl(off + VIRTIO_PCI_NOTIFY_CAP_MULT);
+                break;
+            case VIRTIO_PCI_CAP_ISR_CFG:
+                _isr_cfg = region;
+                break;
+            case VIRTIO_PCI_CAP_DEVICE_CFG:
+                _device_cfg = region;
+                break;
+            case VIRTIO_PCI_CAP_SHARED_MEMORY_CFG:
+                if (bar && _dev.pci_readb(off + VIRTIO_PCI_CAP_ID) == VIRTIO_FS_SHMCAP_ID_CACHE) {
+                    u64 offset = region.offset | u64(_dev.pci_readl(off + VIRTIO_PCI_CAP_OFFSET_HI)) << 32;
+                    u64 len = region.length | u64(_dev.pci_readl(off + VIRTIO_PCI_CAP_LENGTH_HI)) << 32;
+                    // Mapped where phys_to_virt() expects it, so that its
+                    // pages can be given to mmu::write_pte() like others
+                    _dax.addr = const_cast<void*>(mmio_map(bar->get_addr64() + offset, len));
+                    _dax.len = len;
+                }
+                break;
+            }
+        }
+        off = _dev.pci_readb(off + pci::function::PCI_CAP_OFF_NEXT);
+    }
+
+    return _common_cfg.bar && _notify_cfg.bar && _isr_cfg.bar && _device_cfg.bar;
+}
+
+bool fs::negotiate_features()
+{
+    _common_cfg.writel(VIRTIO_PCI_COMMON_DFSELECT, 0);
+    u64 dev_features = _common_cfg.readl(VIRTIO_PCI_COMMON_DF);
+    _common_cfg.writel(VIRTIO_PCI_COMMON_DFSELECT, 1);
+    dev_features |= u64(_common_cfg.readl(VIRTIO_PCI_COMMON_DF)) << 32;
+
+    u64 drv_features = get_driver_features() | 1ull << VIRTIO_F_VERSION_1;
+    u64 subset = dev_features & drv_features;
+    if (!(subset & 1ull << VIRTIO_F_VERSION_1)) {
+        return false;
+    }
+
+    if (subset & (1 << VIRTIO_RING_F_INDIRECT_DESC))
+        set_indirect_buf_cap(true);
+
+    if (subset & (1 << VIRTIO_RING_F_EVENT_IDX))
+        set_event_idx_cap(true);
+
+    _common_cfg.writel(VIRTIO_PCI_COMMON_GFSELECT, 0);
+    _common_cfg.writel(VIRTIO_PCI_COMMON_GF, subset);
+    _common_cfg.writel(VIRTIO_PCI_COMMON_GFSELECT, 1);
+    _common_cfg.writel(VIRTIO_PCI_COMMON_GF, subset >> 32);
+
+    add_dev_status(VIRTIO_CONFIG_S_FEATURES_OK);
+    return get_dev_status() & VIRTIO_CONFIG_S_FEATURES_OK;
+}
+
+void fs::read_config()
+{
+    for (unsigned i = 0; i < sizeof(_config); i++) {
+        reinterpret_cast<u8*>(&_config)[i] = _device_cfg.readb(i);
+    }
+    _tag = std::string(_config.tag, strnlen(_config.tag, sizeof(_config.tag)));
+}
+
+// We use the high priority queue and one request queue, the device may
+// have more of those.
+void fs::setup_queues()
+{
+    u16 num = std::min<u16>(_common_cfg.readw(VIRTIO_PCI_COMMON_NUMQ),
+                            VIRTIO_FS_REQUEST_QUEUE + 1);
+    if (_dev.is_msix()) {
+        _common_cfg.writew(VIRTIO_PCI_COMMON_MSIX, VIRTIO_MSI_NO_VECTOR);
+    }
+
+    for (u16 q = 0; q < num; q++) {
+        _common_cfg.writew(VIRTIO_PCI_COMMON_Q_SELECT, q);
+        u16 qsize = _common_cfg.readw(VIRTIO_PCI_COMMON_Q_SIZE);
+        if (0 == qsize) {
+            break;
+        }
+
+        vring* queue = new vring(this, qsize, q);
+        _queues[q] = queue;
+
+        if (_dev.is_msix()) {
+            // Setup queue_id:entry_id 1:1 correlation...
+            _common_cfg.writew(VIRTIO_PCI_COMMON_Q_MSIX, q);
+            if (_common_cfg.readw(VIRTIO_PCI_COMMON_Q_MSIX) != q) {
+                virtio_e("Setting MSIx entry for queue %d failed.", q);
+                return;
+            }
+        }
+
+        _common_cfg.writeq(VIRTIO_PCI_COMMON_Q_DESC, queue->get_desc_paddr());
+        _common_cfg.writeq(VIRTIO_PCI_COMMON_Q_AVAIL, queue->get_avail_paddr());
+        _common_cfg.writeq(VIRTIO_PCI_COMMON_Q_USED, queue->get_used_paddr());
+        _notify_off.push_back(_common_cfg.readw(VIRTIO_PCI_COMMON_Q_NOFF));
+        _common_cfg.writew(VIRTIO_PCI_COMMON_Q_ENABLE, 1);
+        _num_queues++;
+
+        virtio_d("Queue[%d] -> size %d, paddr %x", q, qsize, queue->get_paddr());
+    }
+}
+
+bool fs::kick(int queue)
+{
+    _notify_cfg.writew(_notify_off[queue] * _notify_multiplier, queue);
+    return true;
+}
+
+u8 fs::get_dev_status()
+{
+    return _common_cfg.readb(VIRTIO_PCI_COMMON_STATUS);
+}
+
+void fs::set_dev_status(u8 status)
+{
+    _common_cfg.writeb(VIRTIO_PCI_COMMON_STATUS, status);
+}
+
+bool fs::ack_irq()
+{
+    // Reading the isr acknowledges the interrupt
+    if (_isr_cfg.readb(0)) {
+        get_virt_queue(VIRTIO_FS_HIPRIO_QUEUE)->disable_interrupts();
+        get_virt_queue(VIRTIO_FS_REQUEST_QUEUE)->disable_interrupts();
+        return true;
+    } else {
+        return false;
+    }
+}
+
+void fs::req_done(unsigned q)
+{
+    auto* queue = get_virt_queue(q);
+    fuse_request* req;
+
+    while (1) {
+
+        virtio_driver::wait_for_queue(queue, &vring::used_ring_not_empty);
+        trace_virtio_fs_wake(q);
+
+        u32 len;
+        while((req = static_cast<fuse_request*>(queue->get_buf_elem(&len))) != nullptr) {
+            if (q == VIRTIO_FS_HIPRIO_QUEUE) {
+                delete static_cast<forget_request*>(req);
+            } else {
+                trace_virtio_fs_reply(req->in_header.unique, req->out_header.error);
+                req->w.wake();
+            }
+            queue->get_buf_finalize();
+        }
+
+        // wake up the requesting thread in case the ring was full before
+        queue->wakeup_waiter();
+    }
+}
+
+void fs::send(unsigned q, fuse_request* req)
+{
+    // The lock is here for parallel requests protection
+    WITH_LOCK(_lock) {
+        auto* queue = get_virt_queue(q);
+
+        req->in_header.unique = ++_unique;
+        req->in_header.len = sizeof(req->in_header) + req->in_args_size;
+        trace_virtio_fs_request(req->in_header.unique, req->in_header.opcode, req->in_header.nodeid);
+
+        queue->init_sg();
+        queue->add_out_sg(&req->in_header, sizeof(req->in_header));
+        if (req->in_args_size) {
+            queue->add_out_sg(req->in_args, req->in_args_size);
+        }
+        // Requests on the high priority queue get no reply
+        if (q != VIRTIO_FS_HIPRIO_QUEUE) {
+            queue->add_in_sg(&req->out_header, sizeof(req->out_header));
+            if (req->out_args_size) {
+                queue->add_in_sg(req->out_args, req->out_args_size);
+            }
+        }
+
+        queue->add_buf_wait(req);
+
+        queue->kick();
+    }
+}
+
+int fs::make_request(fuse_request* req)
+{
+    send(VIRTIO_FS_REQUEST_QUEUE, req);
+    req->w.wait();
+    return req->out_header.error;
+}
+
+void fs::send_forget(u64 nodeid, u64 nlookup)
+{
+    auto* req = new forget_request;
+    req->in_header.opcode = FUSE_FORGET;
+    req->in_header.nodeid = nodeid;
+    req->arg.nlookup = nlookup;
+    req->in_args = &req->arg;
+    req->in_args_size = sizeof(req->arg);
+    send(VIRTIO_FS_HIPRIO_QUEUE, req);
+}
+
+hw_driver* fs::probe(hw_device* dev)
+{
+    return virtio::probe<fs, VIRTIO_FS_DEVICE_ID>(dev);
+}
+
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef VIRTIO_FS_DRIVER_H
+#define VIRTIO_FS_DRIVER_H
+
+#include "drivers/virtio.hh"
+#include "drivers/pci-device.hh"
+#include "fs/virtiofs/fuse_kernel.h"
+#include <osv/mutex.h>
+#include <osv/wait_record.hh>
+
+namespace virtio {
+
+// A FUSE request: the device reads the header and in_args, and writes
+// the reply header and out_args. in_args and out_args can be anywhere in
+// memory, they are split by page for the device.
+struct fuse_request {
+    fuse_request() : in_header(), out_header(), w(sched::thread::current()) {}
+
+    fuse_in_header in_header;
+    void* in_args = nullptr;
+    u32 in_args_size = 0;
+
+    fuse_out_header out_header;
+    void* out_args = nullptr;
+    u32 out_args_size = 0;
+
+    waiter w;
+};
+
+// virtio-fs: FUSE over virtio, to share a directory of the host. The
+// device only exists with the virtio 1.0 pci transport. It can have a
+// "DAX window", shared memory into which the host maps parts of its files
+// on request, for the guest to access them in place.
+class fs : public virtio_driver {
+public:
+    enum {
+        VIRTIO_FS_DEVICE_ID = 0x1040 + VIRTIO_ID_FS,
+        VIRTIO_F_VERSION_1 = 32,
+    };
+
+    // Queue 0 is for high priority requests (FORGET), the rest are for
+    // all other requests
+    enum {
+        VIRTIO_FS_HIPRIO_QUEUE = 0,
+        VIRTIO_FS_REQUEST_QUEUE = 1,
+    };
+
+    struct fs_config {
+        char tag[36];
+        u32 num_request_queues;
+    } __attribute__((packed));
+
+    struct dax_window {
+        void* addr;
+        u64 len;
+    };
+
+    explicit fs(pci::device& dev);
+    virtual ~fs();
+
+    virtual std::string get_name() const { return _driver_name; }
+    virtual bool kick(int queue);
+    virtual u8 get_dev_status();
+    virtual void set_dev_status(u8 status);
+
+    // Sends req and waits for its reply. Returns the FUSE error, which is
+    // minus an errno, or 0.
+    int make_request(fuse_request* req);
+    // Tells the host we dropped nlookup references to nodeid. There is no
+    // reply, so this doesn't wait.
+    void send_forget(u64 nodeid, u64 nlookup);
+
+    const std::string& tag() const { return _tag; }
+    // addr is nullptr if the device has no DAX window
+    const dax_window& dax() const { return _dax; }
+
+    static hw_driver* probe(hw_device* dev);
+private:
+    // Where a virtio 1.0 capability points to
+    struct cap_region {
+        pci::bar* bar = nullptr;
+        u32 offset = 0;
+        u32 length = 0;
+
+        u8 readb(u32 off) { return bar->readb(offset + off); }
+        u16 readw(u32 off) { return bar->readw(offset + off); }
+        u32 readl(u32 off) { return bar->readl(offset + off); }
+        void writeb(u32 off, u8 val) { bar->writeb(offset + off, val); }
+        void writew(u32 off, u16 val) { bar->writew(offset + off, val); }
+        void writel(u32 off, u32 val) { bar->writel(offset + off, val); }
+        void writeq(u32 off, u64 val) {
+            writel(off, val);
+            writel(off + 4, val >> 32);
+        }
+    };
+
+    bool parse_caps();
+    bool negotiate_features();
+    void setup_queues();
+    void read_config();
+    bool ack_irq();
+    void req_done(unsigned queue);
+    void send(unsigned queue, fuse_request* req);
+
+    std::string _driver_name;
+    fs_config _config;
+    std::string _tag;
+    cap_region _common_cfg;
+    cap_region _notify_cfg;
+    u32 _notify_multiplier = 0;
+    cap_region _isr_cfg;
+    cap_region _device_cfg;
+    std::vector<u16> _notify_off;
+    dax_window _dax = {};
+
+    // maintains the virtio instance number for multiple devices
+    static int _instance;
+    int _id;
+    u64 _unique = 0;
+    // This mutex protects the queues from parallel requests
+    mutex _lock;
+    gsi_level_interrupt _gsi;
+};
+
+// The private data of the virtiofsN devices, which the file system mounts
+struct fs_priv {
+    fs* drv;
+};
+
+}
+#endif
@@ -37,10 +37,13 @@
 #include <bsd/sys/netinet/in.h>
 #include <bsd/sys/netinet/ip.h>
 #include <bsd/sys/netinet/udp.h>
+#include <bsd/sys/netinet/ip_var.h>
+#include <bsd/sys/netinet/udp_var.h>
 #include <bsd/sys/netinet/tcp.h>
 
 TRACEPOINT(trace_virtio_net_rx_packet, "if=%d, len=%d", int, int);
 TRACEPOINT(trace_virtio_net_rx_wake, "");
+TRACEPOINT(trace_virtio_net_rx_busy_poll, "if=%d, budget=%d", int, int);
 TRACEPOINT(trace_virtio_net_fill_rx_ring, "if=%d", int);
 TRACEPOINT(trace_virtio_net_fill_rx_ring_added, "if=%d, added=%d", int, int);
 TRACEPOINT(trace_virtio_net_tx_packet, "if=%d, len=%d", int, int);
@@ -130,6 +133,10 @@ static int if_transmit(struct ifnet* ifp, struct mbuf* m_head)
 
 inline int net::xmit(struct mbuf* buff)
 {
+    if (buff->M_dat.MH.MH_pkthdr.csum_flags & CSUM_UDP_SEG) {
+        return xmit_udp_segments(buff);
+    }
+
     //
     // We currently have only a single TX queue. Select a proper TXq here when
     // we implement a multi-queue.
@@ -137,6 +144,32 @@ inline int net::xmit(struct mbuf* buff)
     return _txq.xmit(buff);
 }
 
+int net::xmit_udp_segments(mbuf* buff)
+{
+    int off = sizeof(struct ether_header);
+    if (buff->m_hdr.mh_len < off) {
+        if ((buff = m_pullup(buff, off)) == nullptr)
+            return ENOBUFS;
+    }
+    if (ntohs(mtod(buff, struct ether_header*)->ether_type) == ETHERTYPE_VLAN) {
+        off = sizeof(struct ether_vlan_header);
+    }
+
+    // The IP header checksum of each datagram is ours to compute, while the
+    // host does the UDP ones.
+    int error = udp_segment(&buff, off, CSUM_DELAY_IP);
+    for (mbuf* next; buff; buff = next) {
+        next = buff->m_hdr.mh_nextpkt;
+        buff->m_hdr.mh_nextpkt = nullptr;
+        if (!error) {
+            error = _txq.xmit(buff);
+        } else {
+            m_freem(buff);
+        }
+    }
+    return error;
+}
+
 inline int net::txq::xmit(mbuf* buff)
 {
     return _xmitter.xmit(buff);
@@ -175,6 +208,13 @@ static void if_init(void* xsc)
     net_d("Virtio-net init");
 }
 
+static void if_busy_poll(struct ifnet* ifp, int budget)
+{
+    net* vnet = (net*)ifp->if_softc;
+
+    vnet->busy_poll(budget);
+}
+
 /**
  * Return all the statistics we have gathered.
  * @param ifp
@@ -276,15 +316,17 @@ net::net(pci::device& dev)
     _ifn->if_qflush = if_qflush;
     _ifn->if_init = if_init;
     _ifn->if_getinfo = if_getinfo;
+    _ifn->if_busy_poll = if_busy_poll;
     IFQ_SET_MAXLEN(&_ifn->if_snd, _txq.vqueue->size());
 
-    _ifn->if_capabilities = 0;
+    // See xmit_one_locked()
+    _ifn->if_capabilities = IFCAP_TXQTAG;
 
     if (_csum) {
         _ifn->if_capabilities |= IFCAP_TXCSUM;
         if (_host_tso4) {
             _ifn->if_capabilities |= IFCAP_TSO4;
-            _ifn->if_hwassist = CSUM_TCP | CSUM_UDP | CSUM_TSO;
+            _ifn->if_hwassist = CSUM_TCP | CSUM_UDP | CSUM_TSO | CSUM_UDP_SEG;
         }
     }
 
@@ -427,7 +469,6 @@ bool net::bad_rx_csum(struct mbuf* m, struct net_hdr* hdr)
 void net::receiver()
 {
     vring* vq = _rxq.vqueue;
-    std::vector<iovec> packet;
 
     while (1) {
 
@@ -435,91 +476,121 @@ void net::receiver()
         virtio_driver::wait_for_queue(vq, &vring::used_ring_not_empty);
         trace_virtio_net_rx_wake();
 
-        u32 len;
-        int nbufs;
-        u64 rx_drops = 0, rx_packets = 0, csum_ok = 0;
-        u64 csum_err = 0, rx_bytes = 0;
+        WITH_LOCK(_rx_lock) {
+            poll_rx(std::numeric_limits<int>::max());
+        }
+    }
+}
 
-        // use local header that we copy out of the mbuf since we're
-        // truncating it.
-        net_hdr_mrg_rxbuf* mhdr;
+void net::busy_poll(int budget)
+{
+    // Leave it to the receiver, or to another busy poller, if it's at it
+    if (!_rxq.vqueue->used_ring_not_empty() || !_rx_lock.try_lock()) {
+        return;
+    }
+    trace_virtio_net_rx_busy_poll(_ifn->if_index, budget);
+    poll_rx(budget);
+
+    // The receiver may be asleep with the interrupt armed for where the ring
+    // was before we took packets off it: re-arm it, and have the receiver
+    // take whatever we left.
+    auto vq = _rxq.vqueue;
+    vq->enable_interrupts();
+    if (vq->used_ring_not_empty()) {
+        _rxq.poll_task.wake();
+    }
+    _rx_lock.unlock();
+}
 
-        while (void* page = vq->get_buf_elem(&len)) {
+void net::poll_rx(int budget)
+{
+    vring* vq = _rxq.vqueue;
+    auto& packet = _rx_packet;
+    void* page;
+    u32 len;
+    int nbufs;
+    u64 rx_drops = 0, rx_packets = 0, csum_ok = 0;
+    u64 csum_err = 0, rx_bytes = 0;
 
-            // TODO: should get out of the loop
-            vq->get_buf_finalize();
+    // use local header that we copy out of the mbuf since we're
+    // truncating it.
+    net_hdr_mrg_rxbuf* mhdr;
 
-            // Bad packet/buffer - discard and continue to the next one
-            if (len < _hdr_size + ETHER_HDR_LEN) {
-                rx_drops++;
-                memory::free_page(page);
+    while (rx_packets < u64(budget) && (page = vq->get_buf_elem(&len))) {
 
-                continue;
-            }
+        // TODO: should get out of the loop
+        vq->get_buf_finalize();
 
-            mhdr = static_cast<net_hdr_mrg_rxbuf*>(page);
+        // Bad packet/buffer - discard and continue to the next one
+        if (len < _hdr_size + ETHER_HDR_LEN) {
+            rx_drops++;
+            memory::free_page(page);
 
-            if (!_mergeable_bufs) {
-                nbufs = 1;
-            } else {
-                nbufs = mhdr->num_buffers;
-            }
+            continue;
+        }
 
-            packet.push_back({page + _hdr_size, len - _hdr_size});
-
-            // Read the fragments
-            while (--nbufs > 0) {
-                page = vq->get_buf_elem(&len);
-                if (!page) {
-                    rx_drops++;
-                    for (auto&& v : packet) {
-                        free_buffer(v);
-                    }
-                    break;
-                }
-                packet.push_back({page, len});
-                vq->get_buf_finalize();
-            }
+        mhdr = static_cast<net_hdr_mrg_rxbuf*>(page);
 
-            auto m_head = packet_to_mbuf(packet);
-            packet.clear();
+        if (!_mergeable_bufs) {
+            nbufs = 1;
+        } else {
+            nbufs = mhdr->num_buffers;
+        }
 
-            if ((_ifn->if_capenable & IFCAP_RXCSUM) &&
-                (mhdr->hdr.flags &
-                 net_hdr::VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
-                if (bad_rx_csum(m_head, &mhdr->hdr))
-                    csum_err++;
-                else
-                    csum_ok++;
+        packet.push_back({page + _hdr_size, len - _hdr_size});
 
+        // Read the fragments
+        while (--nbufs > 0) {
+            page = vq->get_buf_elem(&len);
+            if (!page) {
+                rx_drops++;
+                for (auto&& v : packet) {
+                    free_buffer(v);
+                }
+                break;
             }
+            packet.push_back({page, len});
+            vq->get_buf_finalize();
+        }
 
-            rx_packets++;
-            rx_bytes += m_head->M_dat.MH.MH_pkthdr.len;
+        auto m_head = packet_to_mbuf(packet);
+        packet.clear();
 
-            bool fast_path = _ifn->if_classifier.post_packet(m_head);
-            if (!fast_path) {
-                (*_ifn->if_input)(_ifn, m_head);
-            }
+        if ((_ifn->if_capenable & IFCAP_RXCSUM) &&
+            (mhdr->hdr.flags &
+             net_hdr::VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+            if (bad_rx_csum(m_head, &mhdr->hdr))
+                csum_err++;
+            else
+                csum_ok++;
+
+        }
 
-            trace_virtio_net_rx_packet(_ifn->if_index, rx_bytes);
+        rx_packets++;
+        rx_bytes += m_head->M_dat.MH.MH_pkthdr.len;
 
-            // The interface may have been stopped while we were
-            // passing the packet up the network stack.
-            if ((_ifn->if_drv_flags & IFF_DRV_RUNNING) == 0)
-                break;
+        bool fast_path = _ifn->if_classifier.post_packet(m_head);
+        if (!fast_path) {
+            (*_ifn->if_input)(_ifn, m_head);
         }
 
-        if (vq->refill_ring_cond())
-            fill_rx_ring();
+        trace_virtio_net_rx_packet(_ifn->if_index, rx_bytes);
 
-        // Update the stats
-        _rxq.stats.rx_drops      += rx_drops;
-        _rxq.stats.rx_packets    += rx_packets;
-        _rxq.stats.rx_csum       += csum_ok;
-        _rxq.stats.rx_csum_err   += csum_err;
-        _rxq.stats.rx_bytes      += rx_bytes;
+        // The interface may have been stopped while we were
+        // passing the packet up the network stack.
+        if ((_ifn->if_drv_flags & IFF_DRV_RUNNING) == 0)
+            break;
     }
+
+    if (vq->refill_ring_cond())
+        fill_rx_ring();
+
+    // Update the stats
+    _rxq.stats.rx_drops      += rx_drops;
+    _rxq.stats.rx_packets    += rx_packets;
+    _rxq.stats.rx_csum       += csum_ok;
+    _rxq.stats.rx_csum_err   += csum_err;
+    _rxq.stats.rx_bytes      += rx_bytes;
 }
 
 mbuf* net::packet_to_mbuf(const std::vector<iovec>& packet)
@@ -707,6 +778,11 @@ void net::txq::xmit_one_locked(void* _req)
 
     trace_virtio_net_tx_packet(_parent->_ifn->if_index, vqueue->_sg_vec.size());
 
+    // The packet has left the stack's TX path, even though its buffers are
+    // only reclaimed in gc(): let the senders that wait for it know (see
+    // TCP autocorking).
+    m_tag_delete_nonpersistent(req->mb);
+
     // Update the statistics
     update_stats(req);
 
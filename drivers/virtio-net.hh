@@ -217,6 +217,11 @@ public:
     void wait_for_queue(vring* queue);
     bool bad_rx_csum(struct mbuf* m, struct net_hdr* hdr);
     void receiver();
+    /**
+     * Receive up to budget packets, from a thread busy polling a net channel
+     * the interface feeds, unless the receiver is at it already
+     */
+    void busy_poll(int budget);
     void fill_rx_ring();
     mbuf* packet_to_mbuf(const std::vector<iovec>& iovec);
     static void free_buffer_and_refcnt(void* buffer, void* refcnt);
@@ -245,6 +250,11 @@ public:
      */
     int xmit(mbuf* buff);
 private:
+    /**
+     * Transmit the datagrams of a UDP_SEGMENT frame, split here: legacy
+     * devices can't negotiate the host doing it (VIRTIO_NET_F_HOST_USO).
+     */
+    int xmit_udp_segments(mbuf* buff);
 
     struct net_req {
         explicit net_req(mbuf *m) : mb(m) {
@@ -466,6 +476,11 @@ private:
 
     /* We currently support only a single Rx+Tx queue */
     struct rxq _rxq;
+    // Held while receiving, by the receiver or by a busy poller
+    mutex _rx_lock;
+    void poll_rx(int budget);
+    // poll_rx()'s, under _rx_lock, to not allocate for every call
+    std::vector<iovec> _rx_packet;
     struct txq _txq;
 
     //maintains the virtio instance number for multiple drives
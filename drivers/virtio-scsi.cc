@@ -75,13 +75,15 @@ struct driver scsi_driver = {
 
 int scsi::exec_cmd(struct bio *bio)
 {
-    auto queue = get_virt_queue(VIRTIO_SCSI_QUEUE_REQ);
     auto req = static_cast<scsi_virtio_req*>(bio->bio_private);
     auto &req_cmd = req->req.cmd;
     auto &resp_cmd = req->resp.cmd;
 
     memcpy(req_cmd.cdb, req->cdb, req->cdb_len);
 
+    auto& q = queue_for_cpu();
+    SCOPE_LOCK(q.lock);
+    auto queue = q.vq;
     queue->init_sg();
     queue->add_out_sg(&req_cmd, sizeof(req_cmd));
     if (cdb_data_in(req_cmd.cdb)) {
@@ -130,7 +132,7 @@ void scsi::add_lun(u16 target, u16 lun)
 bool scsi::ack_irq()
 {
     auto isr = virtio_conf_readb(VIRTIO_PCI_ISR);
-    auto queue = get_virt_queue(VIRTIO_SCSI_QUEUE_REQ);
+    auto queue = _req_queues[0]->vq;
 
     if (isr) {
         queue->disable_interrupts();
@@ -151,25 +153,41 @@ scsi::scsi(pci::device& dev)
     setup_features();
     read_config();
 
-    //register the single irq callback for the block
-    sched::thread* t = new sched::thread([this] { this->req_done(); },
-            sched::thread::attr().name("virtio-scsi"));
-    t->start();
-    auto queue = get_virt_queue(VIRTIO_SCSI_QUEUE_REQ);
+    // Without MSI-X, all completions come through one interrupt
+    unsigned nr_queues = 1;
+    if (dev.is_msix()) {
+        nr_queues = std::max(1u, std::min<unsigned>(_config.num_queues, sched::cpus.size()));
+    }
+    std::vector<msix_binding> bindings {
+        { VIRTIO_SCSI_QUEUE_CTRL, nullptr, nullptr },
+        { VIRTIO_SCSI_QUEUE_EVT, nullptr, nullptr },
+    };
+    std::vector<sched::thread*> threads;
+    for (unsigned i = 0; i < nr_queues; i++) {
+        auto queue = get_virt_queue(VIRTIO_SCSI_QUEUE_REQ + i);
+        if (!queue) {
+            break;
+        }
+        _req_queues.emplace_back(new req_queue(queue));
+        auto attr = sched::thread::attr().name("virtio-scsi" + std::to_string(i));
+        if (dev.is_msix()) {
+            attr.pin(sched::cpus[i]);
+        }
+        sched::thread* t = new sched::thread([this, queue] { this->req_done(queue); }, attr);
+        t->start();
+        threads.push_back(t);
+        bindings.push_back({ VIRTIO_SCSI_QUEUE_REQ + i, [=] { queue->disable_interrupts(); }, t });
+        // Enable indirect descriptor
+        queue->set_use_indirect(true);
+    }
 
     if (dev.is_msix()) {
-        _msi.easy_register({
-                { VIRTIO_SCSI_QUEUE_CTRL, nullptr, nullptr },
-                { VIRTIO_SCSI_QUEUE_EVT, nullptr, nullptr },
-                { VIRTIO_SCSI_QUEUE_REQ, [=] { queue->disable_interrupts(); }, t },
-        });
+        _msi.easy_register(bindings);
     } else {
+        auto t = threads[0];
         _gsi.set_ack_and_handler(dev.get_interrupt_line(), [=] { return this->ack_irq(); }, [=] { t->wake(); });
     }
 
-    // Enable indirect descriptor
-    queue->set_use_indirect(true);
-
     add_dev_status(VIRTIO_CONFIG_S_DRIVER_OK);
 
     scan();
@@ -187,10 +205,8 @@ void scsi::read_config()
     config.max_target = _config.max_target;
 }
 
-void scsi::req_done()
+void scsi::req_done(vring* queue)
 {
-    auto queue = get_virt_queue(VIRTIO_SCSI_QUEUE_REQ);
-
     while (1) {
 
         virtio_driver::wait_for_queue(queue, &vring::used_ring_not_empty);
@@ -219,20 +235,18 @@ void scsi::req_done()
 
 int scsi::make_request(struct bio* bio)
 {
-    WITH_LOCK(_lock) {
-        if (!bio)
-            return EIO;
-
-        struct scsi_priv *prv;
-        u16 target = 0, lun = 0;
-        if (bio->bio_cmd != BIO_SCSI) {
-            prv = scsi::get_priv(bio);
-            target = prv->target;
-            lun = prv->lun;
-        }
-
-        return handle_bio(target, lun, bio);
+    if (!bio)
+        return EIO;
+
+    struct scsi_priv *prv;
+    u16 target = 0, lun = 0;
+    if (bio->bio_cmd != BIO_SCSI) {
+        prv = scsi::get_priv(bio);
+        target = prv->target;
+        lun = prv->lun;
     }
+
+    return handle_bio(target, lun, bio);
 }
 
 u32 scsi::get_driver_features()
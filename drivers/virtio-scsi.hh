@@ -12,6 +12,8 @@
 #include "drivers/scsi-common.hh"
 #include <osv/bio.h>
 #include <osv/types.h>
+#include <memory>
+#include <vector>
 
 namespace virtio {
 
@@ -157,7 +159,7 @@ public:
         return reinterpret_cast<struct scsi_priv*>(bio->bio_dev->private_data);
     }
 
-    void req_done();
+    void req_done(vring* queue);
     bool ack_irq();
     static hw_driver* probe(hw_device* dev);
 
@@ -180,8 +182,19 @@ private:
     static int _instance;
     int _id;
 
-    // This mutex protects parallel make_request invocations
-    mutex _lock;
+    // One request queue per cpu, as far as the device has them, each
+    // completed by a thread pinned to its cpu, which the queue's MSI-X
+    // vector follows. Submitters only serialize with others on their queue.
+    struct req_queue {
+        explicit req_queue(vring* vq) : vq(vq) {}
+        vring* vq;
+        // Protects parallel submissions on this queue
+        mutex lock;
+    };
+    std::vector<std::unique_ptr<req_queue>> _req_queues;
+    req_queue& queue_for_cpu() {
+        return *_req_queues[sched::cpu::current()->id % _req_queues.size()];
+    }
 };
 }
 #endif
@@ -127,6 +127,10 @@ class virtio_driver;
         virtual ~vring();
 
         u64 get_paddr();
+        // Where each part of the ring is, for the virtio 1.0 transport
+        u64 get_desc_paddr();
+        u64 get_avail_paddr();
+        u64 get_used_paddr();
         static unsigned get_size(unsigned int num, unsigned long align);
 
         // Ring operations
@@ -47,9 +47,30 @@ virtio_driver::virtio_driver(pci::device& dev)
     probe_virt_queues();
 }
 
+virtio_driver::virtio_driver(pci::device& dev, modern_transport)
+    : hw_driver()
+    , _dev(dev)
+    , _msi(&dev)
+    , _num_queues(0)
+    , _bar1(nullptr)
+    , _cap_indirect_buf(false)
+{
+    for (unsigned i = 0; i < max_virtqueues_nr; i++) {
+        _queues[i] = nullptr;
+    }
+    _dev.parse_pci_config();
+
+    _dev.set_bus_master(true);
+
+    _dev.msix_enable();
+}
+
 virtio_driver::~virtio_driver()
 {
-    reset_host_side();
+    // Modern devices were already reset by their driver
+    if (_bar1) {
+        reset_host_side();
+    }
     free_queues();
 }
 
@@ -27,6 +27,8 @@ enum VIRTIO_CONFIG {
     VIRTIO_CONFIG_S_DRIVER = 2,
     /* Driver has used its parts of the config, and is happy */
     VIRTIO_CONFIG_S_DRIVER_OK = 4,
+    /* Driver has acknowledged the features it understands (virtio 1.0) */
+    VIRTIO_CONFIG_S_FEATURES_OK = 8,
     /* We've given up on this device. */
     VIRTIO_CONFIG_S_FAILED = 0x80,
     /* Some virtio feature bits (currently bits 28 through 31) are reserved for the
@@ -97,6 +99,7 @@ enum {
     VIRTIO_ID_SCSI    = 8,
     VIRTIO_ID_9P      = 9,
     VIRTIO_ID_RPROC_SERIAL = 11,
+    VIRTIO_ID_FS      = 26,
 };
 
 #define VIRTIO_ALIGN(x) ((x + (VIRTIO_PCI_VRING_ALIGN-1)) & ~(VIRTIO_PCI_VRING_ALIGN-1))
@@ -133,8 +136,8 @@ public:
     bool get_guest_feature_bit(int bit);
 
     // device status
-    u8 get_dev_status();
-    void set_dev_status(u8 status);
+    virtual u8 get_dev_status();
+    virtual void set_dev_status(u8 status);
     void add_dev_status(u8 status);
     void del_dev_status(u8 status);
 
@@ -152,7 +155,7 @@ public:
     void virtio_conf_writew(u32 offset, u16 val) { _bar1->writew(offset, val);};
     void virtio_conf_writel(u32 offset, u32 val) { _bar1->writel(offset, val);};
 
-    bool kick(int queue);
+    virtual bool kick(int queue);
     void reset_host_side();
     void free_queues();
 
@@ -163,6 +166,12 @@ public:
 
     pci::device& pci_device() { return _dev; }
 protected:
+    // For devices which only speak the virtio 1.0 pci transport, whose
+    // registers are found through vendor capabilities instead of bar 1.
+    // The driver sets up the device and its queues itself.
+    struct modern_transport {};
+    virtio_driver(pci::device& dev, modern_transport);
+
     // Actual drivers should implement this on top of the basic ring features
     virtual u32 get_driver_features() { return 1 << VIRTIO_RING_F_INDIRECT_DESC | 1 << VIRTIO_RING_F_EVENT_IDX; }
     void setup_features();
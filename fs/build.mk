@@ -26,3 +26,6 @@ fs +=	devfs/devfs_vnops.o \
 	devfs/device.o
 
 fs +=	procfs/procfs_vnops.o
+
+fs +=	virtiofs/virtiofs_vnops.o \
+	virtiofs/virtiofs_dax.o
@@ -14,6 +14,8 @@
 #include <osv/debug.h>
 #include <osv/mutex.h>
 #include <osv/rcu.hh>
+#include <osv/app.hh>
+#include <vector>
 
 #include <bsd/sys/sys/queue.h>
 
@@ -26,6 +28,20 @@ using namespace osv;
 rcu_ptr<file> gfdt[FDMAX] = {};
 mutex_t gfdt_lock = MUTEX_INITIALIZER;
 
+/*
+ * The id of the application whose thread installed each descriptor (0 for
+ * none), so that the ones it leaves open can be closed when it is torn down.
+ * Ids aren't reused, unlike the application's address. Protected by
+ * gfdt_lock.
+ */
+static unsigned long gfdt_owner[FDMAX];
+
+static unsigned long current_owner()
+{
+    auto app = application::get_current();
+    return app ? app->get_id() : 0;
+}
+
 /*
  * Allocate a file descriptor and assign fd to it atomically.
  *
@@ -36,6 +52,7 @@ int _fdalloc(struct file *fp, int *newfd, int min_fd)
     int fd;
 
     fhold(fp);
+    auto owner = current_owner();
 
     for (fd = min_fd; fd < FDMAX; fd++) {
         if (gfdt[fd])
@@ -50,6 +67,7 @@ int _fdalloc(struct file *fp, int *newfd, int min_fd)
 
             /* Install */
             gfdt[fd].assign(fp);
+            gfdt_owner[fd] = owner;
             *newfd = fd;
         }
 
@@ -88,6 +106,7 @@ int fdclose(int fd)
         }
 
         gfdt[fd].assign(nullptr);
+        gfdt_owner[fd] = 0;
     }
 
     fdrop(fp);
@@ -95,6 +114,28 @@ int fdclose(int fd)
     return 0;
 }
 
+int fdclose_owned(unsigned long owner)
+{
+    std::vector<struct file*> owned;
+
+    WITH_LOCK(gfdt_lock) {
+        for (int fd = 0; fd < FDMAX; fd++) {
+            if (gfdt_owner[fd] == owner) {
+                owned.push_back(gfdt[fd].read_by_owner());
+                gfdt[fd].assign(nullptr);
+                gfdt_owner[fd] = 0;
+            }
+        }
+    }
+
+    /* Outside the lock, as the last fdrop() closes the file */
+    for (auto fp : owned) {
+        fdrop(fp);
+    }
+
+    return owned.size();
+}
+
 /*
  * Assigns a file pointer to a specific file descriptor.
  * Grabs a reference to the file pointer if successful.
@@ -107,11 +148,13 @@ int fdset(int fd, struct file *fp)
         return EBADF;
 
     fhold(fp);
+    auto owner = current_owner();
 
     WITH_LOCK(gfdt_lock) {
         orig = gfdt[fd].read_by_owner();
         /* Install new file structure in place */
         gfdt[fd].assign(fp);
+        gfdt_owner[fd] = owner;
     }
 
     if (orig)
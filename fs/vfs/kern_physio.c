@@ -93,7 +93,7 @@ static void multiplex_bio_done(struct bio *b)
 	if (error) {
 		pthread_mutex_lock(&bio->bio_mutex);
 		bio->bio_flags |= BIO_ERROR;
-		pthread_mutex_lock(&bio->bio_mutex);
+		pthread_mutex_unlock(&bio->bio_mutex);
 	}
 
 	// Last one releases it. We set the biodone to always be "ok", because
@@ -76,6 +76,7 @@
 
 #include <mntent.h>
 #include <sys/mman.h>
+#include <osv/mmu.hh>
 
 #include <osv/clock.hh>
 #include <api/utime.h>
@@ -1381,6 +1382,21 @@ int fcntl(int fd, int cmd, int arg)
     case F_GETLK:
         WARN_ONCE("fcntl(F_GETLK) stubbed\n");
         break;
+    case F_ADD_SEALS:
+    case F_GET_SEALS: {
+        // Only shared memory can be sealed
+        auto shm = dynamic_cast<mmu::shm_file*>(fp);
+        if (!shm) {
+            error = EINVAL;
+        } else if (cmd == F_GET_SEALS) {
+            ret = shm->seals();
+        } else if (!(fp->f_flags & FWRITE)) {
+            error = EPERM;
+        } else {
+            error = shm->add_seals(arg);
+        }
+        break;
+    }
     default:
         kprintf("unsupported fcntl cmd 0x%x\n", cmd);
         error = EINVAL;
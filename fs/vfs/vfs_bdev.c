@@ -12,11 +12,139 @@
 #include <string.h>
 #include <stdio.h>
 
+#include <sys/param.h>
+
 #include <osv/device.h>
 #include <osv/prex.h>
 #include <osv/buf.h>
 #include <osv/bio.h>
 
+/*
+ * I/O of whole blocks bypasses the buffer cache: it goes between the device
+ * and the caller's buffers in requests as large as the device takes, a
+ * round of them in flight at once. Buffers the device can't reach, or that
+ * are not block aligned (as some devices need), are bounced, still in large
+ * requests. Only I/O splitting blocks between
+ * iovecs goes through the cache, a block at a time.
+ */
+
+/* Most bytes, and requests, of a round */
+#define	DIRECT_ROUND_MAX	(16 << 20)
+#define	DIRECT_ROUND_BIOS	64
+
+static int
+bdev_direct_ok(struct uio *uio)
+{
+	int i;
+
+	if (uio->uio_offset % BSIZE)
+		return 0;
+	for (i = 0; i < uio->uio_iovcnt; i++)
+		if (uio->uio_iov[i].iov_len % BSIZE)
+			return 0;
+	return 1;
+}
+
+static void
+uio_advance(struct uio *uio, size_t n)
+{
+	struct iovec *iov;
+	size_t cnt;
+
+	uio->uio_resid -= n;
+	uio->uio_offset += n;
+	while (n > 0) {
+		iov = uio->uio_iov;
+		cnt = MIN(iov->iov_len, n);
+		iov->iov_base = (char *)iov->iov_base + cnt;
+		iov->iov_len -= cnt;
+		n -= cnt;
+		if (iov->iov_len == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+		}
+	}
+}
+
+static int
+bdev_direct(struct device *dev, struct uio *uio)
+{
+	struct bio *bios[DIRECT_ROUND_BIOS];
+	void *bounced[DIRECT_ROUND_BIOS];
+	int write = uio->uio_rw == UIO_WRITE;
+	size_t max, len, skip, total;
+	struct iovec *iov;
+	int i, n, ret = 0;
+
+	max = MIN(dev->max_io_size, DIRECT_ROUND_MAX) & ~(size_t)(BSIZE - 1);
+	if (max == 0)
+		max = BSIZE;
+
+	bsync_range(dev, uio->uio_offset >> 9, uio->uio_resid >> 9, write);
+
+	while (uio->uio_resid > 0 && !ret) {
+		iov = uio->uio_iov;
+		skip = 0;
+		total = 0;
+
+		bio_user_io_begin();
+		for (n = 0; n < DIRECT_ROUND_BIOS && total < uio->uio_resid &&
+		    total < DIRECT_ROUND_MAX; n++) {
+			while (iov->iov_len == skip) {
+				iov++;
+				skip = 0;
+			}
+			len = MIN(MIN(iov->iov_len - skip, max),
+			    DIRECT_ROUND_MAX - total);
+
+			bios[n] = alloc_bio();
+			if (!bios[n]) {
+				ret = ENOMEM;
+				break;
+			}
+			bios[n]->bio_cmd = write ? BIO_WRITE : BIO_READ;
+			bios[n]->bio_dev = dev;
+			bios[n]->bio_offset = uio->uio_offset + total;
+			bios[n]->bio_bcount = len;
+			bios[n]->bio_data = (char *)iov->iov_base + skip;
+			bounced[n] = NULL;
+			if ((uintptr_t)bios[n]->bio_data % BSIZE ||
+			    !bio_user_io_direct(bios[n]->bio_data, len)) {
+				bounced[n] = bios[n]->bio_data;
+				bios[n]->bio_data = aligned_alloc(BSIZE, len);
+				if (!bios[n]->bio_data) {
+					destroy_bio(bios[n]);
+					ret = ENOMEM;
+					break;
+				}
+				if (write)
+					memcpy(bios[n]->bio_data, bounced[n], len);
+			}
+			dev->driver->devops->strategy(bios[n]);
+			skip += len;
+			total += len;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (bio_wait(bios[i]))
+				ret = EIO;
+			if (bounced[i]) {
+				if (!write && !ret)
+					memcpy(bounced[i], bios[i]->bio_data,
+					    bios[i]->bio_bcount);
+				free(bios[i]->bio_data);
+			}
+			destroy_bio(bios[i]);
+		}
+		bio_user_io_end();
+
+		if (!ret)
+			uio_advance(uio, total);
+	}
+
+	return ret;
+}
+
 int
 bdev_read(struct device *dev, struct uio *uio, int ioflags)
 {
@@ -38,7 +166,9 @@ bdev_read(struct device *dev, struct uio *uio, int ioflags)
 		return EINVAL;
 	if (uio->uio_resid == 0)
 		return 0;
-    
+	if (bdev_direct_ok(uio))
+		return bdev_direct(dev, uio);
+
 	while (uio->uio_resid > 0) {
 		ret = bread(dev, uio->uio_offset >> 9, &bp);
 		if (ret)
@@ -75,7 +205,9 @@ bdev_write(struct device *dev, struct uio *uio, int ioflags)
 		return EINVAL;
 	if (uio->uio_resid == 0)
 		return 0;
-    
+	if (bdev_direct_ok(uio))
+		return bdev_direct(dev, uio);
+
 	while (uio->uio_resid > 0) {
 		bp = getblk(dev, uio->uio_offset >> 9);
 
@@ -125,9 +257,11 @@ physio(struct device *dev, struct uio *uio, int ioflags)
 		bio->bio_offset = uio->uio_offset;
 		bio->bio_bcount = uio->uio_resid;
 
+		bio_user_io_begin();
 		dev->driver->devops->strategy(bio);
 
 		ret = bio_wait(bio);
+		bio_user_io_end();
 		destroy_bio(bio);
 		if (ret)
 			return ret;
@@ -351,6 +351,44 @@ binval(struct device *dev)
 	BIO_UNLOCK();
 }
 
+/*
+ * Make the cache agree with I/O of nblks blocks from blkno that bypasses
+ * it: write out their delayed writes, and if inval (the I/O writes them),
+ * invalidate them.
+ */
+void
+bsync_range(struct device *dev, int blkno, int nblks, int inval)
+{
+	struct buf *bp;
+	int i;
+
+ start:
+	BIO_LOCK();
+	for (i = 0; i < NBUFS; i++) {
+		bp = &buf_table[i];
+		if (bp->b_dev != dev || ISSET(bp->b_flags, B_INVAL) ||
+		    bp->b_blkno < blkno || bp->b_blkno >= blkno + nblks)
+			continue;
+		if (ISSET(bp->b_flags, B_BUSY)) {
+			BIO_UNLOCK();
+			mutex_lock(&bp->b_lock);
+			mutex_unlock(&bp->b_lock);
+			goto start;
+		}
+		if (ISSET(bp->b_flags, B_DELWRI)) {
+			bio_remove(bp);
+			SET(bp->b_flags, B_BUSY);
+			mutex_lock(&bp->b_lock);
+			BIO_UNLOCK();
+			bwrite(bp);
+			goto start;
+		}
+		if (inval)
+			bp->b_flags = B_INVAL;
+	}
+	BIO_UNLOCK();
+}
+
 /*
  * Invalidate all buffers.
  * This is called when unmount.
@@ -49,11 +49,13 @@ extern struct vfsops ramfs_vfsops;
 extern struct vfsops devfs_vfsops;
 extern struct vfsops procfs_vfsops;
 extern struct vfsops zfs_vfsops;
+extern struct vfsops virtiofs_vfsops;
 
 extern int ramfs_init(void);
 extern int devfs_init(void);
 extern int procfs_init(void);
 extern int zfs_init(void);
+extern int virtiofs_init(void);
 
 /*
  * VFS switch table
@@ -63,5 +65,6 @@ const struct vfssw vfssw[] = {
 	{"devfs",	devfs_init,	&devfs_vfsops},
 	{"procfs",	procfs_init,	&procfs_vfsops},
 	{"zfs",		zfs_init,	&zfs_vfsops},
+	{"virtiofs",	virtiofs_init,	&virtiofs_vfsops},
 	{NULL,		fs_noop,	NULL},
 };
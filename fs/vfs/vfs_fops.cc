@@ -13,7 +13,9 @@
 #include <fs/vfs/vfs.h>
 #include <osv/vfs_file.hh>
 #include <osv/mmu.hh>
+#include <osv/mempool.hh>
 #include <osv/pagecache.hh>
+#include <string.h>
 
 vfs_file::vfs_file(unsigned flags)
 	: file(flags, DTYPE_VNODE)
@@ -140,14 +142,91 @@ int vfs_file::chmod(mode_t mode)
 
 bool vfs_file::map_page(uintptr_t off, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pte, bool write, bool shared)
 {
+    if (f_dentry->d_vnode->v_op->vop_dax) {
+        return map_dax_page(off, ptep, pte, write, shared);
+    }
     return pagecache::get(this, off, ptep, pte, write, shared);
 }
 
 bool vfs_file::put_page(void *addr, uintptr_t off, mmu::hw_ptep<0> ptep)
 {
+    if (f_dentry->d_vnode->v_op->vop_dax) {
+        return put_dax_page(addr, off, ptep);
+    }
     return pagecache::release(this, addr, off, ptep);
 }
 
+// Reads a page of the file into a page of our own
+void vfs_file::read_page(void* page, off_t offset)
+{
+    struct vnode *vp = f_dentry->d_vnode;
+
+    iovec io[1];
+
+    io[0].iov_base = page;
+    io[0].iov_len = mmu::page_size;
+    uio data;
+    data.uio_iov = io;
+    data.uio_iovcnt = 1;
+    data.uio_offset = offset;
+    data.uio_resid = mmu::page_size;
+    data.uio_rw = UIO_READ;
+
+    vn_lock(vp);
+    VOP_READ(vp, this, &data, 0);
+    vn_unlock(vp);
+
+    // past the end of the file, or on error
+    memset(static_cast<char*>(page) + mmu::page_size - data.uio_resid, 0, data.uio_resid);
+}
+
+// Files of a DAX file system are mapped in place, bypassing the page
+// cache: the file system gives us the address of the file's page, and we
+// map it as is, cow for private mappings. Only private writes, or a file
+// system running out of room to map file pages, make us copy.
+bool vfs_file::map_dax_page(uintptr_t off, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pte, bool write, bool shared)
+{
+    struct vnode *vp = f_dentry->d_vnode;
+    void* addr;
+    int error = VOP_DAX(vp, this, DAX_ACTION_GET, off, &addr);
+
+    if (!error && !(write && !shared)) {
+        if (!mmu::write_pte(addr, ptep, mmu::pte_mark_cow(pte, !shared))) {
+            VOP_DAX(vp, this, DAX_ACTION_PUT, off, &addr);
+            return false;
+        }
+        return true;
+    }
+
+    void* page = memory::alloc_page();
+    if (!error) {
+        memcpy(page, addr, mmu::page_size);
+        VOP_DAX(vp, this, DAX_ACTION_PUT, off, &addr);
+    } else {
+        read_page(page, off);
+    }
+    // A private write replaces the file's page if it was mapped here
+    auto old = ptep.read();
+    if (!mmu::write_pte(page, ptep, pte)) {
+        memory::free_page(page);
+        return false;
+    }
+    if (old.valid()) {
+        void* old_addr = mmu::phys_to_virt(old.addr());
+        VOP_DAX(vp, this, DAX_ACTION_PUT, off, &old_addr);
+    }
+    return true;
+}
+
+bool vfs_file::put_dax_page(void *addr, uintptr_t off, mmu::hw_ptep<0> ptep)
+{
+    struct vnode *vp = f_dentry->d_vnode;
+
+    mmu::clear_pte(ptep);
+    // The file system takes back its pages, copies are ours to free
+    return VOP_DAX(vp, this, DAX_ACTION_PUT, off, &addr) != 0;
+}
+
 void vfs_file::sync(off_t start, off_t end)
 {
     pagecache::sync(this, start, end);
@@ -182,6 +261,9 @@ std::unique_ptr<mmu::file_vma> vfs_file::mmap(addr_range range, unsigned flags,
 {
 	auto fp = this;
 	struct vnode *vp = fp->f_dentry->d_vnode;
+	if (vp->v_op->vop_dax) {
+		return mmu::map_file_mmap(this, range, flags, perm, offset);
+	}
 	if (!vp->v_op->vop_cache || (vp->v_size < (off_t)mmu::page_size)) {
 		return mmu::default_file_mmap(this, range, flags, perm, offset);
 	}
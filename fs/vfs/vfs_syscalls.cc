@@ -1130,8 +1130,9 @@ sys_ftruncate(struct file *fp, off_t length)
 	struct vnode *vp;
 	int error;
 
+	/* Files not in the file system, like shared memory, size themselves */
 	if (!fp->f_dentry)
-		return EBADF;
+		return fp->truncate(length);
 
 	vp = fp->f_dentry->d_vnode;
 	vn_lock(vp);
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef VIRTIOFS_HH
+#define VIRTIOFS_HH
+
+#include "drivers/virtio-fs.hh"
+#include "fuse_kernel.h"
+
+#include <osv/mutex.h>
+#include <sys/types.h>
+#include <boost/intrusive/list.hpp>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// A read-only file system for a directory the host shares with virtio-fs.
+// File contents are read through the device's DAX window when it has one:
+// the host maps the file there, and we copy from it, or map its pages
+// into the application (see vfs_file::map_page()).
+namespace virtiofs {
+
+// The vnode's v_data
+struct inode {
+    uint64_t nodeid;
+    // LOOKUPs the host counted for this node, which we FORGET when done
+    uint64_t nlookup;
+    fuse_attr attr;
+};
+
+// The file's f_data
+struct file_handle {
+    uint64_t fh;
+    // READDIR replies are read one entry at a time: the rest of the last
+    // one, and the directory offset it starts at
+    std::vector<char> dirbuf;
+    size_t dirpos = 0;
+    off_t diroff = -1;
+};
+
+// The DAX window, divided in 2MB chunks, each mapping (part of) a 2MB
+// aligned range of a file. Chunks are mapped on demand, and when the
+// window is full, the least recently used chunk no page is mapped from
+// is remapped.
+class dax_window {
+public:
+    static constexpr size_t chunk_size = 2 << 20;
+
+    explicit dax_window(virtio::fs& drv);
+
+    // Gets the address of the file's byte at offset, and how many bytes
+    // after it are mapped; the chunk stays mapped until put(). Returns
+    // EINVAL past the end of the file, and ENOMEM if every chunk is in use.
+    int get(inode* ip, uint64_t fh, off_t offset, void** addr, size_t* len);
+    // Drops the reference get() took on addr's chunk. Returns false if
+    // addr is not in the window.
+    bool put(void* addr);
+    // Forgets the chunks of a node the host may reuse the id of
+    void drop(uint64_t nodeid);
+private:
+    struct chunk {
+        uint64_t nodeid;
+        off_t foffset;
+        size_t len;
+        unsigned refs = 0;
+        boost::intrusive::list_member_hook<> lru_hook;
+    };
+    typedef boost::intrusive::list<chunk,
+        boost::intrusive::member_hook<chunk,
+            boost::intrusive::list_member_hook<>, &chunk::lru_hook>,
+        boost::intrusive::constant_time_size<false>> lru_list;
+    struct key_hash {
+        size_t operator()(const std::pair<uint64_t, off_t>& k) const {
+            return std::hash<uint64_t>()(k.first) ^ std::hash<off_t>()(k.second);
+        }
+    };
+
+    int setup_mapping(chunk& c, uint64_t fh);
+    char* chunk_addr(const chunk& c) {
+        return _addr + (&c - _chunks.data()) * chunk_size;
+    }
+
+    virtio::fs& _drv;
+    char* _addr;
+    std::vector<chunk> _chunks;
+    // mapped chunks by node and file offset
+    std::unordered_map<std::pair<uint64_t, off_t>, chunk*, key_hash> _mapped;
+    // chunks without references, least recently used first
+    lru_list _lru;
+    mutex _lock;
+};
+
+struct mount_data {
+    virtio::fs* drv;
+    std::unique_ptr<dax_window> dax;
+};
+
+// Sends a request for nodeid, with in as its argument and out for its
+// reply, of which out_len gets the size. Returns an errno.
+int request(virtio::fs* drv, uint32_t opcode, uint64_t nodeid,
+            void* in, size_t in_size, void* out, size_t out_size,
+            size_t* out_len = nullptr);
+
+}
+
+#endif
@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include "virtiofs.hh"
+
+#include <osv/mmu.hh>
+#include <osv/trace.hh>
+#include <osv/align.hh>
+
+#include <algorithm>
+#include <errno.h>
+
+TRACEPOINT(trace_virtiofs_dax_map, "nodeid=%lu, foffset=%lx, len=%lx, moffset=%lx", uint64_t, off_t, size_t, size_t);
+TRACEPOINT(trace_virtiofs_dax_full, "nodeid=%lu, foffset=%lx", uint64_t, off_t);
+
+namespace virtiofs {
+
+dax_window::dax_window(virtio::fs& drv)
+    : _drv(drv)
+    , _addr(static_cast<char*>(drv.dax().addr))
+    , _chunks(drv.dax().len / chunk_size)
+{
+    for (auto& c : _chunks) {
+        c.nodeid = 0;
+        c.foffset = 0;
+        c.len = 0;
+        _lru.push_back(c);
+    }
+}
+
+// Replaces whatever the host had mapped at the chunk's place
+int dax_window::setup_mapping(chunk& c, uint64_t fh)
+{
+    fuse_setupmapping_in in = {};
+    in.fh = fh;
+    in.foffset = c.foffset;
+    in.len = c.len;
+    in.flags = FUSE_SETUPMAPPING_FLAG_READ;
+    in.moffset = chunk_addr(c) - _addr;
+    trace_virtiofs_dax_map(c.nodeid, c.foffset, c.len, in.moffset);
+    return request(&_drv, FUSE_SETUPMAPPING, c.nodeid, &in, sizeof(in), nullptr, 0);
+}
+
+int dax_window::get(inode* ip, uint64_t fh, off_t offset, void** addr, size_t* len)
+{
+    off_t size = align_up(off_t(ip->attr.size), off_t(mmu::page_size));
+    if (offset >= size) {
+        return EINVAL;
+    }
+    off_t foffset = align_down(offset, off_t(chunk_size));
+
+    WITH_LOCK(_lock) {
+        chunk* c;
+        auto i = _mapped.find({ip->nodeid, foffset});
+        if (i != _mapped.end()) {
+            c = i->second;
+        } else {
+            if (_lru.empty()) {
+                trace_virtiofs_dax_full(ip->nodeid, foffset);
+                return ENOMEM;
+            }
+            c = &_lru.front();
+            if (c->nodeid) {
+                _mapped.erase({c->nodeid, c->foffset});
+            }
+            if (c->len) {
+                // Pages of the chunk put() since may still be in some
+                // cpu's tlb
+                mmu::flush_tlb_all();
+            }
+            c->nodeid = ip->nodeid;
+            c->foffset = foffset;
+            c->len = std::min(off_t(chunk_size), size - foffset);
+            int error = setup_mapping(*c, fh);
+            if (error) {
+                c->nodeid = 0;
+                return error;
+            }
+            _mapped.emplace(std::make_pair(c->nodeid, c->foffset), c);
+        }
+
+        size_t delta = offset - foffset;
+        // The file grew since the chunk was mapped
+        if (delta >= c->len) {
+            return EINVAL;
+        }
+        if (c->refs++ == 0) {
+            _lru.erase(_lru.iterator_to(*c));
+        }
+        *addr = chunk_addr(*c) + delta;
+        if (len) {
+            *len = c->len - delta;
+        }
+    }
+    return 0;
+}
+
+bool dax_window::put(void* addr)
+{
+    auto p = static_cast<char*>(addr);
+    if (p < _addr || p >= _addr + _chunks.size() * chunk_size) {
+        return false;
+    }
+
+    WITH_LOCK(_lock) {
+        auto& c = _chunks[(p - _addr) / chunk_size];
+        assert(c.refs);
+        if (--c.refs == 0) {
+            _lru.push_back(c);
+        }
+    }
+    return true;
+}
+
+void dax_window::drop(uint64_t nodeid)
+{
+    WITH_LOCK(_lock) {
+        for (auto i = _mapped.begin(); i != _mapped.end();) {
+            auto c = i->second;
+            if (c->nodeid != nodeid) {
+                ++i;
+                continue;
+            }
+            // No file of the node is open, so nothing maps its pages
+            assert(!c->refs);
+            c->nodeid = 0;
+            i = _mapped.erase(i);
+            // This one can go first
+            _lru.erase(_lru.iterator_to(*c));
+            _lru.push_front(*c);
+        }
+    }
+}
+
+}
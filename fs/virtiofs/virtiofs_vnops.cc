@@ -0,0 +1,442 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include <osv/dentry.h>
+#include <osv/vnode.h>
+#include <osv/mount.h>
+#include <osv/prex.h>
+#include <osv/device.h>
+#include <osv/file.h>
+#include "fs/vfs/vfs.h"
+
+#include "virtiofs.hh"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+namespace virtiofs {
+
+// The most a READ or READDIR request asks for
+static constexpr size_t max_read = 128 << 10;
+static constexpr size_t dirbuf_size = 4096;
+
+int request(virtio::fs* drv, uint32_t opcode, uint64_t nodeid,
+            void* in, size_t in_size, void* out, size_t out_size,
+            size_t* out_len)
+{
+    virtio::fuse_request req;
+    req.in_header.opcode = opcode;
+    req.in_header.nodeid = nodeid;
+    req.in_args = in;
+    req.in_args_size = in_size;
+    req.out_args = out;
+    req.out_args_size = out_size;
+
+    int error = drv->make_request(&req);
+    if (out_len) {
+        *out_len = std::max(req.out_header.len, u32(sizeof(req.out_header))) - sizeof(req.out_header);
+    }
+    return -error;
+}
+
+static mount_data* to_mount(vnode* vp)
+{
+    return static_cast<mount_data*>(vp->v_mount->m_data);
+}
+
+static inode* to_inode(vnode* vp)
+{
+    return static_cast<inode*>(vp->v_data);
+}
+
+static file_handle* to_handle(file* fp)
+{
+    return static_cast<file_handle*>(fp->f_data);
+}
+
+static void set_vnode(vnode* vp, inode* ip)
+{
+    vp->v_data = ip;
+    vp->v_type = IFTOVT(ip->attr.mode);
+    vp->v_mode = ip->attr.mode & ~S_IFMT;
+    vp->v_size = ip->attr.size;
+}
+
+static int
+virtiofs_erofs(void)
+{
+    return EROFS;
+}
+
+static int
+virtiofs_open(file* fp)
+{
+    auto* vp = fp->f_dentry->d_vnode;
+    auto* m = to_mount(vp);
+
+    if (fp->f_flags & FWRITE) {
+        return EROFS;
+    }
+
+    fuse_open_in in = {};
+    in.flags = O_RDONLY;
+    fuse_open_out out = {};
+    int error = request(m->drv, vp->v_type == VDIR ? FUSE_OPENDIR : FUSE_OPEN,
+            to_inode(vp)->nodeid, &in, sizeof(in), &out, sizeof(out));
+    if (error) {
+        return error;
+    }
+
+    auto* h = new file_handle;
+    h->fh = out.fh;
+    fp->f_data = h;
+    return 0;
+}
+
+static int
+virtiofs_close(vnode* vp, file* fp)
+{
+    auto* h = to_handle(fp);
+    if (!h) {
+        return 0;
+    }
+
+    fuse_release_in in = {};
+    in.fh = h->fh;
+    request(to_mount(vp)->drv, vp->v_type == VDIR ? FUSE_RELEASEDIR : FUSE_RELEASE,
+            to_inode(vp)->nodeid, &in, sizeof(in), nullptr, 0);
+
+    delete h;
+    fp->f_data = nullptr;
+    return 0;
+}
+
+// Copies from the DAX window when the file could be mapped there, and has
+// the host copy into a buffer otherwise.
+static int
+virtiofs_read(vnode* vp, file* fp, uio* uio, int ioflags)
+{
+    auto* m = to_mount(vp);
+    auto* ip = to_inode(vp);
+    auto* h = to_handle(fp);
+    std::unique_ptr<char[]> buf;
+
+    if (vp->v_type == VDIR)
+        return EISDIR;
+    if (vp->v_type != VREG)
+        return EINVAL;
+    if (uio->uio_offset < 0)
+        return EINVAL;
+
+    while (uio->uio_resid > 0 && uio->uio_offset < (off_t)ip->attr.size) {
+        size_t len = std::min(uio->uio_resid, (off_t)ip->attr.size - uio->uio_offset);
+        int error;
+
+        void* addr;
+        size_t mapped;
+        if (m->dax && m->dax->get(ip, h->fh, uio->uio_offset, &addr, &mapped) == 0) {
+            error = uiomove(addr, std::min(len, mapped), uio);
+            m->dax->put(addr);
+            if (error) {
+                return error;
+            }
+            continue;
+        }
+
+        len = std::min(len, max_read);
+        if (!buf) {
+            buf.reset(new char[std::min(size_t(uio->uio_resid), max_read)]);
+        }
+        fuse_read_in in = {};
+        in.fh = h->fh;
+        in.offset = uio->uio_offset;
+        in.size = len;
+        size_t got;
+        error = request(m->drv, FUSE_READ, ip->nodeid, &in, sizeof(in),
+                buf.get(), len, &got);
+        if (error) {
+            return error;
+        }
+        if (!got) {
+            break;
+        }
+        error = uiomove(buf.get(), got, uio);
+        if (error) {
+            return error;
+        }
+    }
+
+    return 0;
+}
+
+static int
+virtiofs_readdir(vnode* vp, file* fp, dirent* dir)
+{
+    auto* h = to_handle(fp);
+
+    if (h->diroff != fp->f_offset || h->dirpos >= h->dirbuf.size()) {
+        h->dirbuf.resize(dirbuf_size);
+        fuse_read_in in = {};
+        in.fh = h->fh;
+        in.offset = fp->f_offset;
+        in.size = dirbuf_size;
+        size_t got;
+        int error = request(to_mount(vp)->drv, FUSE_READDIR, to_inode(vp)->nodeid,
+                &in, sizeof(in), h->dirbuf.data(), dirbuf_size, &got);
+        if (error) {
+            return error;
+        }
+        h->dirbuf.resize(got);
+        h->dirpos = 0;
+        h->diroff = fp->f_offset;
+    }
+
+    auto* d = reinterpret_cast<fuse_dirent*>(h->dirbuf.data() + h->dirpos);
+    if (h->dirpos + sizeof(*d) > h->dirbuf.size() ||
+        h->dirpos + FUSE_DIRENT_SIZE(d) > h->dirbuf.size()) {
+        return ENOENT;
+    }
+
+    // FUSE uses the DT_* types too
+    dir->d_type = d->type;
+    if (vfs_dname_copy((char *)&dir->d_name, std::string(d->name, d->namelen).c_str(),
+            sizeof(dir->d_name))) {
+        return EINVAL;
+    }
+    dir->d_fileno = d->ino;
+
+    h->dirpos += FUSE_DIRENT_SIZE(d);
+    fp->f_offset = h->diroff = d->off;
+
+    return 0;
+}
+
+static int
+virtiofs_lookup(vnode* dvp, char* name, vnode** vpp)
+{
+    auto* m = to_mount(dvp);
+
+    *vpp = nullptr;
+
+    if (!*name) {
+        return ENOENT;
+    }
+
+    fuse_entry_out entry = {};
+    int error = request(m->drv, FUSE_LOOKUP, to_inode(dvp)->nodeid,
+            name, strlen(name) + 1, &entry, sizeof(entry));
+    if (error) {
+        return error;
+    }
+    // a negative entry
+    if (!entry.nodeid) {
+        return ENOENT;
+    }
+
+    vnode* vp;
+    if (vget(dvp->v_mount, entry.nodeid, &vp)) {
+        /* found in cache */
+        to_inode(vp)->nlookup++;
+        *vpp = vp;
+        return 0;
+    }
+    if (!vp) {
+        m->drv->send_forget(entry.nodeid, 1);
+        return ENOMEM;
+    }
+    set_vnode(vp, new inode{entry.nodeid, 1, entry.attr});
+
+    *vpp = vp;
+
+    return 0;
+}
+
+static int
+virtiofs_getattr(vnode* vp, vattr* attr)
+{
+    auto* ip = to_inode(vp);
+
+    fuse_getattr_in in = {};
+    fuse_attr_out out = {};
+    int error = request(to_mount(vp)->drv, FUSE_GETATTR, ip->nodeid,
+            &in, sizeof(in), &out, sizeof(out));
+    if (error) {
+        return error;
+    }
+    ip->attr = out.attr;
+    vp->v_size = ip->attr.size;
+
+    attr->va_type = IFTOVT(ip->attr.mode);
+    attr->va_mode = ip->attr.mode & ~S_IFMT;
+    attr->va_nlink = ip->attr.nlink;
+    attr->va_uid = ip->attr.uid;
+    attr->va_gid = ip->attr.gid;
+    attr->va_nodeid = ip->attr.ino;
+    attr->va_atime = { time_t(ip->attr.atime), long(ip->attr.atimensec) };
+    attr->va_mtime = { time_t(ip->attr.mtime), long(ip->attr.mtimensec) };
+    attr->va_ctime = { time_t(ip->attr.ctime), long(ip->attr.ctimensec) };
+    attr->va_rdev = ip->attr.rdev;
+    attr->va_nblocks = ip->attr.blocks;
+    attr->va_size = ip->attr.size;
+    return 0;
+}
+
+static int
+virtiofs_readlink(vnode* vp, uio* uio)
+{
+    std::unique_ptr<char[]> buf(new char[PATH_MAX]);
+    size_t len;
+    int error = request(to_mount(vp)->drv, FUSE_READLINK, to_inode(vp)->nodeid,
+            nullptr, 0, buf.get(), PATH_MAX, &len);
+    if (error) {
+        return error;
+    }
+    return uiomove(buf.get(), std::min(len, size_t(uio->uio_resid)), uio);
+}
+
+// The vnode goes away, and the host can forget the node
+static int
+virtiofs_inactive(vnode* vp)
+{
+    auto* ip = to_inode(vp);
+    if (!ip) {
+        return 0;
+    }
+
+    auto* m = to_mount(vp);
+    if (m->dax) {
+        m->dax->drop(ip->nodeid);
+    }
+    if (ip->nlookup) {
+        m->drv->send_forget(ip->nodeid, ip->nlookup);
+    }
+    delete ip;
+    vp->v_data = nullptr;
+    return 0;
+}
+
+static int
+virtiofs_dax(vnode* vp, file* fp, int action, off_t offset, void** addr)
+{
+    auto* m = to_mount(vp);
+    if (!m->dax) {
+        return ENODEV;
+    }
+
+    switch (action) {
+    case DAX_ACTION_GET:
+        return m->dax->get(to_inode(vp), to_handle(fp)->fh, offset, addr, nullptr);
+    case DAX_ACTION_PUT:
+        return m->dax->put(*addr) ? 0 : ENOENT;
+    default:
+        return EINVAL;
+    }
+}
+
+// Mounts /dev/virtiofsN, read-only
+static int
+virtiofs_mount(mount* mp, const char *dev, int flags, const void* data)
+{
+    if (!mp->m_dev || strncmp(mp->m_dev->name, "virtiofs", 8)) {
+        return ENODEV;
+    }
+    auto* drv = static_cast<virtio::fs_priv*>(mp->m_dev->private_data)->drv;
+
+    fuse_init_in in = {};
+    in.major = FUSE_KERNEL_VERSION;
+    in.minor = FUSE_KERNEL_MINOR_VERSION;
+    in.flags = FUSE_MAP_ALIGNMENT;
+    fuse_init_out out = {};
+    int error = request(drv, FUSE_INIT, 0, &in, sizeof(in), &out, sizeof(out));
+    if (error) {
+        return error;
+    }
+    if (out.major != FUSE_KERNEL_VERSION) {
+        return EPROTONOSUPPORT;
+    }
+
+    fuse_getattr_in gin = {};
+    fuse_attr_out root = {};
+    error = request(drv, FUSE_GETATTR, FUSE_ROOT_ID, &gin, sizeof(gin),
+            &root, sizeof(root));
+    if (error) {
+        return error;
+    }
+
+    auto* m = new mount_data{drv, nullptr};
+    // Chunks must start where the host can map files
+    if (drv->dax().addr && drv->dax().len >= dax_window::chunk_size &&
+        (!(out.flags & FUSE_MAP_ALIGNMENT) ||
+         (1ull << out.map_alignment) <= dax_window::chunk_size)) {
+        m->dax.reset(new dax_window(*drv));
+    }
+    mp->m_data = m;
+    mp->m_flags |= MNT_RDONLY;
+
+    set_vnode(mp->m_root->d_vnode, new inode{FUSE_ROOT_ID, 0, root.attr});
+
+    return 0;
+}
+
+static int
+virtiofs_unmount(mount* mp, int flags)
+{
+    release_mp_dentries(mp);
+
+    delete static_cast<mount_data*>(mp->m_data);
+    mp->m_data = nullptr;
+
+    return 0;
+}
+
+} // namespace virtiofs
+
+extern "C"
+int virtiofs_init(void)
+{
+    return 0;
+}
+
+vnops virtiofs_vnops = {
+    virtiofs::virtiofs_open,        // vop_open
+    virtiofs::virtiofs_close,       // vop_close
+    virtiofs::virtiofs_read,        // vop_read
+    (vnop_write_t)    virtiofs::virtiofs_erofs, // vop_write
+    (vnop_seek_t)     vop_nullop,   // vop_seek
+    (vnop_ioctl_t)    vop_einval,   // vop_ioctl
+    (vnop_fsync_t)    vop_nullop,   // vop_fsync
+    virtiofs::virtiofs_readdir,     // vop_readdir
+    virtiofs::virtiofs_lookup,      // vop_lookup
+    (vnop_create_t)   virtiofs::virtiofs_erofs, // vop_create
+    (vnop_remove_t)   virtiofs::virtiofs_erofs, // vop_remove
+    (vnop_rename_t)   virtiofs::virtiofs_erofs, // vop_remame
+    (vnop_mkdir_t)    virtiofs::virtiofs_erofs, // vop_mkdir
+    (vnop_rmdir_t)    virtiofs::virtiofs_erofs, // vop_rmdir
+    virtiofs::virtiofs_getattr,     // vop_getattr
+    (vnop_setattr_t)  virtiofs::virtiofs_erofs, // vop_setattr
+    virtiofs::virtiofs_inactive,    // vop_inactive
+    (vnop_truncate_t) virtiofs::virtiofs_erofs, // vop_truncate
+    (vnop_link_t)     virtiofs::virtiofs_erofs, // vop_link
+    nullptr,                        // vop_cache
+    (vnop_fallocate_t) virtiofs::virtiofs_erofs, // vop_fallocate
+    virtiofs::virtiofs_readlink,    // vop_readlink
+    (vnop_symlink_t)  virtiofs::virtiofs_erofs, // vop_symlink
+    virtiofs::virtiofs_dax,         // vop_dax
+};
+
+vfsops virtiofs_vfsops = {
+    virtiofs::virtiofs_mount,       // vfs_mount
+    virtiofs::virtiofs_unmount,     // vfs_unmount
+    (vfsop_sync_t)   vfs_nullop,    // vfs_sync
+    (vfsop_vget_t)   vfs_nullop,    // vfs_vget
+    (vfsop_statfs_t) vfs_nullop,    // vfs_statfs
+    &virtiofs_vnops,                // vfs_vnops
+};
@@ -21,6 +21,8 @@ struct udphdr {
 
 #define UDP_CORK	1
 #define UDP_ENCAP	100
+#define UDP_SEGMENT	103
+#define UDP_GRO		104
 
 #define UDP_ENCAP_ESPINUDP_NON_IKE 1
 #define UDP_ENCAP_ESPINUDP	2
@@ -189,6 +189,8 @@ struct ucred
 #define SO_NOFCS                43
 #define SO_LOCK_FILTER          44
 
+#define SO_BUSY_POLL            46
+
 #define SOL_RAW         255
 #define SOL_DECNET      261
 #define SOL_X25         262
@@ -70,7 +70,14 @@ protected:
     // and reads its own depth. "owner" is atomic - one thread doing lock()
     // needs to read the current owner possibly set by another thread - but
     // it can be accessed with relaxed memory ordering.
-    unsigned int depth;
+    unsigned int depth : 31;
+    // If set, a thread which has to wait for the mutex lends its priority
+    // to the owner (see sched::thread::inherit_priority()), so a
+    // low-priority owner can't keep it waiting for unrelated threads.
+    // Packed with depth, to keep every mutex as small as before; it is set
+    // before the mutex is used, so the owner's updates of depth only ever
+    // write it back unchanged.
+    unsigned int prio_inherit : 1;
     std::atomic<sched::thread *> owner;
     queue_mpsc<wait_record> waitqueue;
     std::atomic<unsigned int> handoff;
@@ -79,9 +86,13 @@ public:
     // Note: mutex's constructor just initializes the whole structure to
     // zero, and its destructor does nothing. This is useful to know when
     // allocating a mutex in C.
-    constexpr mutex() : count(0), depth(0), owner(nullptr), waitqueue(), handoff(0), sequence(0) { }
+    constexpr mutex() : count(0), depth(0), prio_inherit(0), owner(nullptr), waitqueue(), handoff(0), sequence(0) { }
     ~mutex() { /*assert(count==0);*/ }
 
+    // Enable priority inheritance. Must be called before the mutex is used.
+    void set_priority_inheritance(bool enable) { prio_inherit = enable; }
+    bool priority_inheritance() const { return prio_inherit; }
+
     void lock();
     bool try_lock();
     void unlock();
@@ -94,6 +105,10 @@ public:
     void send_lock(wait_record *wr);
     bool send_lock_unless_already_waiting(wait_record *wr);
     void receive_lock();
+private:
+    void hand_off();
+    void acquired(sched::thread *current);
+    void lend_priority(sched::thread *current);
 };
 
 }
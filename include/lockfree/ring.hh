@@ -109,6 +109,14 @@ public:
         return (end - beg);
     }
 
+    /**
+     * Running (wrapping) counts of the elements pushed and popped so far.
+     * pushed() should be called by the producer, popped() may be called by
+     * anyone: once popped() - N >= 0, the N-th pushed element has been popped.
+     */
+    unsigned pushed() const { return _end.load(std::memory_order_relaxed); }
+    unsigned popped() const { return _begin.load(std::memory_order_acquire); }
+
 private:
     std::atomic<unsigned> _begin CACHELINE_ALIGNED;
     std::atomic<unsigned> _end CACHELINE_ALIGNED;
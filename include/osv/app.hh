@@ -9,6 +9,44 @@
 #define _OSV_APP_HH
 
 #include <functional>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace osv {
+
+class launch_error : public std::runtime_error
+{
+public:
+    launch_error(std::string msg) : std::runtime_error(msg) {}
+};
+
+/**
+ * Describes an application started with application::run().
+ */
+struct application_info {
+    unsigned long id;
+    std::string command;
+    unsigned restarts;
+};
+
+/**
+ * Returns the applications started with application::run() which are still
+ * referenced.
+ */
+std::vector<application_info> get_applications();
+
+/**
+ * Restarts the application with the given id without rebooting, see
+ * application::restart().
+ *
+ * \return false if there is no such application
+ * \throw launch_error if the restart failed
+ */
+bool restart_application(unsigned long id, std::chrono::nanoseconds timeout);
+
+}
 
 #ifdef _KERNEL
 
@@ -17,6 +55,7 @@
 #include <osv/sched.hh>
 #include <pthread.h>
 #include <osv/mutex.h>
+#include <osv/condvar.h>
 #include <osv/elf.hh>
 #include <boost/signals2.hpp>
 
@@ -25,12 +64,6 @@ namespace osv {
 class application;
 using shared_app_t = std::shared_ptr<application>;
 
-class launch_error : public std::runtime_error
-{
-public:
-    launch_error(std::string msg) : std::runtime_error(msg) {}
-};
-
 /**
  * Represents an executing program.
  *
@@ -60,17 +93,39 @@ public:
      */
     static shared_app_t run(const std::string& command, const std::vector<std::string>& args);
 
+    /**
+     * Returns the applications started with run() which are still referenced.
+     */
+    static std::vector<shared_app_t> get_all();
+
     application(const std::string& command, const std::vector<std::string>& args);
 
     ~application();
 
     /**
-     * Waits until application terminates.
+     * Waits until application terminates. Keeps waiting while the
+     * application is being restarted.
      *
      * @return application's exit code.
      */
     int join();
 
+    /**
+     * Restarts the application in the running kernel, without a reboot.
+     *
+     * Requests termination and waits for all of the application's threads
+     * to exit. Then closes the file descriptors and unmaps the mmap()ed
+     * memory the application left behind, and drops its ELF object, which
+     * elf::program unloads once nothing else holds it. Finally, loads the
+     * program afresh and runs it again with the same arguments.
+     *
+     * May not be called from one of the application's own threads.
+     *
+     * \param timeout how long to wait for the application's threads to exit
+     * \throw launch_error if they didn't, or the program failed to load
+     */
+    void restart(std::chrono::nanoseconds timeout = std::chrono::seconds(10));
+
     /**
      * Moves current thread under this application context
      * Each thread can belong only to one application. If current
@@ -84,6 +139,14 @@ public:
      */
     void abandon_current();
 
+    /**
+     * Counts a thread being created in this application's context in, so
+     * that restart() waits for it even before it runs and adopts the
+     * application. It is counted out when the returned reference is
+     * dropped, which the thread does once it has adopted the application.
+     */
+    std::shared_ptr<void> count_new_thread();
+
     /**
      * Installs a termination callback which will be called when
      * termination is requested or immediately if termination was
@@ -111,7 +174,20 @@ public:
      */
     std::string get_command();
 
+    /**
+     * Returns a number identifying this application, unique for the
+     * lifetime of the kernel.
+     */
+    unsigned long get_id();
+
+    /**
+     * Returns how many times this application was restarted.
+     */
+    unsigned get_restarts();
+
 private:
+    void load();
+    void release();
     void start();
     void main();
     void run_main(std::string path, int argc, char** argv);
@@ -128,6 +204,15 @@ private:
     mutex _termination_mutex;
     std::shared_ptr<elf::object> _lib;
     main_func_t* _main;
+    unsigned long _id;
+
+    // Protects the following, which restart() and join() wait on
+    mutex _state_mutex;
+    condvar _state_cond;
+    unsigned _threads;     // threads in this application's context
+    bool _main_done;       // main() returned
+    bool _restarting;
+    unsigned _restarts;
 
     // Must be destroyed before _lib
     boost::signals2::signal<void()> _termination_signal;
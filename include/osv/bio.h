@@ -124,6 +124,15 @@ void		biodone(struct bio *bio, bool ok);
 struct devstat;
 void    biofinish(struct bio *bp, struct devstat *stat, int error);
 
+/*
+ * I/O directly to or from application memory is bracketed by these, so
+ * that memory compaction doesn't move the pages while the device uses them.
+ */
+void	bio_user_io_begin(void);
+void	bio_user_io_end(void);
+/* Whether a device can transfer straight to or from the buffer */
+int	bio_user_io_direct(const void *addr, size_t len);
+
 __END_DECLS
 
 #endif /* !_SYS_BIO_H_ */
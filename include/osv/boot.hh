@@ -13,7 +13,7 @@ class boot_time_chart {
 public:
     void event(const char *str);
     void print_chart();
-    time_element arrays[16];
+    time_element arrays[32];
     friend void arch_setup_free_memory();
 private:
     // Can we keep it at 0 and let the initial two users increment it?  No, we
@@ -65,6 +65,7 @@ void	bdwrite(struct buf *);
 void	binval(struct device *);
 void	brelse(struct buf *);
 void	bflush(struct buf *);
+void	bsync_range(struct device *, int, int, int);
 void	bio_sync(void);
 void	bio_init(void);
 __END_DECLS
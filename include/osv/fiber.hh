@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef OSV_FIBER_HH_
+#define OSV_FIBER_HH_
+
+#include <osv/sched.hh>
+#include <osv/rcu.hh>
+#include <boost/intrusive/list.hpp>
+#include "arch-fiber.hh"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+
+namespace osv {
+
+class fiber;
+class fiber_carrier;
+
+extern "C" {
+    void fiber_main_c(fiber* f);
+};
+
+/**
+ * Lightweight, user-mode scheduled thread of execution
+ *
+ * Fibers are multiplexed over carrier threads, one pinned carrier per cpu.
+ * A fiber has its own (small) stack, but no scheduler entry, TLS block or
+ * timers of its own in the thread scheduler: switching between fibers of
+ * the same carrier is a plain stack switch. This makes it practical to have
+ * a fiber per connection for hundreds of thousands of connections.
+ *
+ * A fiber never moves to another carrier. When it blocks, it parks and the
+ * carrier runs its other fibers; when all are parked the carrier sleeps.
+ * Fibers block with:
+ *  - wait_until(pred), woken by wake() or wake_with(), like threads;
+ *  - wait_for(waitables...), using the same wait_object<> protocol as
+ *    sched::thread::wait_for(). The wait objects register the carrier
+ *    thread, which polls its parked fibers when it is woken;
+ *  - poll() on file descriptors, and sleep(), which park the fiber itself.
+ *
+ * Code running in a fiber shares the carrier's thread-local variables, and
+ * sched::thread::current() returns the carrier. Anything that blocks the
+ * carrier thread (blocking socket calls, a long-held mutex) blocks all of
+ * its fibers, so use non-blocking sockets and poll() in fibers.
+ */
+class fiber : private sched::timer_base::client {
+public:
+    struct attr {
+        size_t _stack_size;
+        bool _detached;
+        attr() : _stack_size(16384), _detached(false) { }
+        attr& stack(size_t stacksize) {
+            _stack_size = stacksize;
+            return *this;
+        }
+        // A detached fiber is freed by its carrier when it completes, and
+        // can't be joined.
+        attr& detached(bool val = true) {
+            _detached = val;
+            return *this;
+        }
+    };
+    // A timer waking a fiber (rather than its carrier) when it expires.
+    class timer : public sched::timer_base {
+    public:
+        explicit timer(fiber& f) : sched::timer_base(f) {}
+    };
+    explicit fiber(std::function<void ()> func, attr a = attr());
+    ~fiber();
+    // Start running the fiber on the given cpu's carrier. By default, a
+    // fiber started from a fiber shares its carrier, and one started from
+    // a thread runs on the current cpu's carrier.
+    void start(sched::cpu* c = nullptr);
+    void join();
+    // Wake the fiber if it's waiting in wait_until(). The caller must make
+    // sure the fiber isn't concurrently destroyed (see wake_with()).
+    void wake();
+    template <class Action>
+    inline void wake_with(Action action);
+    static inline fiber* current();
+    static void yield();
+    template <class Pred>
+    static void wait_until(Pred pred);
+    template <typename... waitable>
+    static void wait_for(waitable&&... waitables);
+    template <class Rep, class Period>
+    static void sleep(std::chrono::duration<Rep, Period> duration);
+public:
+    // for lockfree::queue_mpsc
+    fiber* next = nullptr;
+private:
+    enum class status {
+        unstarted,
+        running,
+        waiting,
+        queued,
+        done,
+    };
+    // The part of the fiber accessed by wakers, freed by RCU after the
+    // fiber itself, so that a wake racing with the fiber's destruction is
+    // harmless.
+    struct detached_state {
+        explicit detached_state(fiber* f) : f(f) {}
+        fiber* f;
+        fiber_carrier* carrier = nullptr;
+        std::atomic<status> st = { status::unstarted };
+    };
+    // A thread or fiber waiting in join()
+    struct joiner {
+        sched::thread* t;
+        fiber* f;
+        template <class Action>
+        void wake_with(Action action) {
+            if (f) {
+                f->wake_with(action);
+            } else {
+                t->wake_with(action);
+            }
+        }
+    };
+    // The wait objects of a fiber parked in wait_for(), polled by the carrier
+    template <typename... wait_object>
+    struct wait_objects;
+    static void wake_impl(detached_state* st);
+    void main();
+    void complete();
+    void switch_out();
+    void prepare_wait();
+    void wait();
+    void stop_wait();
+    void wait_polled(bool (*poll)(void*), void* arg);
+    virtual void timer_fired() override;
+private:
+    std::function<void ()> _func;
+    attr _attr;
+    void* _stack = nullptr;
+    fiber_state _state;
+    sched::lazy_stack_state _lazy_stack = {};
+    bool _finished = false;
+    std::unique_ptr<detached_state> _detached_state;
+    std::atomic<joiner*> _joiner = { nullptr };
+    // carrier-local: parked in wait_for(), and how to poll
+    boost::intrusive::list_member_hook<> _polled_hook;
+    bool (*_poll)(void*) = nullptr;
+    void* _poll_arg = nullptr;
+    friend class fiber_carrier;
+    friend class fiber_handle;
+    friend void fiber_main_c(fiber* f);
+};
+
+// Like sched::thread_handle: allows waking a fiber which may be concurrently
+// completing or being destroyed.
+class fiber_handle {
+public:
+    fiber_handle() = default;
+    fiber_handle(const fiber_handle& f) { _f.assign(f._f.read()); }
+    explicit fiber_handle(fiber* f) { if (f) { reset(*f); } }
+    fiber_handle& operator=(const fiber_handle& x) {
+        _f.assign(x._f.read());
+        return *this;
+    }
+    void reset(fiber& f) { _f.assign(f._detached_state.get()); }
+    void wake();
+    void clear() { _f.assign(nullptr); }
+    operator bool() const { return _f; }
+private:
+    osv::rcu_ptr<fiber::detached_state> _f;
+};
+
+extern fiber __thread * s_current_fiber;
+
+inline fiber* fiber::current()
+{
+    return s_current_fiber;
+}
+
+template <class Action>
+inline
+void fiber::wake_with(Action action)
+{
+    WITH_LOCK(osv::rcu_read_lock) {
+        auto ds = _detached_state.get();
+        action();
+        wake_impl(ds);
+    }
+}
+
+template <class Pred>
+void fiber::wait_until(Pred pred)
+{
+    fiber* me = current();
+    assert(me);
+    while (true) {
+        me->prepare_wait();
+        if (pred()) {
+            me->stop_wait();
+            return;
+        }
+        me->wait();
+    }
+}
+
+template <>
+struct fiber::wait_objects<> {
+    bool poll() { return false; }
+    void arm() {}
+    void disarm() {}
+};
+
+template <typename wait_object_first, typename... wait_object_rest>
+struct fiber::wait_objects<wait_object_first, wait_object_rest...> {
+    template <typename waitable_first, typename... waitable_rest>
+    explicit wait_objects(waitable_first& wa, waitable_rest&... others)
+        : first(wa), rest(others...) {}
+    bool poll() { return first.poll() || rest.poll(); }
+    void arm() { first.arm(); rest.arm(); }
+    void disarm() { rest.disarm(); first.disarm(); }
+    static bool poll_thunk(void* arg) {
+        return static_cast<wait_objects*>(arg)->poll();
+    }
+    wait_object_first first;
+    wait_objects<wait_object_rest...> rest;
+};
+
+// Waits, like sched::thread::wait_for(), for one of the waitables. Each
+// waitable's wait_object<> registers (and so wakes) the carrier thread,
+// which then polls the wait objects of the fibers parked here. Waiting with
+// a mutex is not supported.
+template <typename... waitable>
+void fiber::wait_for(waitable&&... waitables)
+{
+    if (!current()) {
+        sched::thread::wait_for(std::forward<waitable>(waitables)...);
+        return;
+    }
+    wait_objects<sched::wait_object<typename std::remove_reference<waitable>::type>...>
+        objs(waitables...);
+    if (objs.poll()) {
+        return;
+    }
+    objs.arm();
+    current()->wait_polled(&decltype(objs)::poll_thunk, &objs);
+    objs.disarm();
+}
+
+template <class Rep, class Period>
+void fiber::sleep(std::chrono::duration<Rep, Period> duration)
+{
+    timer t(*current());
+    t.set(duration);
+    wait_until([&] { return t.expired(); });
+}
+
+}
+
+#endif /* OSV_FIBER_HH_ */
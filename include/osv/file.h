@@ -162,6 +162,8 @@ struct file {
 	virtual void epoll_del() {}
 	virtual void poll_install(pollreq& pr) {}
 	virtual void poll_uninstall(pollreq& pr) {}
+	// drive whatever this file's events come from once, for busy polling
+	virtual void busy_poll(int budget) {}
 	virtual std::unique_ptr<mmu::file_vma> mmap(addr_range range, unsigned flags, unsigned perm, off_t offset) {
 	    throw make_error(ENODEV);
 	}
@@ -236,6 +238,8 @@ int fdalloc(struct file* fp, int *newfd);
 int fdset(int fd, struct file* fp);
 void fdfree(int fd);
 int fdclose(int fd);
+/* Close the fds installed by threads of the given application */
+int fdclose_owned(unsigned long owner);
 
 __BEGIN_DECLS
 
@@ -71,6 +71,8 @@ public:
     // 3. Setup entries
     // 4. Unmask interrupts
     bool easy_register(std::initializer_list<msix_binding> bindings);
+    // For drivers whose number of queues is only known at run time
+    bool easy_register(const std::vector<msix_binding>& bindings);
     void easy_unregister();
 
     /////////////////////
@@ -96,6 +98,8 @@ public:
     explicit inter_processor_interrupt(std::function<void ()>);
     ~inter_processor_interrupt();
     void send(sched::cpu* cpu);
+    // multicast to every cpu in @cpus
+    void send(sched::cpu_set& cpus);
     void send_allbutself();
 private:
     unsigned _vector;
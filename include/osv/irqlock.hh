@@ -9,10 +9,26 @@
 #define IRQLOCK_HH_
 
 #include "arch.hh"
+#include <osv/lazy-stack.hh>
+
+namespace sched {
+extern unsigned __thread preempt_counter;
+}
+
+// Disabling interrupts is the last chance to fault in stack pages, see
+// conf-lazy_stack. If preemption is already disabled, it was taken then.
+inline void irq_lock_ensure_stack()
+{
+#if CONF_lazy_stack
+    if (!sched::preempt_counter && arch::irq_enabled()) {
+        sched::lazy_stack_ensure();
+    }
+#endif
+}
 
 class irq_lock_type {
 public:
-    static void lock() { arch::irq_disable(); }
+    static void lock() { irq_lock_ensure_stack(); arch::irq_disable(); }
     static void unlock() { arch::irq_enable(); }
 };
 
@@ -27,6 +43,7 @@ private:
 
 inline void irq_save_lock_type::lock()
 {
+    irq_lock_ensure_stack();
     _flags.save();
     arch::irq_disable();
 }
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef OSV_KSM_HH
+#define OSV_KSM_HH
+
+#include <osv/mmu.hh>
+#include <chrono>
+
+// Same-page merging: a scanner thread looks for identical pages in the
+// anonymous memory applications marked with madvise(MADV_MERGEABLE), and
+// maps all of them to a single read-only copy, which is copied again on
+// the first write to it (like Linux's KSM).
+namespace ksm {
+
+struct stats {
+    size_t pages_shared;     // merged pages currently in use
+    size_t pages_sharing;    // mappings of those, beyond the first one
+    size_t pages_merged;     // total merges so far
+    size_t pages_unmerged;   // total copies made on write or unmerge
+    size_t pages_scanned;
+    size_t full_scans;
+    std::chrono::nanoseconds scan_time; // cpu time used by the scanner
+};
+
+stats get_stats();
+
+// Scan at most this many pages every interval (by default 100 per 20ms)
+void set_rate(unsigned pages, std::chrono::milliseconds interval);
+
+// Called by mmu::advise(), starts the scanner if not running yet
+void start();
+
+// For the anonymous page provider, with vma_list_mutex held. unshare()
+// maps pte, writable, instead of the merged page ptep maps. put() drops
+// ptep's mapping of the merged page addr, and returns true if that was
+// its last one, and the page should be freed.
+bool unshare(mmu::hw_ptep<0> ptep, mmu::pt_element<0> pte);
+bool put(void* addr, mmu::hw_ptep<0> ptep);
+
+}
+
+#endif
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef OSV_LAZY_STACK_HH_
+#define OSV_LAZY_STACK_HH_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arch.hh"
+
+// With conf-lazy_stack, pthread stacks are populated as they are used, but
+// the kernel must not fault on them once preemption or interrupts are off.
+// So whoever disables them first faults in lazy_stack_depth of stack below
+// the stack pointer, which is as much as a kernel thread's whole stack, and
+// so as deep as any kernel path may go. The current thread's stack remembers
+// how far down it is already populated, so this is a compare and a branch
+// unless the thread went deeper than ever before.
+
+namespace sched {
+
+constexpr size_t lazy_stack_depth = 64 * 1024;
+
+struct lazy_stack_state {
+    uintptr_t low;     // populated from here up; 0 if not a lazy stack
+    uintptr_t bottom;  // just above the guard page
+    uintptr_t top;
+};
+
+extern __thread lazy_stack_state lazy_stack;
+
+__attribute__((no_instrument_function))
+void lazy_stack_fault_in(uintptr_t sp);
+
+__attribute__((no_instrument_function))
+inline void lazy_stack_ensure();
+
+inline void lazy_stack_ensure()
+{
+#if CONF_lazy_stack
+    auto sp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    if (__builtin_expect(sp - lazy_stack_depth < lazy_stack.low, false)) {
+        lazy_stack_fault_in(sp);
+    }
+#endif
+}
+
+}
+
+#endif /* OSV_LAZY_STACK_HH_ */
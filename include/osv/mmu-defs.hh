@@ -25,6 +25,8 @@ constexpr int pte_per_page = 512;
 constexpr int pte_per_page_shift = 9; // log2(pte_per_page)
 
 constexpr uintptr_t huge_page_size = mmu::page_size*pte_per_page; // 2 MB
+// How much of the top of an mmap_stack mapping is populated up front
+constexpr uintptr_t stack_prefault_size = 4 * page_size;
 
 typedef uint64_t f_offset;
 typedef uint64_t phys;
@@ -84,11 +86,17 @@ enum {
     mmap_small       = 1ul << 5,
     mmap_jvm_balloon = 1ul << 6,
     mmap_file        = 1ul << 7,
+    mmap_mergeable   = 1ul << 8,
+    mmap_stack       = 1ul << 9,
+    // Only touched from preemptible code, so memory compaction may move it
+    mmap_movable     = 1ul << 10,
 };
 
 enum {
     advise_dontneed = 1ul << 0,
     advise_nohugepage = 1ul << 1,
+    advise_mergeable = 1ul << 2,
+    advise_unmergeable = 1ul << 3,
 };
 
 enum {
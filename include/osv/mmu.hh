@@ -16,10 +16,14 @@
 #include <osv/error.h>
 #include <osv/addr_range.hh>
 #include <unordered_map>
+#include <unordered_set>
 #include <memory>
+#include <vector>
 #include <osv/mmu-defs.hh>
 #include <osv/align.hh>
 #include <osv/trace.hh>
+#include <osv/mutex.h>
+#include <osv/condvar.h>
 
 struct exception_frame;
 class balloon;
@@ -62,6 +66,9 @@ public:
     virtual page_allocator* page_ops();
     void update_flags(unsigned flag);
     bool has_flags(unsigned flag);
+    void clear_flags(unsigned flag);
+    unsigned long owner() const { return _owner; }
+    void set_owner(unsigned long owner) { _owner = owner; }
     template<typename T> ulong operate_range(T mapper, void *start, size_t size);
     template<typename T> ulong operate_range(T mapper);
     bool map_dirty();
@@ -72,6 +79,7 @@ protected:
     unsigned _flags;
     bool _map_dirty;
     page_allocator *_page_ops;
+    unsigned long _owner = 0; // id of the application which mapped it
 public:
     boost::intrusive::set_member_hook<> _vma_list_hook;
 };
@@ -105,6 +113,8 @@ public:
     virtual void fault(uintptr_t addr, exception_frame *ef) override;
     fileref file() const { return _file; }
     f_offset offset() const { return _offset; }
+    // Lets faults map huge pages, for files whose map_page() can
+    void allow_huge_pages() { _flags &= ~mmap_small; }
 private:
     f_offset offset(uintptr_t addr);
     fileref _file;
@@ -143,14 +153,31 @@ private:
     uintptr_t _real_size;
 };
 
+// Shared memory (shmget(), shm_open(), memfd_create()), kept in huge pages
+// which mappings of it use directly, with memfd's F_SEAL_* seals.
 class shm_file final : public special_file {
+    mutex _mutex;
     size_t _size;
+    unsigned _seals;
     std::unordered_map<uintptr_t, void*> _pages;
+    // Holes which read faults mapped to the zero page
+    std::unordered_set<uintptr_t> _zero_mapped;
+    // write()s copying in, and F_SEAL_WRITE seals waiting for them
+    unsigned _writers = 0;
+    unsigned _write_sealers = 0;
+    condvar _writers_cond;
+    void* find_page(uintptr_t hp_off);
     void* page(uintptr_t hp_off);
+    void unmap_zero(uintptr_t hp_off);
 public:
-    shm_file(size_t size, int flags);
+    shm_file(size_t size, int flags, bool sealable = false);
+    virtual int read(struct uio *uio, int flags) override;
+    virtual int write(struct uio *uio, int flags) override;
+    virtual int truncate(off_t len) override;
     virtual int stat(struct stat* buf) override;
     virtual int close() override;
+    int add_seals(unsigned seals);
+    unsigned seals();
     virtual std::unique_ptr<file_vma> mmap(addr_range range, unsigned flags, unsigned perm, off_t offset) override;
 
     virtual bool map_page(uintptr_t offset, hw_ptep<0> ptep, pt_element<0> pte, bool write, bool shared) override;
@@ -165,6 +192,10 @@ void* map_anon(const void* addr, size_t size, unsigned flags, unsigned perm);
 ulong map_jvm(const void* addr, size_t size, balloon *b);
 
 error munmap(const void* addr, size_t size);
+// Tags the mappings in the range as the given owner's, for unmap_owned()
+void set_owner(const void* addr, size_t size, unsigned long owner);
+// Unmaps all the mappings tagged as owner's, returning how many there were
+int unmap_owned(unsigned long owner);
 error mprotect(const void *addr, size_t size, unsigned int perm);
 error msync(const void* addr, size_t length, int flags);
 error mincore(const void *addr, size_t length, unsigned char *vec);
@@ -174,6 +205,30 @@ bool isreadable(void *addr, size_t size);
 std::unique_ptr<file_vma> default_file_mmap(file* file, addr_range range, unsigned flags, unsigned perm, off_t offset);
 std::unique_ptr<file_vma> map_file_mmap(file* file, addr_range range, unsigned flags, unsigned perm, off_t offset);
 
+// Keeps memory compaction from moving the pages of the mappings in the range,
+// for memory the kernel may use where it can't take a page fault (e.g., a
+// stack an application provides for a thread)
+void set_unmovable(const void* addr, size_t size);
+
+// Support for memory::compact(): moves the pages we know how to move (those
+// of mmap_movable anonymous vmas, and of the page cache's write cache) out of the given
+// sorted list of huge_page_size physical regions. isolate() is called with the
+// number of movable pages in each region, and returns the regions to move
+// the pages out of, after making sure no page is allocated from them. Returns
+// the number of pages moved.
+size_t migrate_pages(const std::vector<phys>& regions,
+        std::function<std::vector<bool> (const std::vector<unsigned>& movable)> isolate);
+
+// Serializes modifications to the vma list and the page table.
+extern mutex vma_list_mutex;
+
+// For the page merging scanner (see ksm.hh): calls f() on the small pages
+// mapped in vmas having one of the given flags, in address order starting at
+// start, until f() returns false. Returns the address to continue from, or 0
+// once past the last vma. Must be called with vma_list_mutex held.
+uintptr_t for_each_small_page(unsigned flags, uintptr_t start,
+        std::function<bool (uintptr_t addr, hw_ptep<0> ptep)> f);
+
 
 template<int N>
 inline bool pte_is_cow(pt_element<N> pte)
@@ -39,9 +39,22 @@ private:
     osv::rcu_ptr<std::vector<pollreq*>> _pollers;
     osv::rcu_hashtable<epoll_ptr> _epollers;
     mutex _pollers_mutex;
+public:
+    // A way for a busy polling consumer to drive the producer, e.g. the
+    // NIC's receive queue, for up to budget packets. It outlives the channel.
+    struct busy_poller {
+        void (*poll)(void* arg, int budget);
+        void* arg;
+    };
+private:
+    busy_poller _busy_poller = {};
 public:
     explicit net_channel(std::function<void (mbuf*)> process_packet)
         : _process_packet(std::move(process_packet)) {}
+    void set_busy_poller(busy_poller bp) { _busy_poller = bp; }
+    busy_poller get_busy_poller() const { return _busy_poller; }
+    // consumer: are there packets to process?
+    bool empty() { return !_queue.size(); }
     // producer: try to push a packet
     bool push(mbuf* m) { return _queue.push(m); }
     // consumer: wake the consumer (best used after multiple push()s)
@@ -16,6 +16,9 @@ void* alloc_page();
 void free_page(void* page);
 void* alloc_huge_page(size_t bytes);
 void free_huge_page(void *page, size_t bytes);
+// Moves pages in use out of mostly free huge page regions, to make them
+// available to alloc_huge_page() again. Returns how many it made available.
+size_t compact();
 
 }
 
@@ -35,4 +35,9 @@ bool release(vfs_file* fp, void *addr, off_t offset, mmu::hw_ptep<0> ptep);
 void sync(vfs_file* fp, off_t start, off_t end);
 void unmap_arc_buf(arc_buf_t* ab);
 void map_arc_buf(hashkey* key, arc_buf_t* ab, void* page);
+// Memory compaction support, called with vma_list_mutex held: the pages of
+// the write cache, and moving some of them elsewhere. Moved pages are
+// unmapped, to be mapped again by the next fault on them.
+void for_each_write_page(std::function<void (void* page)> f);
+void move_write_pages(std::function<bool (void* page)> move);
 }
@@ -2,36 +2,83 @@
 #define PERCPU_XMIT_HH_
 
 #include <atomic>
-#include <osv/nway_merger.hh>
+#include <vector>
+#include <string.h>
 
 #include <osv/types.h>
 #include <osv/percpu.hh>
 #include <osv/wait_record.hh>
-#include <osv/percpu_xmit.hh>
+#include <osv/spinlock.h>
+#include <osv/mutex.h>
 
 #include <lockfree/ring.hh>
 #include <lockfree/queue-mpsc.hh>
 
-#include <osv/clock.hh>
-
 #include <bsd/sys/sys/mbuf.h>
+#include <bsd/sys/net/ethernet.h>
+#include <bsd/sys/netinet/in.h>
+#include <bsd/sys/netinet/ip.h>
 
 #include <boost/function_output_iterator.hpp>
 
 namespace osv {
 
+/**
+ * Returns a hash identifying the flow of an outgoing frame, which is used to
+ * keep the frames of a flow in order (see xmitter::push_cpu()).
+ *
+ * Prefers the flow id the stack attached to the mbuf and otherwise hashes the
+ * IPv4 addresses, the protocol and, if they are in the first mbuf, the ports.
+ * All non-IPv4 frames belong to a single flow.
+ */
+inline u32 tx_flow_hash(mbuf* m)
+{
+    if (m->m_hdr.mh_flags & M_FLOWID) {
+        return m->M_dat.MH.MH_pkthdr.flowid;
+    }
+
+    caddr_t h = m->m_hdr.mh_data;
+    unsigned len = m->m_hdr.mh_len;
+    if (len < ETHER_HDR_LEN + sizeof(ip)) {
+        return 0;
+    }
+    auto ether_hdr = reinterpret_cast<ether_header*>(h);
+    if (ntohs(ether_hdr->ether_type) != ETHERTYPE_IP) {
+        return 0;
+    }
+    auto ip_hdr = reinterpret_cast<ip*>(h + ETHER_HDR_LEN);
+    u32 hash = ip_hdr->ip_src.s_addr ^ ip_hdr->ip_dst.s_addr ^ ip_hdr->ip_p;
+    unsigned ip_size = ip_hdr->ip_hl << 2;
+    if (ip_size >= sizeof(ip) && len >= ETHER_HDR_LEN + ip_size + 4) {
+        u32 ports;
+        memcpy(&ports, h + ETHER_HDR_LEN + ip_size, sizeof(ports));
+        hash ^= ports;
+    }
+    // Fold, so that the low bits used to index the flow table depend on
+    // all the fields.
+    hash ^= hash >> 16;
+    hash ^= hash >> 8;
+    return hash;
+}
+
 /**
  * @class cpu_queue
  * This class will represent a single per-CPU Tx queue.
  *
- * These queues will be subject to the merging by the nway_merger class in
- * order to address the reordering issue. Therefore this class will
- * implement the following methods/classes:
+ * The dispatcher drains these queues in bulk, one after another. Packets of
+ * the same flow are kept in order by never letting a flow have queued packets
+ * in more than one queue at a time (see xmitter::push_cpu()). This class
+ * implements the following methods/classes:
  *  - push(val)
  *  - empty()
  *  - front(), which will return the iterator that implements:
  *      - operator *() to access the underlying value
  *  - erase(it), which would pop the front element.
+ *  - pushed()/popped(), the running counts of pushed and popped elements.
+ *
+ * The queue is normally fed by the threads of its own CPU. A thread of another
+ * CPU may push into it too when its flow still has packets here, so producers
+ * serialize on producer_lock(); it's not contended in the common case.
  *
  * If the producer fails to push a new element into the queue (the queue is
  * full) then it may start "waiting for the queue": request to be woken when the
@@ -43,31 +90,15 @@ namespace osv {
 template <unsigned CpuTxqSize>
 class cpu_queue {
 public:
-    /**
-     * @struct buff_desc
-     *
-     * A pair of pointer to buffer and the timestamp.
-     * Two objects are compared by their timestamps.
-     */
-    struct buff_desc {
-        clock::uptime::time_point ts;
-        void* cooky;
-
-        bool operator>(const buff_desc& other) const
-        {
-            return ts - other.ts > 0;
-        }
-    };
-
     class cpu_queue_iterator;
     typedef cpu_queue_iterator   iterator;
-    typedef buff_desc            value_type;
+    typedef void*                value_type;
 
-    explicit cpu_queue() {}
+    explicit cpu_queue(unsigned cpu_id) : _cpu_id(cpu_id) {}
 
     class cpu_queue_iterator {
     public:
-        void* operator*() const { return _cpuq->front().cooky; }
+        void* operator*() const { return _cpuq->front(); }
 
     private:
         typedef cpu_queue<CpuTxqSize> cpu_queue_type;
@@ -91,8 +122,6 @@ public:
         _r.pop(tmp);
         _popped_since_wakeup++;
 
-        debug_check(tmp);
-
         //
         // Wake the waiters after a threshold or when the last packet has
         // been popped.
@@ -142,6 +171,10 @@ public:
     bool push(value_type v) { return _r.push(v); }
     bool empty() const { return _r.empty(); }
     void push_new_waiter(wait_record* wr) { _waitq.push(wr); }
+    unsigned pushed() const { return _r.pushed(); }
+    unsigned popped() const { return _r.popped(); }
+    spinlock_t& producer_lock() { return _producer_lock; }
+    unsigned cpu_id() const { return _cpu_id; }
 
 private:
     lockfree::queue_mpsc<wait_record> _waitq;
@@ -154,21 +187,8 @@ private:
     //
     static const int _wakeup_threshold = CpuTxqSize / 2;
     int _popped_since_wakeup = 0;
-
-#if defined(TX_DEBUG) && !defined(NDEBUG)
-    void debug_check(value_type& tmp) {
-        if (tmp.ts <= _last_ts) {
-            printf("Time went backwards: curr_ts(%d) < prev_ts(%d)\n",
-                   tmp.ts, _last_ts);
-            assert(0);
-        }
-
-        _last_ts = tmp.ts;
-    }
-    s64 _last_ts = -1;
-#else
-    void debug_check(value_type& tmp) {}
-#endif
+    spinlock_t _producer_lock;
+    unsigned _cpu_id;
 } CACHELINE_ALIGNED;
 
 /**
@@ -186,11 +206,33 @@ private:
  */
 template <class NetDevTxq, unsigned CpuTxqSize>
 class xmitter {
+private:
+    typedef cpu_queue<CpuTxqSize> cpu_queue_type;
+
+    //
+    // Maximum number of packets the dispatcher takes from a single per-CPU
+    // queue before moving to the next one.
+    //
+    static constexpr unsigned _drain_burst = 64;
+
+    //
+    // Flow table: for each flow hash bucket, the CPU whose queue got the
+    // bucket's last packet (plus 1, 0 means "none") in the high half and the
+    // queue's pushed() count right after that packet in the low half.
+    // Different flows may share a bucket, which only costs an occasional
+    // push into a remote CPU's queue. Each bucket has a cache line of its own
+    // so that flows sent from different CPUs don't bounce it.
+    //
+    static constexpr unsigned flow_table_size = 256;
+    struct flow_slot {
+        std::atomic<u64> last { 0 };
+    } CACHELINE_ALIGNED;
+
 public:
     explicit xmitter(NetDevTxq* txq) :
         _txq(txq),_check_empty_queues(false) {
         for (auto c : sched::cpus) {
-            _cpuq.for_cpu(c)->reset(new cpu_queue_type);
+            _cpuq.for_cpu(c)->reset(new cpu_queue_type(c->id));
         }
     }
 
@@ -208,6 +250,7 @@ public:
     int xmit(mbuf* buff) {
 
         void* cooky = nullptr;
+        u32 flow = tx_flow_hash(buff);
         int rc = _txq->xmit_prep(buff, cooky);
 
         if (rc) {
@@ -226,7 +269,7 @@ public:
         // in-place.
         //
         if (has_pending() || !try_lock_running()) {
-            push_cpu(cooky);
+            push_cpu(cooky, flow);
             return 0;
         }
 
@@ -257,7 +300,7 @@ public:
             // packet - push it into the per-CPU queue, dispatcher will handle
             // it later.
             //
-            push_cpu(cooky);
+            push_cpu(cooky, flow);
         }
 
         return 0;
@@ -266,15 +309,12 @@ public:
     template <class StopPollingPred, class XmitIterator>
     void poll_until(StopPollingPred stop_pred, XmitIterator& xmit_it) {
         // Create a collection of a per-CPU queues
-        std::list<cpu_queue_type*> all_cpuqs;
+        std::vector<cpu_queue_type*> all_cpuqs;
 
         for (auto c : sched::cpus) {
             all_cpuqs.push_back(_cpuq.for_cpu(c)->get());
         }
 
-        // Push them all into the heap
-        _mg.create_heap(all_cpuqs);
-
         //
         // Dispatcher holds the RUNNING lock all the time it doesn't sleep
         // waiting for a new work.
@@ -290,27 +330,27 @@ public:
             //
             // Reset the PENDING state.
             //
-            // The producer thread will first add a new element to the heap and
-            // only then set the PENDING state.
+            // The producer thread will first add a new element to a per-CPU
+            // queue and only then set the PENDING state.
             //
-            // We need to ensure that PENDING is cleared before _mg.pop() is
-            // performed (and possibly returns false - the heap is empty)
+            // We need to ensure that PENDING is cleared before drain() is
+            // performed (and possibly returns false - all queues are empty)
             // because otherwise the producer may see the "old" value of the
             // PENDING state and won't wake us up.
             //
             // However since the StoreLoad memory barrier is expensive we'll
             // first perform a "weak" (not ordered) clearing and only if
-            // _mg.pop() returns false we'll put an appropriate memory barrier
-            // and check the _mg.pop() again.
+            // drain() returns false we'll put an appropriate memory barrier
+            // and check the queues again.
             //
             clear_pending_weak();
 
-            // Check if there are elements in the heap
-            if (!_mg.pop(xmit_it)) {
+            // Check if there are elements in the queues
+            if (!drain(all_cpuqs, xmit_it)) {
 
                 std::atomic_thread_fence(std::memory_order_seq_cst);
 
-                if (!_mg.pop(xmit_it)) {
+                if (!drain(all_cpuqs, xmit_it)) {
 
                     // Wake all unwoken waiters before going to sleep
                     wake_waiters_all();
@@ -328,9 +368,7 @@ public:
                 }
             }
 
-            while (_mg.pop(xmit_it)) {
-                _txq->kick_pending_with_thresh();
-            }
+            while (drain(all_cpuqs, xmit_it));
 
             // Kick any pending work
             _txq->kick_pending();
@@ -348,20 +386,74 @@ private:
     }
 
     /**
-     * Push the packet into the per-CPU queue for the current CPU.
-     * @param buf packet descriptor to push
+     * Send up to _drain_burst packets from each per-CPU queue downstream.
+     *
+     * Packets of a flow are never queued on more than one CPU at a time, so
+     * the order between the queues doesn't matter and we may consume them in
+     * batches, without merging.
+     *
+     * @return true if any packet has been sent
      */
-    void push_cpu(void* cooky) {
+    template <class XmitIterator>
+    bool drain(std::vector<cpu_queue_type*>& cpuqs, XmitIterator& xmit_it) {
+        bool sent = false;
+
+        for (auto cpuq : cpuqs) {
+            for (unsigned i = 0; i < _drain_burst && !cpuq->empty(); i++) {
+                auto it = cpuq->begin();
+                *xmit_it = *it;
+                ++xmit_it;
+                cpuq->erase(it);
+                _txq->kick_pending_with_thresh();
+                sent = true;
+            }
+        }
+
+        return sent;
+    }
+
+    /**
+     * Choose the per-CPU queue for a packet of the given flow: it's the queue
+     * of the current CPU unless the previous packet of the flow is still
+     * waiting in another CPU's queue (e.g. the sender has just migrated), in
+     * which case we have to queue behind it.
+     *
+     * Must be called with preemption disabled.
+     *
+     * @param slot flow table entry of the packet's flow
+     */
+    cpu_queue_type* flow_cpuq(flow_slot& slot) {
+        auto last = slot.last.load(std::memory_order_relaxed);
+        auto cpu_id = sched::cpu::current()->id;
+
+        if (last && (last >> 32) - 1 != cpu_id) {
+            auto last_cpu = sched::cpus[(last >> 32) - 1];
+            cpu_queue_type* last_cpuq = _cpuq.for_cpu(last_cpu)->get();
+            if (int(last_cpuq->popped() - u32(last)) < 0) {
+                return last_cpuq;
+            }
+        }
+
+        return _cpuq->get();
+    }
+
+    /**
+     * Push the packet into the per-CPU queue, normally the one of the current
+     * CPU (see flow_cpuq()).
+     * @param cooky packet descriptor to push
+     * @param flow hash of the packet's flow
+     */
+    void push_cpu(void* cooky, u32 flow) {
         bool success = false;
+        auto& slot = _flows[flow % flow_table_size];
 
         sched::preempt_disable();
 
-        cpu_queue_type* local_cpuq = _cpuq->get();
-        typename cpu_queue_type::value_type new_buff_desc = { get_ts(), cooky };
+        cpu_queue_type* cpuq = flow_cpuq(slot);
 
-        while (!local_cpuq->push(new_buff_desc)) {
+        while (!try_push(cpuq, slot, cooky)) {
             wait_record wr(sched::thread::current());
-            local_cpuq->push_new_waiter(&wr);
+            cpuq->push_new_waiter(&wr);
 
             //
             // Try to push again in order to resolve a nasty race:
@@ -379,7 +471,7 @@ private:
             // All this is because we can't exit this function until dispatcher
             // pop()s our wait_record since it's allocated on our stack.
             //
-            success = local_cpuq->push(new_buff_desc);
+            success = try_push(cpuq, slot, cooky);
             if (success && !test_and_set_pending()) {
                 _txq->wake_worker();
             }
@@ -395,14 +487,11 @@ private:
 
             sched::preempt_disable();
 
-            // Refresh: we could have been moved to a different CPU
-            local_cpuq = _cpuq->get();
             //
-            // Refresh: another thread could have pushed its packet before us
-            //          and i t had an earlier timestamp - we have to keep the
-            //          timestampes ordered in the CPU queue.
+            // Refresh: we could have been moved to a different CPU and the
+            // flow's packets could have left the other CPU's queue.
             //
-            new_buff_desc.ts = get_ts();
+            cpuq = flow_cpuq(slot);
         }
 
         //
@@ -418,11 +507,20 @@ private:
     }
 
     /**
-     * @return the current timestamp
+     * Push the packet into the given per-CPU queue and record the queue and
+     * the packet's position in it in the flow table.
+     *
+     * @return true if the packet has been pushed, false if the queue is full
      */
-    clock::uptime::time_point get_ts() {
-        return clock::uptime::now();
-
+    bool try_push(cpu_queue_type* cpuq, flow_slot& slot, void* cooky) {
+        WITH_LOCK(cpuq->producer_lock()) {
+            if (!cpuq->push(cooky)) {
+                return false;
+            }
+            slot.last.store((u64(cpuq->cpu_id() + 1) << 32) | cpuq->pushed(),
+                            std::memory_order_relaxed);
+        }
+        return true;
     }
 
     // RUNNING state controling functions
@@ -457,11 +555,9 @@ private:
     }
 
 private:
-    typedef cpu_queue<CpuTxqSize> cpu_queue_type;
-
     NetDevTxq* _txq; // Rename to _dev_txq
     dynamic_percpu<std::unique_ptr<cpu_queue_type> > _cpuq;
-    osv::nway_merger<std::list<cpu_queue_type*> >      _mg    CACHELINE_ALIGNED;
+    flow_slot _flows[flow_table_size];
     std::atomic<bool>                  _check_empty_queues    CACHELINE_ALIGNED;
     //
     // This lock will be used to get an exclusive control over the HW
@@ -475,8 +571,8 @@ private:
  * @class xmitter_functor
  *
  * This functor (through boost::function_output_iterator) will be used as an
- * output iterator by the nway_merger instance that will merge the per-CPU
- * tx_cpu_queue instances.
+ * output iterator by the xmitter's dispatcher that drains the per-CPU
+ * cpu_queue instances.
  */
 template <class NetDevTxq>
 struct xmitter_functor {
@@ -38,6 +38,7 @@
 #ifdef __cplusplus
 
 #include <fs/fs.hh>
+#include <osv/fiber.hh>
 #include <vector>
 
 #endif
@@ -148,6 +149,16 @@ struct pollreq {
     nfds_t _nfds;
     std::atomic<bool> _awake = { false };
     sched::thread_handle _poll_thread = { *sched::thread::current() };
+    // Set when poll() is called from a fiber, which is woken instead of
+    // the carrier thread
+    osv::fiber_handle _poll_fiber { osv::fiber::current() };
+    void wake() {
+        if (_poll_fiber) {
+            _poll_fiber.wake();
+        } else {
+            _poll_thread.wake();
+        }
+    }
 };
 
 #endif
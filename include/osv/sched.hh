@@ -25,6 +25,7 @@
 #include <osv/rcu.hh>
 #include <osv/clock.hh>
 #include <osv/timer-set.hh>
+#include <osv/lazy-stack.hh>
 
 typedef float runtime_t;
 
@@ -321,8 +322,9 @@ public:
         stack_info _stack;
         cpu *_pinned_cpu;
         bool _detached;
+        bool _app;
         std::array<char, 16> _name = {};
-        attr() : _pinned_cpu(nullptr), _detached(false) { }
+        attr() : _pinned_cpu(nullptr), _detached(false), _app(false) { }
         attr &pin(cpu *c) {
             _pinned_cpu = c;
             return *this;
@@ -339,6 +341,14 @@ public:
             _detached = val;
             return *this;
         }
+        // Join the creating thread's application, which then waits for the
+        // thread before it is restarted. Only for threads created through
+        // the application APIs (pthread_create(), signal handlers); kernel
+        // threads, even if created from application context, stay out.
+        attr &app(bool val = true) {
+            _app = val;
+            return *this;
+        }
         attr& name(std::string n) {
             strncpy(_name.data(), n.data(), sizeof(_name) - 1);
             return *this;
@@ -465,6 +475,59 @@ public:
      * explained in set_priority().
      */
     float priority() const;
+    /**
+     * Real-time scheduling policies
+     *
+     * A real-time thread runs before all threads of the fair-share class
+     * (those using set_priority()), and before all real-time threads of a
+     * lower real-time priority. Real-time threads of equal priority run in
+     * FIFO order: a "fifo" thread runs until it blocks, yields or a higher
+     * priority thread becomes runnable, while a "rr" thread also gives way to
+     * the next thread of its priority after running for realtime_rr_slice.
+     */
+    enum class realtime_policy { none, fifo, rr };
+    /**
+     * Make the thread real-time, or fair-share again with policy "none"
+     *
+     * The priority is in [1, realtime_priority_max], higher runs first.
+     *
+     * To keep runaway real-time threads from starving the system, each CPU
+     * only lets real-time threads run ahead of the fair-share ones for
+     * realtime_runtime out of every realtime_period; for the rest of the
+     * period, they compete for the CPU like fair-share threads.
+     */
+    void set_realtime(realtime_policy policy, unsigned priority);
+    realtime_policy get_realtime_policy() const;
+    unsigned realtime_priority() const;
+    static constexpr unsigned realtime_priority_max = 99;
+    static constexpr thread_runtime::duration realtime_rr_slice =
+            std::chrono::milliseconds(100);
+    static constexpr thread_runtime::duration realtime_period =
+            std::chrono::seconds(1);
+    static constexpr thread_runtime::duration realtime_runtime =
+            std::chrono::milliseconds(950);
+    /**
+     * Priority inheritance, used by priority-inheritance mutexes
+     *
+     * inherit_priority() raises the thread's effective fair-share and
+     * real-time priorities to at least those of the given thread. The
+     * thread keeps the inherited priority until it releases the last
+     * priority-inheritance mutex it holds: the mutex calls pi_acquired()
+     * and pi_released() (in the holding thread) around holding the lock.
+     *
+     * A waiter reads pi_state() and then checks that the thread still holds
+     * the mutex; inherit_priority() is then given that state, and does
+     * nothing if the thread released its mutexes in the meantime.
+     */
+    struct pi_boost {
+        float priority;     // fair-share; priority_idle if nothing inherited
+        u16 epoch;          // advanced by each final pi_released()
+        u16 realtime;       // 0 if nothing inherited
+    };
+    pi_boost pi_state() const;
+    void inherit_priority(const thread& from, pi_boost seen);
+    void pi_acquired();
+    void pi_released();
 private:
     static void wake_impl(detached_state* st,
             unsigned allowed_initial_states_mask = 1 << unsigned(status::waiting));
@@ -553,6 +616,30 @@ private:
         terminated,
     };
     thread_runtime _runtime;
+    // The scheduler's real-time state. Only the scheduler of the thread's
+    // cpu changes it, when the thread isn't on the runqueue (so that the
+    // runqueue stays sorted): set_realtime() posts the new policy and
+    // priority to _realtime_request and update_realtime() applies it.
+    struct realtime_state {
+        realtime_policy policy = realtime_policy::none;
+        unsigned priority = 0; // 0 for fair-share threads
+        thread_runtime::duration slice_used {0};
+        bool yielded = false;
+    } _realtime;
+    std::atomic<unsigned> _realtime_request { 0 };
+    // Priorities inherited through priority-inheritance mutexes, and the
+    // number of such mutexes the thread holds (only touched by itself).
+    // Waiters post to _pi_boost and, like _realtime_request, it is applied
+    // by the scheduler of the thread's cpu.
+    std::atomic<pi_boost> _pi_boost { pi_boost{priority_idle, 0, 0} };
+    float _base_priority = priority_default;
+    unsigned _pi_held = 0;
+    bool _pi_used = false;
+    void effective_realtime(realtime_policy& policy, unsigned& priority) const;
+    float effective_priority() const;
+    void update_realtime();
+    bool realtime_changed() const;
+    void request_realtime_update();
     // part of the thread state is detached from the thread structure,
     // and freed by rcu, so that waking a thread and destroying it can
     // occur in parallel without synchronization via thread_handle
@@ -668,6 +755,14 @@ osv::clock::uptime::duration process_cputime();
 class thread_runtime_compare {
 public:
     bool operator()(const thread& t1, const thread& t2) const {
+        // Real-time threads first, in decreasing priority, FIFO within a
+        // priority (insert_equal() inserts after the equal ones).
+        if (t1._realtime.priority != t2._realtime.priority) {
+            return t1._realtime.priority > t2._realtime.priority;
+        }
+        if (t1._realtime.priority) {
+            return false;
+        }
         return t1._runtime.get_local() < t2._runtime.get_local();
     }
 };
@@ -718,6 +813,21 @@ struct cpu : private timer_base::client {
     // For scheduler:
     runtime_t c;
     int renormalize_count;
+    // For real-time throttling (see thread::set_realtime()):
+    osv::clock::uptime::time_point rt_period_end;
+    thread_runtime::duration rt_used {0};
+    bool rt_throttled = false;
+    // set when the real-time priority of a queued thread has changed
+    std::atomic<bool> realtime_update_pending { false };
+private:
+    void update_queued_realtime();
+    thread* next_queued();
+    bool keeps_running(thread& p, thread& t);
+    void requeue_preempted(thread& p);
+    void account_realtime(thread* p, thread_runtime::duration interval,
+            osv::clock::uptime::time_point now);
+    void set_preemption_timer(thread& n, thread& t,
+            osv::clock::uptime::time_point now);
 };
 
 class cpu::notifier {
@@ -829,6 +939,12 @@ inline void preempt()
 
 inline void preempt_disable()
 {
+#if CONF_lazy_stack
+    // Last chance to fault in stack pages, see conf-lazy_stack
+    if (!preempt_counter && arch::irq_enabled()) {
+        lazy_stack_ensure();
+    }
+#endif
     ++preempt_counter;
     barrier();
 }
@@ -39,6 +39,7 @@ public:
     virtual void epoll_del() override;
     virtual void poll_install(pollreq& pr) override;
     virtual void poll_uninstall(pollreq& pr) override;
+    virtual void busy_poll(int budget) override;
     int bsd_ioctl(u_long cmd, void* data);
     socket* so;
 };
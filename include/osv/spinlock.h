@@ -16,9 +16,12 @@ __BEGIN_DECLS
 
 typedef struct spinlock {
     bool _lock;
+    // cpu id + 1 of the lock holder, 0 if unknown. Used by spinning cpus to
+    // notice that the holder's vCPU was descheduled by the hypervisor.
+    unsigned char _owner;
 #ifdef __cplusplus
     // additional convenience methods for C++
-    inline constexpr spinlock() : _lock(false) { }
+    inline constexpr spinlock() : _lock(false), _owner(0) { }
     inline bool trylock();
     inline void lock();
     inline void unlock();
@@ -28,6 +31,7 @@ typedef struct spinlock {
 static inline void spinlock_init(spinlock_t *sl)
 {
     sl->_lock = false;
+    sl->_owner = 0;
 }
 void spin_lock(spinlock_t *sl);
 bool spin_trylock(spinlock_t *sl);
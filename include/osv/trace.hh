@@ -30,6 +30,21 @@ void enable_backtraces(bool = true);
 
 class tracepoint_base;
 
+// Tracing disables interrupts, so it must fault in the next stack page
+// first, like irq_lock does (see conf-lazy_stack). "irq" holds the saved
+// flags: if interrupts were already off, that was done before.
+__attribute__((no_instrument_function))
+inline void trace_ensure_stack(const arch::irq_flag_notrace& irq);
+
+inline void trace_ensure_stack(const arch::irq_flag_notrace& irq)
+{
+#if CONF_lazy_stack
+    if (irq.enabled()) {
+        sched::lazy_stack_ensure();
+    }
+#endif
+}
+
 struct blob_tag {};
 
 template<typename T>
@@ -348,6 +363,7 @@ public:
         if (active) {
             arch::irq_flag_notrace irq;
             irq.save();
+            trace_ensure_stack(irq);
             arch::irq_disable_notrace();
             log(as);
             run_probes();
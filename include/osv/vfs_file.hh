@@ -27,6 +27,10 @@ public:
     virtual void sync(off_t start, off_t end);
 
     int get_arcbuf(void *key, off_t offset);
+private:
+    bool map_dax_page(uintptr_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pte, bool write, bool shared);
+    bool put_dax_page(void *addr, uintptr_t offset, mmu::hw_ptep<0> ptep);
+    void read_page(void* page, off_t offset);
 };
 
 #endif /* VFS_FILE_HH_ */
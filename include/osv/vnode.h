@@ -125,6 +125,13 @@ struct vattr {
 #define ARC_ACTION_HOLD     1
 #define ARC_ACTION_RELEASE  2
 
+/*
+ * DAX actions: file systems whose files can be mapped in place (vop_dax)
+ * hand out, and take back, the address of a file page.
+ */
+#define DAX_ACTION_GET      0
+#define DAX_ACTION_PUT      1
+
 typedef	int (*vnop_open_t)	(struct file *);
 typedef	int (*vnop_close_t)	(struct vnode *, struct file *);
 typedef	int (*vnop_read_t)	(struct vnode *, struct file *, struct uio *, int);
@@ -149,6 +156,7 @@ typedef int (*vnop_cache_t) (struct vnode *, struct file *, struct uio *);
 typedef int (*vnop_fallocate_t) (struct vnode *, int, loff_t, loff_t);
 typedef int (*vnop_readlink_t)  (struct vnode *, struct uio *);
 typedef int (*vnop_symlink_t)   (struct vnode *, char *, char *);
+typedef int (*vnop_dax_t)       (struct vnode *, struct file *, int, off_t, void **);
 
 /*
  * vnode operations
@@ -177,6 +185,7 @@ struct vnops {
 	vnop_fallocate_t	vop_fallocate;
 	vnop_readlink_t		vop_readlink;
 	vnop_symlink_t		vop_symlink;
+	vnop_dax_t		vop_dax;
 };
 
 /*
@@ -206,6 +215,7 @@ struct vnops {
 #define VOP_FALLOCATE(VP, M, OFF, LEN) ((VP)->v_op->vop_fallocate)(VP, M, OFF, LEN)
 #define VOP_READLINK(VP, U)        ((VP)->v_op->vop_readlink)(VP, U)
 #define VOP_SYMLINK(DVP, OP, NP)   ((DVP)->v_op->vop_symlink)(DVP, OP, NP)
+#define VOP_DAX(VP, FP, A, OFF, P) ((VP)->v_op->vop_dax)(VP, FP, A, OFF, P)
 
 int	 vop_nullop(void);
 int	 vop_einval(void);
@@ -1,5 +1,6 @@
 #include <api/ucontext.h>
 #include <osv/stubbing.hh>
+#include <osv/mmu.hh>
 #include <stdint.h>
 
 extern "C" { void start_context(void); }
@@ -12,6 +13,9 @@ void makecontext(struct __ucontext *ucp, void (*func)(void), int argc, ...)
     va_list ap;
     int i;
 
+    /* The kernel may run on this stack with interrupts disabled. */
+    mmu::set_unmovable(ucp->uc_stack.ss_sp, ucp->uc_stack.ss_size);
+
     /* Generate room on stack for parameter if needed and uc_link. */
     sp = (greg_t *) ((uintptr_t) ucp->uc_stack.ss_sp + ucp->uc_stack.ss_size);
     sp -= (argc > 6 ? argc - 6 : 0) + 1;
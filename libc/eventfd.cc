@@ -11,7 +11,22 @@
 #include <osv/fcntl.h>
 #include <osv/mutex.h>
 #include <osv/condvar.h>
-
+#include <osv/poll.h>
+
+#include <atomic>
+
+// The counter is only manipulated atomically, so read() and write() don't
+// take the mutex unless they have to block, or to wake someone who is
+// blocked. Readers and writers which block count themselves in
+// _blocked_readers and _blocked_writers before re-checking the counter
+// under the mutex, and the other side looks at these counts after changing
+// the counter, so one of them always sees the other. This takes sequential
+// consistency on both sides: the counter load after the count increment
+// must not be reordered before it, which weakly ordered cpus would do for
+// a relaxed load. Pollers are woken only
+// when the counter becomes readable (0 -> nonzero) or writable again, not on
+// every write, which keeps the cost of using an eventfd as a doorbell down
+// to one atomic operation when nobody is waiting.
 class event_fd final : public special_file {
     public:
         event_fd(unsigned int initval, int is_semaphore,  int flags)
@@ -26,15 +41,19 @@ class event_fd final : public special_file {
         virtual int poll(int events) override;
 
     private:
-        mutable mutex _mutex;
-        uint64_t      _count;
-        bool          _is_semaphore;
-        condvar       _blocked_reader;
-        condvar       _blocked_writer;
+        mutable mutex         _mutex;
+        std::atomic<uint64_t> _count;
+        bool                  _is_semaphore;
+        std::atomic<unsigned> _blocked_readers = { 0 };
+        std::atomic<unsigned> _blocked_writers = { 0 };
+        condvar               _blocked_reader;
+        condvar               _blocked_writer;
 
     private:
         size_t copy_to_uio(uint64_t value, uio *uio);
         size_t copy_from_uio(uio *uio, uint64_t *value);
+        bool try_read(uint64_t &v, uint64_t &old);
+        bool try_write(uint64_t v, uint64_t &old);
 };
 
 size_t event_fd::copy_to_uio(uint64_t value, uio *uio)
@@ -83,34 +102,63 @@ size_t event_fd::copy_from_uio(uio *uio, uint64_t *value)
     return bc;
 }
 
+// Takes the whole count, or one in semaphore mode, unless it is zero.
+// Returns the count before the read in old.
+bool event_fd::try_read(uint64_t &v, uint64_t &old)
+{
+    old = _count.load();
+    do {
+        if (old == 0) {
+            return false;
+        }
+        v = _is_semaphore ? 1 : old;
+    } while (!_count.compare_exchange_weak(old, old - v));
+    return true;
+}
+
+// Adds v to the count unless it would reach ULLONG_MAX. Returns the count
+// before the write in old.
+bool event_fd::try_write(uint64_t v, uint64_t &old)
+{
+    old = _count.load();
+    do {
+        if (v >= ULLONG_MAX - old) {
+            return false;
+        }
+    } while (!_count.compare_exchange_weak(old, old + v));
+    return true;
+}
+
 int event_fd::read(uio *data, int flags)
 {
-    uint64_t v;
+    uint64_t v, old;
 
     if (data->uio_resid < (ssize_t) sizeof(v)) {
         return EINVAL;
     }
 
-    WITH_LOCK(_mutex) {
-        for (;;) {
-            if (_count > 0) {
-                if (_is_semaphore) {
-                    v = 1;
-                } else {
-                    v = _count;
-                }
-                _count -= v;
-                break;
-            } else {
-                if (f_flags & O_NONBLOCK) {
-                    return EAGAIN;
-                }
+    if (!try_read(v, old)) {
+        if (f_flags & O_NONBLOCK) {
+            return EAGAIN;
+        }
+        WITH_LOCK(_mutex) {
+            _blocked_readers.fetch_add(1);
+            while (!try_read(v, old)) {
                 _blocked_reader.wait(_mutex);
             }
+            _blocked_readers.fetch_sub(1);
         }
+    }
+
+    data->uio_resid -= copy_to_uio(v, data);
 
-        data->uio_resid -= copy_to_uio(v, data);
-        _blocked_writer.wake_all();
+    if (_blocked_writers.load()) {
+        WITH_LOCK(_mutex) {
+            _blocked_writer.wake_all();
+        }
+    }
+    if (old >= ULLONG_MAX - 1) {
+        poll_wake(this, POLLOUT);
     }
 
     return 0;
@@ -118,7 +166,7 @@ int event_fd::read(uio *data, int flags)
 
 int event_fd::write(uio *data, int flags)
 {
-    uint64_t v;
+    uint64_t v, old;
 
     if (data->uio_resid < (ssize_t) sizeof(v)) {
         return EINVAL;
@@ -129,47 +177,53 @@ int event_fd::write(uio *data, int flags)
         return EINVAL;
     }
 
-    WITH_LOCK(_mutex) {
-        for (;;) {
-            if (v < ULLONG_MAX - _count) {
-                _count += v;
-                break;
-            } else {
-                if (f_flags & O_NONBLOCK) {
-                    return EAGAIN;
-                }
+    if (!try_write(v, old)) {
+        if (f_flags & O_NONBLOCK) {
+            return EAGAIN;
+        }
+        WITH_LOCK(_mutex) {
+            _blocked_writers.fetch_add(1);
+            while (!try_write(v, old)) {
                 _blocked_writer.wait(_mutex);
             }
+            _blocked_writers.fetch_sub(1);
         }
-
-        _blocked_reader.wake_all();
     }
 
     /* update uio_resid only when count is updated. */
     data->uio_resid -= bc;
 
+    // Readers only block, and pollers only wait, while the count is zero
+    if (old == 0 && v != 0) {
+        if (_blocked_readers.load()) {
+            WITH_LOCK(_mutex) {
+                _blocked_reader.wake_all();
+            }
+        }
+        poll_wake(this, POLLIN);
+    }
+
     return 0;
 }
 
 int event_fd::poll(int events)
 {
     int rc = 0;
+    uint64_t count = _count.load();
 
-    WITH_LOCK(_mutex) {
-        if ((_count > 0) && ((events & POLLIN) != 0)) {
-            /* readable */
-            rc |= POLLIN;
-        }
+    if ((count > 0) && ((events & POLLIN) != 0)) {
+        /* readable */
+        rc |= POLLIN;
+    }
 
-        if ((_count < ULLONG_MAX - 1) && ((events & POLLOUT) != 0)) {
-            /* writable */
-            rc |= POLLOUT;
-        }
+    if ((count < ULLONG_MAX - 1) && ((events & POLLOUT) != 0)) {
+        /* writable */
+        rc |= POLLOUT;
+    }
 
-        if (_count == ULLONG_MAX) {
-            /* error on overflow */
-            rc |= POLLERR;
-        }
+    if (count == ULLONG_MAX) {
+        /* error on overflow */
+        rc |= POLLERR;
     }
 
     return rc;
@@ -16,6 +16,7 @@
 #include "libc/libc.hh"
 #include <safe-ptr.hh>
 #include <java/jvm_balloon.hh>
+#include <osv/app.hh>
 
 TRACEPOINT(trace_memory_mmap, "addr=%p, length=%d, prot=%d, flags=%d, fd=%d, offset=%d", void *, size_t, int, int, int, off_t);
 TRACEPOINT(trace_memory_mmap_err, "%d", int);
@@ -68,6 +69,10 @@ unsigned libc_madvise_to_advise(int advice)
         return mmu::advise_dontneed;
     } else if (advice == MADV_NOHUGEPAGE) {
         return mmu::advise_nohugepage;
+    } else if (advice == MADV_MERGEABLE) {
+        return mmu::advise_mergeable;
+    } else if (advice == MADV_UNMERGEABLE) {
+        return mmu::advise_unmergeable;
     }
     return 0;
 }
@@ -137,6 +142,13 @@ void *mmap(void *addr, size_t length, int prot, int flags,
             mmap_flags |= mmu::mmap_jvm_heap;
             memory::return_jvm_heap(length);
         }
+        // The application's own memory, which the kernel only touches
+        // from system calls, where it may take a page fault. Unless it is
+        // meant for a stack, which it may run on with interrupts disabled.
+        if (!(flags & (MAP_STACK | MAP_GROWSDOWN)) &&
+                !(mmap_flags & mmu::mmap_jvm_heap)) {
+            mmap_flags |= mmu::mmap_movable;
+        }
         try {
             ret = mmu::map_anon(addr, length, mmap_flags, mmap_perm);
         } catch (error& err) {
@@ -164,6 +176,10 @@ void *mmap(void *addr, size_t length, int prot, int flags,
             return MAP_FAILED;
         }
     }
+    // So the application's leftover mappings can go when it is torn down
+    if (auto app = osv::application::get_current()) {
+        mmu::set_owner(ret, length, app->get_id());
+    }
     trace_memory_mmap_ret(ret);
     return ret;
 }
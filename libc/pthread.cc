@@ -15,8 +15,10 @@
 #include <string.h>
 #include <list>
 #include <stdio.h>
+#include <unistd.h>
 
 #include <osv/mmu.hh>
+#include "libc.hh"
 
 #include <osv/debug.hh>
 #include <osv/prio.hh>
@@ -84,11 +86,50 @@ namespace pthread_private {
         size_t stack_size;
         size_t guard_size;
         bool detached;
+        bool explicit_sched;
+        unsigned char sched_policy;
+        int sched_priority;
         cpu_set_t *cpuset;
         sched::cpu *cpu;
-        thread_attr() : stack_begin{}, stack_size{1<<20}, guard_size{4096}, detached{false}, cpuset{nullptr}, cpu{nullptr} {}
+        thread_attr() : stack_begin{}, stack_size{1<<20}, guard_size{4096}, detached{false}, explicit_sched{false}, sched_policy{SCHED_OTHER}, sched_priority{0}, cpuset{nullptr}, cpu{nullptr} {}
     };
 
+    sched::thread::realtime_policy to_realtime_policy(int policy)
+    {
+        switch (policy) {
+        case SCHED_FIFO:
+            return sched::thread::realtime_policy::fifo;
+        case SCHED_RR:
+            return sched::thread::realtime_policy::rr;
+        default:
+            return sched::thread::realtime_policy::none;
+        }
+    }
+
+    int from_realtime_policy(sched::thread::realtime_policy policy)
+    {
+        switch (policy) {
+        case sched::thread::realtime_policy::fifo:
+            return SCHED_FIFO;
+        case sched::thread::realtime_policy::rr:
+            return SCHED_RR;
+        default:
+            return SCHED_OTHER;
+        }
+    }
+
+    // Checked before anything reaches sched::thread::set_realtime(), which
+    // asserts on a priority out of the policy's range.
+    bool valid_sched_param(int policy, int priority)
+    {
+        if (policy != SCHED_OTHER && policy != SCHED_FIFO &&
+                policy != SCHED_RR) {
+            return false;
+        }
+        return priority >= sched_get_priority_min(policy) &&
+               priority <= sched_get_priority_max(policy);
+    }
+
     pthread::pthread(void *(*start)(void *arg), void *arg, sigset_t sigset,
                      const thread_attr* attr)
             : _thread([=] {
@@ -98,12 +139,34 @@ namespace pthread_private {
             }, attributes(attr ? *attr : thread_attr()))
     {
         _thread.set_cleanup([=] { delete this; });
+        if (attr && attr->explicit_sched) {
+            _thread.set_realtime(to_realtime_policy(attr->sched_policy),
+                    attr->sched_priority);
+        } else {
+            auto cur = sched::thread::current();
+            _thread.set_realtime(cur->get_realtime_policy(),
+                    cur->realtime_priority());
+        }
+#if CONF_lazy_stack
+        // Tell the thread what of its stack allocate_stack() populated, so
+        // it can fault in more as needed (see sched::lazy_stack_ensure())
+        auto a = attr ? *attr : thread_attr();
+        if (!a.stack_begin) {
+            auto si = _thread.get_stack_info();
+            auto begin = reinterpret_cast<uintptr_t>(si.begin);
+            auto top = begin + si.size;
+            auto bottom = begin + a.guard_size;
+            _thread.remote_thread_local_var(sched::lazy_stack) =
+                { std::max(top - mmu::stack_prefault_size, bottom), bottom, top };
+        }
+#endif
         _thread.start();
     }
 
     sched::thread::attr pthread::attributes(thread_attr attr)
     {
         sched::thread::attr a;
+        a.app();
         a.stack(allocate_stack(attr));
         a.detached(attr.detached);
         if (attr.cpu != nullptr) {
@@ -115,10 +178,18 @@ namespace pthread_private {
     sched::thread::stack_info pthread::allocate_stack(thread_attr attr)
     {
         if (attr.stack_begin) {
+            // We'll run with interrupts disabled on it
+            mmu::set_unmovable(attr.stack_begin, attr.stack_size);
             return {attr.stack_begin, attr.stack_size};
         }
         size_t size = attr.stack_size;
-        void *addr = mmu::map_anon(nullptr, size, mmu::mmap_populate, mmu::perm_rw);
+        void *addr = mmu::map_anon(nullptr, size,
+#if CONF_lazy_stack
+                mmu::mmap_stack,
+#else
+                mmu::mmap_populate,
+#endif
+                mmu::perm_rw);
         mmu::mprotect(addr, attr.guard_size, 0);
         sched::thread::stack_info si{addr, size};
         si.deleter = free_stack;
@@ -174,6 +245,11 @@ int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 
     if (attr != nullptr) {
         thread_attr tmp(*from_libc(attr));
+        // The policy may have been changed after the priority was set
+        if (tmp.explicit_sched &&
+                !valid_sched_param(tmp.sched_policy, tmp.sched_priority)) {
+            return EINVAL;
+        }
         if (tmp.cpuset != nullptr) {
             // We have a CPU set. If we have only one bit set in the set, we
             // pin it to the corresponding CPU. If the set exists, but has no
@@ -281,8 +357,8 @@ int pthread_getcpuclockid(pthread_t thread, clockid_t *clock_id)
 }
 
 // pthread_spinlock_t and spinlock_t aren't really the same type. But since
-// spinlock_t is a boolean and pthread_spinlock_t is defined to be an integer,
-// just casting it like this is fine. As long as we are never operating more
+// spinlock_t is a boolean and an owner byte, and pthread_spinlock_t is
+// defined to be an integer, just casting it like this is fine. As long as we are never operating more
 // than sizeof(int) at a time, we should be fine.
 int pthread_spin_init(pthread_spinlock_t *lock, int pshared)
 {
@@ -318,6 +394,13 @@ int pthread_spin_unlock(pthread_spinlock_t *lock)
     return 0;
 }
 
+// pthread_mutexattr_t holds the mutex type in its low byte, and the
+// protocol in the next one.
+static int mutexattr_protocol(pthread_mutexattr_t attr)
+{
+    return (attr >> 8) & 0xff;
+}
+
 #ifdef LOCKFREE_MUTEX
 typedef lazy_indirect<mutex> indirect_mutex;
 static_assert(sizeof(indirect_mutex) <= sizeof(pthread_mutex_t), "mutex overflow");
@@ -325,8 +408,11 @@ static_assert(sizeof(indirect_mutex) <= 16, "pthread_mutex_t not zeroed at byte
 int pthread_mutex_init(pthread_mutex_t* __restrict m,
         const pthread_mutexattr_t* __restrict attr)
 {
-    // FIXME: respect attr
+    // FIXME: respect the type attribute
     new (m) indirect_mutex;
+    if (attr && mutexattr_protocol(*attr) == PTHREAD_PRIO_INHERIT) {
+        reinterpret_cast<indirect_mutex*>(m)->get()->set_priority_inheritance(true);
+    }
     return 0;
 }
 int pthread_mutex_destroy(pthread_mutex_t *m)
@@ -350,8 +436,11 @@ mutex* from_libc(pthread_mutex_t* m)
 int pthread_mutex_init(pthread_mutex_t* __restrict m,
         const pthread_mutexattr_t* __restrict attr)
 {
-    // FIXME: respect attr
+    // FIXME: respect the type attribute
     new (m) mutex;
+    if (attr && mutexattr_protocol(*attr) == PTHREAD_PRIO_INHERIT) {
+        from_libc(m)->set_priority_inheritance(true);
+    }
     return 0;
 }
 
@@ -618,6 +707,47 @@ int pthread_attr_setinheritsched(pthread_attr_t *attr, int inheritsched)
 {
     if (inheritsched != PTHREAD_INHERIT_SCHED && inheritsched != PTHREAD_EXPLICIT_SCHED)
         return EINVAL;
+    from_libc(attr)->explicit_sched = inheritsched == PTHREAD_EXPLICIT_SCHED;
+    return 0;
+}
+
+int pthread_attr_getinheritsched(const pthread_attr_t *attr, int *inheritsched)
+{
+    *inheritsched = from_libc(attr)->explicit_sched ?
+            PTHREAD_EXPLICIT_SCHED : PTHREAD_INHERIT_SCHED;
+    return 0;
+}
+
+int pthread_attr_setschedpolicy(pthread_attr_t *attr, int policy)
+{
+    if (policy != SCHED_OTHER && policy != SCHED_FIFO && policy != SCHED_RR) {
+        return EINVAL;
+    }
+    from_libc(attr)->sched_policy = policy;
+    return 0;
+}
+
+int pthread_attr_getschedpolicy(const pthread_attr_t *attr, int *policy)
+{
+    *policy = from_libc(attr)->sched_policy;
+    return 0;
+}
+
+int pthread_attr_setschedparam(pthread_attr_t *attr,
+        const struct sched_param *param)
+{
+    if (!valid_sched_param(from_libc(attr)->sched_policy,
+            param->sched_priority)) {
+        return EINVAL;
+    }
+    from_libc(attr)->sched_priority = param->sched_priority;
+    return 0;
+}
+
+int pthread_attr_getschedparam(const pthread_attr_t *attr,
+        struct sched_param *param)
+{
+    param->sched_priority = from_libc(attr)->sched_priority;
     return 0;
 }
 
@@ -737,16 +867,37 @@ int pthread_mutexattr_destroy(pthread_mutexattr_t *attr)
 
 int pthread_mutexattr_gettype(const pthread_mutexattr_t *attr, int *type)
 {
-    *(type) = *(attr);
+    *(type) = *(attr) & 0xff;
     return 0;
 }
 
 int pthread_mutexattr_settype(pthread_mutexattr_t *attr, int type)
 {
-    *(attr) = type;
+    *(attr) = (*(attr) & ~0xff) | type;
+    return 0;
+}
+
+int pthread_mutexattr_getprotocol(const pthread_mutexattr_t *attr,
+        int *protocol)
+{
+    *protocol = mutexattr_protocol(*attr);
     return 0;
 }
 
+int pthread_mutexattr_setprotocol(pthread_mutexattr_t *attr, int protocol)
+{
+    switch (protocol) {
+    case PTHREAD_PRIO_NONE:
+    case PTHREAD_PRIO_INHERIT:
+        *(attr) = (*(attr) & ~0xff00) | (protocol << 8);
+        return 0;
+    case PTHREAD_PRIO_PROTECT:
+        return ENOTSUP;
+    default:
+        return EINVAL;
+    }
+}
+
 int pthread_condattr_init(pthread_condattr_t *attr)
 {
     // We assume there's room for at least one byte in pthread_condattr_t
@@ -811,28 +962,82 @@ void pthread_exit(void *retval)
 
 int sched_get_priority_max(int policy)
 {
-    WARN_STUBBED();
-    return EINVAL;
+    switch (policy) {
+    case SCHED_OTHER:
+        return 0;
+    case SCHED_FIFO:
+    case SCHED_RR:
+        return sched::thread::realtime_priority_max;
+    default:
+        return libc_error(EINVAL);
+    }
 }
 
 int sched_get_priority_min(int policy)
 {
-    WARN_STUBBED();
-    return EINVAL;
+    switch (policy) {
+    case SCHED_OTHER:
+        return 0;
+    case SCHED_FIFO:
+    case SCHED_RR:
+        return 1;
+    default:
+        return libc_error(EINVAL);
+    }
+}
+
+int sched_rr_get_interval(pid_t pid, struct timespec *interval)
+{
+    // OSv only implements one process
+    if (pid != 0 && pid != getpid()) {
+        return libc_error(ESRCH);
+    }
+    auto slice = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            sched::thread::realtime_rr_slice).count();
+    interval->tv_sec = slice / 1000000000;
+    interval->tv_nsec = slice % 1000000000;
+    return 0;
+}
+
+// Threads not created by pthread_create() (e.g. the one running main())
+// have no pthread object, so pthread_self() of such a thread is null.
+static sched::thread* to_sched_thread(pthread_t thread)
+{
+    if (!thread || thread == current_pthread) {
+        return sched::thread::current();
+    }
+    return &pthread::from_libc(thread)->_thread;
 }
 
 int pthread_setschedparam(pthread_t thread, int policy,
         const struct sched_param *param)
 {
-    WARN_STUBBED();
-    return EINVAL;
+    if (!valid_sched_param(policy, param->sched_priority)) {
+        return EINVAL;
+    }
+    to_sched_thread(thread)->set_realtime(to_realtime_policy(policy),
+            param->sched_priority);
+    return 0;
 }
 
 int pthread_getschedparam(pthread_t thread, int *policy,
         struct sched_param *param)
 {
-    WARN_STUBBED();
-    return EINVAL;
+    auto t = to_sched_thread(thread);
+    *policy = from_realtime_policy(t->get_realtime_policy());
+    param->sched_priority = t->realtime_priority();
+    return 0;
+}
+
+int pthread_setschedprio(pthread_t thread, int prio)
+{
+    auto t = to_sched_thread(thread);
+    auto policy = t->get_realtime_policy();
+    if (!valid_sched_param(from_realtime_policy(policy), prio)) {
+        return EINVAL;
+    }
+    t->set_realtime(policy, prio);
+    return 0;
 }
 
 int pthread_kill(pthread_t thread, int sig)
@@ -11,6 +11,10 @@
 #include <osv/fcntl.h>
 #include <osv/align.hh>
 #include <unordered_map>
+#include <string>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
 #include <fs/fs.hh>
 #include <libc/libc.hh>
 
@@ -97,3 +101,76 @@ int shmget(key_t key, size_t size, int shmflg)
     }
     return fd;
 }
+
+// Objects shm_open() creates, by name, until shm_unlink(). Unlinked objects
+// live on while they are open or mapped.
+static std::unordered_map<std::string, fileref> shmnames;
+
+int shm_open(const char *name, int oflag, mode_t mode)
+{
+    if (name[0] == '/') {
+        name++;
+    }
+    if (!*name || strchr(name, '/') || strlen(name) >= NAME_MAX) {
+        return libc_error(EINVAL);
+    }
+    fileref fref;
+    WITH_LOCK(shm_lock) {
+        auto s = shmnames.find(name);
+        if (s != shmnames.end()) {
+            if ((oflag & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+                return libc_error(EEXIST);
+            }
+            fref = s->second;
+        } else if (oflag & O_CREAT) {
+            try {
+                fref = make_file<mmu::shm_file>(0, FREAD | FWRITE);
+            } catch (int error) {
+                return libc_error(error);
+            }
+            shmnames.emplace(name, fref);
+        } else {
+            return libc_error(ENOENT);
+        }
+    }
+    // All opens share the one file, and so its read-write access
+    if ((oflag & O_TRUNC) && (oflag & O_ACCMODE) == O_RDWR) {
+        int error = fref->truncate(0);
+        if (error) {
+            return libc_error(error);
+        }
+    }
+    fdesc f(fref);
+    return f.release();
+}
+
+int shm_unlink(const char *name)
+{
+    if (name[0] == '/') {
+        name++;
+    }
+    SCOPE_LOCK(shm_lock);
+    if (!shmnames.erase(name)) {
+        return libc_error(ENOENT);
+    }
+    return 0;
+}
+
+int memfd_create(const char *name, unsigned flags)
+{
+    if (flags & ~(MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_HUGETLB)) {
+        return libc_error(EINVAL);
+    }
+    if (strlen(name) > NAME_MAX - strlen("memfd:")) {
+        return libc_error(EINVAL);
+    }
+    // Always in huge pages, so MFD_HUGETLB changes nothing
+    try {
+        fileref fref = make_file<mmu::shm_file>(0, FREAD | FWRITE,
+                flags & MFD_ALLOW_SEALING);
+        fdesc f(fref);
+        return f.release();
+    } catch (int error) {
+        return libc_error(error);
+    }
+}
@@ -359,7 +359,7 @@ int kill(pid_t pid, int sig)
                 }
                 sa.sa_handler(sig);
             }
-        }, sched::thread::attr().detached().stack(65536).name("signal_handler"));
+        }, sched::thread::attr().detached().app().stack(65536).name("signal_handler"));
         t->start();
     }
     return 0;
@@ -17,6 +17,12 @@
 #include <sys/timerfd.h>
 
 #include <atomic>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class timerfd_service;
 
 class timerfd final : public special_file {
 public:
@@ -36,52 +42,170 @@ private:
     s64 _expiration = 0;
     s64 _interval = 0;
 
-    // Each timerfd keeps a timer for wakeup of sleeping read() or poll()
-    // in a dedicated thread. We could have used a timer_base::client instead
-    // of a real thread, but things get really complicated when trying to
-    // support set() which cancels on one CPU the timer set on another CPU.
-    sched::thread _wakeup_thread;
+    // The wakeup of sleeping read() or poll() is due at _wakeup_due, and is
+    // done by the timerfd service of the cpu the timerfd was created on.
     s64 _wakeup_due = 0;
-    condvar _wakeup_change_cond;
-    bool _wakeup_thread_exit = false;
     condvar _blocked_reader;
-    void wakeup_thread_func();
+    timerfd_service& _service;
+    friend class timerfd_service;
 
     // Which clock to use to interpret s64 times.
     int _clockid;
-    void set_timer(sched::timer &tmr, s64 time);
 public:
     s64 time_now() const;
+    osv::clock::uptime::time_point to_uptime(s64 time) const;
+};
+
+// Each timerfd used to keep a dedicated thread, sleeping on a timer until
+// the timerfd's next expiration. Instead, the timerfds created on a cpu
+// share one thread pinned to it, which keeps their expirations in a
+// multimap and a single timer, on that cpu's timer list, for the earliest.
+// We can't have the timerfds own timer_base::client timers directly, as
+// set() would then need to cancel, on one cpu, a timer set on another.
+class timerfd_service {
+public:
+    explicit timerfd_service(sched::cpu* cpu);
+    static timerfd_service& current();
+    // Re-reads tfd's wakeup time and (re)arms or disarms it. Call without
+    // holding tfd->_mutex, after every change of tfd->_wakeup_due.
+    void rearm(timerfd* tfd);
+    void remove(timerfd* tfd);
+private:
+    void run();
+    void fire(timerfd* tfd, s64 due);
+private:
+    using time_point = osv::clock::uptime::time_point;
+    using armed_map = std::multimap<time_point, std::pair<timerfd*, s64>>;
+    mutex _mutex;
+    armed_map _armed;
+    std::unordered_map<timerfd*, armed_map::iterator> _index;
+    condvar _changed;
+    std::unique_ptr<sched::thread> _thread;
 };
 
+timerfd_service::timerfd_service(sched::cpu* cpu)
+    : _thread(new sched::thread([this] { run(); },
+            sched::thread::attr().pin(cpu).name("timerfd")))
+{
+    _thread->start();
+}
+
+timerfd_service& timerfd_service::current()
+{
+    static mutex lock;
+    static std::vector<std::unique_ptr<timerfd_service>> services(sched::cpus.size());
+    auto cpu = sched::cpu::current();
+    WITH_LOCK(lock) {
+        auto& s = services[cpu->id];
+        if (!s) {
+            s.reset(new timerfd_service(cpu));
+        }
+        return *s;
+    }
+}
+
+void timerfd_service::rearm(timerfd* tfd)
+{
+    WITH_LOCK(_mutex) {
+        auto i = _index.find(tfd);
+        bool was_first = false;
+        if (i != _index.end()) {
+            was_first = i->second == _armed.begin();
+            _armed.erase(i->second);
+            _index.erase(i);
+        }
+        s64 due;
+        WITH_LOCK(tfd->_mutex) {
+            due = tfd->_wakeup_due;
+        }
+        if (due) {
+            auto it = _armed.emplace(tfd->to_uptime(due), std::make_pair(tfd, due));
+            _index.emplace(tfd, it);
+            was_first |= it == _armed.begin();
+        }
+        // Only a change of the earliest expiration needs the thread
+        if (was_first) {
+            _changed.wake_one();
+        }
+    }
+}
+
+void timerfd_service::remove(timerfd* tfd)
+{
+    WITH_LOCK(_mutex) {
+        auto i = _index.find(tfd);
+        if (i != _index.end()) {
+            _armed.erase(i->second);
+            _index.erase(i);
+        }
+    }
+}
+
+// Called with _mutex held, so a timerfd being closed waits for it in remove()
+void timerfd_service::fire(timerfd* tfd, s64 due)
+{
+    WITH_LOCK(tfd->_mutex) {
+        if (tfd->_wakeup_due != due) {
+            // set() raced with us, and will rearm
+            return;
+        }
+        tfd->_wakeup_due = 0;
+        // Wake blocked read() or poll() on this fd
+        tfd->_blocked_reader.wake_one();
+    }
+    poll_wake(tfd, POLLIN);
+}
+
+void timerfd_service::run()
+{
+    sched::timer tmr(*sched::thread::current());
+    WITH_LOCK(_mutex) {
+        for (;;) {
+            if (_armed.empty()) {
+                _changed.wait(_mutex);
+                continue;
+            }
+            auto now = osv::clock::uptime::now();
+            // Fire everything due, in one pass
+            while (!_armed.empty() && _armed.begin()->first <= now) {
+                auto first = _armed.begin();
+                auto tfd = first->second.first;
+                auto due = first->second.second;
+                _index.erase(tfd);
+                _armed.erase(first);
+                fire(tfd, due);
+            }
+            if (!_armed.empty()) {
+                tmr.set(_armed.begin()->first);
+                _changed.wait(_mutex, &tmr);
+                tmr.cancel();
+            }
+        }
+    }
+}
+
 timerfd::timerfd(int clockid, int oflags)
     : special_file(FREAD | oflags, DTYPE_UNSPEC),
-      _wakeup_thread(
-            [&] { wakeup_thread_func(); }, sched::thread::attr().stack(4096).name("timerfd")),
+      _service(timerfd_service::current()),
       _clockid(clockid)
 {
-    _wakeup_thread.start();
 }
 
 int timerfd::close() {
-    WITH_LOCK(_mutex) {
-        _wakeup_thread_exit = true;
-        _wakeup_change_cond.wake_one();
-    }
-    _wakeup_thread.join();
+    _service.remove(this);
     return 0;
 }
 
-void timerfd::set_timer(sched::timer &tmr, s64 t)
+osv::clock::uptime::time_point timerfd::to_uptime(s64 t) const
 {
     using namespace osv::clock;
     switch(_clockid) {
     case CLOCK_REALTIME:
-        tmr.set(wall::time_point(std::chrono::nanoseconds(t)));
-        break;
+        // As sched::timer does, fix the duration until expiration now
+        return uptime::time_point(
+                wall::time_point(std::chrono::nanoseconds(t)) - wall::boot_time());
     case CLOCK_MONOTONIC:
-        tmr.set(uptime::time_point(std::chrono::nanoseconds(t)));
-        break;
+        return uptime::time_point(std::chrono::nanoseconds(t));
     default:
         assert(false);
     }
@@ -102,38 +226,15 @@ s64 timerfd::time_now() const
     }
 }
 
-void timerfd::wakeup_thread_func()
-{
-    sched::timer tmr(*sched::thread::current());
-    WITH_LOCK(_mutex) {
-        while (!_wakeup_thread_exit) {
-            if (_wakeup_due != 0) {
-                set_timer(tmr, _wakeup_due);
-                _wakeup_change_cond.wait(_mutex, &tmr);
-                if (tmr.expired()) {
-                    _wakeup_due = 0;
-                    // Wake blocked read() or poll() on this fd
-                    _blocked_reader.wake_one();
-                    poll_wake(this, POLLIN);
-                } else {
-                    tmr.cancel();
-                }
-            } else {
-                _wakeup_change_cond.wait(_mutex);
-            }
-        }
-    }
-}
-
 void timerfd::set(s64 expiration, s64 interval)
 {
     WITH_LOCK(_mutex) {
         _expiration = expiration;
         _interval = interval;
         _wakeup_due = expiration;
-        _wakeup_change_cond.wake_one();
         _blocked_reader.wake_one();
     }
+    _service.rearm(this);
 }
 
 void timerfd::get(s64 &expiration, s64 &interval) const
@@ -173,6 +274,7 @@ static void copy_to_uio(const char *q, size_t qlen, uio *uio)
 int timerfd::read(uio *data, int flags)
 {
     u64 ret;
+    bool rearm = false;
 
     if (data->uio_resid < (ssize_t) sizeof(ret)) {
         return EINVAL;
@@ -199,12 +301,15 @@ int timerfd::read(uio *data, int flags)
             u64 count = (now - _expiration) / _interval;
             _expiration = _expiration + (count+1) * _interval;
             _wakeup_due = _expiration;
-            _wakeup_change_cond.wake_one();
+            rearm = true;
             ret = 1 + count;
         }
         copy_to_uio((const char *)&ret, sizeof(ret), data);
-        return 0;
     }
+    if (rearm) {
+        _service.rearm(this);
+    }
+    return 0;
 }
 
 int timerfd::poll(int events)
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include "app.hh"
+#include "autogen/app.json.hh"
+#include "exception.hh"
+#include <osv/app.hh>
+#include <osv/clock.hh>
+#include <vector>
+
+namespace httpserver {
+
+namespace api {
+
+namespace app {
+
+using namespace json;
+using namespace std;
+using namespace app_json;
+using namespace std::chrono;
+
+void init(routes& routes)
+{
+    app_json_init_path();
+
+    listApps.set_handler([](const_req req) {
+        vector<App> res;
+        for (auto& info : osv::get_applications()) {
+            App app;
+            app.id = info.id;
+            app.command = info.command;
+            app.restarts = info.restarts;
+            res.push_back(app);
+        }
+        return res;
+    });
+
+    restartApp.set_handler([](const_req req) {
+        string id = req.param.at("id").substr(1);
+        string timeout = req.get_query_param("timeout");
+        auto t0 = osv::clock::uptime::now();
+        try {
+            if (!osv::restart_application(stoul(id),
+                    milliseconds(timeout.empty() ? 10000 : stol(timeout)))) {
+                throw not_found_exception("Application " + id + " not found");
+            }
+        } catch (const osv::launch_error& e) {
+            throw server_error_exception(e.what());
+        } catch (const logic_error& e) {
+            throw bad_param_exception("Invalid application id or timeout");
+        }
+        return duration_cast<microseconds>(osv::clock::uptime::now() - t0).count();
+    });
+}
+
+}
+}
+}
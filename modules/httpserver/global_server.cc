@@ -16,6 +16,7 @@
 #include "api/hardware.hh"
 #include "path_holder.hh"
 #include "api/network.hh"
+#include "api/app.hh"
 #include <iostream>
 #include <osv/app.hh>
 #include <fstream>
@@ -102,6 +103,7 @@ void global_server::set_routes()
     api::env::init(_routes);
     api::files_mapping::init(_routes);
     api::hardware::init(_routes);
+    api::app::init(_routes);
 }
 
 }
@@ -23,6 +23,11 @@ opt = optparse.OptionParser(option_list = [
                     dest = 'manifest',
                     help = 'read manifest from FILE',
                     metavar = 'FILE'),
+        make_option('-c',
+                    dest = 'compression',
+                    help = 'compress the image with ALGORITHM',
+                    metavar = 'ALGORITHM',
+                    default = 'lz4'),
 ])
 
 (options, args) = opt.parse_args()
@@ -39,7 +44,7 @@ depends.write(u'%s: \\\n' % (options.output,))
 
 image_path = os.path.abspath(options.output)
 
-osv = subprocess.Popen('cd ../..; scripts/run.py --vnc none -c1 -m 512 -i %s -u -s -e "--nomount --norandom tools/mkfs.so; tools/cpiod.so --prefix /zfs/zfs" --forward tcp:10000::10000' % image_path, shell = True, stdout=subprocess.PIPE)
+osv = subprocess.Popen('cd ../..; scripts/run.py --vnc none -c1 -m 512 -i %s -u -s -e "--nomount --norandom tools/mkfs.so %s; tools/cpiod.so --prefix /zfs/zfs" --forward tcp:10000::10000' % (image_path, options.compression), shell = True, stdout=subprocess.PIPE)
 
 upload_manifest.upload(osv, manifest, depends)
 
@@ -106,7 +106,7 @@ def start_osv_qemu(options):
         "-device", "ide-hd,drive=hd0,id=idehd0,bus=ide.0"]
     elif (options.scsi):
         args += [
-        "-device", "virtio-scsi-pci,id=scsi0",
+        "-device", "virtio-scsi-pci,id=scsi0,num_queues=%s" % (options.vcpus),
         "-drive", "file=%s,if=none,id=hd0,media=disk,aio=native,cache=%s" % (options.image_file, cache),
         "-device", "scsi-hd,bus=scsi0.0,drive=hd0,scsi-id=1,lun=0,bootindex=0"]
     elif (options.ide):
@@ -150,6 +150,18 @@ def start_osv_qemu(options):
     args += ["-device", ','.join(net_device_options)]
     args += ["-device", "virtio-rng-pci"]
 
+    if options.virtio_fs:
+        # virtiofsd serves the directory on this socket; the device needs
+        # guest memory the daemon can map too
+        fs_device_options = ['vhost-user-fs-pci', 'chardev=vfs0', 'tag=osv']
+        if options.virtio_fs_cache:
+            fs_device_options.append('cache-size=%s' % options.virtio_fs_cache)
+        args += [
+        "-chardev", "socket,id=vfs0,path=%s" % options.virtio_fs,
+        "-device", ','.join(fs_device_options),
+        "-object", "memory-backend-file,id=mem,size=%s,mem-path=/dev/shm,share=on" % options.memsize,
+        "-numa", "node,memdev=mem"]
+
     if options.hypervisor == "kvm":
         args += ["-enable-kvm", "-cpu", "host,+x2apic"]
     elif (options.hypervisor == "none") or (options.hypervisor == "qemu"):
@@ -439,6 +451,10 @@ if (__name__ == "__main__"):
                         help="enable collecting of backtrace at tracepoints")
     parser.add_argument("--sampler", action="store", nargs='?', const='1000',
                         help="start sampling profiler. optionally specify sampling frequency in Hz")
+    parser.add_argument("--virtio-fs", action="store", default=None, metavar="SOCKET",
+                        help="share a directory with virtio-fs, served by virtiofsd on SOCKET")
+    parser.add_argument("--virtio-fs-cache", action="store", default=None, metavar="SIZE",
+                        help="size of the virtio-fs DAX window (needs a qemu which supports it)")
     parser.add_argument("--qemu-path", action="store",
                         default="qemu-system-x86_64",
                         help="specify qemu command path")
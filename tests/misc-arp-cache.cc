@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Cost of an ARP cache lookup, as every packet sent to a neighbor does, with
+// the cache holding many neighbors: hits, misses, and hits from several
+// threads at once, which shouldn't slow each other down. The counters of the
+// system's own cache are printed at the end:
+//   scripts/run.py -e "tests/misc-arp-cache.so [neighbors] [threads] [lookups]"
+
+#include <bsd/sys/netinet/arpcache.hh>
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::high_resolution_clock clk;
+
+static in_addr neighbor(unsigned i)
+{
+    in_addr ip;
+    ip.s_addr = htonl((10u << 24) + i);
+    return ip;
+}
+
+// Looks up n addresses from first on, cycling through count of them, and
+// returns the ns per lookup
+static double lookups(arp_cache& cache, unsigned first, unsigned count,
+                      unsigned long n, unsigned long& found)
+{
+    arp_cache::mac_address mac;
+    u16 flags;
+    found = 0;
+    auto t0 = clk::now();
+    for (unsigned long i = 0; i < n; i++) {
+        found += cache.lookup(neighbor(first + i % count), mac, flags);
+    }
+    return std::chrono::duration<double, std::nano>(clk::now() - t0).count() / n;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned neighbors = argc > 1 ? atoi(argv[1]) : 10000;
+    unsigned nthreads = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+    unsigned long n = argc > 3 ? atol(argv[3]) : 10000000;
+
+    arp_cache cache;
+    for (unsigned i = 0; i < neighbors; i++) {
+        arp_cache::mac_address mac = {{ 0x52, 0x54, 0, u8(i >> 16), u8(i >> 8), u8(i) }};
+        cache.add(neighbor(i), mac, 0);
+    }
+
+    printf("%u neighbors, %lu lookups\n", neighbors, n);
+    bool ok = true;
+    unsigned long found;
+    auto ns = lookups(cache, 0, neighbors, n, found);
+    ok &= found == n;
+    printf("%-24s %8.1f ns/lookup\n", "hit", ns);
+    ns = lookups(cache, neighbors, neighbors, n, found);
+    ok &= found == 0;
+    printf("%-24s %8.1f ns/lookup\n", "miss", ns);
+
+    std::vector<double> per_thread(nthreads);
+    std::vector<unsigned long> per_thread_found(nthreads);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t] {
+            per_thread[t] = lookups(cache, 0, neighbors, n / nthreads,
+                    per_thread_found[t]);
+        });
+    }
+    double avg = 0;
+    for (unsigned t = 0; t < nthreads; t++) {
+        threads[t].join();
+        avg += per_thread[t] / nthreads;
+        ok &= per_thread_found[t] == n / nthreads;
+    }
+    char what[64];
+    snprintf(what, sizeof(what), "hit, %u threads", nthreads);
+    printf("%-24s %8.1f ns/lookup\n", what, avg);
+
+    auto st = arp_cache_stats();
+    printf("system cache: %lu hits, %lu misses, %lu probes\n",
+            st.hits, st.misses, st.probes);
+    printf("%s\n", ok ? "lookups: OK" : "lookups: FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Throughput of read() and write() of a raw block device, by block size,
+// against bios of the same size handed to the driver (as misc-bdev-rw does),
+// which is as fast as the device goes. The first MB of every block size
+// are verified. The device's contents are overwritten, so give the guest a
+// scratch disk besides its own, and:
+//   scripts/run.py -e "tests/misc-bdev-direct.so [/dev/vblk1] [MB]"
+
+#include <osv/device.h>
+#include <osv/bio.h>
+#include <osv/prex.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <vector>
+
+typedef std::chrono::high_resolution_clock clk;
+
+static double mbps(size_t bytes, clk::duration d)
+{
+    return (bytes >> 20) / std::chrono::duration<double>(d).count();
+}
+
+// Does total bytes of I/O in bs sized bios, one at a time
+static double bio_io(device* dev, int cmd, char* buf, size_t bs, size_t total)
+{
+    auto t0 = clk::now();
+    for (size_t off = 0; off < total; off += bs) {
+        auto bio = alloc_bio();
+        bio->bio_cmd = cmd;
+        bio->bio_dev = dev;
+        bio->bio_data = buf;
+        bio->bio_offset = off;
+        bio->bio_bcount = bs;
+        dev->driver->devops->strategy(bio);
+        if (bio_wait(bio)) {
+            printf("bio failed at %zu\n", off);
+            exit(1);
+        }
+        destroy_bio(bio);
+    }
+    return mbps(total, clk::now() - t0);
+}
+
+// Does total bytes of I/O in bs sized system calls
+static double file_io(int fd, bool write, char* buf, size_t bs, size_t total)
+{
+    auto t0 = clk::now();
+    for (size_t off = 0; off < total; off += bs) {
+        auto r = write ? pwrite(fd, buf, bs, off) : pread(fd, buf, bs, off);
+        if (r != (ssize_t)bs) {
+            perror(write ? "pwrite" : "pread");
+            exit(1);
+        }
+    }
+    return mbps(total, clk::now() - t0);
+}
+
+int main(int argc, char **argv)
+{
+    const char* path = argc > 1 ? argv[1] : "/dev/vblk1";
+    size_t total = (argc > 2 ? atoi(argv[2]) : 256) << 20;
+
+    device* dev;
+    if (device_open(path + strlen("/dev/"), DO_RDWR, &dev)) {
+        printf("open %s failed\n", path);
+        return 1;
+    }
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    total = std::min<size_t>(total, dev->size & ~((1 << 20) - 1));
+
+    const size_t max_bs = 1 << 20;
+    // Kernel memory, as the bios need
+    auto buf = static_cast<char*>(aligned_alloc(4096, max_bs));
+    std::vector<char> check(max_bs);
+
+    printf("%s, %zu MB\n", path, total >> 20);
+    printf("   block   bio write    write  bio read     read  (MB/s)\n");
+    bool ok = true;
+    for (size_t bs = 4096; bs <= max_bs; bs *= 4) {
+        for (size_t i = 0; i < max_bs; i++) {
+            buf[i] = i * 7 + bs;
+        }
+        auto bw = bio_io(dev, BIO_WRITE, buf, bs, total);
+        auto fw = file_io(fd, true, buf, bs, total);
+        auto br = bio_io(dev, BIO_READ, buf, bs, total);
+        auto fr = file_io(fd, false, buf, bs, total);
+        printf("%7zuK %10.1f %8.1f %9.1f %8.1f\n", bs >> 10, bw, fw, br, fr);
+
+        if (pread(fd, check.data(), max_bs, 0) != (ssize_t)max_bs) {
+            perror("pread");
+            return 1;
+        }
+        for (size_t i = 0; i < max_bs; i++) {
+            if (check[i] != char((i % bs) * 7 + bs)) {
+                printf("data mismatch at %zu for %zuK blocks\n", i, bs >> 10);
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    free(buf);
+    close(fd);
+    device_close(dev);
+    printf("%s\n", ok ? "data check: OK" : "data check: FAILED");
+    return ok ? 0 : 1;
+}
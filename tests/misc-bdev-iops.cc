@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Random small reads of a block device from many threads at once, each
+// with one bio in flight, handed straight to the driver. Reported are the
+// IOPS and the average latency. Drivers with one queue per cpu
+// (virtio-scsi with num_queues, as run.py -S sets to the number of vcpus)
+// should scale with the vcpus; run with -c 1, 2, 4, ... 16 to compare:
+//   scripts/run.py -S -c 16 -e "tests/misc-bdev-iops.so [/dev/vblk0] [threads] [seconds] [bs]"
+// AHCI with native command queuing (run.py -A, on q35's ich9-ahci) should
+// scale with the threads, up to its 32 slots; compare 1 and 32 threads:
+//   scripts/run.py -A -e "tests/misc-bdev-iops.so /dev/vblk0 [threads]"
+
+#include <osv/device.h>
+#include <osv/bio.h>
+#include <osv/prex.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::high_resolution_clock clk;
+
+static std::atomic<bool> failed;
+
+// Reads bs sized blocks at random offsets until end, returning how many
+static unsigned long reader(device* dev, size_t bs, clk::time_point end, unsigned seed)
+{
+    std::default_random_engine rand(seed);
+    std::uniform_int_distribution<uint64_t> block(0, dev->size / bs - 1);
+    // Kernel memory, as the bios need
+    auto buf = aligned_alloc(4096, bs);
+    unsigned long n = 0;
+    while (clk::now() < end) {
+        auto bio = alloc_bio();
+        bio->bio_cmd = BIO_READ;
+        bio->bio_dev = dev;
+        bio->bio_data = buf;
+        bio->bio_offset = block(rand) * bs;
+        bio->bio_bcount = bs;
+        dev->driver->devops->strategy(bio);
+        if (bio_wait(bio)) {
+            failed.store(true);
+        }
+        destroy_bio(bio);
+        n++;
+    }
+    free(buf);
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    const char* path = argc > 1 ? argv[1] : "/dev/vblk0";
+    unsigned nthreads = argc > 2 ? atoi(argv[2]) : 4 * std::thread::hardware_concurrency();
+    int seconds = argc > 3 ? atoi(argv[3]) : 10;
+    size_t bs = argc > 4 ? atoi(argv[4]) : 4096;
+
+    device* dev;
+    if (device_open(path + strlen("/dev/"), DO_RDWR, &dev)) {
+        printf("open %s failed\n", path);
+        return 1;
+    }
+
+    std::vector<unsigned long> done(nthreads);
+    std::vector<std::thread> threads;
+    auto end = clk::now() + std::chrono::seconds(seconds);
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads.emplace_back([&, i] { done[i] = reader(dev, bs, end, i); });
+    }
+    unsigned long total = 0;
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads[i].join();
+        total += done[i];
+    }
+    device_close(dev);
+
+    printf("%s, %u cpus, %u threads, %zu byte reads: %10.0f IOPS %8.1f us avg\n",
+            path, std::thread::hardware_concurrency(), nthreads, bs,
+            total / double(seconds), seconds * 1e6 * nthreads / total);
+    if (failed.load()) {
+        printf("some reads failed\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Ping-pong round trips over a TCP connection, waiting for each reply with
+// a blocking read() and with epoll_wait(), each with and without busy
+// polling (SO_BUSY_POLL, and EPIOCSPARAMS for epoll). Reported are the
+// average and 99th percentile round trip times and the waiting thread's cpu
+// time per round trip. Busy polling only applies to sockets fed by a net
+// channel, which loopback connections aren't, so the pings go to an echo
+// server on the host:
+//   socat tcp-listen:9999,fork,reuseaddr exec:cat &
+//   scripts/run.py -e "tests/misc-busy-poll.so [addr] [rounds] [usecs] [size]"
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#define PORT 9999
+
+typedef std::chrono::high_resolution_clock clk;
+
+static double cputime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Reads len bytes, waiting on ep first if it is not -1
+static bool read_all(int s, int ep, char* buf, size_t len)
+{
+    while (len) {
+        if (ep >= 0) {
+            struct epoll_event ev;
+            if (epoll_wait(ep, &ev, 1, 1000) <= 0) {
+                return false;
+            }
+        }
+        ssize_t r = read(s, buf, len);
+        if (r < 0 && ep >= 0 && errno == EAGAIN) {
+            continue;
+        }
+        if (r <= 0) {
+            return false;
+        }
+        buf += r;
+        len -= r;
+    }
+    return true;
+}
+
+static void run(const char* what, const sockaddr_in& addr, int rounds,
+                size_t size, bool use_epoll, int usecs)
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(s, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    int ep = -1;
+    if (use_epoll) {
+        ep = epoll_create1(0);
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        epoll_ctl(ep, EPOLL_CTL_ADD, s, &ev);
+        ioctl(s, FIONBIO, &one);
+        if (usecs) {
+            struct epoll_params params = {};
+            params.busy_poll_usecs = usecs;
+            if (ioctl(ep, EPIOCSPARAMS, &params) < 0) {
+                perror("ioctl(EPIOCSPARAMS)");
+                exit(1);
+            }
+        }
+    } else if (usecs) {
+        if (setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0) {
+            perror("setsockopt(SO_BUSY_POLL)");
+            exit(1);
+        }
+    }
+
+    std::vector<char> ping(size, 'p'), pong(size);
+    std::vector<float> lat;
+    lat.reserve(rounds);
+    double cpu0 = cputime();
+    for (int i = 0; i < rounds; i++) {
+        auto t0 = clk::now();
+        if (write(s, ping.data(), size) != (ssize_t)size ||
+                !read_all(s, ep, pong.data(), size)) {
+            printf("connection lost\n");
+            exit(1);
+        }
+        lat.push_back(std::chrono::duration<float, std::micro>(clk::now() - t0).count());
+    }
+    double cpu = cputime() - cpu0;
+    if (ep >= 0) {
+        close(ep);
+    }
+    close(s);
+
+    std::sort(lat.begin(), lat.end());
+    double avg = 0;
+    for (auto l : lat) {
+        avg += l;
+    }
+    printf("%-20s %8.1f us avg %8.1f us p99 %8.1f us cpu/round trip\n", what,
+           avg / rounds, lat[size_t(rounds * 0.99)], cpu * 1e6 / rounds);
+}
+
+int main(int argc, char **argv)
+{
+    const char* host = argc > 1 ? argv[1] : "192.168.122.1";
+    int rounds = argc > 2 ? atoi(argv[2]) : 100000;
+    int usecs = argc > 3 ? atoi(argv[3]) : 50;
+    size_t size = argc > 4 ? atoi(argv[4]) : 64;
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    inet_aton(host, &addr.sin_addr);
+    addr.sin_port = htons(PORT);
+
+    printf("%d round trips of %zu bytes to %s:%d, busy polling %d us\n",
+            rounds, size, host, PORT, usecs);
+    run("read", addr, rounds, size, false, 0);
+    run("read SO_BUSY_POLL", addr, rounds, size, false, usecs);
+    run("epoll", addr, rounds, size, true, 0);
+    run("epoll EPIOCSPARAMS", addr, rounds, size, true, usecs);
+    return 0;
+}
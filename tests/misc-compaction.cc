@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Ages physical memory into fragmentation, and measures how many huge pages
+// can still be allocated, before and after memory::compact(), round after
+// round. Most of the memory in use is anonymous memory, mapped in small
+// pages and churned in random order; a small part of it is kernel pages,
+// which can't be moved.
+//   scripts/run.py -m 2G -e "tests/misc-compaction.so [MB] [rounds]"
+
+#include <osv/mempool.hh>
+#include <osv/mmu.hh>
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+// one page in this many is a kernel page rather than an anonymous one
+#define UNMOVABLE_RATIO 64
+
+static std::default_random_engine rnd;
+
+// How many huge pages we could allocate right now
+static unsigned count_huge_pages()
+{
+    std::vector<void*> pages;
+    while (void* p = memory::alloc_huge_page(mmu::huge_page_size)) {
+        pages.push_back(p);
+    }
+    for (auto p : pages) {
+        memory::free_huge_page(p, mmu::huge_page_size);
+    }
+    return pages.size();
+}
+
+static void fill(char* page, size_t i)
+{
+    memset(page, i % 251, mmu::page_size);
+}
+
+static bool check(char* page, size_t i)
+{
+    for (size_t j = 0; j < mmu::page_size; j++) {
+        if (page[j] != char(i % 251)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    size_t mb = argc > 1 ? atoi(argv[1]) : memory::stats::free() / 2 / (1 << 20);
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    size_t npages = (mb << 20) / mmu::page_size;
+
+    printf("%zu MB of anonymous memory, %d rounds\n", mb, rounds);
+    auto mem = static_cast<char*>(mmap(nullptr, npages * mmu::page_size,
+            PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    // Small pages only, so each page fault takes one page from anywhere
+    madvise(mem, npages * mmu::page_size, MADV_NOHUGEPAGE);
+
+    std::vector<size_t> order(npages);
+    for (size_t i = 0; i < npages; i++) {
+        order[i] = i;
+    }
+    std::vector<bool> present(npages);
+    std::vector<void*> unmovable;
+
+    printf("huge pages available at start: %u\n", count_huge_pages());
+    printf("round  in use MB  huge pages before  after compact  compact ms\n");
+    bool ok = true;
+    for (int round = 0; round < rounds; round++) {
+        // Touch a random half of the pages, and drop a random quarter, so
+        // that what's left in use is scattered all over physical memory.
+        std::shuffle(order.begin(), order.end(), rnd);
+        for (size_t k = 0; k < npages / 2; k++) {
+            auto i = order[k];
+            if (!present[i]) {
+                fill(mem + i * mmu::page_size, i);
+                present[i] = true;
+            }
+            if (k % UNMOVABLE_RATIO == 0) {
+                unmovable.push_back(memory::alloc_page());
+            }
+        }
+        std::shuffle(order.begin(), order.end(), rnd);
+        for (size_t k = 0; k < npages / 4; k++) {
+            auto i = order[k];
+            if (present[i]) {
+                madvise(mem + i * mmu::page_size, mmu::page_size, MADV_DONTNEED);
+                present[i] = false;
+            }
+        }
+        std::shuffle(unmovable.begin(), unmovable.end(), rnd);
+        while (unmovable.size() > npages / UNMOVABLE_RATIO / 2) {
+            memory::free_page(unmovable.back());
+            unmovable.pop_back();
+        }
+
+        auto before = count_huge_pages();
+        auto start = std::chrono::high_resolution_clock::now();
+        memory::compact();
+        auto end = std::chrono::high_resolution_clock::now();
+        auto after = count_huge_pages();
+        size_t in_use = std::count(present.begin(), present.end(), true) + unmovable.size();
+        printf("%5d  %9zu  %17u  %13u  %10.1f\n", round,
+                in_use * mmu::page_size >> 20, before, after,
+                std::chrono::duration<double, std::milli>(end - start).count());
+
+        // Moved pages must have kept their contents
+        for (size_t i = 0; i < npages; i++) {
+            if (present[i] && !check(mem + i * mmu::page_size, i)) {
+                printf("page %zu corrupted\n", i);
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    for (auto p : unmovable) {
+        memory::free_page(p);
+    }
+    munmap(mem, npages * mmu::page_size);
+    printf("%s\n", ok ? "data check: OK" : "data check: FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// eventfd used as a doorbell between threads, as event loops do: two
+// threads ping-pong over a pair of eventfds, waiting in read() and in
+// epoll_wait(); then one thread rings as fast as it can while another drains
+// the count with epoll_wait() and read(), reporting the writer's cost per
+// ring and how many rings each wakeup collected. Compare with tst-eventfd
+// for the semantics:
+//   scripts/run.py -e "tests/misc-eventfd-doorbell.so [rounds] [seconds]"
+
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+typedef std::chrono::high_resolution_clock clk;
+
+static double cputime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Waits until fd is readable, with epoll if ep is not -1, and reads it
+static void wait_read(int fd, int ep)
+{
+    eventfd_t v;
+    if (ep >= 0) {
+        struct epoll_event ev;
+        while (epoll_wait(ep, &ev, 1, -1) != 1) {
+        }
+    }
+    if (eventfd_read(fd, &v) < 0) {
+        perror("eventfd_read");
+        exit(1);
+    }
+}
+
+static int epoll_on(int fd)
+{
+    int ep = epoll_create1(0);
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+    return ep;
+}
+
+static void ping_pong(const char* what, int rounds, bool use_epoll)
+{
+    int ping = eventfd(0, 0), pong = eventfd(0, 0);
+    int ping_ep = use_epoll ? epoll_on(ping) : -1;
+    int pong_ep = use_epoll ? epoll_on(pong) : -1;
+    std::thread peer([&] {
+        for (int i = 0; i < rounds; i++) {
+            wait_read(ping, ping_ep);
+            eventfd_write(pong, 1);
+        }
+    });
+    auto t0 = clk::now();
+    for (int i = 0; i < rounds; i++) {
+        eventfd_write(ping, 1);
+        wait_read(pong, pong_ep);
+    }
+    auto d = std::chrono::duration<double>(clk::now() - t0).count();
+    peer.join();
+    printf("%-24s %10.0f round trips/s %8.2f us/round trip\n", what,
+            rounds / d, d * 1e6 / rounds);
+    for (int fd : { ping, pong, ping_ep, pong_ep }) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+static void doorbell(int seconds)
+{
+    int fd = eventfd(0, EFD_NONBLOCK);
+    int ep = epoll_on(fd);
+    std::atomic<bool> done(false);
+    unsigned long wakeups = 0, drained = 0;
+    std::thread drainer([&] {
+        while (!done.load(std::memory_order_relaxed)) {
+            struct epoll_event ev;
+            if (epoll_wait(ep, &ev, 1, 100) != 1) {
+                continue;
+            }
+            eventfd_t v;
+            if (eventfd_read(fd, &v) == 0) {
+                wakeups++;
+                drained += v;
+            }
+        }
+    });
+    unsigned long rings = 0;
+    double cpu0 = cputime();
+    auto end = clk::now() + std::chrono::seconds(seconds);
+    while (clk::now() < end) {
+        for (int i = 0; i < 1000; i++) {
+            eventfd_write(fd, 1);
+        }
+        rings += 1000;
+    }
+    double cpu = cputime() - cpu0;
+    done.store(true);
+    drainer.join();
+    printf("%-24s %10.0f rings/s %8.0f ns cpu/ring %8.1f rings/wakeup\n",
+            "doorbell", rings / double(seconds), cpu * 1e9 / rings,
+            wakeups ? drained / double(wakeups) : 0);
+    close(ep);
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 100000;
+    int seconds = argc > 2 ? atoi(argv[2]) : 5;
+
+    ping_pong("ping-pong read", rounds, false);
+    ping_pong("ping-pong epoll", rounds, true);
+    doorbell(seconds);
+    return 0;
+}
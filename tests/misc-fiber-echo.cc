@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Compares an echo server with a fiber per connection to one with a thread
+// per connection: the memory each needs to hold many connections open, and
+// the request rate. Clients run in the same guest, on a few threads using
+// epoll; each connection has one 64-byte message in flight at a time.
+//   scripts/run.py -m 4G -c 4 -e "tests/misc-fiber-echo.so [fiber|thread]
+//       [connections] [seconds] [fiber stack size]"
+// 100000 connections (the default) need about 2GB of memory in fiber mode.
+
+#include <osv/fiber.hh>
+#include <osv/mempool.hh>
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#define BASE_PORT 10000
+// connections per listening port, well below the ephemeral port range
+#define CONNS_PER_PORT 20000
+#define MSG_SIZE 64
+
+static bool use_fibers = true;
+static size_t fiber_stack = 16384;
+static std::atomic<unsigned> handlers(0);
+
+static void set_nonblock(int fd, bool nonblock = true)
+{
+    auto flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, nonblock ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+
+// Like read()/write() on a blocking socket, parking the fiber instead
+static ssize_t fiber_io(int fd, char* buf, size_t len, bool wr)
+{
+    while (true) {
+        auto n = wr ? write(fd, buf, len) : read(fd, buf, len);
+        if (n >= 0 || errno != EAGAIN) {
+            return n;
+        }
+        struct pollfd pfd = { fd, short(wr ? POLLOUT : POLLIN), 0 };
+        poll(&pfd, 1, -1);
+    }
+}
+
+static void echo(int fd)
+{
+    char buf[MSG_SIZE];
+    while (true) {
+        auto n = use_fibers ? fiber_io(fd, buf, sizeof(buf), false) :
+                read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        if ((use_fibers ? fiber_io(fd, buf, n, true) : write(fd, buf, n)) != n) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+static void serve(int fd)
+{
+    handlers++;
+    set_nonblock(fd, use_fibers);
+    if (use_fibers) {
+        static unsigned next_cpu;
+        auto c = sched::cpus[next_cpu++ % sched::cpus.size()];
+        (new osv::fiber([fd] { echo(fd); },
+                osv::fiber::attr().detached().stack(fiber_stack)))->start(c);
+    } else {
+        std::thread([fd] { echo(fd); }).detach();
+    }
+}
+
+static void acceptor(std::vector<int> listeners)
+{
+    std::vector<struct pollfd> pfds;
+    for (auto l : listeners) {
+        set_nonblock(l);
+        pfds.push_back({ l, POLLIN, 0 });
+    }
+    while (true) {
+        poll(pfds.data(), pfds.size(), -1);
+        for (auto& p : pfds) {
+            int fd;
+            while ((fd = accept(p.fd, nullptr, nullptr)) >= 0) {
+                serve(fd);
+            }
+        }
+    }
+}
+
+static std::atomic<bool> done(false);
+
+// Drives its share of the connections: keeps one message in flight on each
+static void client(std::vector<int> fds, std::atomic<unsigned long>* requests)
+{
+    int ep = epoll_create1(0);
+    char buf[MSG_SIZE] = {};
+    for (auto fd : fds) {
+        set_nonblock(fd);
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+        write(fd, buf, sizeof(buf));
+    }
+    std::vector<struct epoll_event> events(256);
+    unsigned long n = 0;
+    while (!done.load(std::memory_order_relaxed)) {
+        int r = epoll_wait(ep, events.data(), events.size(), 100);
+        for (int i = 0; i < r; i++) {
+            int fd = events[i].data.fd;
+            if (read(fd, buf, sizeof(buf)) == sizeof(buf)) {
+                write(fd, buf, sizeof(buf));
+                n++;
+            }
+        }
+    }
+    *requests += n;
+    for (auto fd : fds) {
+        close(fd);
+    }
+    close(ep);
+}
+
+int main(int argc, char **argv)
+{
+    use_fibers = argc <= 1 || strcmp(argv[1], "thread") != 0;
+    unsigned conns = argc > 2 ? atoi(argv[2]) : 100000;
+    int seconds = argc > 3 ? atoi(argv[3]) : 10;
+    fiber_stack = argc > 4 ? atoi(argv[4]) : fiber_stack;
+    unsigned nports = (conns + CONNS_PER_PORT - 1) / CONNS_PER_PORT;
+
+    printf("%s per connection, %u connections, %d seconds\n",
+            use_fibers ? "fiber" : "thread", conns, seconds);
+
+    std::vector<int> listeners;
+    for (unsigned i = 0; i < nports; i++) {
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        int one = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(BASE_PORT + i);
+        if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+                listen(s, SOMAXCONN) < 0) {
+            perror("listen");
+            return 1;
+        }
+        listeners.push_back(s);
+    }
+    std::thread(acceptor, listeners).detach();
+
+    auto free_before = memory::stats::free();
+    std::vector<std::vector<int>> client_fds(sched::cpus.size());
+    for (unsigned i = 0; i < conns; i++) {
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(BASE_PORT + i % nports);
+        if (s < 0 || connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("connect");
+            printf("stopping at %u connections\n", i);
+            if (s >= 0) {
+                close(s);
+            }
+            conns = i;
+            break;
+        }
+        client_fds[i % client_fds.size()].push_back(s);
+    }
+    while (handlers.load() < conns) {
+        usleep(1000);
+    }
+    long used = free_before - memory::stats::free();
+    printf("%u connections: %.1f MB, %.1f KB per connection\n", conns,
+            used / 1e6, conns ? used / 1e3 / conns : 0);
+
+    std::atomic<unsigned long> requests(0);
+    std::vector<std::thread> clients;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (unsigned i = 0; i < client_fds.size(); i++) {
+        clients.emplace_back(client, std::move(client_fds[i]), &requests);
+    }
+    sleep(seconds);
+    done.store(true);
+    for (auto& t : clients) {
+        t.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    float sec = std::chrono::duration<float>(end - start).count();
+    printf("%.0f requests/s\n", requests.load() / sec);
+    return 0;
+}
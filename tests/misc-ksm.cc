@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures same-page merging: fills anonymous memory half with pages of a
+// few distinct contents, half with unique pages, marks it MADV_MERGEABLE,
+// and reports every second how much memory merging gave back, and the cpu
+// time the scanner used for it. Then writes every page, which unmerges them.
+//   scripts/run.py -m 2G -e "tests/misc-ksm.so [MB] [pages per 20ms] [seconds]"
+
+#include <osv/ksm.hh>
+#include <osv/mempool.hh>
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <chrono>
+
+// distinct contents among the duplicated half of the pages
+#define KINDS 64
+
+static void fill(char* page, uint64_t v)
+{
+    auto p = reinterpret_cast<uint64_t*>(page);
+    for (size_t j = 0; j < mmu::page_size / sizeof(*p); j++) {
+        p[j] = v ^ j;
+    }
+}
+
+static bool check(char* page, uint64_t v)
+{
+    auto p = reinterpret_cast<uint64_t*>(page);
+    for (size_t j = 0; j < mmu::page_size / sizeof(*p); j++) {
+        if (p[j] != (v ^ j)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Page i holds one of KINDS contents in the first half, its own in the second
+static uint64_t contents(size_t i, size_t npages)
+{
+    return i < npages / 2 ? i % KINDS : i + (1ull << 40);
+}
+
+int main(int argc, char **argv)
+{
+    size_t mb = argc > 1 ? atoi(argv[1]) : 256;
+    unsigned rate = argc > 2 ? atoi(argv[2]) : 100;
+    int seconds = argc > 3 ? atoi(argv[3]) : 60;
+    size_t npages = (mb << 20) / mmu::page_size;
+
+    printf("%zu MB of anonymous memory, half of it duplicates, "
+            "scanning %u pages per 20ms\n", mb, rate);
+    ksm::set_rate(rate, std::chrono::milliseconds(20));
+    auto mem = static_cast<char*>(mmap(nullptr, npages * mmu::page_size,
+            PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (madvise(mem, npages * mmu::page_size, MADV_MERGEABLE) < 0) {
+        perror("madvise");
+        return 1;
+    }
+    for (size_t i = 0; i < npages; i++) {
+        fill(mem + i * mmu::page_size, contents(i, npages));
+    }
+
+    auto free_start = memory::stats::free();
+    auto start = ksm::get_stats();
+    auto t0 = std::chrono::high_resolution_clock::now();
+    printf("  sec  shared  sharing  saved MB  scans  scan cpu ms  cpu %%\n");
+    // Until merging stops making progress for two full scans
+    size_t last_merged = start.pages_merged, last_scans = start.full_scans;
+    int idle_scans = 0;
+    for (int sec = 1; sec <= seconds && idle_scans < 2; sec++) {
+        sleep(1);
+        auto s = ksm::get_stats();
+        auto elapsed = std::chrono::high_resolution_clock::now() - t0;
+        auto cpu = s.scan_time - start.scan_time;
+        long saved = long(memory::stats::free()) - long(free_start);
+        printf("%5d  %6zu  %7zu  %8.1f  %5zu  %11.1f  %5.1f\n", sec,
+                s.pages_shared, s.pages_sharing, saved / 1048576.0,
+                s.full_scans - start.full_scans,
+                std::chrono::duration<double, std::milli>(cpu).count(),
+                100.0 * cpu.count() / std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        if (s.full_scans != last_scans) {
+            idle_scans = s.pages_merged == last_merged ? idle_scans + 1 : 0;
+            last_merged = s.pages_merged;
+            last_scans = s.full_scans;
+        }
+    }
+    auto merged = ksm::get_stats();
+    printf("merged %zu pages, expected about %zu\n",
+            merged.pages_merged - start.pages_merged, npages / 2 - KINDS);
+
+    bool ok = true;
+    for (size_t i = 0; i < npages; i++) {
+        if (!check(mem + i * mmu::page_size, contents(i, npages))) {
+            printf("page %zu corrupted after merging\n", i);
+            ok = false;
+            break;
+        }
+    }
+
+    // Writing to the merged pages gives each its own copy again
+    auto free_merged = memory::stats::free();
+    auto t1 = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < npages; i++) {
+        fill(mem + i * mmu::page_size, contents(i, npages) + 1);
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    auto unmerged = ksm::get_stats();
+    printf("write after merge: %zu pages unmerged, %.1f MB, %.1f ms\n",
+            unmerged.pages_unmerged - merged.pages_unmerged,
+            (long(free_merged) - long(memory::stats::free())) / 1048576.0,
+            std::chrono::duration<double, std::milli>(t2 - t1).count());
+    for (size_t i = 0; i < npages; i++) {
+        if (!check(mem + i * mmu::page_size, contents(i, npages) + 1)) {
+            printf("page %zu corrupted after unmerging\n", i);
+            ok = false;
+            break;
+        }
+    }
+
+    munmap(mem, npages * mmu::page_size);
+    printf("%s\n", ok ? "data check: OK" : "data check: FAILED");
+    return ok ? 0 : 1;
+}
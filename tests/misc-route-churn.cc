@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Route cache lookups, as every packet sent does, while another thread keeps
+// adding and deleting a route for half of a network the default route
+// otherwise covers. Every lookup which doesn't overlap a route change must
+// return the current gateway; such stale lookups are counted, and lookup
+// latencies (average, 99th percentile and the longest stall) are compared
+// with those of lookups of the same destinations without churn. The guest
+// needs a default route through an on-link gateway, as run.py sets up:
+//   scripts/run.py -e "tests/misc-route-churn.so [threads] [seconds] [updates/s]"
+
+#include <bsd/sys/net/routecache.hh>
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::high_resolution_clock clk;
+
+// TEST-NET-2, routed by the default route unless the churned route covers it
+static const u32 net = 0xc6336400;
+static const u32 churned_mask = 0xffffff80;
+
+// Incremented before and after each route change, so it is odd during one
+static std::atomic<unsigned long> seq;
+static u32 default_gw, churned_gw;
+
+static bsd_sockaddr_in make_sin(u32 addr)
+{
+    bsd_sockaddr_in s = {};
+    s.sin_len = sizeof(s);
+    s.sin_family = AF_INET;
+    s.sin_addr.s_addr = htonl(addr);
+    return s;
+}
+
+static u32 lookup_gw(u32 addr)
+{
+    auto dst = make_sin(addr);
+    rtentry rte;
+    bsd_sockaddr_storage gw;
+    route_cache::lookup(&dst, 0, &rte, &gw);
+    if (!rte.rt_ifp || !(rte.rt_flags & RTF_GATEWAY)) {
+        return 0;
+    }
+    return ntohl(((bsd_sockaddr_in *)rte.rt_gateway)->sin_addr.s_addr);
+}
+
+static bool change_route(int cmd)
+{
+    auto dst = make_sin(net), gw = make_sin(churned_gw), mask = make_sin(churned_mask);
+    seq++;
+    int error = rtrequest(cmd, (bsd_sockaddr *)&dst, (bsd_sockaddr *)&gw,
+            (bsd_sockaddr *)&mask, RTF_UP | RTF_GATEWAY | RTF_STATIC, nullptr);
+    seq++;
+    if (error) {
+        printf("route %s failed: %d\n", cmd == RTM_ADD ? "add" : "delete", error);
+    }
+    return !error;
+}
+
+struct result {
+    // Every 64th lookup's latency, to keep memory in check
+    std::vector<float> lat;
+    float max = 0;
+    unsigned long lookups = 0;
+    unsigned long stale = 0;
+};
+
+static void looker(clk::time_point end, unsigned id, result& r)
+{
+    for (unsigned i = id; clk::now() < end; i++) {
+        u32 addr = net + (i * 7 & 0xff);
+        auto s0 = seq.load();
+        auto t0 = clk::now();
+        auto gw = lookup_gw(addr);
+        auto lat = std::chrono::duration<float, std::nano>(clk::now() - t0).count();
+        r.max = std::max(r.max, lat);
+        if (r.lookups++ % 64 == 0) {
+            r.lat.push_back(lat);
+        }
+        if (s0 % 2 == 0 && seq.load() == s0) {
+            // No change overlapped: the route is there after every add
+            bool churned = (s0 / 2) % 2 && (addr & churned_mask) == net;
+            r.stale += gw != (churned ? churned_gw : default_gw);
+        }
+    }
+}
+
+static void run(const char* what, unsigned nthreads, int seconds, int rate)
+{
+    std::vector<result> results(nthreads);
+    std::vector<std::thread> threads;
+    auto end = clk::now() + std::chrono::seconds(seconds);
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads.emplace_back([&, i] { looker(end, i, results[i]); });
+    }
+    unsigned long updates = 0;
+    if (rate) {
+        auto period = std::chrono::nanoseconds(1000000000 / rate);
+        auto next = clk::now();
+        while (clk::now() < end) {
+            if (!change_route(seq / 2 % 2 ? RTM_DELETE : RTM_ADD)) {
+                exit(1);
+            }
+            updates++;
+            next += period;
+            std::this_thread::sleep_until(next);
+        }
+        if (seq / 2 % 2) {
+            change_route(RTM_DELETE);
+        }
+    }
+    std::vector<float> all;
+    unsigned long lookups = 0, stale = 0;
+    float max = 0;
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads[i].join();
+        all.insert(all.end(), results[i].lat.begin(), results[i].lat.end());
+        lookups += results[i].lookups;
+        stale += results[i].stale;
+        max = std::max(max, results[i].max);
+    }
+    std::sort(all.begin(), all.end());
+    double avg = 0;
+    for (auto l : all) {
+        avg += l;
+    }
+    printf("%-12s %8lu updates %10.0f lookups/s %6.0f ns avg %6.0f ns p99 "
+           "%8.0f ns max %lu stale\n", what, updates, lookups / double(seconds),
+           avg / all.size(), all[size_t(all.size() * 0.99)], max, stale);
+    if (stale) {
+        printf("stale routes returned\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    unsigned nthreads = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+    int seconds = argc > 2 ? atoi(argv[2]) : 5;
+    int rate = argc > 3 ? atoi(argv[3]) : 1000;
+
+    default_gw = lookup_gw(net);
+    if (!default_gw) {
+        printf("no default route\n");
+        return 1;
+    }
+    // Another address next to the gateway, so on the same network
+    churned_gw = default_gw ^ 1;
+    char gw1[INET_ADDRSTRLEN], gw2[INET_ADDRSTRLEN];
+    in_addr a;
+    a.s_addr = htonl(default_gw);
+    inet_ntop(AF_INET, &a, gw1, sizeof(gw1));
+    a.s_addr = htonl(churned_gw);
+    inet_ntop(AF_INET, &a, gw2, sizeof(gw2));
+    printf("%u threads, default gateway %s, churned gateway %s, %d updates/s\n",
+            nthreads, gw1, gw2, rate);
+
+    run("no churn", nthreads, seconds, 0);
+    run("churn", nthreads, seconds, rate);
+    printf("no stale routes\n");
+    return 0;
+}
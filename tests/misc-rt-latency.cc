@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures wakeup-to-run latency of a periodic thread competing with
+// cpu-bound threads on the same cpu: once as a normal (SCHED_OTHER) thread,
+// and once as a SCHED_FIFO thread, which should preempt the busy threads as
+// soon as it's woken. This benchmark can run on both OSv and Linux:
+//    g++ -g -pthread -std=c++11 tests/misc-rt-latency.cc
+//    sudo ./a.out
+
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static void pin_to_cpu0()
+{
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+    CPU_SET(0, &cs);
+    pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs);
+}
+
+static void latency_test(const char* name, int policy, int nbusy,
+        int iterations)
+{
+    std::atomic<bool> done {false};
+    std::vector<std::thread> busy;
+    for (int i = 0; i < nbusy; i++) {
+        busy.emplace_back([&] {
+            pin_to_cpu0();
+            while (!done.load(std::memory_order_relaxed)) {
+                asm volatile("" : : : "memory");
+            }
+        });
+    }
+
+    std::vector<float> lat;
+    lat.reserve(iterations);
+    std::thread t([&] {
+        pin_to_cpu0();
+        struct sched_param param = {};
+        param.sched_priority = policy == SCHED_OTHER ? 0 :
+                sched_get_priority_max(policy);
+        int err = pthread_setschedparam(pthread_self(), policy, &param);
+        if (err) {
+            printf("pthread_setschedparam() failed: %d\n", err);
+            return;
+        }
+        for (int i = 0; i < iterations; i++) {
+            // Sleep for 1ms and see how late we start running again
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_nsec += 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            struct timespec req = { 0, 1000000 };
+            nanosleep(&req, nullptr);
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            lat.push_back((now.tv_sec - ts.tv_sec) * 1e6 +
+                          (now.tv_nsec - ts.tv_nsec) / 1e3);
+        }
+    });
+    t.join();
+    done = true;
+    for (auto& b : busy) {
+        b.join();
+    }
+
+    if (lat.empty()) {
+        return;
+    }
+    std::sort(lat.begin(), lat.end());
+    float sum = 0;
+    for (auto l : lat) {
+        sum += l;
+    }
+    printf("%s: wakeup latency (us): avg %.1f p50 %.1f p99 %.1f max %.1f\n",
+            name, sum / lat.size(), lat[lat.size() / 2],
+            lat[lat.size() * 99 / 100], lat.back());
+}
+
+int main(int argc, char **argv)
+{
+    int nbusy = argc > 1 ? atoi(argv[1]) : 4;
+    int iterations = argc > 2 ? atoi(argv[2]) : 2000;
+    printf("%d busy threads on cpu 0, %d wakeups every 1ms\n",
+            nbusy, iterations);
+    latency_test("SCHED_OTHER", SCHED_OTHER, nbusy, iterations);
+    latency_test("SCHED_FIFO", SCHED_FIFO, nbusy, iterations);
+    latency_test("SCHED_RR", SCHED_RR, nbusy, iterations);
+    return 0;
+}
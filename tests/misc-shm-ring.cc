@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Producer/consumer throughput of a single producer, single consumer ring in
+// memfd_create() memory, which the two sides map separately as two
+// applications would, against passing the same messages through a pipe.
+// Also the cost of mapping, touching and unmapping the shared memory, which
+// is in huge pages:
+//   scripts/run.py -e "tests/misc-shm-ring.so [msg bytes] [MB of messages] [ring MB]"
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::high_resolution_clock clk;
+
+struct ring {
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    alignas(64) char data[];
+};
+
+static double seconds(clk::time_point t0)
+{
+    return std::chrono::duration<double>(clk::now() - t0).count();
+}
+
+static void* map(int fd, size_t size)
+{
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return p;
+}
+
+static void print(const char* what, size_t msg, size_t total, double secs)
+{
+    printf("%-12s %10.0f msgs/s %8.2f GB/s\n", what, total / msg / secs,
+            total / secs / (1 << 30));
+}
+
+static bool run_ring(int fd, size_t ring_size, size_t msg, size_t total)
+{
+    auto cap = ring_size - sizeof(ring);
+    cap -= cap % msg;
+    auto tx = static_cast<ring*>(map(fd, ring_size));
+    auto rx = static_cast<ring*>(map(fd, ring_size));
+    tx->head.store(0);
+    tx->tail.store(0);
+    bool ok = true;
+    auto t0 = clk::now();
+    std::thread consumer([&] {
+        std::vector<char> buf(msg);
+        size_t tail = 0;
+        for (size_t n = 0; n < total / msg; n++) {
+            while (rx->head.load(std::memory_order_acquire) == tail) {
+            }
+            memcpy(buf.data(), rx->data + tail % cap, msg);
+            ok &= buf[0] == char(n);
+            tail += msg;
+            rx->tail.store(tail, std::memory_order_release);
+        }
+    });
+    std::vector<char> buf(msg);
+    size_t head = 0;
+    for (size_t n = 0; n < total / msg; n++) {
+        buf[0] = n;
+        while (head - tx->tail.load(std::memory_order_acquire) == cap) {
+        }
+        memcpy(tx->data + head % cap, buf.data(), msg);
+        head += msg;
+        tx->head.store(head, std::memory_order_release);
+    }
+    consumer.join();
+    print("shm ring", msg, total, seconds(t0));
+    munmap(tx, ring_size);
+    munmap(rx, ring_size);
+    return ok;
+}
+
+static bool run_pipe(size_t msg, size_t total)
+{
+    int p[2];
+    if (pipe(p) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    bool ok = true;
+    auto t0 = clk::now();
+    std::thread consumer([&] {
+        std::vector<char> buf(msg);
+        for (size_t n = 0; n < total / msg; n++) {
+            for (size_t got = 0; got < msg; ) {
+                auto r = read(p[0], buf.data() + got, msg - got);
+                if (r <= 0) {
+                    ok = false;
+                    return;
+                }
+                got += r;
+            }
+            ok &= buf[0] == char(n);
+        }
+    });
+    std::vector<char> buf(msg);
+    for (size_t n = 0; n < total / msg; n++) {
+        buf[0] = n;
+        if (write(p[1], buf.data(), msg) != (ssize_t)msg) {
+            perror("write");
+            exit(1);
+        }
+    }
+    consumer.join();
+    print("pipe", msg, total, seconds(t0));
+    close(p[0]);
+    close(p[1]);
+    return ok;
+}
+
+// Maps the memory, touches every page of it and unmaps it, many times
+static void run_map(int fd, size_t size)
+{
+    const int rounds = 1000;
+    auto t0 = clk::now();
+    for (int i = 0; i < rounds; i++) {
+        auto p = static_cast<volatile char*>(map(fd, size));
+        for (size_t off = 0; off < size; off += 4096) {
+            p[off];
+        }
+        munmap(const_cast<char*>(p), size);
+    }
+    printf("%-12s %10.1f us per %zu MB\n", "map/unmap",
+            seconds(t0) * 1e6 / rounds, size >> 20);
+}
+
+int main(int argc, char **argv)
+{
+    size_t msg = argc > 1 ? atoi(argv[1]) : 64;
+    size_t total = size_t(argc > 2 ? atoi(argv[2]) : 1024) << 20;
+    size_t ring_size = size_t(argc > 3 ? atoi(argv[3]) : 4) << 20;
+
+    int fd = memfd_create("misc-shm-ring", MFD_ALLOW_SEALING);
+    if (fd < 0 || ftruncate(fd, ring_size) < 0) {
+        perror("memfd");
+        return 1;
+    }
+    // As a producer would, before handing the memory over
+    fcntl(fd, F_ADD_SEALS, F_SEAL_GROW | F_SEAL_SHRINK);
+
+    printf("%zu byte messages, %zu MB of them, %zu MB ring\n", msg,
+            total >> 20, ring_size >> 20);
+    bool ok = run_ring(fd, ring_size, msg, total);
+    ok &= run_pipe(msg, total);
+    run_map(fd, ring_size);
+    close(fd);
+    printf("%s\n", ok ? "data check: OK" : "data check: FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Small-write RPCs over TCP_NODELAY connections, with and without
+// autocorking (net.inet.tcp.autocork): each request is a 4 byte header and
+// a body written separately, and the reply is read back whole. Reported are
+// requests/s, the data segments sent per request and the round trip
+// latency. Autocorking only kicks in when segments queue up in the driver,
+// so the requests go to an echo server on the host, over several
+// connections at once:
+//   socat tcp-listen:9999,fork,reuseaddr exec:cat &
+//   scripts/run.py -e "tests/misc-tcp-autocork.so [addr] [conns] [seconds] [body]"
+
+#include <bsd/porting/netport.h>
+#include <bsd/sys/netinet/tcp_var.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#define PORT 9999
+
+extern int tcp_do_autocork;
+extern struct tcpstat tcpstat;
+
+typedef std::chrono::high_resolution_clock clk;
+
+static bool xfer(int s, char* buf, size_t len, bool write)
+{
+    while (len) {
+        ssize_t r = write ? ::write(s, buf, len) : read(s, buf, len);
+        if (r <= 0) {
+            return false;
+        }
+        buf += r;
+        len -= r;
+    }
+    return true;
+}
+
+// Does RPCs over a new connection until end, recording their latencies in us
+static void client(const sockaddr_in& addr, size_t body, clk::time_point end,
+                   std::vector<float>& lat)
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(s, (sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    uint32_t hdr = htonl(body);
+    std::vector<char> req(body, 'r'), reply(sizeof(hdr) + body);
+    while (clk::now() < end) {
+        auto t0 = clk::now();
+        if (!xfer(s, (char *)&hdr, sizeof(hdr), true) ||
+                !xfer(s, req.data(), body, true) ||
+                !xfer(s, reply.data(), reply.size(), false)) {
+            printf("connection lost\n");
+            exit(1);
+        }
+        lat.push_back(std::chrono::duration<float, std::micro>(clk::now() - t0).count());
+    }
+    close(s);
+}
+
+static void run(const sockaddr_in& addr, int conns, int seconds, size_t body)
+{
+    std::vector<std::vector<float>> lat(conns);
+    std::vector<std::thread> threads;
+    auto sndpack = tcpstat.tcps_sndpack;
+    auto corked = tcpstat.tcps_autocork;
+    auto end = clk::now() + std::chrono::seconds(seconds);
+    for (int i = 0; i < conns; i++) {
+        threads.emplace_back([&, i] { client(addr, body, end, lat[i]); });
+    }
+    std::vector<float> all;
+    for (int i = 0; i < conns; i++) {
+        threads[i].join();
+        all.insert(all.end(), lat[i].begin(), lat[i].end());
+    }
+    if (all.empty()) {
+        printf("no requests completed\n");
+        exit(1);
+    }
+    std::sort(all.begin(), all.end());
+    double n = all.size();
+    double avg = 0;
+    for (auto l : all) {
+        avg += l;
+    }
+    printf("autocork %d %10.0f req/s %8.2f segs/req %8.2f corked/req "
+           "%8.1f us avg %8.1f us p99\n", tcp_do_autocork, n / seconds,
+           (tcpstat.tcps_sndpack - sndpack) / n,
+           (tcpstat.tcps_autocork - corked) / n,
+           avg / n, all[size_t(n * 0.99)]);
+}
+
+int main(int argc, char **argv)
+{
+    const char* host = argc > 1 ? argv[1] : "192.168.122.1";
+    int conns = argc > 2 ? atoi(argv[2]) : 16;
+    int seconds = argc > 3 ? atoi(argv[3]) : 5;
+    size_t body = argc > 4 ? atoi(argv[4]) : 100;
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    inet_aton(host, &addr.sin_addr);
+    addr.sin_port = htons(PORT);
+
+    printf("%d connections to %s:%d, 4+%zu byte requests\n",
+            conns, host, PORT, body);
+    int saved = tcp_do_autocork;
+    for (int autocork : { 0, 1 }) {
+        tcp_do_autocork = autocork;
+        run(addr, conns, seconds, body);
+    }
+    tcp_do_autocork = saved;
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Memory taken per idle thread: with pthread's own stacks, which are populated
+// as they are used when the kernel is built with conf-lazy_stack, and with
+// stacks the application populated up front (as all stacks were before).
+// Threads that first go some way down their stack before idling show how it
+// grows. Memory is counted as it leaves the free pool, so stack, thread and
+// TLS memory are all included:
+//   scripts/run.py -e "tests/misc-thread-stacks.so [threads] [stack KB] [depth KB]"
+
+#include <osv/mempool.hh>
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+static std::mutex mtx;
+static std::condition_variable cv;
+static unsigned idle;
+static bool done;
+
+static size_t depth;
+
+// Uses about bytes of stack
+static int __attribute__((noinline)) dig(size_t bytes)
+{
+    volatile char frame[1024];
+    memset(const_cast<char*>(frame), bytes, sizeof(frame));
+    if (bytes <= sizeof(frame)) {
+        return frame[0];
+    }
+    return dig(bytes - sizeof(frame)) + frame[1];
+}
+
+static void* idler(void* arg)
+{
+    if (arg) {
+        dig(depth);
+    }
+    std::unique_lock<std::mutex> lock(mtx);
+    idle++;
+    cv.notify_all();
+    cv.wait(lock, [] { return done; });
+    return nullptr;
+}
+
+// Starts n idle threads and returns the memory they took, in bytes per thread
+static double run(unsigned n, size_t stack, bool populated, bool deep)
+{
+    std::vector<pthread_t> threads(n);
+    std::vector<void*> stacks;
+    idle = 0;
+    done = false;
+    long free0 = memory::stats::free();
+    for (auto& t : threads) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (populated) {
+            void* p = mmap(nullptr, stack, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+            if (p == MAP_FAILED) {
+                perror("mmap");
+                exit(1);
+            }
+            stacks.push_back(p);
+            pthread_attr_setstack(&attr, p, stack);
+        } else {
+            pthread_attr_setstacksize(&attr, stack);
+        }
+        if (pthread_create(&t, &attr, idler, deep ? &t : nullptr)) {
+            printf("pthread_create failed\n");
+            exit(1);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    long used;
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [n] { return idle == n; });
+        used = free0 - long(memory::stats::free());
+        done = true;
+        cv.notify_all();
+    }
+    for (auto& t : threads) {
+        pthread_join(t, nullptr);
+    }
+    for (auto p : stacks) {
+        munmap(p, stack);
+    }
+    return double(used) / n;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned n = argc > 1 ? atoi(argv[1]) : 1000;
+    size_t stack = (argc > 2 ? atoi(argv[2]) : 1024) << 10;
+    depth = (argc > 3 ? atoi(argv[3]) : 256) << 10;
+
+    printf("%u threads with %zu KB stacks\n", n, stack >> 10);
+    printf("%-30s %10.1f KB/thread\n", "populated stacks",
+            run(n, stack, true, false) / 1024);
+    printf("%-30s %10.1f KB/thread\n", "pthread stacks",
+            run(n, stack, false, false) / 1024);
+    char what[64];
+    snprintf(what, sizeof(what), "pthread stacks, %zu KB deep", depth >> 10);
+    printf("%-30s %10.1f KB/thread\n", what,
+            run(n, stack, false, true) / 1024);
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures the latency of mprotect(), which must flush the TLB on all cpus
+// before returning. To see the effect of KVM's PV TLB flush and PV IPIs,
+// run on a host with fewer physical cpus than vCPUs, e.g.,
+//   taskset -c 0-1 scripts/run.py -c 4 -e tests/misc-tlb-shootdown.so
+
+#include <osv/sched.hh>
+#include <cpuid.hh>
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+int main(int argc, char **argv)
+{
+    int iterations = 100000;
+    if (argc > 1) {
+        iterations = atoi(argv[1]);
+    }
+    printf("cpu features: %s\n", processor::features_str().c_str());
+    printf("%d cpus, %d mprotect() calls\n", (int)sched::cpus.size(), iterations);
+
+    // Keep the other cpus busy with a thread each, so the host has to
+    // time-share them with the mprotect()ing cpu when oversubscribed.
+    std::atomic<bool> done(false);
+    std::vector<sched::thread*> spinners;
+    for (auto c : sched::cpus) {
+        if (c == sched::cpu::current()) {
+            continue;
+        }
+        auto t = new sched::thread([&] {
+            while (!done.load(std::memory_order_relaxed)) {
+                barrier();
+            }
+        }, sched::thread::attr().pin(c));
+        spinners.push_back(t);
+        t->start();
+    }
+
+    auto p = mmap(nullptr, 4096, PROT_READ | PROT_WRITE,
+            MAP_ANONYMOUS | MAP_PRIVATE | MAP_POPULATE, -1, 0);
+    std::vector<float> lat;
+    lat.reserve(iterations);
+    for (int i = 0; i < iterations; i++) {
+        mprotect(p, 4096, PROT_READ | PROT_WRITE);
+        // Only removing permissions requires a TLB shootdown
+        auto start = std::chrono::high_resolution_clock::now();
+        mprotect(p, 4096, PROT_READ);
+        auto end = std::chrono::high_resolution_clock::now();
+        lat.push_back(std::chrono::duration<float, std::micro>(end - start).count());
+    }
+    munmap(p, 4096);
+
+    done.store(true);
+    for (auto t : spinners) {
+        t->join();
+        delete t;
+    }
+
+    std::sort(lat.begin(), lat.end());
+    float sum = 0;
+    for (auto l : lat) {
+        sum += l;
+    }
+    printf("mprotect latency (us): avg %.2f p50 %.2f p99 %.2f max %.2f\n",
+            sum / lat.size(), lat[lat.size() / 2],
+            lat[lat.size() * 99 / 100], lat.back());
+    return 0;
+}
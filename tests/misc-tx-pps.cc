@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures the transmit rate (packets per second) of small UDP datagrams sent
+// concurrently from all cpus, each cpu sending its own flow. The datagrams go
+// to the host (192.168.122.1 by default), which doesn't need to listen:
+//   scripts/run.py -c 8 -e "tests/misc-tx-pps.so [addr] [seconds] [size]"
+
+#include <osv/sched.hh>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#define SEND_PORT 9999
+
+int main(int argc, char **argv)
+{
+    const char* addr = argc > 1 ? argv[1] : "192.168.122.1";
+    int seconds = argc > 2 ? atoi(argv[2]) : 10;
+    size_t size = argc > 3 ? atoi(argv[3]) : 64;
+
+    struct sockaddr_in raddr;
+    memset(&raddr, 0, sizeof(raddr));
+    raddr.sin_family = AF_INET;
+    inet_aton(addr, &raddr.sin_addr);
+    raddr.sin_port = htons(SEND_PORT);
+
+    printf("%d cpus sending %d byte datagrams to %s:%d for %d seconds\n",
+            (int)sched::cpus.size(), (int)size, addr, SEND_PORT, seconds);
+
+    std::atomic<bool> done(false);
+    std::vector<unsigned long> sent(sched::cpus.size());
+    std::vector<sched::thread*> senders;
+    for (auto c : sched::cpus) {
+        auto t = new sched::thread([&, c] {
+            int s = socket(AF_INET, SOCK_DGRAM, 0);
+            if (s < 0) {
+                perror("socket");
+                return;
+            }
+            std::vector<char> buf(size, 'A');
+            unsigned long n = 0;
+            while (!done.load(std::memory_order_relaxed)) {
+                if (sendto(s, buf.data(), size, 0, (struct sockaddr *)&raddr,
+                        sizeof(raddr)) == (ssize_t)size) {
+                    n++;
+                }
+            }
+            sent[c->id] = n;
+            close(s);
+        }, sched::thread::attr().pin(c));
+        senders.push_back(t);
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (auto t : senders) {
+        t->start();
+    }
+    sleep(seconds);
+    done.store(true);
+    for (auto t : senders) {
+        t->join();
+        delete t;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    float sec = std::chrono::duration<float>(end - start).count();
+
+    unsigned long total = 0;
+    for (unsigned i = 0; i < sent.size(); i++) {
+        printf("cpu %d: %.0f pps\n", i, sent[i] / sec);
+        total += sent[i];
+    }
+    printf("total: %.0f pps\n", total / sec);
+    return 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Compares a file of a directory the host shares with virtio-fs against
+// a copy of it on the zfs root: read() throughput, and the time mmap()ed
+// pages take to fault in. On virtio-fs both go through the DAX window when
+// the device has one (--virtio-fs-cache).
+//   virtiofsd --socket-path=/tmp/vfsd.sock -o source=DIR &
+//   scripts/run.py --virtio-fs /tmp/vfsd.sock [--virtio-fs-cache 1G] \
+//       -e "tests/misc-virtiofs.so [file in DIR]"
+
+#include <osv/mmu.hh>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+extern "C" int sys_mount(const char *dev, const char *dir, const char *fsname, int flags, void *data);
+
+#define BUFSIZE (1 << 20)
+
+typedef std::chrono::high_resolution_clock clk;
+
+static double ms(clk::duration d)
+{
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+// Reads the whole file, returning MB/s
+static double read_file(const char* path, size_t size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    std::vector<char> buf(BUFSIZE);
+    auto t0 = clk::now();
+    size_t total = 0;
+    ssize_t r;
+    while ((r = read(fd, buf.data(), buf.size())) > 0) {
+        total += r;
+    }
+    auto t1 = clk::now();
+    close(fd);
+    if (total != size) {
+        printf("%s: read %zu bytes of %zu\n", path, total, size);
+        exit(1);
+    }
+    return (size >> 20) / (ms(t1 - t0) / 1000);
+}
+
+// Touches every page of a private read-only mapping of the file, returning
+// the average time a page took to fault in, in microseconds
+static double map_file(const char* path, size_t size, unsigned long* sum)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    auto p = static_cast<volatile char*>(mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0));
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    auto t0 = clk::now();
+    *sum = 0;
+    for (size_t off = 0; off < size; off += mmu::page_size) {
+        *sum += p[off];
+    }
+    auto t1 = clk::now();
+    munmap(const_cast<char*>(p), size);
+    close(fd);
+    return ms(t1 - t0) * 1000 / ((size + mmu::page_size - 1) / mmu::page_size);
+}
+
+static bool same_contents(const char* a, const char* b)
+{
+    int fa = open(a, O_RDONLY), fb = open(b, O_RDONLY);
+    std::vector<char> ba(BUFSIZE), bb(BUFSIZE);
+    bool same = true;
+    ssize_t ra, rb;
+    do {
+        ra = read(fa, ba.data(), ba.size());
+        rb = read(fb, bb.data(), bb.size());
+        same = ra == rb && (ra <= 0 || !memcmp(ba.data(), bb.data(), ra));
+    } while (same && ra > 0);
+    close(fa);
+    close(fb);
+    return same;
+}
+
+int main(int argc, char **argv)
+{
+    std::string name = argc > 1 ? argv[1] : "misc-virtiofs.dat";
+    std::string host = "/virtiofs/" + name;
+    std::string local = "/misc-virtiofs.dat";
+
+    mkdir("/virtiofs", 0755);
+    int ret = sys_mount("/dev/virtiofs0", "/virtiofs", "virtiofs", 0, nullptr);
+    if (ret) {
+        printf("mount /dev/virtiofs0: %s\n", strerror(ret));
+        return 1;
+    }
+    struct stat st;
+    if (stat(host.c_str(), &st) < 0) {
+        perror(host.c_str());
+        return 1;
+    }
+    size_t size = st.st_size;
+    printf("%s: %zu MB\n", host.c_str(), size >> 20);
+
+    // The same contents on zfs
+    int in = open(host.c_str(), O_RDONLY);
+    int out = open(local.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    std::vector<char> buf(BUFSIZE);
+    ssize_t r;
+    while ((r = read(in, buf.data(), buf.size())) > 0) {
+        if (write(out, buf.data(), r) != r) {
+            perror("write");
+            return 1;
+        }
+    }
+    close(in);
+    fsync(out);
+    close(out);
+
+    printf("         read MB/s (1st, 2nd)   mmap fault us/page (1st, 2nd)\n");
+    unsigned long host_sum, local_sum;
+    for (auto path : { host.c_str(), local.c_str() }) {
+        auto r1 = read_file(path, size);
+        auto r2 = read_file(path, size);
+        auto m1 = map_file(path, size, path == host.c_str() ? &host_sum : &local_sum);
+        auto m2 = map_file(path, size, path == host.c_str() ? &host_sum : &local_sum);
+        printf("%-8s %8.1f %8.1f             %8.2f %8.2f\n",
+                path == host.c_str() ? "virtiofs" : "zfs", r1, r2, m1, m2);
+    }
+
+    bool ok = host_sum == local_sum && same_contents(host.c_str(), local.c_str());
+    unlink(local.c_str());
+    printf("%s\n", ok ? "data check: OK" : "data check: FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Write throughput as the pool fills and fragments: files of random sizes
+// (4 KB to 1 MB by default) are written until the pool is 50% used, then
+// every other file is deleted, leaving holes of all sizes behind; the same
+// is repeated up to 80%, and the pool is finally filled to 95%. Reported is
+// the write throughput of each stage, which on a fragmented, nearly full
+// pool depends on how fast the allocator finds free space. This fills the
+// pool, so run it on a scratch image:
+//   scripts/run.py -e "tests/misc-zfs-fragment.so [dir] [max file KB]"
+
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+typedef std::chrono::high_resolution_clock clk;
+
+static const size_t MB = 1024 * 1024;
+static const size_t bs = 4096;
+
+struct file {
+    std::string path;
+    size_t size;
+};
+
+// Percentage of the file system in use, as of the last synced txg
+static double used_pct(const std::string& dir)
+{
+    struct statvfs st;
+    if (statvfs(dir.c_str(), &st) < 0) {
+        perror("statvfs");
+        exit(1);
+    }
+    return 100.0 * (st.f_blocks - st.f_bfree) / st.f_blocks;
+}
+
+static bool write_file(const std::string& path, const std::vector<char>& buf, size_t size)
+{
+    int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    bool ok = true;
+    for (size_t off = 0; off < size; ) {
+        auto n = write(fd, buf.data() + off, size - off);
+        if (n < 0) {
+            if (errno != ENOSPC) {
+                perror("write");
+                exit(1);
+            }
+            ok = false;
+            break;
+        }
+        off += n;
+    }
+    close(fd);
+    if (!ok) {
+        unlink(path.c_str());
+    }
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    std::string dir = argc > 1 ? argv[1] : "/tmp";
+    size_t max_size = (argc > 2 ? atoi(argv[2]) : 1024) * 1024;
+
+    dir += "/fragment";
+    if (mkdir(dir.c_str(), 0777) < 0 && errno != EEXIST) {
+        perror("mkdir");
+        return 1;
+    }
+
+    // Incompressible, in case compression is on
+    std::vector<char> buf(max_size);
+    std::default_random_engine rand;
+    for (auto& c : buf) {
+        c = rand();
+    }
+    std::uniform_int_distribution<size_t> blocks(1, max_size / bs);
+
+    std::vector<file> files;
+    unsigned long n = 0;
+    bool full = false;
+    printf("%.1f%% used, writing files of up to %zu KB\n", used_pct(dir), max_size / 1024);
+    for (double target : { 50.0, 80.0, 95.0 }) {
+        size_t written = 0;
+        auto t0 = clk::now();
+        while (!full && used_pct(dir) < target) {
+            // statvfs only moves as txgs sync, so check it every 64 MB
+            for (size_t chunk = 0; chunk < 64 * MB; ) {
+                file f = { dir + "/" + std::to_string(n++), blocks(rand) * bs };
+                if (!write_file(f.path, buf, f.size)) {
+                    full = true;
+                    break;
+                }
+                files.push_back(f);
+                chunk += f.size;
+                written += f.size;
+            }
+            sync();
+        }
+        auto d = std::chrono::duration<double>(clk::now() - t0).count();
+        printf("to %4.1f%% used: %8zu MB written %8.1f MB/s %8zu files\n",
+                used_pct(dir), written / MB, written / double(MB) / d, files.size());
+        if (full) {
+            printf("out of space\n");
+            break;
+        }
+        if (target < 95.0) {
+            // Leave holes behind
+            std::vector<file> kept;
+            for (size_t i = 0; i < files.size(); i++) {
+                if (i % 2) {
+                    unlink(files[i].path.c_str());
+                } else {
+                    kept.push_back(files[i]);
+                }
+            }
+            files.swap(kept);
+            sync();
+            printf("deleted every other file: %4.1f%% used\n", used_pct(dir));
+        }
+    }
+
+    for (auto& f : files) {
+        unlink(f.path.c_str());
+    }
+    rmdir(dir.c_str());
+    return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Compression ratio and cold read throughput of the image's files: walks a
+// tree (the whole root file system by default), summing the files' sizes
+// and the space they take on disk, then reads every file through. Run it
+// first thing after boot, so that the reads miss the ARC, and compare
+// images built with different compression, e.g. lz4 (the default) and zstd:
+//   make fs_compression=zstd
+//   scripts/run.py -e "tests/misc-zfs-image-read.so [dir]"
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+typedef std::chrono::high_resolution_clock clk;
+
+static const size_t MB = 1024 * 1024;
+
+struct totals {
+    size_t files = 0;
+    size_t size = 0;
+    size_t allocated = 0;
+    std::vector<std::string> paths;
+};
+
+static void walk(const std::string& dir, totals& t)
+{
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        return;
+    }
+    while (auto e = readdir(d)) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) {
+            continue;
+        }
+        auto path = (dir == "/" ? "" : dir) + "/" + e->d_name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) < 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            // Not the pseudo file systems
+            if (path != "/dev" && path != "/proc") {
+                walk(path, t);
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            t.files++;
+            t.size += st.st_size;
+            t.allocated += st.st_blocks * 512;
+            t.paths.push_back(path);
+        }
+    }
+    closedir(d);
+}
+
+int main(int argc, char **argv)
+{
+    std::string dir = argc > 1 ? argv[1] : "/";
+
+    totals t;
+    walk(dir, t);
+    printf("%zu files, %zu MB, %zu MB on disk, ratio %.2fx\n", t.files,
+            t.size / MB, t.allocated / MB, t.size / double(t.allocated));
+
+    std::vector<char> buf(128 * 1024);
+    size_t read_bytes = 0;
+    auto t0 = clk::now();
+    for (auto& path : t.paths) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            perror(path.c_str());
+            continue;
+        }
+        ssize_t n;
+        while ((n = read(fd, buf.data(), buf.size())) > 0) {
+            read_bytes += n;
+        }
+        close(fd);
+    }
+    auto d = std::chrono::duration<double>(clk::now() - t0).count();
+    printf("read %zu MB in %.2f s: %.1f MB/s\n", read_bytes / MB, d,
+            read_bytes / double(MB) / d);
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Read latency under a write burst: threads read 4 KB blocks at random
+// offsets of a file twice the size of memory, so that most miss the ARC,
+// first alone and then while another thread streams writes into a second
+// file, which each txg sync issues as a burst of async writes. Reported are
+// the reads' average, median and 99th percentile latencies; with the I/O
+// classes queued apart, sync reads should keep their latency under the
+// burst. Run on a virtio-blk disk (run.py's default), with a small memory
+// to keep the file's preparation short:
+//   scripts/run.py -m 512M -e "tests/misc-zfs-read-latency.so [dir] [file MB] [seconds] [threads]"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" uint64_t kmem_size(void);
+
+typedef std::chrono::high_resolution_clock clk;
+
+static const size_t MB = 1024 * 1024;
+static const size_t bs = 4096;
+
+static void fill(const std::string& path, size_t size)
+{
+    int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    std::vector<char> buf(MB);
+    std::default_random_engine rand;
+    for (size_t off = 0; off < size; off += MB) {
+        // Incompressible, in case compression is on
+        for (auto& c : buf) {
+            c = rand();
+        }
+        if (write(fd, buf.data(), buf.size()) != ssize_t(buf.size())) {
+            perror("write");
+            exit(1);
+        }
+    }
+    fsync(fd);
+    close(fd);
+}
+
+// Reads blocks at random offsets until end, returning their latencies in us
+static std::vector<float> reader(int fd, size_t size, clk::time_point end, unsigned seed)
+{
+    std::default_random_engine rand(seed);
+    std::uniform_int_distribution<size_t> block(0, size / bs - 1);
+    std::vector<float> lat;
+    char buf[bs];
+    while (clk::now() < end) {
+        auto t0 = clk::now();
+        if (pread(fd, buf, bs, block(rand) * bs) != bs) {
+            perror("pread");
+            exit(1);
+        }
+        lat.push_back(std::chrono::duration<float, std::micro>(clk::now() - t0).count());
+    }
+    return lat;
+}
+
+// Streams writes into path until end, returning the MB written
+static size_t writer(const std::string& path, clk::time_point end)
+{
+    int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (fd < 0) {
+        perror("open");
+        exit(1);
+    }
+    std::vector<char> buf(MB);
+    std::default_random_engine rand;
+    for (auto& c : buf) {
+        c = rand();
+    }
+    size_t written = 0;
+    while (clk::now() < end) {
+        if (write(fd, buf.data(), buf.size()) != ssize_t(buf.size())) {
+            perror("write");
+            exit(1);
+        }
+        // Keep the file from outgrowing the disk
+        if (++written % 1024 == 0) {
+            lseek(fd, 0, SEEK_SET);
+        }
+    }
+    close(fd);
+    return written;
+}
+
+static void run(const char* what, int fd, size_t size, int seconds,
+        unsigned nthreads, const std::string& wpath)
+{
+    std::vector<std::vector<float>> lats(nthreads);
+    std::vector<std::thread> threads;
+    auto end = clk::now() + std::chrono::seconds(seconds);
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads.emplace_back([&, i] { lats[i] = reader(fd, size, end, i + 1); });
+    }
+    size_t written = 0;
+    if (!wpath.empty()) {
+        written = writer(wpath, end);
+    }
+    std::vector<float> all;
+    for (unsigned i = 0; i < nthreads; i++) {
+        threads[i].join();
+        all.insert(all.end(), lats[i].begin(), lats[i].end());
+    }
+    std::sort(all.begin(), all.end());
+    double avg = 0;
+    for (auto l : all) {
+        avg += l;
+    }
+    printf("%-14s %8.0f reads/s %8.1f us avg %8.1f us p50 %8.1f us p99 %6.1f MB/s written\n",
+            what, all.size() / double(seconds), avg / all.size(),
+            all[all.size() / 2], all[size_t(all.size() * 0.99)],
+            written / double(seconds));
+}
+
+int main(int argc, char **argv)
+{
+    std::string dir = argc > 1 ? argv[1] : "/tmp";
+    size_t size = (argc > 2 ? atoi(argv[2]) : 2 * kmem_size() / MB) * MB;
+    int seconds = argc > 3 ? atoi(argv[3]) : 10;
+    unsigned nthreads = argc > 4 ? atoi(argv[4]) : 4;
+
+    auto rpath = dir + "/read-latency.dat";
+    auto wpath = dir + "/read-latency-burst.dat";
+    printf("preparing %zu MB\n", size / MB);
+    fill(rpath, size);
+
+    int fd = open(rpath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    printf("%u threads reading %zu byte blocks of %zu MB\n", nthreads, bs, size / MB);
+    run("reads", fd, size, seconds, nthreads, "");
+    run("reads+writes", fd, size, seconds, nthreads, wpath);
+    close(fd);
+    unlink(rpath.c_str());
+    unlink(wpath.c_str());
+    return 0;
+}
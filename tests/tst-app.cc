@@ -12,13 +12,27 @@
 #include <osv/app.hh>
 #include <osv/debug.hh>
 #include <osv/latch.hh>
+#include <osv/clock.hh>
+#include <sys/mman.h>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace osv;
 
 const char* WAIT_UNTIL_TERMINATION = "wait_until_termination";
 const char* RETURN = "return";
+const char* LEAK = "leak";
 const char* prog;
 
+// What LEAK leaves behind for restart() to clean up. The child is this very
+// object, which the test keeps loaded, so these are shared with it.
+static int leaked_fds[2];
+static void* leaked_mapping;
+static const size_t leaked_size = 1 << 20;
+static std::atomic<int> leak_runs(0);
+static std::atomic<bool> straggler_done(false);
+
 int child(std::string command, int argc, char const *argv[])
 {
     auto app = application::get_current();
@@ -40,6 +54,31 @@ int child(std::string command, int argc, char const *argv[])
         return std::atoi(argv[2]);
     }
 
+    if (command == LEAK) {
+        latch termination_requested;
+        app->on_termination_request([&] {
+            termination_requested.count_down();
+        });
+        if (pipe(leaked_fds) < 0) {
+            return -1;
+        }
+        leaked_mapping = mmap(nullptr, leaked_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (leaked_mapping == MAP_FAILED) {
+            return -1;
+        }
+        memset(leaked_mapping, 1, leaked_size);
+        straggler_done = false;
+        // Outlives main(); restart() must wait for it
+        std::thread([] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            straggler_done = true;
+        }).detach();
+        leak_runs++;
+        termination_requested.await();
+        return 0;
+    }
+
     std::cerr << "Unknown command: " << command << std::endl;
     return -1;
 }
@@ -76,6 +115,42 @@ void test_return_code_is_propagated()
     assert(result == code);
 }
 
+void test_restart_releases_and_reruns()
+{
+    debug("%s\n", __FUNCTION__);
+
+    auto app = application::run({prog, LEAK});
+    while (leak_runs < 1) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    int fds[2] = { leaked_fds[0], leaked_fds[1] };
+    void* mapping = leaked_mapping;
+
+    auto t0 = osv::clock::uptime::now();
+    app->restart();
+    auto t1 = osv::clock::uptime::now();
+
+    assert(straggler_done);
+    for (auto fd : fds) {
+        assert(fcntl(fd, F_GETFD) < 0 && errno == EBADF);
+    }
+    assert(msync(mapping, leaked_size, MS_ASYNC) < 0 && errno == ENOMEM);
+    assert(app->get_restarts() == 1);
+
+    while (leak_runs < 2) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    auto t2 = osv::clock::uptime::now();
+    app->request_termination();
+    assert(app->join() == 0);
+
+    using namespace std::chrono;
+    debug("restart: %d ms, to running again: %d ms (booting to this test: %d ms)\n",
+            (int)duration_cast<milliseconds>(t1 - t0).count(),
+            (int)duration_cast<milliseconds>(t2 - t0).count(),
+            (int)duration_cast<milliseconds>(t0.time_since_epoch()).count());
+}
+
 int main(int argc, char const *argv[])
 {
     if (argc > 1) {
@@ -86,5 +161,6 @@ int main(int argc, char const *argv[])
     test_termination_request_before_callback_is_registerred();
     test_termination_request_after_callback_is_registerred();
     test_return_code_is_propagated();
+    test_restart_releases_and_reruns();
     return 0;
 }
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include <osv/fiber.hh>
+#include <osv/debug.hh>
+
+#include <poll.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, const char* msg)
+{
+    ++tests;
+    fails += !ok;
+    debug("%s: %s\n", ok ? "PASS" : "FAIL", msg);
+}
+
+using osv::fiber;
+using namespace std::chrono;
+
+int main(int argc, char **argv)
+{
+    // start and join, from a thread
+    bool ran = false;
+    fiber f1([&] { ran = fiber::current() != nullptr; });
+    f1.start();
+    f1.join();
+    report(ran, "fiber runs and is joined");
+
+    // yield() interleaves the fibers of a carrier
+    std::vector<int> order;
+    fiber f3([&] {
+        for (int i = 0; i < 3; i++) {
+            order.push_back(1);
+            fiber::yield();
+        }
+    });
+    fiber f2([&] {
+        // started from a fiber, f3 shares our carrier
+        f3.start();
+        for (int i = 0; i < 3; i++) {
+            order.push_back(0);
+            fiber::yield();
+        }
+    });
+    f2.start();
+    f2.join();
+    f3.join();
+    report(order == std::vector<int>({0, 1, 0, 1, 0, 1}),
+            "yield() alternates fibers");
+
+    // wait_until() and wake_with() from another thread
+    std::atomic<bool> flag(false);
+    fiber f4([&] {
+        fiber::wait_until([&] { return flag.load(); });
+    });
+    f4.start();
+    sched::thread::sleep(milliseconds(10));
+    f4.wake_with([&] { flag.store(true); });
+    f4.join();
+    report(true, "wake_with() wakes a waiting fiber");
+
+    // wait_for() with a wait_object (a timer of the carrier thread); a
+    // second fiber keeps running on the same carrier in the meantime
+    bool expired = false;
+    std::atomic<int> spins(0);
+    fiber f5([&] {
+        sched::timer tmr(*sched::thread::current());
+        tmr.set(milliseconds(50));
+        fiber::wait_for(tmr);
+        expired = tmr.expired();
+    });
+    fiber f6([&] {
+        for (int i = 0; i < 100; i++) {
+            spins++;
+            fiber::sleep(milliseconds(1));
+        }
+    });
+    f5.start(sched::cpus[0]);
+    f6.start(sched::cpus[0]);
+    f5.join();
+    f6.join();
+    report(expired && spins == 100, "wait_for() parks only the waiting fiber");
+
+    // poll() on a pipe parks the fiber until the pipe is written to
+    int fds[2];
+    pipe(fds);
+    int revents = 0;
+    fiber f7([&] {
+        struct pollfd pfd = { fds[0], POLLIN, 0 };
+        poll(&pfd, 1, 5000);
+        revents = pfd.revents;
+    });
+    f7.start();
+    sched::thread::sleep(milliseconds(10));
+    char c = 'x';
+    write(fds[1], &c, 1);
+    f7.join();
+    report(revents & POLLIN, "poll() from a fiber");
+    close(fds[0]);
+    close(fds[1]);
+
+    // many small detached fibers
+    constexpr int N = 10000;
+    std::atomic<int> done(0);
+    for (int i = 0; i < N; i++) {
+        (new fiber([&] {
+            fiber::yield();
+            done++;
+        }, fiber::attr().detached().stack(8192)))->start(
+                sched::cpus[i % sched::cpus.size()]);
+    }
+    while (done.load() != N) {
+        sched::thread::sleep(milliseconds(1));
+    }
+    report(true, "detached fibers complete");
+
+    debug("SUMMARY: %d tests, %d failures\n", tests, fails);
+    return fails == 0 ? 0 : 1;
+}
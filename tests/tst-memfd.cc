@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, const char* msg)
+{
+    ++tests;
+    fails += !ok;
+    printf("%s: %s\n", (ok ? "PASS" : "FAIL"), msg);
+}
+
+static size_t size_of(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 ? st.st_size : -1;
+}
+
+static void test_memfd()
+{
+    const size_t size = 4 << 20;
+    int fd = memfd_create("test", MFD_ALLOW_SEALING);
+    report(fd >= 0, "memfd_create");
+    report(size_of(fd) == 0, "new memfd is empty");
+    report(ftruncate(fd, size) == 0 && size_of(fd) == size, "ftruncate");
+
+    auto a = static_cast<char*>(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    auto b = static_cast<char*>(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    report(a != MAP_FAILED && b != MAP_FAILED, "mmap twice");
+    strcpy(a + size - 4096, "memfd");
+    report(strcmp(b + size - 4096, "memfd") == 0, "mappings share memory");
+    char buf[6] = {};
+    report(pread(fd, buf, 5, size - 4096) == 5 && strcmp(buf, "memfd") == 0,
+            "pread sees mapped writes");
+    report(pwrite(fd, "MEMFD", 5, 0) == 5 && memcmp(a, "MEMFD", 5) == 0,
+            "mapping sees pwrite");
+
+    report(fcntl(fd, F_GET_SEALS) == 0, "no seals");
+    report(fcntl(fd, F_ADD_SEALS, F_SEAL_GROW) == 0, "seal growing");
+    report(ftruncate(fd, 2 * size) == -1 && errno == EPERM, "can't grow");
+    report(pwrite(fd, "x", 1, size) == -1 && errno == EPERM, "can't write past end");
+    report(ftruncate(fd, size / 2) == 0, "can shrink");
+    report(ftruncate(fd, size) == 0 && a[size - 4096] == 0, "regrown part is zero");
+
+    report(fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE) == -1 && errno == EBUSY,
+            "can't seal writes while mapped writable");
+    munmap(a, size);
+    munmap(b, size);
+    report(fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK) == 0, "seal writes");
+    report(fcntl(fd, F_GET_SEALS) == (F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SHRINK),
+            "seals added up");
+    report(pwrite(fd, "x", 1, 0) == -1 && errno == EPERM, "can't write");
+    report(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) == MAP_FAILED
+            && errno == EPERM, "can't map writable");
+    a = static_cast<char*>(mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0));
+    report(a != MAP_FAILED && memcmp(a, "MEMFD", 5) == 0, "can map read only");
+    report(mprotect(a, size, PROT_READ | PROT_WRITE) == -1, "can't mprotect writable");
+    auto p = static_cast<char*>(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0));
+    report(p != MAP_FAILED, "can map private writable");
+    memcpy(p, "xxxxx", 5);
+    p[size - 1] = 'x';
+    report(memcmp(p, "xxxxx", 5) == 0, "private mapping sees its writes");
+    report(memcmp(a, "MEMFD", 5) == 0 && a[size - 1] == 0,
+            "private writes leave the sealed contents alone");
+    report(pread(fd, buf, 5, 0) == 5 && memcmp(buf, "MEMFD", 5) == 0,
+            "pread doesn't see private writes");
+    munmap(p, size);
+    munmap(a, size);
+    report(ftruncate(fd, 0) == -1 && errno == EPERM, "can't shrink");
+    report(fcntl(fd, F_ADD_SEALS, F_SEAL_SEAL) == 0, "seal seals");
+    report(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) == -1 && errno == EPERM,
+            "can't add seals");
+    close(fd);
+
+    fd = memfd_create("test", 0);
+    report(fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE) == -1 && errno == EPERM,
+            "no sealing without MFD_ALLOW_SEALING");
+    close(fd);
+}
+
+static void test_shm_open()
+{
+    shm_unlink("/tst-memfd");
+    int fd = shm_open("/tst-memfd", O_RDWR | O_CREAT | O_EXCL, 0600);
+    report(fd >= 0, "shm_open create");
+    report(shm_open("/tst-memfd", O_RDWR | O_CREAT | O_EXCL, 0600) == -1
+            && errno == EEXIST, "shm_open O_EXCL of existing");
+    report(write(fd, "shared", 6) == 6, "write");
+    int fd2 = shm_open("/tst-memfd", O_RDWR, 0);
+    char buf[7] = {};
+    report(fd2 >= 0 && pread(fd2, buf, 6, 0) == 6 && strcmp(buf, "shared") == 0,
+            "second shm_open sees the data");
+    report(fcntl(fd, F_ADD_SEALS, F_SEAL_WRITE) == -1 && errno == EPERM,
+            "shm_open objects aren't sealable");
+    report(shm_unlink("/tst-memfd") == 0, "shm_unlink");
+    report(shm_open("/tst-memfd", O_RDWR, 0) == -1 && errno == ENOENT,
+            "unlinked name is gone");
+    report(pread(fd2, buf, 6, 0) == 6, "unlinked object lives on while open");
+    close(fd);
+    close(fd2);
+}
+
+int main(int argc, char **argv)
+{
+    test_memfd();
+    test_shm_open();
+    printf("SUMMARY: %d tests, %d failures\n", tests, fails);
+    return fails == 0 ? 0 : 1;
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2014 Cloudius Systems, Ltd.
+ *
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Tests priority inheritance of mutexes with the classic priority inversion:
+// a low priority thread holds a mutex needed by a high priority thread, while
+// a medium priority thread keeps the cpu busy. Without priority inheritance,
+// the high priority thread waits for the medium one to finish; with it, the
+// low priority thread is boosted and releases the mutex quickly.
+
+#include <osv/sched.hh>
+#include <osv/mutex.h>
+#include <osv/debug.hh>
+
+#include <pthread.h>
+#include <atomic>
+#include <chrono>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, const char* msg)
+{
+    ++tests;
+    fails += !ok;
+    debug("%s: %s\n", ok ? "PASS" : "FAIL", msg);
+}
+
+using namespace std::chrono;
+typedef steady_clock clk;
+
+static void spin_for(clk::duration d)
+{
+    auto end = clk::now() + d;
+    while (clk::now() < end) {
+        barrier();
+    }
+}
+
+// Returns how long the high priority thread waited for the mutex
+static clk::duration inversion(bool prio_inherit)
+{
+    using realtime_policy = sched::thread::realtime_policy;
+    mutex m;
+    m.set_priority_inheritance(prio_inherit);
+    auto cpu = sched::cpus[0];
+    std::atomic<bool> locked(false);
+    clk::duration waited;
+
+    // All the threads share one cpu. We (the controller) have the highest
+    // priority, so we can start them in order no matter how busy it is.
+    sched::thread::current()->set_realtime(realtime_policy::fifo,
+            sched::thread::realtime_priority_max);
+
+    sched::thread low([&] {
+        WITH_LOCK(m) {
+            locked = true;
+            spin_for(milliseconds(10));
+        }
+    }, sched::thread::attr().pin(cpu));
+    sched::thread medium([&] {
+        spin_for(milliseconds(500));
+    }, sched::thread::attr().pin(cpu));
+    sched::thread high([&] {
+        auto start = clk::now();
+        WITH_LOCK(m) {
+            waited = clk::now() - start;
+        }
+    }, sched::thread::attr().pin(cpu));
+    medium.set_realtime(realtime_policy::fifo, 10);
+    high.set_realtime(realtime_policy::fifo, 50);
+
+    low.start();
+    while (!locked) {
+        sched::thread::sleep(milliseconds(1));
+    }
+    medium.start();
+    sched::thread::sleep(milliseconds(5));
+    high.start();
+
+    high.join();
+    medium.join();
+    low.join();
+    sched::thread::current()->set_realtime(realtime_policy::none, 0);
+    return waited;
+}
+
+int main(int argc, char **argv)
+{
+    int without = duration_cast<milliseconds>(inversion(false)).count();
+    debug("without priority inheritance, waited %d ms\n", without);
+    int with = duration_cast<milliseconds>(inversion(true)).count();
+    debug("with priority inheritance, waited %d ms\n", with);
+    report(with < 100, "priority inheritance bounds the inversion");
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    report(pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT) == 0,
+            "set PTHREAD_PRIO_INHERIT");
+    int protocol, type;
+    pthread_mutexattr_getprotocol(&attr, &protocol);
+    pthread_mutexattr_gettype(&attr, &type);
+    report(protocol == PTHREAD_PRIO_INHERIT && type == PTHREAD_MUTEX_RECURSIVE,
+            "mutexattr keeps both protocol and type");
+    pthread_mutex_t pm;
+    pthread_mutex_init(&pm, &attr);
+    report(pthread_mutex_lock(&pm) == 0 && pthread_mutex_unlock(&pm) == 0,
+            "lock and unlock PTHREAD_PRIO_INHERIT mutex");
+    pthread_mutex_destroy(&pm);
+
+    debug("SUMMARY: %d tests, %d failures\n", tests, fails);
+    return fails == 0 ? 0 : 1;
+}
@@ -51,7 +51,7 @@ static void get_blk_devices(vector<string> &zpool_args)
     closedir(dir);
 }
 
-static void mkfs(void)
+static void mkfs(const string& compression)
 {
     // Create zfs device, then /etc/mnttab which is required by libzfs
     zfsdev::zfsdev_init();
@@ -77,15 +77,16 @@ static void mkfs(void)
     run_cmd("/zfs.so", {"zfs", "set", "canmount=noauto", "osv"});
     run_cmd("/zfs.so", {"zfs", "set", "canmount=noauto", "osv/zfs"});
 
-    // Enable lz4 compression on the created zfs dataset
+    // Enable compression (lz4 unless told otherwise) on the created zfs
+    // dataset
     // NOTE: Compression is disabled after image creation.
-    run_cmd("/zfs.so", {"zfs", "set", "compression=lz4", "osv"});
+    run_cmd("/zfs.so", {"zfs", "set", "compression=" + compression, "osv"});
 }
 
 int main(int ac, char** av)
 {
     cout << "Running mkfs...\n";
-    mkfs();
+    mkfs(ac > 1 ? av[1] : "lz4");
     sync();
     return 0;
 }